@@ -0,0 +1,364 @@
+/*
+ * The server's record of its clients' cache watches. See cache_watch.h.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cd_data.h"
+#include "cliserv.h"
+#include "cache_watch.h"
+
+/* Each client with watches has a watcher, which has a watch for every slot
+ * of the client's cache. The watches in use are also chained into a hash
+ * table by key, so that a change finds the watches on its entry without
+ * looking through everybody's. The chains hold watch numbers, which are
+ * watcher * CACHE_SLOTS + slot + 1, so that 0 can end them.
+ *
+ * A watcher stays with its client until another client needs the room. It
+ * can only be given to another once it has no watches, no notices on their
+ * way, and nobody has claimed it. */
+#define WATCH_BUCKETS 1024   /* must be a power of two */
+
+typedef struct {
+    int              in_use;
+    client_request_e kind;
+    char             catalog[CAT_CAT_LEN + 1];
+    int              track_no;    /* 0 for a catalog entry */
+    int              next;        /* the next in its chain */
+} watch;
+
+typedef struct {
+    pid_t client_pid;       /* 0 if it has never been used */
+    int   n_watches;
+    int   n_notices;        /* taken, but not yet accounted for */
+    int   claimed;
+    watch watches[CACHE_SLOTS];
+} watcher;
+
+static watcher watchers[WATCH_MAX_CLIENTS];
+static int buckets[WATCH_BUCKETS];
+static int n_watchers = 0;          /* that have ever been used */
+static long last_version = 0;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t client_released = PTHREAD_COND_INITIALIZER;
+static __thread pid_t claimed_pid = 0;
+
+
+static unsigned int key_hash(const client_request_e kind, const char *catalog,
+                             const int track_no) {
+    unsigned int hash = 2166136261U ^ kind;
+
+    while (*catalog) {
+        hash ^= (unsigned char)*catalog++;
+        hash *= 16777619U;
+    }
+    hash ^= (unsigned int)track_no;
+    hash *= 16777619U;
+    return(hash & (WATCH_BUCKETS - 1));
+}
+
+static watch *watch_of(const int watch_no) {
+    return(&watchers[(watch_no - 1) / CACHE_SLOTS]
+                .watches[(watch_no - 1) % CACHE_SLOTS]);
+}
+
+static int is_key(const watch *watch_ptr, const client_request_e kind,
+                  const char *catalog, const int track_no) {
+    return(watch_ptr->in_use && watch_ptr->kind == kind &&
+           watch_ptr->track_no == track_no &&
+           strcmp(watch_ptr->catalog, catalog) == 0);
+}
+
+/* the key a request is for */
+static void request_key(const message_db_t *mess_ptr,
+                        client_request_e *kind_ptr, const char **catalog_ptr,
+                        int *track_no_ptr) {
+    if (mess_ptr->request == s_watch_cdt_entry) {
+        *kind_ptr = s_watch_cdt_entry;
+        *catalog_ptr = mess_ptr->cdt_entry_data.catalog;
+        *track_no_ptr = mess_ptr->cdt_entry_data.track_no;
+    } else {
+        *kind_ptr = s_watch_cdc_entry;
+        *catalog_ptr = mess_ptr->cdc_entry_data.catalog;
+        *track_no_ptr = 0;
+    }
+}
+
+/* All of the functions from here on are called with watch_lock held.
+ *
+ * The versions start from the time, in ns, so that a server that takes over
+ * from another (by restarting in place, say) carries on from versions later
+ * than any its clients have heard of. */
+static void start_versions(void) {
+    struct timespec now;
+
+    if (last_version != 0) return;
+    clock_gettime(CLOCK_REALTIME, &now);
+    last_version = now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static watcher *find_watcher(const pid_t client_pid) {
+    int i;
+
+    for (i = 0; i < n_watchers; i++) {
+        if (watchers[i].client_pid == client_pid) return(&watchers[i]);
+    }
+    return(NULL);
+}
+
+/* a watcher for a client that hasn't got one, or NULL if there is no room */
+static watcher *new_watcher(const pid_t client_pid) {
+    watcher *w = NULL;
+    int i;
+
+    if (n_watchers < WATCH_MAX_CLIENTS) {
+        w = &watchers[n_watchers];
+        __atomic_store_n(&n_watchers, n_watchers + 1, __ATOMIC_RELEASE);
+    } else {
+        for (i = 0; i < WATCH_MAX_CLIENTS && !w; i++) {
+            if (watchers[i].n_watches == 0 && watchers[i].n_notices == 0 &&
+                !watchers[i].claimed) w = &watchers[i];
+        }
+        if (!w) return(NULL);
+    }
+    memset(w, '\0', sizeof(*w));
+    w->client_pid = client_pid;
+    // we may be answering the client right now
+    w->claimed = (claimed_pid == client_pid);
+    return(w);
+}
+
+static void unlink_watch(const int watch_no) {
+    watch *watch_ptr = watch_of(watch_no);
+    int *link = &buckets[key_hash(watch_ptr->kind, watch_ptr->catalog,
+                                  watch_ptr->track_no)];
+
+    while (*link != watch_no) link = &watch_of(*link)->next;
+    *link = watch_ptr->next;
+    watch_ptr->in_use = 0;
+    watchers[(watch_no - 1) / CACHE_SLOTS].n_watches--;
+}
+
+static void forget_watches(watcher *w) {
+    int slot;
+
+    for (slot = 0; slot < CACHE_SLOTS; slot++) {
+        if (w->watches[slot].in_use) {
+            unlink_watch((w - watchers) * CACHE_SLOTS + slot + 1);
+        }
+    }
+}
+
+/* take the watches on a key, adding a notice for each to notices. Returns
+ * the number of notices there are now. */
+static int take_key(const client_request_e kind, const char *catalog,
+                    const int track_no, const long version,
+                    watch_notice *notices, int n_notices) {
+    int *link = &buckets[key_hash(kind, catalog, track_no)];
+    watch_notice *notice;
+    watch *watch_ptr;
+    watcher *w;
+    int watch_no;
+
+    while ((watch_no = *link) != 0) {
+        watch_ptr = watch_of(watch_no);
+        if (!is_key(watch_ptr, kind, catalog, track_no) ||
+            n_notices == WATCH_MAX_NOTICES) {
+            link = &watch_ptr->next;
+            continue;
+        }
+        w = &watchers[(watch_no - 1) / CACHE_SLOTS];
+        notice = &notices[n_notices++];
+        notice->client_pid = w->client_pid;
+        notice->kind = kind;
+        notice->slot = (watch_no - 1) % CACHE_SLOTS;
+        strcpy(notice->catalog, catalog);
+        notice->track_no = track_no;
+        notice->version = version;
+        w->n_notices++;
+
+        *link = watch_ptr->next;
+        watch_ptr->in_use = 0;
+        w->n_watches--;
+    }
+    return(n_notices);
+}
+
+static int flush_watches(watch_notice *notices) {
+    watch_notice *notice;
+    int n_notices = 0;
+    int i;
+
+    start_versions();
+    last_version++;
+    for (i = 0; i < n_watchers; i++) {
+        if (watchers[i].n_watches == 0) continue;
+        forget_watches(&watchers[i]);
+        notice = &notices[n_notices++];
+        memset(notice, '\0', sizeof(*notice));
+        notice->client_pid = watchers[i].client_pid;
+        notice->kind = s_watch_cdc_entry;
+        notice->slot = -1;
+        notice->version = last_version;
+        watchers[i].n_notices++;
+    }
+    return(n_notices);
+}
+
+
+int watch_entry(const message_db_t *mess_ptr, long *version_ptr) {
+    const int slot = mess_ptr->cache_data.slot;
+    client_request_e kind;
+    const char *catalog;
+    int track_no;
+    watch *watch_ptr;
+    watcher *w;
+    int watch_no;
+    int *link;
+
+    if (slot < 0 || slot >= CACHE_SLOTS) return(0);
+    request_key(mess_ptr, &kind, &catalog, &track_no);
+
+    pthread_mutex_lock(&watch_lock);
+    w = find_watcher(mess_ptr->client_pid);
+    if (!w) w = new_watcher(mess_ptr->client_pid);
+    if (!w) {
+        pthread_mutex_unlock(&watch_lock);
+        return(0);
+    }
+
+    // a key is only ever in one of a client's slots
+    link = &buckets[key_hash(kind, catalog, track_no)];
+    for (watch_no = *link; watch_no != 0; watch_no = watch_of(watch_no)->next) {
+        if ((watch_no - 1) / CACHE_SLOTS == w - watchers &&
+            (watch_no - 1) % CACHE_SLOTS != slot &&
+            is_key(watch_of(watch_no), kind, catalog, track_no)) {
+            unlink_watch(watch_no);
+            break;
+        }
+    }
+
+    watch_no = (w - watchers) * CACHE_SLOTS + slot + 1;
+    watch_ptr = watch_of(watch_no);
+    if (!is_key(watch_ptr, kind, catalog, track_no)) {
+        if (watch_ptr->in_use) unlink_watch(watch_no);
+        watch_ptr->in_use = 1;
+        watch_ptr->kind = kind;
+        strcpy(watch_ptr->catalog, catalog);
+        watch_ptr->track_no = track_no;
+        watch_ptr->next = *link;
+        *link = watch_no;
+        w->n_watches++;
+    }
+    start_versions();
+    *version_ptr = last_version;
+    pthread_mutex_unlock(&watch_lock);
+    return(1);
+}
+
+int watch_changed(const message_db_t *mess_ptr, watch_notice *notices) {
+    const cd_batch_op *op;
+    long version;
+    int n_notices = 0;
+    int i;
+
+    pthread_mutex_lock(&watch_lock);
+    start_versions();
+    version = ++last_version;
+    switch(mess_ptr->request) {
+        case s_create_new_database:
+            n_notices = flush_watches(notices);
+            break;
+        case s_add_cdc_entry:
+        case s_del_cdc_entry:
+            n_notices = take_key(s_watch_cdc_entry,
+                                 mess_ptr->cdc_entry_data.catalog, 0,
+                                 version, notices, 0);
+            break;
+        case s_add_cdt_entry:
+        case s_del_cdt_entry:
+            n_notices = take_key(s_watch_cdt_entry,
+                                 mess_ptr->cdt_entry_data.catalog,
+                                 mess_ptr->cdt_entry_data.track_no,
+                                 version, notices, 0);
+            break;
+        case s_batch:
+            for (i = 0; i < mess_ptr->batch_data.n_ops &&
+                        i < BATCH_MAX_OPS; i++) {
+                op = &mess_ptr->batch_data.ops[i];
+                if (!op->succeeded) continue;
+                if (op->op == batch_add_cdc || op->op == batch_del_cdc) {
+                    n_notices = take_key(s_watch_cdc_entry,
+                                         op->cdc_entry_data.catalog, 0,
+                                         version, notices, n_notices);
+                }
+                if (op->op == batch_add_cdt || op->op == batch_del_cdt) {
+                    n_notices = take_key(s_watch_cdt_entry,
+                                         op->cdt_entry_data.catalog,
+                                         op->cdt_entry_data.track_no,
+                                         version, notices, n_notices);
+                }
+            }
+            break;
+        default:
+            break;
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return(n_notices);
+}
+
+int watch_flush(watch_notice *notices) {
+    int n_notices;
+
+    pthread_mutex_lock(&watch_lock);
+    n_notices = flush_watches(notices);
+    pthread_mutex_unlock(&watch_lock);
+    return(n_notices);
+}
+
+void watch_notified(const pid_t client_pid, const int sent) {
+    watcher *w;
+
+    pthread_mutex_lock(&watch_lock);
+    w = find_watcher(client_pid);
+    if (w) {
+        w->n_notices--;
+        if (!sent) forget_watches(w);
+    }
+    pthread_mutex_unlock(&watch_lock);
+}
+
+/* Until some client has watched something, there is nobody to claim. A
+ * client with no watcher can't be sent notices, and it only gets a watcher
+ * from a request of its own, which happens while the thread answering it
+ * has claimed it (see new_watcher). */
+void watch_claim(const pid_t client_pid) {
+    watcher *w;
+
+    claimed_pid = client_pid;
+    if (__atomic_load_n(&n_watchers, __ATOMIC_ACQUIRE) == 0) return;
+    pthread_mutex_lock(&watch_lock);
+    while ((w = find_watcher(client_pid)) && w->claimed) {
+        pthread_cond_wait(&client_released, &watch_lock);
+    }
+    if (w) w->claimed = 1;
+    pthread_mutex_unlock(&watch_lock);
+}
+
+void watch_release(void) {
+    const pid_t client_pid = claimed_pid;
+    watcher *w;
+
+    claimed_pid = 0;
+    if (client_pid == 0 ||
+        __atomic_load_n(&n_watchers, __ATOMIC_ACQUIRE) == 0) return;
+    pthread_mutex_lock(&watch_lock);
+    w = find_watcher(client_pid);
+    if (w && w->claimed) {
+        w->claimed = 0;
+        pthread_cond_broadcast(&client_released);
+    }
+    pthread_mutex_unlock(&watch_lock);
+}
@@ -0,0 +1,78 @@
+/* Watching clients' caches
+ *
+ * A client that caches entries (see "Caching" in cd_data.h) fetches them
+ * with s_watch_cdc_entry and s_watch_cdt_entry, which are gets that also ask
+ * the server to tell the client when the entry changes. The client's cache
+ * has CACHE_SLOTS slots, and each request says which one the entry is going
+ * in, so the server keeps a copy of which key the client has in each of its
+ * slots: its watches. An entry that goes into a slot replaces the one that
+ * was there, watch and all.
+ *
+ * When a request changes an entry, the server takes the watches on it, and
+ * sends each of their clients a notice (a response with r_invalidated and a
+ * request_id of 0) before it answers the request. A client takes in any
+ * notices waiting for it before it uses its cache, so once a change has been
+ * answered, no client can read the old entry from its cache. A watch only
+ * brings one notice; the client fetches the entry again if it still wants
+ * it.
+ *
+ * Watches and changes take their versions from one counter. A notice
+ * carries the version of the change, and a cached entry that of its watch,
+ * which was taken before the entry was read; so a client whose entry is at
+ * least as new as a notice knows that it already has the change.
+ *
+ * There is room for the watches of WATCH_MAX_CLIENTS clients; a client that
+ * can't have any isn't given them, and doesn't cache. A client whose notice
+ * can't be sent is taken to have gone, and its watches are forgotten.
+ *
+ * Most of the transports can only have one thread sending to a client at a
+ * time, so with a worker pool, a notice has to wait until nobody is
+ * answering its client. The threads answering clients claim them first
+ * (watch_claim), and let them go when they are done (watch_release), and
+ * the threads sending notices do the same. The notices for a change are
+ * sent before its own response is started, so no thread ever waits for one
+ * client while it has claimed another.
+ *
+ * Include this after cd_data.h and cliserv.h.
+ */
+
+#define WATCH_MAX_CLIENTS 64
+
+/* the most notices one request can give rise to */
+#define WATCH_MAX_NOTICES (BATCH_MAX_OPS * WATCH_MAX_CLIENTS)
+
+typedef struct {
+    pid_t            client_pid;
+    client_request_e kind;        /* s_watch_cdc_entry or s_watch_cdt_entry */
+    int              slot;        /* -1 for all of the client's entries */
+    char             catalog[CAT_CAT_LEN + 1];
+    int              track_no;
+    long             version;
+} watch_notice;
+
+/* Watch the entry that a s_watch_ request from a client is for, in the slot
+ * it asks for, and put the watch's version in *version_ptr. Call this before
+ * reading the entry. Returns 0 if the client can't have the watch. */
+int watch_entry(const message_db_t *mess_ptr, long *version_ptr);
+
+/* Take the watches on the entries that a request which succeeded has
+ * changed, and fill in notices (which has room for WATCH_MAX_NOTICES) for
+ * their clients. For a batch, pass its response, so that only the ops that
+ * worked count. Returns the number of notices. */
+int watch_changed(const message_db_t *mess_ptr, watch_notice *notices);
+
+/* Take every watch there is, with a notice for each client that had any
+ * telling it to forget all of its entries, e.g. when the server stops.
+ * Returns the number of notices, which is at most WATCH_MAX_CLIENTS. */
+int watch_flush(watch_notice *notices);
+
+/* Every notice has to be accounted for once it has been sent (sent is 1),
+ * or has failed to send (0), in which case the client's watches are
+ * forgotten. */
+void watch_notified(const pid_t client_pid, const int sent);
+
+/* Claim a client, waiting while another thread has it, before sending it
+ * anything, and let it go again afterwards. Only needed with more than one
+ * thread sending. A thread claims one client at a time. */
+void watch_claim(const pid_t client_pid);
+void watch_release(void);
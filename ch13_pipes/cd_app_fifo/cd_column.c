@@ -0,0 +1,491 @@
+/*
+ * The packed catalog column, and the substring matching kernels that run
+ * over it. See cd_column.h for the layout.
+ *
+ * The kernels look for the needle anywhere in the buffer rather than record
+ * by record, using the trick of comparing a block of the buffer against the
+ * first character of the needle and, shifted along by the needle length, the
+ * last character. Only positions where both compare equal need a memcmp. The
+ * sse2 and avx2 versions do this 16 or 32 positions at a time.
+ *
+ * A match can't run from one record into the next one, since every string
+ * is followed by a null and a needle never contains a null. We do still check
+ * that a match lies within a record's string, and not on its length byte.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define COLUMN_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+#include "cd_data.h"
+#include "cd_column.h"
+
+/* the buffers are over-allocated by this much, and the excess kept zeroed,
+ * so the kernels can always load a whole vector past the last position
+ * they check */
+#define COLUMN_PAD (CAT_CAT_LEN + 64)
+
+typedef long (*column_kernel_fn)(const char *hay, long start, long end,
+                                 const char *needle, int needle_len);
+
+/* The column itself. File scope, like the dbm pointers in cd_dbm.c. */
+static char *packed = NULL;      /* length byte, string, null, ... */
+static char *folded = NULL;      /* the same, in lower case */
+static long packed_len = 0;
+static long packed_allocated = 0;
+static long *offsets = NULL;     /* where each record's length byte is */
+static int n_records = 0;
+static int n_dead = 0;
+static int offsets_allocated = 0;
+
+/* a hash table from catalog string to record number, so we can find an
+ * entry to delete (or notice an add is a duplicate) without a scan. It uses
+ * open addressing, and -1 marks an empty slot. */
+static int *hash_slots = NULL;
+static int hash_size = 0;
+
+/* the live records in order of catalog, once column_sort has been called */
+static int *sorted = NULL;
+static int n_sorted = 0;
+static int sorted_allocated = 0;
+static int sorted_on = 0;
+
+static column_kernel_fn kernel = NULL;
+static const char *kernel_name = NULL;
+
+
+static unsigned long hash_string(const char *str) {
+    unsigned long hash = 5381;
+
+    while (*str) hash = hash * 33 + (unsigned char)*str++;
+    return(hash);
+}
+
+/* build the hash table from scratch, big enough to stay under half full */
+static int rehash(void) {
+    int new_size = 64;
+    int *new_slots;
+    int record;
+    unsigned long slot;
+
+    while (new_size < (n_records + 1) * 2) new_size *= 2;
+    new_slots = malloc(new_size * sizeof(int));
+    if (!new_slots) return(0);
+    memset(new_slots, 0xff, new_size * sizeof(int));
+
+    for (record = 0; record < n_records; record++) {
+        if (!column_entry(record)) continue;
+        slot = hash_string(column_entry(record)) & (new_size - 1);
+        while (new_slots[slot] != -1) slot = (slot + 1) & (new_size - 1);
+        new_slots[slot] = record;
+    }
+    free(hash_slots);
+    hash_slots = new_slots;
+    hash_size = new_size;
+    return(1);
+}
+
+/* returns the hash slot holding catalog, or the empty slot where it would
+ * go. Assumes the table exists. */
+static unsigned long find_slot(const char *catalog) {
+    unsigned long slot = hash_string(catalog) & (hash_size - 1);
+    const char *entry;
+
+    while (hash_slots[slot] != -1) {
+        entry = column_entry(hash_slots[slot]);
+        if (entry && strcmp(entry, catalog) == 0) break;
+        slot = (slot + 1) & (hash_size - 1);
+    }
+    return(slot);
+}
+
+static int compare_records(const void *a, const void *b) {
+    const int record_a = *(const int *)a;
+    const int record_b = *(const int *)b;
+
+    return(strcmp(column_entry(record_a), column_entry(record_b)));
+}
+
+/* put the live records into the index, and sort it. Returns 0 if we run
+ * out of memory. */
+static int sort_records(void) {
+    int *new_sorted;
+    int record;
+
+    if (n_records > sorted_allocated) {
+        new_sorted = realloc(sorted, n_records * sizeof(int));
+        if (!new_sorted) return(0);
+        sorted = new_sorted;
+        sorted_allocated = n_records;
+    }
+    n_sorted = 0;
+    for (record = 0; record < n_records; record++) {
+        if (column_entry(record)) sorted[n_sorted++] = record;
+    }
+    qsort(sorted, n_sorted, sizeof(int), compare_records);
+    return(1);
+}
+
+/* squeeze the dead records out of the column */
+static void compact(void) {
+    long to = 0;
+    long from;
+    long record_len;
+    int record;
+    int live = 0;
+
+    for (record = 0; record < n_records; record++) {
+        from = offsets[record];
+        record_len = (unsigned char)packed[from] + 2;
+        if (packed[from + 1] == '\0') continue;
+        memmove(packed + to, packed + from, record_len);
+        memmove(folded + to, folded + from, record_len);
+        offsets[live++] = to;
+        to += record_len;
+    }
+    memset(packed + to, '\0', packed_len - to);
+    memset(folded + to, '\0', packed_len - to);
+    packed_len = to;
+    n_records = live;
+    n_dead = 0;
+    (void)rehash();
+
+    // the records keep their order, but not their numbers
+    if (sorted_on) sorted_on = sort_records();
+}
+
+
+void column_clear(void) {
+    free(packed);
+    free(folded);
+    free(offsets);
+    free(hash_slots);
+    free(sorted);
+    packed = folded = NULL;
+    offsets = NULL;
+    hash_slots = NULL;
+    sorted = NULL;
+    packed_len = packed_allocated = 0;
+    n_records = n_dead = offsets_allocated = hash_size = 0;
+    n_sorted = sorted_allocated = sorted_on = 0;
+}
+
+
+int column_add(const char *catalog) {
+    long len = strlen(catalog);
+    long new_allocated;
+    long *new_offsets;
+    int *new_sorted;
+    char *new_packed;
+    char *new_folded;
+    unsigned long slot;
+    int position;
+    long i;
+
+    if (len == 0) return(1);    /* nothing a search could find */
+    if (len > CAT_CAT_LEN) return(0);
+    if (!hash_slots && !rehash()) return(0);
+    slot = find_slot(catalog);
+    if (hash_slots[slot] != -1) return(1);
+
+    /* make room for the record, plus the padding */
+    if (packed_len + len + 2 + COLUMN_PAD > packed_allocated) {
+        new_allocated = packed_allocated ? packed_allocated * 2 : 4096;
+        while (packed_len + len + 2 + COLUMN_PAD > new_allocated) {
+            new_allocated *= 2;
+        }
+        new_packed = realloc(packed, new_allocated);
+        if (!new_packed) return(0);
+        packed = new_packed;
+        new_folded = realloc(folded, new_allocated);
+        if (!new_folded) return(0);
+        folded = new_folded;
+        memset(packed + packed_allocated, '\0',
+               new_allocated - packed_allocated);
+        memset(folded + packed_allocated, '\0',
+               new_allocated - packed_allocated);
+        packed_allocated = new_allocated;
+    }
+    if (n_records == offsets_allocated) {
+        offsets_allocated = offsets_allocated ? offsets_allocated * 2 : 256;
+        new_offsets = realloc(offsets, offsets_allocated * sizeof(long));
+        if (!new_offsets) return(0);
+        offsets = new_offsets;
+    }
+    if (sorted_on && n_sorted == sorted_allocated) {
+        new_allocated = sorted_allocated ? sorted_allocated * 2 : 256;
+        new_sorted = realloc(sorted, new_allocated * sizeof(int));
+        if (!new_sorted) return(0);
+        sorted = new_sorted;
+        sorted_allocated = (int)new_allocated;
+    }
+    position = sorted_on ? column_sorted_after(catalog) : 0;
+
+    offsets[n_records] = packed_len;
+    packed[packed_len] = folded[packed_len] = (char)len;
+    for (i = 0; i < len; i++) {
+        packed[packed_len + 1 + i] = catalog[i];
+        folded[packed_len + 1 + i] = tolower((unsigned char)catalog[i]);
+    }
+    packed[packed_len + 1 + len] = folded[packed_len + 1 + len] = '\0';
+    packed_len += len + 2;
+    if (sorted_on) {
+        memmove(sorted + position + 1, sorted + position,
+                (n_sorted - position) * sizeof(int));
+        sorted[position] = n_records;
+        n_sorted++;
+    }
+    hash_slots[slot] = n_records++;
+
+    /* keep the hash table under half full */
+    if (n_records * 2 >= hash_size) (void)rehash();
+    return(1);
+}
+
+
+void column_remove(const char *catalog) {
+    unsigned long slot;
+    long from;
+    int record;
+    int position;
+
+    if (!hash_slots || !*catalog) return;
+    slot = find_slot(catalog);
+    if (hash_slots[slot] == -1) return;
+    record = hash_slots[slot];
+
+    /* it is the last record before those after it */
+    if (sorted_on) {
+        position = column_sorted_after(catalog) - 1;
+        memmove(sorted + position, sorted + position + 1,
+                (n_sorted - position - 1) * sizeof(int));
+        n_sorted--;
+    }
+
+    /* blank the string, so no needle can match it. The hash slot stays
+     * occupied (it would break the probe chains otherwise) until the next
+     * rehash drops it. */
+    from = offsets[record];
+    memset(packed + from + 1, '\0', (unsigned char)packed[from]);
+    memset(folded + from + 1, '\0', (unsigned char)folded[from]);
+    n_dead++;
+    if (n_dead * 2 > n_records) compact();
+}
+
+
+int column_records(void) {
+    return(n_records);
+}
+
+
+const char *column_entry(const int record) {
+    if (record < 0 || record >= n_records) return(NULL);
+    if (packed[offsets[record] + 1] == '\0') return(NULL);
+    return(packed + offsets[record] + 1);
+}
+
+
+int column_find(const char *catalog) {
+    if (!hash_slots || !*catalog) return(-1);
+    return(hash_slots[find_slot(catalog)]);
+}
+
+
+int column_sort(void) {
+    sorted_on = sort_records();
+    return(sorted_on);
+}
+
+
+int column_sorted_after(const char *catalog) {
+    int first = 0;
+    int last = n_sorted;
+    int middle;
+
+    while (first < last) {
+        middle = first + (last - first) / 2;
+        if (strcmp(column_entry(sorted[middle]), catalog) <= 0) {
+            first = middle + 1;
+        } else {
+            last = middle;
+        }
+    }
+    return(first);
+}
+
+
+int column_sorted_record(const int position) {
+    if (position < 0 || position >= n_sorted) return(-1);
+    return(sorted[position]);
+}
+
+
+/* The kernels. Each returns the first position from start up to
+ * end - needle_len at which the needle occurs, or -1. needle_len is at
+ * least 1. */
+
+static long scalar_kernel(const char *hay, long start, long end,
+                          const char *needle, int needle_len) {
+    long pos;
+
+    for (pos = start; pos + needle_len <= end; pos++) {
+        if (hay[pos] == needle[0] &&
+            memcmp(hay + pos + 1, needle + 1, needle_len - 1) == 0) {
+            return(pos);
+        }
+    }
+    return(-1);
+}
+
+#ifdef COLUMN_HAVE_X86
+
+__attribute__((target("sse2")))
+static long sse2_kernel(const char *hay, long start, long end,
+                        const char *needle, int needle_len) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    long block;
+    long pos;
+    unsigned int mask;
+
+    for (block = start; block + needle_len <= end; block += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(hay + block));
+        __m128i block_last = _mm_loadu_si128(
+            (const __m128i *)(hay + block + needle_len - 1));
+        mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(first, block_first),
+            _mm_cmpeq_epi8(last, block_last)));
+        while (mask) {
+            pos = block + __builtin_ctz(mask);
+            if (pos + needle_len > end) return(-1);
+            if (memcmp(hay + pos + 1, needle + 1, needle_len - 1) == 0) {
+                return(pos);
+            }
+            mask &= mask - 1;
+        }
+    }
+    return(-1);
+}
+
+__attribute__((target("avx2")))
+static long avx2_kernel(const char *hay, long start, long end,
+                        const char *needle, int needle_len) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    long block;
+    long pos;
+    unsigned int mask;
+
+    for (block = start; block + needle_len <= end; block += 32) {
+        __m256i block_first = _mm256_loadu_si256(
+            (const __m256i *)(hay + block));
+        __m256i block_last = _mm256_loadu_si256(
+            (const __m256i *)(hay + block + needle_len - 1));
+        mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(first, block_first),
+            _mm256_cmpeq_epi8(last, block_last)));
+        while (mask) {
+            pos = block + __builtin_ctz(mask);
+            if (pos + needle_len > end) return(-1);
+            if (memcmp(hay + pos + 1, needle + 1, needle_len - 1) == 0) {
+                return(pos);
+            }
+            mask &= mask - 1;
+        }
+    }
+    return(-1);
+}
+
+#endif
+
+
+const char *column_use_kernel(const column_kernel_e wanted) {
+    kernel = scalar_kernel;
+    kernel_name = "scalar";
+#ifdef COLUMN_HAVE_X86
+    __builtin_cpu_init();
+    if ((wanted == column_auto || wanted == column_avx2) &&
+        __builtin_cpu_supports("avx2")) {
+        kernel = avx2_kernel;
+        kernel_name = "avx2";
+    } else if ((wanted == column_auto || wanted == column_sse2 ||
+                wanted == column_avx2) &&
+               __builtin_cpu_supports("sse2")) {
+        kernel = sse2_kernel;
+        kernel_name = "sse2";
+    }
+#endif
+    return(kernel_name);
+}
+
+
+/* find which record a buffer position falls in. Matches are usually close
+ * to where the search started, so look at the next few records before
+ * falling back to a binary search. */
+static int record_at(long pos, int first, int last) {
+    int middle;
+    int probe;
+
+    for (probe = first; probe < last && probe < first + 8; probe++) {
+        if (probe + 1 == last || offsets[probe + 1] > pos) return(probe);
+    }
+    first = probe;
+    while (last - first > 1) {
+        middle = first + (last - first) / 2;
+        if (offsets[middle] <= pos) first = middle;
+        else last = middle;
+    }
+    return(first);
+}
+
+
+int column_next_match(const char *needle, const int nocase,
+                      const int first, const int last) {
+    char folded_needle[CAT_CAT_LEN + 1];
+    const char *hay = nocase ? folded : packed;
+    int needle_len = strlen(needle);
+    int stop = last < n_records ? last : n_records;
+    int record;
+    long start;
+    long end;
+    long pos;
+    int i;
+
+    if (first < 0 || first >= stop) return(-1);
+
+    /* an empty needle matches every live record */
+    if (needle_len == 0) {
+        for (record = first; record < stop; record++) {
+            if (column_entry(record)) return(record);
+        }
+        return(-1);
+    }
+    if (needle_len > CAT_CAT_LEN) return(-1);
+
+    if (nocase) {
+        for (i = 0; i < needle_len; i++) {
+            folded_needle[i] = tolower((unsigned char)needle[i]);
+        }
+        folded_needle[needle_len] = '\0';
+        needle = folded_needle;
+    }
+
+    if (!kernel) (void)column_use_kernel(column_auto);
+    start = offsets[first];
+    end = stop < n_records ? offsets[stop] : packed_len;
+    while ((pos = kernel(hay, start, end, needle, needle_len)) != -1) {
+        record = record_at(pos, first, stop);
+        if (pos > offsets[record] &&
+            pos + needle_len <= offsets[record] + 1 +
+                                (unsigned char)hay[offsets[record]]) {
+            return(record);
+        }
+        start = pos + 1;
+    }
+    return(-1);
+}
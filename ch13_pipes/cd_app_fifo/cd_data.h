@@ -32,6 +32,190 @@ typedef struct {
     char track_txt[TRACK_TTEXT_LEN + 1];
 } cdt_entry;
 
+/* Queries
+ *
+ * search_cdc_entry can only look for a substring of the catalog. A query can
+ * test any of the catalog, title, type and artist fields, with up to
+ * QUERY_MAX_PREDICATES predicates that must either all hold (query_and) or
+ * of which at least one must hold (query_or). A query with no predicates
+ * matches every entry.
+ */
+#define QUERY_MAX_PREDICATES 4
+#define QUERY_TEXT_LEN       CAT_TITLE_LEN  /* the longest field */
+
+typedef enum {
+    field_catalog = 0,
+    field_title,
+    field_type,
+    field_artist
+} query_field_e;
+
+typedef enum {
+    match_exact = 0,
+    match_prefix,
+    match_substring
+} query_match_e;
+
+typedef enum {
+    query_and = 0,
+    query_or
+} query_combine_e;
+
+typedef struct {
+    query_field_e field;
+    query_match_e match;
+    int           ignore_case;
+    char          text[QUERY_TEXT_LEN + 1];
+} query_predicate;
+
+typedef struct {
+    query_combine_e combine;
+    int             n_predicates;
+    query_predicate predicates[QUERY_MAX_PREDICATES];
+} cd_query;
+
+/* The server's planner picks one of these ways to find the entries for a
+ * query, cheapest first:
+ *   - an index probe fetches a single entry by its catalog key, when the
+ *     query needs an exact (case sensitive) catalog match.
+ *   - a catalog column scan searches the in-memory catalog column for a
+ *     catalog predicate, and only fetches the entries that pass it.
+ *   - a full scan fetches every entry from the database.
+ * Whichever is chosen, the entries fetched are then filtered against the
+ * whole query before being returned.
+ *
+ * explain_cdc_query runs a query and reports the plan the server used,
+ * rather than the matches. */
+#define PLAN_DESC_LEN 80
+
+typedef enum {
+    plan_index_probe = 0,
+    plan_catalog_column,
+    plan_full_scan
+} plan_access_e;
+
+typedef struct {
+    plan_access_e access;
+    int           driving_predicate;  /* -1 if not driven by one predicate */
+    int           rows_examined;      /* entries fetched from the database */
+    int           rows_matched;
+    char          description[PLAN_DESC_LEN + 1];
+} cd_query_plan;
+
+/* Aggregates
+ *
+ * Rather than pulling every entry across to count them, a client can ask
+ * for counts of the CDs, either in total (group_none) or for each type,
+ * artist or catalog entry. With count_tracks set, each row also counts the
+ * tracks on those CDs, so grouping by catalog gives the track count of each
+ * CD. Rows come back sorted by group.
+ */
+typedef enum {
+    group_none = 0,
+    group_type,
+    group_artist,
+    group_catalog
+} agg_group_e;
+
+typedef struct {
+    agg_group_e group_by;
+    int         count_tracks;
+} cd_aggregate;
+
+typedef struct {
+    char group[CAT_ARTIST_LEN + 1];   /* empty for group_none */
+    int  cd_count;
+    int  track_count;
+} cd_agg_row;
+
+/* Batches
+ *
+ * A batch is a list of up to BATCH_MAX_OPS gets, adds and deletes of
+ * catalog and track entries, which the server runs one after the other for
+ * a single request. Each op records whether it worked, and the gets bring
+ * back their entry, in the op's own cdc_entry_data or cdt_entry_data. An op
+ * failing doesn't stop the rest of the batch. The ops only use the fields
+ * that the function they stand for would take.
+ */
+#define BATCH_MAX_OPS 16
+
+typedef enum {
+    batch_get_cdc = 0,
+    batch_get_cdt,
+    batch_add_cdc,
+    batch_add_cdt,
+    batch_del_cdc,
+    batch_del_cdt
+} batch_op_e;
+
+typedef struct {
+    batch_op_e op;
+    int        succeeded;
+    cdc_entry  cdc_entry_data;
+    cdt_entry  cdt_entry_data;
+} cd_batch_op;
+
+typedef struct {
+    int         n_ops;
+    cd_batch_op ops[BATCH_MAX_OPS];
+} cd_batch;
+
+/* Replication
+ *
+ * A server is either the primary, which owns the database, or a read-only
+ * replica which follows the primary's change log (see changelog.h). The
+ * status says how far the server's copy of the data is behind the primary,
+ * as it was when the request arrived.
+ */
+typedef struct {
+    int  is_replica;
+    long primary_sequence;   /* changes in the primary's log */
+    long applied_sequence;   /* changes applied to this server's data */
+    long lag_changes;
+    long lag_ms;             /* age of the oldest change not yet applied */
+} replica_status;
+
+/* Statistics
+ *
+ * What a server has done since it started (see stats.h): how many requests
+ * of each kind it has answered, indexed by their number in cliserv.h, and
+ * how many of those failed; how long the requests spent in each phase of
+ * being answered; and what it is doing now. STATS_REQUEST_KINDS is the
+ * number of kinds of request in cliserv.h, which checks that it still is.
+ */
+#define STATS_REQUEST_KINDS 16
+#define STATS_PHASES        3
+
+typedef enum {
+    phase_queue_wait = 0,
+    phase_storage,
+    phase_send
+} stats_phase_e;
+
+typedef struct {
+    long count;
+    long mean_ns;
+    long p50_ns;
+    long p90_ns;
+    long p99_ns;
+    long p999_ns;
+    long max_ns;
+} latency_summary;
+
+typedef struct {
+    long            uptime_ms;
+    long            requests[STATS_REQUEST_KINDS];
+    long            failures[STATS_REQUEST_KINDS];
+    long            gets_coalesced;   /* answered by another get's read */
+    long            expired_dropped;  /* past their deadlines, so not run */
+    long            in_progress;      /* read, but not yet answered */
+    long            queue_depth;      /* in the worker pool's queue */
+    long            transport_backlog; /* sent, but not yet read, or -1 */
+    long            backlog_in_bytes; /* if that is bytes, not requests */
+    long            active_clients;
+    latency_summary latency[STATS_PHASES];
+} server_stats;
+
 /* Now that we have some data structures, we can define some access routines
  * that we'll need.  Functions with cdc_ are for catalog entries; functions
  * with cdt_ are for track entries.  Notice that some of the functions return
@@ -62,3 +246,211 @@ int del_cdt_entry(const char *cd_catalog_ptr, const int track_no);
 /* one search function */
 cdc_entry search_cdc_entry(const char *cd_catalog_ptr, int *first_call_ptr);
 
+/* and a paged version of it, for callers that only want a few of the
+ * matches at a time. A page holds the next matches after its continuation
+ * token, in order of catalog, so each page carries on where the last one
+ * stopped however long the caller waits, and whatever is added or deleted
+ * in between. Zero a cd_page and set its limit (up to PAGE_MAX) for the
+ * first page. search_cdc_page fills in up to limit matches, and leaves the
+ * page ready for the next call, with more set if there are any more.
+ * Returns the number of matches, or -1 on error. */
+#define PAGE_MAX 100
+
+typedef struct {
+    int  limit;                     /* the most matches to return */
+    int  more;                      /* there are matches after this page */
+    char after[CAT_CAT_LEN + 1];    /* the token: the last catalog returned */
+} cd_page;
+
+int search_cdc_page(const char *cd_catalog_ptr, cd_page *page_ptr,
+                    cdc_entry *matches);
+
+/* queries, which work through their results in the same way as
+ * search_cdc_entry, and a way to see how the server runs a query. The
+ * explain function returns 1 on success, 0 on failure. */
+cdc_entry query_cdc_entry(const cd_query *query_ptr, int *first_call_ptr);
+int explain_cdc_query(const cd_query *query_ptr, cd_query_plan *plan_ptr);
+
+/* aggregates also work through their rows like search_cdc_entry. The end
+ * of the rows is marked by a row with a cd_count of 0. */
+cd_agg_row aggregate_cdc_entry(const cd_aggregate *aggregate_ptr,
+                               int *first_call_ptr);
+
+/* run a batch, filling in the results of its ops. Returns 1 if every op
+ * succeeded, else 0. */
+int run_cdc_batch(cd_batch *batch_ptr);
+
+/* ask the server we are talking to how far behind the primary it is. This
+ * only exists on the client side (in clientif.c). Returns 1 on success. */
+int get_replica_status(replica_status *status_ptr);
+
+/* ask the server we are talking to for its statistics, which also only
+ * happens on the client side. Returns 1 on success. */
+int get_server_stats(server_stats *stats_ptr);
+
+/* Pipelining, which also only exists on the client side.
+ *
+ * The get, add and del functions above each wait for the server's answer
+ * before returning, so a client making many of them pays a round trip for
+ * each one. The pipeline_ versions just send the request, and return a
+ * ticket for it (or 0 if the request could not be sent). pipeline_wait
+ * collects the answer for a ticket, in any order; it returns 1 if the request
+ * succeeded, else 0, and for the gets it fills in *result_ptr (which may be
+ * NULL otherwise).
+ *
+ * At most PIPELINE_WINDOW tickets can be waiting to be collected. Asking for
+ * another one fails until one of those is collected. */
+#define PIPELINE_WINDOW 32
+
+typedef struct {
+    cdc_entry cdc_entry_data;   /* from pipeline_get_cdc_entry */
+    cdt_entry cdt_entry_data;   /* from pipeline_get_cdt_entry */
+} pipeline_result;
+
+unsigned int pipeline_get_cdc_entry(const char *cd_catalog_ptr);
+unsigned int pipeline_get_cdt_entry(const char *cd_catalog_ptr,
+                                    const int track_no);
+unsigned int pipeline_add_cdc_entry(const cdc_entry entry_to_add);
+unsigned int pipeline_add_cdt_entry(const cdt_entry entry_to_add);
+unsigned int pipeline_del_cdc_entry(const char *cd_catalog_ptr);
+unsigned int pipeline_del_cdt_entry(const char *cd_catalog_ptr,
+                                    const int track_no);
+int pipeline_wait(const unsigned int ticket, pipeline_result *result_ptr);
+
+/* Asynchronous calls, which also only exist on the client side.
+ *
+ * The async_ versions of the get, add and del functions send the request
+ * and return a handle for it straight away (or 0 if it could not be sent,
+ * or ASYNC_WINDOW calls are already outstanding). When the answer comes,
+ * the callback (if it isn't NULL) is called with the result and the
+ * user_data it was given. The async gets always go to the server, whether
+ * or not there is a cache.
+ *
+ * Callbacks are only ever called from cd_client_run_once. It takes in the
+ * answers that have arrived, waiting up to timeout_ms (-1 means as long as
+ * it takes) for one if none has, and calls their callbacks. It returns how
+ * many it called, or -1 if it lost touch with the server, in which case it
+ * has called the callbacks of all the outstanding calls, with succeeded set
+ * to 0. A callback may make more calls, but not call cd_client_run_once.
+ *
+ * A program with an event loop of its own can wait on cd_client_fd,
+ * alongside its other fds, and call cd_client_run_once(0) when it is
+ * readable. Answers can also arrive while the client is busy with other
+ * calls, which the fd doesn't show, so call cd_client_run_once(0) before
+ * each wait as well. Some transports (the SysV and shared memory ones) have
+ * no fd to wait on, and cd_client_fd is -1; with those, the program has to
+ * call cd_client_run_once every so often.
+ *
+ * async_outstanding says how many calls are still waiting for their
+ * callbacks to be called. database_close drops any calls that are still
+ * outstanding, without calling their callbacks. */
+#define ASYNC_WINDOW 128
+
+typedef struct {
+    unsigned int handle;
+    int          succeeded;
+    cdc_entry    cdc_entry_data;    /* from async_get_cdc_entry */
+    cdt_entry    cdt_entry_data;    /* from async_get_cdt_entry */
+} async_result;
+
+typedef void (*async_callback)(const async_result *result_ptr,
+                               void *user_data);
+
+unsigned int async_get_cdc_entry(const char *cd_catalog_ptr,
+                                 async_callback callback, void *user_data);
+unsigned int async_get_cdt_entry(const char *cd_catalog_ptr,
+                                 const int track_no,
+                                 async_callback callback, void *user_data);
+unsigned int async_add_cdc_entry(const cdc_entry entry_to_add,
+                                 async_callback callback, void *user_data);
+unsigned int async_add_cdt_entry(const cdt_entry entry_to_add,
+                                 async_callback callback, void *user_data);
+unsigned int async_del_cdc_entry(const char *cd_catalog_ptr,
+                                 async_callback callback, void *user_data);
+unsigned int async_del_cdt_entry(const char *cd_catalog_ptr,
+                                 const int track_no,
+                                 async_callback callback, void *user_data);
+int async_outstanding(void);
+int cd_client_run_once(const int timeout_ms);
+int cd_client_fd(void);
+
+/* Caching, which also only exists on the client side.
+ *
+ * With the cache on, get_cdc_entry and get_cdt_entry keep what they fetch
+ * (including that there is no such entry) in a cache of CACHE_SLOTS
+ * entries, and answer later gets for it from there, without asking the
+ * server. The server tells us when anybody changes an entry we have, before
+ * it answers the change, so the cache never hands back an entry that has
+ * been changed since. Servers that can't do that (replicas, and servers
+ * with worker processes) don't let their clients cache; nor does a server
+ * we have lost touch with, since the cache empties whenever a request
+ * fails to reach the server, or its answer fails to come back.
+ *
+ * The cache is off unless CD_CLIENT_CACHE is set (to anything but 0) when
+ * database_initialize is called. set_client_cache turns it on or off, and
+ * empties it either way. get_client_cache_stats says how well it has done
+ * since the client started. */
+#define CACHE_SLOTS 128     /* must be a power of two */
+
+typedef struct {
+    long hits;
+    long misses;
+    long invalidations;     /* entries the server told us had changed */
+} client_cache_stats;
+
+void set_client_cache(const int on);
+void get_client_cache_stats(client_cache_stats *stats_ptr);
+
+/* Deadlines, which also only exist on the client side.
+ *
+ * Without a request timeout, a client waits as long as it takes for every
+ * answer, so a server that has stopped answering leaves it stuck. With one
+ * of timeout_ms, each request carries a deadline that far after it is sent,
+ * and the client waits no longer than that for the answer; a search or
+ * query that has started answering gets that long again for each match
+ * after the first, so a caller that is slow to take its matches doesn't
+ * run out of time. A request that runs out of time fails, just as if the
+ * server had failed to answer it, and its answer is dropped if it comes
+ * later. For the async calls, the callback is called with succeeded set to
+ * 0 by the first cd_client_run_once after the deadline.
+ *
+ * The server drops any request whose deadline has passed by the time it
+ * gets to it, without running or answering it (see server.c), so a client
+ * that has given up costs it nothing more. The deadline is a time of day,
+ * so with the server on another machine, the two clocks have to agree.
+ *
+ * There is no timeout unless CD_REQUEST_TIMEOUT is set (to a number of ms)
+ * when database_initialize is called. set_request_timeout changes it for
+ * the requests sent from then on (0 for none), and requests_expired says
+ * how many requests have run out of time since the client started. */
+void set_request_timeout(const int timeout_ms);
+long requests_expired(void);
+
+/* Sharing the database between server processes, which also only happens
+ * on the server side (in cd_dbm.c). After database_share, the locking in
+ * cd_dbm.c works across processes as well as threads, and each process
+ * picks up the changes the others make. Call it once the database is open,
+ * before forking the processes that will share it; each of them must use
+ * it from a single thread. Returns 1 on success, 0 on failure. */
+int database_share(void);
+
+/* and a parallel version of the search, which only exists on the server side
+ * (in cd_dbm.c). Rather than handing back one entry per call, it returns all
+ * of the matches at once in a malloc'd array that the caller must free, and
+ * stores the number of matches in *n_found_ptr. The catalog is split between
+ * n_workers threads. Returns NULL on error. */
+cdc_entry *search_cdc_entries(const char *cd_catalog_ptr, int n_workers,
+                              int *n_found_ptr);
+
+/* the server-side query engine behind query_cdc_entry and explain_cdc_query.
+ * Like search_cdc_entries, it returns all of the matches in a malloc'd array
+ * which the caller must free (or NULL on error), and it fills in *plan_ptr
+ * with the plan it used. */
+cdc_entry *run_cdc_query(const cd_query *query_ptr, cd_query_plan *plan_ptr,
+                         int *n_found_ptr);
+
+/* and the server-side engine behind aggregate_cdc_entry, which returns all
+ * of the rows in a malloc'd array in the same way. */
+cd_agg_row *run_cdc_aggregate(const cd_aggregate *aggregate_ptr,
+                              int *n_rows_ptr);
+
@@ -0,0 +1,181 @@
+/* cd_stat: watch a running server's statistics (see stats.h).
+ *
+ *     cd_stat [-r replica_no] [interval [count]]
+ *
+ * With no interval, it prints everything the server has recorded since it
+ * started. With one, it prints a line every interval seconds (count times,
+ * or until it is stopped) about the requests of that interval, in the
+ * manner of vmstat. Either way, it only reads the server's stats page, so
+ * watching a server costs the server nothing.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "cd_data.h"
+#include "cliserv.h"
+#include "stats.h"
+
+#define HEADER_EVERY 20   /* lines */
+
+static const char *request_names[s_request_kinds] = {
+    [s_create_new_database] = "create",
+    [s_get_cdc_entry]       = "get_cdc",
+    [s_get_cdt_entry]       = "get_cdt",
+    [s_add_cdc_entry]       = "add_cdc",
+    [s_add_cdt_entry]       = "add_cdt",
+    [s_del_cdc_entry]       = "del_cdc",
+    [s_del_cdt_entry]       = "del_cdt",
+    [s_find_cdc_entry]      = "find",
+    [s_query_cdc_entry]     = "query",
+    [s_explain_cdc_query]   = "explain",
+    [s_aggregate]           = "aggregate",
+    [s_replica_status]      = "replica_status",
+    [s_batch]               = "batch",
+    [s_stats]               = "stats",
+    [s_watch_cdc_entry]     = "watch_cdc",
+    [s_watch_cdt_entry]     = "watch_cdt"
+};
+
+static const char *phase_names[STATS_PHASES] = {
+    [phase_queue_wait] = "queue wait",
+    [phase_storage]    = "storage",
+    [phase_send]       = "send"
+};
+
+/* copies of the page, at the start and end of an interval; they are too
+ * big to want on the stack */
+static stats_page before;
+static stats_page after;
+
+static double us(const long ns) {
+    return(ns / 1000.0);
+}
+
+/* the transport's backlog: a count of requests, or of bytes with a B */
+static const char *backlog(const server_stats *stats_ptr) {
+    static char text[32];
+
+    if (stats_ptr->transport_backlog < 0) return("-");
+    sprintf(text, "%ld%s", stats_ptr->transport_backlog,
+            stats_ptr->backlog_in_bytes ? "B" : "");
+    return(text);
+}
+
+/* everything since the server started */
+static void print_report(const pid_t server_pid,
+                         const server_stats *stats_ptr) {
+    const latency_summary *latency;
+    int i;
+
+    printf("server %d, up %.1f s\n", server_pid,
+           stats_ptr->uptime_ms / 1000.0);
+    printf("\n%-16s %10s %10s\n", "request", "count", "failed");
+    for (i = 0; i < STATS_REQUEST_KINDS; i++) {
+        if (stats_ptr->requests[i] == 0) continue;
+        printf("%-16s %10ld %10ld\n",
+               request_names[i] ? request_names[i] : "?",
+               stats_ptr->requests[i], stats_ptr->failures[i]);
+    }
+    printf("\nin progress %ld, queue depth %ld, transport backlog %s, "
+           "active clients %ld, gets coalesced %ld\n", stats_ptr->in_progress,
+           stats_ptr->queue_depth, backlog(stats_ptr),
+           stats_ptr->active_clients, stats_ptr->gets_coalesced);
+    printf("requests dropped past their deadlines %ld\n",
+           stats_ptr->expired_dropped);
+    printf("\n%-12s %10s %9s %9s %9s %9s %9s %9s\n", "phase (us)", "count",
+           "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (i = 0; i < STATS_PHASES; i++) {
+        latency = &stats_ptr->latency[i];
+        printf("%-12s %10ld %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+               phase_names[i], latency->count, us(latency->mean_ns),
+               us(latency->p50_ns), us(latency->p90_ns), us(latency->p99_ns),
+               us(latency->p999_ns), us(latency->max_ns));
+    }
+}
+
+/* one interval of secs seconds. The latencies are in us. */
+static void print_line(const server_stats *stats_ptr, const double secs,
+                       const int line_no) {
+    long requests = 0;
+    long failures = 0;
+    int i;
+
+    if (line_no % HEADER_EVERY == 0) {
+        printf("%9s %8s %8s %6s %6s %8s %7s %9s %9s %9s\n", "req/s",
+               "fail/s", "drop/s", "inprog", "queue", "backlog", "clients",
+               "wait p99", "stor p99", "send p99");
+    }
+    for (i = 0; i < STATS_REQUEST_KINDS; i++) {
+        requests += stats_ptr->requests[i];
+        failures += stats_ptr->failures[i];
+    }
+    printf("%9.0f %8.0f %8.0f %6ld %6ld %8s %7ld %9.1f %9.1f %9.1f\n",
+           requests / secs, failures / secs,
+           stats_ptr->expired_dropped / secs, stats_ptr->in_progress,
+           stats_ptr->queue_depth, backlog(stats_ptr),
+           stats_ptr->active_clients,
+           us(stats_ptr->latency[phase_queue_wait].p99_ns),
+           us(stats_ptr->latency[phase_storage].p99_ns),
+           us(stats_ptr->latency[phase_send].p99_ns));
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    const stats_page *page;
+    server_stats stats;
+    long before_ns, after_ns;
+    int instance = 0;
+    int interval = 0;
+    int count = 0;
+    int line_no;
+    int c;
+
+    while ((c = getopt(argc, argv, "r:")) != -1) {
+        switch(c) {
+            case 'r':
+                instance = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-r replica_no] "
+                        "[interval [count]]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc) interval = atoi(argv[optind++]);
+    if (optind < argc) count = atoi(argv[optind++]);
+
+    page = stats_attach(instance);
+    if (!page) {
+        fprintf(stderr, "cd_stat: no stats for server %d; is it running?\n",
+                instance);
+        exit(EXIT_FAILURE);
+    }
+
+    if (interval <= 0) {
+        stats_summarize(page, NULL, stats_now(), &stats);
+        print_report(page->server_pid, &stats);
+        exit(EXIT_SUCCESS);
+    }
+
+    memcpy(&before, page, sizeof(before));
+    before_ns = stats_now();
+    for (line_no = 0; count == 0 || line_no < count; line_no++) {
+        sleep(interval);
+        if (kill(page->server_pid, 0) == -1 && errno == ESRCH) {
+            fprintf(stderr, "cd_stat: the server has stopped\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(&after, page, sizeof(after));
+        after_ns = stats_now();
+        stats_summarize(&after, &before, after_ns, &stats);
+        print_line(&stats, (after_ns - before_ns) / 1e9, line_no);
+        memcpy(&before, &after, sizeof(before));
+        before_ns = after_ns;
+    }
+    exit(EXIT_SUCCESS);
+}
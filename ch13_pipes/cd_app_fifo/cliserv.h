@@ -16,6 +16,9 @@
 #define SERVER_PIPE "/tmp/server_pipe"
 #define CLIENT_PIPE "/tmp/client_%d_pipe"
 
+/* replica servers each have their own pipe, named by instance number */
+#define REPLICA_PIPE "/tmp/server_%d_pipe"
+
 #define ERR_TEXT_LEN 80
 
 /* We implement the commands as enumerated types, rather than #defines.  This
@@ -32,16 +35,41 @@ typedef enum {
     s_add_cdt_entry,
     s_del_cdc_entry,
     s_del_cdt_entry,
-    s_find_cdc_entry
+    s_find_cdc_entry,
+    s_query_cdc_entry,
+    s_explain_cdc_query,
+    s_aggregate,
+    s_replica_status,
+    s_batch,
+    s_stats,
+    s_watch_cdc_entry,
+    s_watch_cdt_entry,
+    s_request_kinds             /* how many there are, not a request */
 } client_request_e;
 
+/* the server's statistics have a count for each kind (see cd_data.h) */
+_Static_assert(s_request_kinds == STATS_REQUEST_KINDS,
+               "STATS_REQUEST_KINDS is not the number of client_request_e");
+
 /* Server responses are enumerated */
 typedef enum {
     r_success = 0,
     r_failure,
-    r_find_no_more
+    r_find_no_more,
+    r_invalidated       /* a notice that a watched entry has changed */
 } server_response_e;
 
+/* The s_watch_ requests are gets for a client's cache, which ask the server
+ * to watch the entry for changes (see cache_watch.h). They say which slot
+ * of the cache the entry is going in, and the response says what version
+ * of it the client has, or has a slot of -1 if the server won't watch it,
+ * in which case the client mustn't cache it. A notice that the entry has
+ * changed says which slot it was in, and the version of the change. */
+typedef struct {
+    int  slot;
+    long version;
+} cache_stamp;
+
 /* Next, we declare a structure that will form the message passed in both
  * directions between the two processes.
  *
@@ -50,10 +78,24 @@ typedef enum {
  * keep them separate.  This also makes the code easier to maintain.  */
 typedef struct {
     pid_t               client_pid;
+    unsigned int        request_id;   /* set by clientif.c, and echoed
+                                         back in the responses */
+    long                deadline_ms;  /* of a request: ms since the epoch,
+                                         or 0 for none (see "Deadlines"
+                                         in cd_data.h) */
     client_request_e    request;
     server_response_e   response;
     cdc_entry           cdc_entry_data;
     cdt_entry           cdt_entry_data;
+    cd_query            query_data;
+    cd_query_plan       plan_data;
+    cd_aggregate        aggregate_data;
+    cd_agg_row          agg_row_data;
+    replica_status      status_data;
+    server_stats        stats_data;
+    cd_batch            batch_data;
+    cache_stamp         cache_data;
+    cd_page             page_data;
     char                error_text[ERR_TEXT_LEN + 1];
 } message_db_t;
 
@@ -63,14 +105,73 @@ typedef struct {
  *
  *  Note that we don't have functions for specific database command - these
  *  are all encoded in side of the cient_request and server_response withing
- *  the message_db_t struct. */
+ *  the message_db_t struct. The transports don't send the whole struct, just
+ *  the parts of it that the request uses; see wire.h.
+ *
+ *  A client can have several requests with the server at once (see the
+ *  pipeline_ functions in cd_data.h), and the server may answer them in any
+ *  order, so the client matches responses to requests by request_id. All the
+ *  responses to any one request arrive in order, though.
+ *
+ *  A server with a worker pool (see server.c) reads requests on one thread,
+ *  but may call start_, send_ and end_resp_to_client from several threads at
+ *  once, each answering a different client. */
+/* Several servers (a primary and its replicas) can run at once, each with
+ * its own instance number. Instance 0, the default, is the primary. Both
+ * sides must choose the instance before calling X_starting. */
+void set_server_instance(const int instance);
+
 int server_starting(void);
 void server_ending(void);
+
+/* Several server processes can take requests from the one server fifo or
+ * queue (see server.c). Call this after server_starting, before forking
+ * them, so that each read_request_from_client takes exactly one whole
+ * request. Returns 0 for error, 1 for success. */
+int server_share_intake(void);
+
+/* A server can be restarted in place (with a new build, say) without losing
+ * any requests, by handing its intake over to the program it execs (see
+ * server.c). Once it has stopped reading requests and answered all those
+ * it read, it calls server_handoff instead of server_ending. That leaves the
+ * intake in place, so that clients can go on sending requests, which wait
+ * in it until the new program reads them. It writes whatever the new
+ * program needs to take the intake over to state_fd, including any requests
+ * it read but didn't get to, and leaves open any fds that must survive the
+ * exec. The new program calls server_take_over with that state in place of
+ * server_starting. Both return 0 for error, 1 for success.
+ *
+ * server_can_hand_off says whether the intake can be handed over at all,
+ * so that the server can find out before it stops reading. */
+int server_can_hand_off(void);
+int server_handoff(const int state_fd);
+int server_take_over(const int state_fd);
+
 int read_request_from_client(message_db_t *rec_ptr);
-int start_resp_to_client(const message_db_t mess_to_send);
-int send_resp_to_client(const message_db_t mess_to_send);
+int start_resp_to_client(const message_db_t *mess_ptr);
+int send_resp_to_client(const message_db_t *mess_ptr);
 void end_resp_to_client(void);
 
+/* send_resp_to_client returns 1 once the response is with the client. A
+ * transport that never waits for room (the SysV queues) may keep it back
+ * instead, until the client makes room, and then returns RESP_QUEUED. The
+ * responses to a client still reach it in order, but the server has to
+ * know that a notice (see cache_watch.h) has arrived before it answers the
+ * change, so it waits for those with wait_resp_delivered. That returns 1
+ * once all that was kept back for the client so far has gone, or 0 if it
+ * couldn't be sent, in which case the client has been cut off, and knows
+ * to empty its cache. Transports that keep nothing back return 1 at once. */
+#define RESP_QUEUED 2
+int wait_resp_delivered(const pid_t client_pid);
+
+/* For the stats (see stats.h): how much has been sent to the server and not
+ * yet read. The queues count requests; the byte streams can only count
+ * bytes, and set *in_bytes_ptr. Returns -1 if the transport can't tell. */
+long server_backlog(int *in_bytes_ptr);
+
+/* If the server isn't taking requests, send_mess_to_server waits for it
+ * no later than the request's deadline (if it has one), and then fails
+ * with errno set to ETIMEDOUT. */
 int client_starting(void);
 void client_ending(void);
 int send_mess_to_server(message_db_t mess_to_send);
@@ -78,4 +179,17 @@ int start_resp_from_server(void);
 int read_resp_from_server(message_db_t *rec_ptr);
 void end_resp_from_server(void);
 
+/* Like read_resp_from_server, but only waits up to timeout_ms for a response
+ * to arrive (0 means just take one if it is already there, and -1 means wait
+ * as long as it takes). Returns 1 if it read a response, 0 if none came in
+ * time, and -1 on error. */
+int poll_resp_from_server(message_db_t *rec_ptr, const int timeout_ms);
+
+/* A file descriptor that becomes readable when a response arrives, for a
+ * client to wait on with poll or epoll, or -1 if the transport has none.
+ * A response can also be waiting in the transport's own buffer, where the
+ * fd doesn't show it, so only wait on the fd once poll_resp_from_server has
+ * found nothing. */
+int resp_fd_from_server(void);
+
 
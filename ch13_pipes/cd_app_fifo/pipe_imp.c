@@ -1,7 +1,39 @@
 /* Include files */
 
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
 #include "cd_data.h"
 #include "cliserv.h"
+#include "wire.h"
+
+/* The server keeps each client's fifo open between requests, in a small
+ * connection table keyed by client pid. Opening the fifo (and formatting its
+ * name) on every request used to cost more than the request itself.
+ *
+ * Connections that haven't been used for CONN_IDLE_SECS, or whose client has
+ * gone away, are closed by a sweep that runs at most once every
+ * CONN_SWEEP_SECS. If the table is full, the least recently used connection
+ * makes way for a new one.
+ *
+ * The server can send responses from several worker threads at once, each
+ * to a different client, so the table is guarded by conns_lock, and the
+ * connection a thread is responding on is kept per thread. A connection that
+ * a thread is using is never closed under it. */
+#define MAX_CONNS       64
+#define CONN_IDLE_SECS  60
+#define CONN_SWEEP_SECS 5
+
+typedef struct {
+    pid_t  client_pid;      /* 0 if the slot is free */
+    int    fd;
+    time_t last_used;
+    int    in_use;          /* a response is being sent on it */
+} client_conn;
 
 /* define some values that we need in different functions within the file. */
 
@@ -10,23 +42,46 @@ static pid_t mypid = 0;
 static char client_pipe_name[PATH_MAX + 1] = {'\0'};
 static int client_fd = -1;
 static int client_write_fd = -1;
+static int server_write_fd = -1;
+static client_conn conns[MAX_CONNS];
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread client_conn *current_conn = NULL;
+static time_t last_sweep = 0;
+static char server_pipe_name[PATH_MAX + 1] = SERVER_PIPE;
+
+/* when several server processes read the server fifo, they take turns by
+ * locking this file, so that each reads one whole frame at a time */
+static char intake_lock_name[PATH_MAX + 6] = {'\0'};
+static int intake_lock_fd = -1;
+
+/* frames read from our fifo that haven't been handed out yet (the server
+ * reads requests from its fifo, a client reads responses from its own) */
+static wire_stream read_stream;
+
+static void close_idle_conns(const int idle_secs);
+
+/* Either side:
+ *
+ * pick which server's fifo to use. The primary (instance 0) has the
+ * well-known SERVER_PIPE; replicas have numbered ones. */
+void set_server_instance(const int instance) {
+    if (instance == 0) strcpy(server_pipe_name, SERVER_PIPE);
+    else sprintf(server_pipe_name, REPLICA_PIPE, instance);
+}
 
 /* initialize the server pipe, from the server side
  *   - unlink any old fifo
  *   - make a new fifo
  *   - open the read end fo the fifo, in blocking mode
  *
- * We don't open a write side of the fifo, which means that once any single
- * client connects, the next time there are no clients up the server will
- * read 0 bytes.
- *
- * We handle this issue in the read_request_from_client function,
- * which always closes and reopens after every request. That way if no clients
- * are connected and we read the last data, the next call to read will 
- * once again block until there's data.
+ * We also open a write side of the fifo, which we never write to. Without
+ * it, once any single client connects, the next time there are no clients
+ * up the server would read 0 bytes, and have to close and reopen the fifo
+ * to block again. Holding a writer ourselves means a read just blocks until
+ * the next request arrives.
  *
- * We could change this by holding a write-side fd on the fifo, if
- * we wanted the server to stay up until explicitly brought down.
+ * Since we keep client fifos open, a client can go away while we hold its
+ * fifo; we ignore SIGPIPE and notice the EPIPE from write instead.
  *
  * Returns 0 for error, 1 for success.
  */
@@ -35,16 +90,23 @@ int server_starting(void) {
         printf("%d :- server_starting()\n",  getpid());
     #endif
 
-        unlink(SERVER_PIPE);
-    if (mkfifo(SERVER_PIPE, 0777) == -1) {
+        unlink(server_pipe_name);
+    if (mkfifo(server_pipe_name, 0777) == -1) {
         fprintf(stderr, "Server startup error, no FIFO created\n");
         return(0);
     }
 
-    if ((server_fd = open(SERVER_PIPE, O_RDONLY)) == -1) {
+    if ((server_fd = open(server_pipe_name, O_RDONLY)) == -1) {
+        fprintf(stderr, "Server startup error, no FIFO opened\n");
+        return(0);
+    }
+    if ((server_write_fd = open(server_pipe_name, O_WRONLY)) == -1) {
         fprintf(stderr, "Server startup error, no FIFO opened\n");
         return(0);
     }
+    signal(SIGPIPE, SIG_IGN);
+    memset(conns, '\0', sizeof(conns));
+    wire_stream_reset(&read_stream);
     return(1);
 }
 
@@ -58,8 +120,101 @@ void server_ending(void)
         printf("%d :- server_ending()\n",  getpid());
     #endif
 
+    close_idle_conns(0);
     close(server_fd);
-    unlink(SERVER_PIPE);
+    close(server_write_fd);
+    unlink(server_pipe_name);
+    if (intake_lock_fd != -1) {
+        close(intake_lock_fd);
+        unlink(intake_lock_name);
+        intake_lock_fd = -1;
+    }
+}
+
+
+/* server side:
+ *
+ * get ready for several processes to read the server fifo. Frames don't
+ * split in a fifo, but a read can return several of them, or end partway
+ * through one; so instead of buffering reads in read_stream, each process
+ * locks the intake file, reads exactly one frame, and unlocks it again. */
+int server_share_intake(void) {
+    sprintf(intake_lock_name, "%s.lock", server_pipe_name);
+    intake_lock_fd = open(intake_lock_name, O_RDWR | O_CREAT, 0600);
+    if (intake_lock_fd == -1) {
+        fprintf(stderr, "Server startup error, no intake lock opened\n");
+        return(0);
+    }
+    return(1);
+}
+
+
+/* server side:
+ *
+ * Handing the intake over (see cliserv.h). The fifo keeps its name, and we
+ * pass on both of our fds for it: the read side, so that the fifo always
+ * has a reader and clients can go on writing to it, and the write side,
+ * which keeps reads blocking as in server_starting. The requests waiting
+ * in the fifo stay there. Those we have already read into read_stream go
+ * in the state, the last of them perhaps only partly read; the new server
+ * reads the rest of it from the fifo. */
+typedef struct {
+    int server_fd;
+    int server_write_fd;
+    int buffered;           /* bytes of read_stream that follow */
+} fifo_handoff;
+
+int server_can_hand_off(void) {
+    return(1);
+}
+
+int server_handoff(const int state_fd) {
+    fifo_handoff state;
+
+    pthread_mutex_lock(&conns_lock);
+    close_idle_conns(0);
+    pthread_mutex_unlock(&conns_lock);
+    if (intake_lock_fd != -1) {
+        close(intake_lock_fd);
+        intake_lock_fd = -1;
+    }
+
+    state.server_fd = server_fd;
+    state.server_write_fd = server_write_fd;
+    state.buffered = read_stream.end - read_stream.start;
+    return(wire_write_all(state_fd, &state, sizeof(state)) &&
+           wire_write_all(state_fd, read_stream.data + read_stream.start,
+                          state.buffered));
+}
+
+int server_take_over(const int state_fd) {
+    fifo_handoff state;
+
+    wire_stream_reset(&read_stream);
+    if (!wire_read_all(state_fd, &state, sizeof(state)) ||
+        state.buffered < 0 || state.buffered > WIRE_STREAM_LEN ||
+        !wire_read_all(state_fd, read_stream.data, state.buffered)) {
+        fprintf(stderr, "Server startup error, could not take over FIFO\n");
+        return(0);
+    }
+    read_stream.end = state.buffered;
+    server_fd = state.server_fd;
+    server_write_fd = state.server_write_fd;
+    signal(SIGPIPE, SIG_IGN);
+    memset(conns, '\0', sizeof(conns));
+    return(1);
+}
+
+
+/* lock or unlock the intake file. The lock blocks until it is our turn,
+ * but gives up if a signal arrives while we wait. */
+static int lock_intake(const short lock_type) {
+    struct flock intake_lock;
+
+    memset(&intake_lock, '\0', sizeof(intake_lock));
+    intake_lock.l_type = lock_type;
+    intake_lock.l_whence = SEEK_SET;
+    return(fcntl(intake_lock_fd, F_SETLKW, &intake_lock) != -1);
 }
 
 
@@ -69,32 +224,33 @@ void server_ending(void)
  * It puts the data into *rec_ptr, and returns 0 if it read no data or if
  * any errors occur.
  *
- * If it reads 0 bytes, it will try to reopen the pipe and read again. This
- * causes read to block if all clients have disconnected but the fifo is still
- * intact, which is the desired behavior.
+ * Since we hold a write side of the fifo ourselves, the read blocks until
+ * there is a request, even when no clients are connected.
+ *
+ * This is also where we sweep out idle and dead client connections.
  *
  * Returns 1 on successful reads, and zero if we read malformed data or if
- * we fail to reopen the fifo */
+ * the read fails */
 int read_request_from_client(message_db_t *rec_ptr) {
     int return_code = 0;
-    int read_bytes;
 
     #if DEBUG_TRACE    
         printf("%d :- read_request_from_client()\n",  getpid());
     #endif
 
-    if (server_fd != -1) {
-        read_bytes = read(server_fd, rec_ptr, sizeof(*rec_ptr)); 
-
-        if (read_bytes == 0) {
-            close(server_fd);
-            if ((server_fd = open(SERVER_PIPE, O_RDONLY)) == -1) {
-               fprintf(stderr, "Server error, FIFO open failed\n");
-               return(0);
-            }
-            read_bytes = read(server_fd, rec_ptr, sizeof(*rec_ptr));
+    if (server_fd != -1 && intake_lock_fd != -1) {
+        if (lock_intake(F_WRLCK)) {
+            return_code = wire_read_frame(server_fd, rec_ptr);
+            lock_intake(F_UNLCK);
         }
-        if (read_bytes == sizeof(*rec_ptr)) return_code = 1;
+    }
+    else if (server_fd != -1) {
+        return_code = wire_stream_read(server_fd, &read_stream, rec_ptr);
+    }
+    if (time(NULL) - last_sweep >= CONN_SWEEP_SECS) {
+        pthread_mutex_lock(&conns_lock);
+        close_idle_conns(CONN_IDLE_SECS);
+        pthread_mutex_unlock(&conns_lock);
     }
     return(return_code);
 }
@@ -102,62 +258,208 @@ int read_request_from_client(message_db_t *rec_ptr) {
 
 /* Server side:
  *
- * open the write side of a client's fifo.
+ * close one client connection, and free its slot. This and
+ * close_idle_conns are called with conns_lock held. */
+static void close_conn(client_conn *conn) {
+    if (conn->client_pid == 0) return;
+    (void)close(conn->fd);
+    conn->client_pid = 0;
+    conn->fd = -1;
+    conn->in_use = 0;
+}
+
+/* Server side:
+ *
+ * close the connections that have been idle for at least idle_secs, and
+ * those whose client process no longer exists. With idle_secs of 0 this
+ * closes everything that isn't in use. */
+static void close_idle_conns(const int idle_secs) {
+    time_t now = time(NULL);
+    int i;
+
+    last_sweep = now;
+    for (i = 0; i < MAX_CONNS; i++) {
+        if (conns[i].client_pid == 0 || conns[i].in_use) continue;
+        if (now - conns[i].last_used >= idle_secs ||
+            (kill(conns[i].client_pid, 0) == -1 && errno == ESRCH)) {
+            close_conn(&conns[i]);
+        }
+    }
+}
+
+/* Server side:
+ *
+ * open the write side of a client's fifo, and put it in the table, marked
+ * as in use. If the table is full, the least recently used connection that
+ * isn't in use is closed to make room. Returns NULL if the fifo can't be
+ * opened, or every connection is in use.
+ *
+ * The open waits for the client to have its fifo open for reading, so we
+ * don't hold conns_lock until we have the fd. A client that was killed can
+ * leave its fifo behind with nobody to read it, though, and a blocking open
+ * of that would never return (and, in a worker thread, can't be interrupted
+ * by the signal that stops the server). So we open without blocking, and
+ * only keep trying while the client is still alive. */
+static client_conn *open_conn(const pid_t client_pid) {
+    char pipe_name[PATH_MAX + 1];
+    struct timespec nap = {0, 1000000};
+    client_conn *conn = NULL;
+    int fd;
+    int i;
+
+    sprintf(pipe_name, CLIENT_PIPE, client_pid);
+    while ((fd = open(pipe_name, O_WRONLY | O_NONBLOCK)) == -1) {
+        if (errno != ENXIO) return(NULL);
+        if (kill(client_pid, 0) == -1 && errno == ESRCH) return(NULL);
+        nanosleep(&nap, NULL);
+    }
+    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    pthread_mutex_lock(&conns_lock);
+    for (i = 0; i < MAX_CONNS; i++) {
+        if (conns[i].client_pid == 0) {
+            conn = &conns[i];
+            break;
+        }
+        if (conns[i].in_use) continue;
+        if (!conn || conns[i].last_used < conn->last_used) conn = &conns[i];
+    }
+    if (conn) {
+        close_conn(conn);
+        conn->client_pid = client_pid;
+        conn->fd = fd;
+        conn->last_used = time(NULL);
+        conn->in_use = 1;
+    } else {
+        (void)close(fd);
+    }
+    pthread_mutex_unlock(&conns_lock);
+    return(conn);
+}
+
+
+/* Server side:
+ *
+ * find the write side of a client's fifo in the connection table, or open
+ * it if we don't have it yet, and mark it as in use by this thread.
+ *
+ * The server never runs two requests from one client at once, so nobody
+ * else is using the connection.
  *
  * return 0 if fail, 1 if success.
  */
-int start_resp_to_client(const message_db_t mess_to_send)
+int start_resp_to_client(const message_db_t *mess_ptr)
 {
+    int i;
+
     #if DEBUG_TRACE
         printf("%d :- start_resp_to_client()\n", getpid());
     #endif
 
-    sprintf(client_pipe_name, CLIENT_PIPE, mess_to_send.client_pid);
-    if ((client_fd = open(client_pipe_name, O_WRONLY)) == -1) return(0);
-    return(1);
+    pthread_mutex_lock(&conns_lock);
+    current_conn = NULL;
+    for (i = 0; i < MAX_CONNS; i++) {
+        if (conns[i].client_pid == mess_ptr->client_pid) {
+            current_conn = &conns[i];
+            current_conn->in_use = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&conns_lock);
+    if (!current_conn) current_conn = open_conn(mess_ptr->client_pid);
+    return(current_conn != NULL);
 }
 
 /* Server side:
  *
- * Send a message_db_t struct over the write end of a client's fifo
+ * Send a message_db_t struct, as a frame, over the write end of a client's fifo
  * Before you call this you already need to have called start_resp_to_client
- * with the message, which ensures tha the (global) file descriptor is set
- * to the correct fifo.
+ * with the message, which ensures that this thread's connection is the
+ * correct fifo.
+ *
+ * If the write fails with EPIPE, the client we had open has gone away. Its
+ * pid may have been reused by a new client with a new fifo, though, so we
+ * reopen the fifo once and try again.
  *
  * Return 1 for success, 0 for error (write failed, or the fd wasn't set)
  */
-int send_resp_to_client(const message_db_t mess_to_send) {
+int send_resp_to_client(const message_db_t *mess_ptr) {
+    unsigned char frame[WIRE_MAX_FRAME];
+    int frame_len;
     int write_bytes;
 
     #if DEBUG_TRACE
         printf("%d :- send_resp_to_client()\n", getpid());
     #endif
 
-    if (client_fd == -1) return(0);
-    write_bytes = write(client_fd, &mess_to_send, sizeof(mess_to_send));
-    if (write_bytes != sizeof(mess_to_send)) return(0);
+    if (!current_conn) return(0);
+    frame_len = wire_encode_response(mess_ptr, frame);
+    write_bytes = write(current_conn->fd, frame, frame_len);
+    if (write_bytes == -1 && errno == EPIPE) {
+        pthread_mutex_lock(&conns_lock);
+        close_conn(current_conn);
+        pthread_mutex_unlock(&conns_lock);
+        if (!(current_conn = open_conn(mess_ptr->client_pid))) return(0);
+        write_bytes = write(current_conn->fd, frame, frame_len);
+    }
+    if (write_bytes != frame_len) {
+        pthread_mutex_lock(&conns_lock);
+        close_conn(current_conn);
+        pthread_mutex_unlock(&conns_lock);
+        current_conn = NULL;
+        return(0);
+    }
     return(1);
 }
 
 /* Server side
  *
- * Close the client fifo fd. We do this after sending every message.  */
+ * Finish a response. The client's fifo stays open in the connection table
+ * for its next request; we just note when it was last used.  */
 void end_resp_to_client(void) {
     #if DEBUG_TRACE
         printf("%d :- end_resp_to_client()\n",  getpid());
     #endif
 
-    if (client_fd != -1) {
-        (void)close(client_fd);
-        client_fd = -1;
+    if (current_conn) {
+        pthread_mutex_lock(&conns_lock);
+        current_conn->last_used = time(NULL);
+        current_conn->in_use = 0;
+        pthread_mutex_unlock(&conns_lock);
+    }
+    current_conn = NULL;
+}
+
+
+/* server side:
+ *
+ * a response is written to the client's fifo before send_resp_to_client
+ * returns, so there is nothing kept back to wait for. */
+int wait_resp_delivered(const pid_t client_pid) {
+    return(1);
+}
+
+
+/* server side:
+ *
+ * the bytes waiting in the server fifo, and those we have read from it but
+ * not yet handed out. Only the thread that reads requests calls this. */
+long server_backlog(int *in_bytes_ptr) {
+    int waiting;
+
+    *in_bytes_ptr = 1;
+    if (server_fd == -1 || ioctl(server_fd, FIONREAD, &waiting) == -1) {
+        return(-1);
     }
+    return(waiting + read_stream.end - read_stream.start);
 }
 
 
 /* Client side
  *
  * Start up a client. Open the write end of the server fifo, and create
- * (but don't open) the client fifo (which is named via the pid).
+ * (but don't open) the client fifo (which is named via the pid). Writes to
+ * the server fifo don't block (see send_mess_to_server).
  * 
  * Return 0 if there are any errors, else 1. */
 int client_starting(void)
@@ -167,10 +469,12 @@ int client_starting(void)
     #endif
 
     mypid = getpid();
-    if ((server_fd = open(SERVER_PIPE, O_WRONLY)) == -1) {
+    wire_stream_reset(&read_stream);
+    if ((server_fd = open(server_pipe_name, O_WRONLY)) == -1) {
         fprintf(stderr, "Server not running\n");
         return(0);
     }
+    (void)fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
 
     (void)sprintf(client_pipe_name, CLIENT_PIPE, mypid);
     (void)unlink(client_pipe_name);
@@ -194,6 +498,7 @@ void client_ending(void) {
     if (client_write_fd != -1) close(client_write_fd);
     if (client_fd != -1) close(client_fd);
     if (server_fd != -1) close(server_fd);
+    client_write_fd = client_fd = server_fd = -1;
     unlink(client_pipe_name);
 }
 
@@ -201,14 +506,17 @@ void client_ending(void) {
  *
  * Send a message to the server through the write end of the server fifo.
  *
- * Since we have a struct smaller than the buffer side, this is pretty
- * straightforward, and the server will always read the whole message at once.
- *
  * Multiple clients can send data at the same time, because a single write
- * call is atomic as long as it's no larger than the buffer size.
+ * call is atomic as long as it's no larger than the buffer size, and a frame
+ * is always smaller than that.
+ *
+ * When the fifo is full, we wait for room until the request's deadline, if
+ * it has one. Another client may fill the room first, so the write end is
+ * non-blocking, and we go back to waiting if the write finds no room.
  */
 int send_mess_to_server(message_db_t mess_to_send) {
-    int write_bytes;
+    unsigned char frame[WIRE_MAX_FRAME];
+    int frame_len;
 
     #if DEBUG_TRACE    
         printf("%d :- send_mess_to_server()\n",  getpid());
@@ -216,9 +524,9 @@ int send_mess_to_server(message_db_t mess_to_send) {
 
     if (server_fd == -1) return(0);
     mess_to_send.client_pid = mypid;
-    write_bytes = write(server_fd, &mess_to_send, sizeof(mess_to_send));
-    if (write_bytes != sizeof(mess_to_send)) return(0);
-    return(1);
+    frame_len = wire_encode_request(&mess_to_send, frame);
+    return(wire_write_frame_by(server_fd, frame, frame_len,
+                               mess_to_send.deadline_ms) == 1);
 }
 
 /* client side:
@@ -227,7 +535,8 @@ int send_mess_to_server(message_db_t mess_to_send) {
  * don't actually read, the `read_resp_from_server` does that.
  *
  * It also opens a write-only file descriptor also. The reason it does that
- * is because the server closes the write end after every request. This can
+ * is because the server may close its write end between requests, when it
+ * drops an idle connection. This can
  * caluse a dropped request in race situations where the client might open
  * the read side of its fifo and then try to read data *before* the server
  * has had a chance to open the write side.
@@ -237,6 +546,10 @@ int send_mess_to_server(message_db_t mess_to_send) {
  * there are no write fd's open on the fifo) in this situation. This is
  * the desired behavior.
  *
+ * The read side is opened without waiting for a writer, and only then made
+ * to block, so that this doesn't hang before the server has ever answered
+ * us (when we just want the fd to wait on, say).
+ *
  * Returns 0*/
 int start_resp_from_server(void) {
     #if DEBUG_TRACE    
@@ -246,12 +559,15 @@ int start_resp_from_server(void) {
     if (client_pipe_name[0] == '\0') return(0);
     if (client_fd != -1) return(1);
 
-    client_fd = open(client_pipe_name, O_RDONLY);
+    client_fd = open(client_pipe_name, O_RDONLY | O_NONBLOCK);
     if (client_fd != -1) {
         client_write_fd = open(client_pipe_name, O_WRONLY);
-        if (client_write_fd != -1) return(1);
+        if (client_write_fd != -1 &&
+            fcntl(client_fd, F_SETFL,
+                  fcntl(client_fd, F_GETFL) & ~O_NONBLOCK) != -1) return(1);
+        if (client_write_fd != -1) close(client_write_fd);
         close(client_fd);
-        client_fd = -1;
+        client_write_fd = client_fd = -1;
     }
     return(0);
 }
@@ -261,8 +577,6 @@ int start_resp_from_server(void) {
  *
  * read a server response from the pipe, and dump the data in *rec_ptr */
 int read_resp_from_server(message_db_t *rec_ptr) {
-    int read_bytes;
-    int return_code = 0;
 
     #if DEBUG_TRACE    
         printf("%d :- read_resp_from_server()\n",  getpid());    
@@ -271,9 +585,32 @@ int read_resp_from_server(message_db_t *rec_ptr) {
     if (!rec_ptr) return(0);
     if (client_fd == -1) return(0);
 
-    read_bytes = read(client_fd, rec_ptr, sizeof(*rec_ptr));
-    if (read_bytes == sizeof(*rec_ptr)) return_code = 1;
-    return(return_code);
+    return(wire_stream_read(client_fd, &read_stream, rec_ptr));
+}
+
+/* client side:
+ *
+ * read a server response, if one turns up within timeout_ms. We must already
+ * have called start_resp_from_server, to open our fifo. */
+int poll_resp_from_server(message_db_t *rec_ptr, const int timeout_ms) {
+
+    #if DEBUG_TRACE
+        printf("%d :- poll_resp_from_server()\n",  getpid());
+    #endif
+
+    if (!rec_ptr) return(-1);
+    if (client_fd == -1) return(-1);
+
+    return(wire_stream_read_timed(client_fd, &read_stream, rec_ptr,
+                                  timeout_ms));
+}
+
+/* client side:
+ *
+ * our fifo, which we open if we haven't already */
+int resp_fd_from_server(void) {
+    if (!start_resp_from_server()) return(-1);
+    return(client_fd);
 }
 
 /* Client side:
@@ -0,0 +1,157 @@
+/* Server statistics
+ *
+ * The server keeps its statistics in a page of shared memory, where any
+ * thread or worker process of the server can add to them without taking a
+ * lock, and where cd_stat can read them without asking the server anything.
+ * Clients get a summary of them with get_server_stats (see cd_data.h).
+ *
+ * For every request the server records its kind, whether it failed, and
+ * how long it spent in each of three phases:
+ *   - queue wait: from being read to a worker starting on it. This is only
+ *     more than a moment with a -t worker pool, whose queue can back up.
+ *   - storage: the rest of the time spent on the request, which is mostly
+ *     the database's.
+ *   - send: the time spent handing the responses to the transport.
+ *
+ * The times go into histograms whose buckets get wider as the times get
+ * longer, as in HdrHistogram: each power of two is split into HIST_SUB
+ * buckets, so any time is known to within 1/HIST_SUB of itself however long
+ * it is, from nanoseconds up to a minute, in a fixed amount of space. A
+ * percentile is read off by counting buckets until enough requests have
+ * been passed. Since the counts only ever go up, the difference between two
+ * copies of a histogram is the histogram of the requests in between, which
+ * is how cd_stat shows the latencies of the last few seconds.
+ *
+ * Requests whose deadlines (see "Deadlines" in cd_data.h) have passed by the
+ * time the server gets to them are dropped, and only counted as that: they
+ * aren't counted as requests of their kind, or timed.
+ *
+ * Besides the counters there are some gauges: the requests in progress
+ * (read, but not yet answered), the depth of the worker pool's queue, and
+ * the number of clients that have sent a request in the last ACTIVE_SECS.
+ * The clients are kept in a small hash table, so with more than a few
+ * hundred of them the count becomes an underestimate.
+ *
+ * The last gauge is the transport's backlog: the requests that have been
+ * sent but not yet read (see server_backlog in cliserv.h), or the bytes of
+ * them, for the byte streams. Asking costs a system call, so the server
+ * only does it as requests arrive, at most every BACKLOG_SAMPLE_MS. A
+ * server that hasn't read a request for BACKLOG_IDLE_MS, and has none in
+ * progress, is waiting for one, so its backlog is taken to be empty. With
+ * -w worker processes, each socket connection belongs to one of them, and
+ * the backlog is that of the connections of whichever sampled last.
+ *
+ * Include this after cd_data.h and cliserv.h.
+ */
+
+#include <stdint.h>
+
+#define STATS_SHM         "/cd_stats"
+#define REPLICA_STATS_SHM "/cd_stats_%d"
+
+#define STATS_MAGIC   0x43445354   /* "CDST" */
+#define STATS_VERSION 3
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36            /* times up to 2^36 ns, about 69 s */
+#define HIST_BUCKETS  ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define ACTIVE_SLOTS  1024          /* must be a power of two */
+#define ACTIVE_SECS   10
+#define ACTIVE_PROBES 8             /* slots a client may be found in */
+
+#define BACKLOG_SAMPLE_MS 10
+#define BACKLOG_IDLE_MS   100
+
+typedef struct {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total_ns;
+    unsigned long max_ns;
+} stats_histogram;
+
+typedef struct {
+    unsigned int    magic;
+    unsigned int    version;
+    pid_t           server_pid;
+    long            started_ns;     /* CLOCK_MONOTONIC */
+    unsigned long   requests[STATS_REQUEST_KINDS];
+    unsigned long   failures[STATS_REQUEST_KINDS];
+    unsigned long   gets_coalesced;
+    unsigned long   expired_dropped;
+    long            in_progress;
+    long            queue_depth;
+    long            transport_backlog;
+    long            backlog_in_bytes;
+    long            backlog_sampled_ns;
+    stats_histogram phases[STATS_PHASES];
+    /* each slot is a client pid in the top half, and in the bottom half the
+     * second (since started_ns) in which we last heard from it */
+    uint64_t        clients[ACTIVE_SLOTS];
+} stats_page;
+
+/* Histograms, which are also of use to other programs timing requests
+ * (cd_loadgen, for one). Adding to a histogram is atomic, so processes
+ * can share one in shared memory.
+ *
+ * Record a time in ns... */
+void stats_record_time(stats_histogram *hist_ptr, const long ns);
+
+/* ... and summarize the times recorded since the copy of the histogram in
+ * since_ptr was taken (or all of them, if since_ptr is NULL). */
+void stats_summarize_histogram(const stats_histogram *hist_ptr,
+                               const stats_histogram *since_ptr,
+                               latency_summary *summary_ptr);
+
+/* Server side:
+ *
+ * Make this server's stats page, named for its instance number, replacing
+ * any that a server which crashed left behind. Worker processes forked
+ * afterwards share it. If the page can't be shared, the server keeps its
+ * stats to itself (only get_server_stats can see them). Returns 0 if there
+ * is no memory for them at all. */
+int stats_open(const int instance);
+
+/* A server restarting in place (see server.c) keeps its stats: the new
+ * program maps the page the old one left, if it is still there and of the
+ * same version. Returns 0 if it isn't, and stats_open must make a new one. */
+int stats_take_over(const int instance);
+
+/* unmap the page and remove its name, so that cd_stat can't find it */
+void stats_close(void);
+
+/* the time now, in ns, on the clock the stats use */
+long stats_now(void);
+
+/* Record the arrival of a request from client_pid at arrived_ns... */
+void stats_arrived(const pid_t client_pid, const long arrived_ns);
+
+/* ... and that it has been answered, and how long it took, or that it has
+ * been dropped because its deadline had passed */
+void stats_done(const client_request_e request, const int failed,
+                const long queue_ns, const long storage_ns,
+                const long send_ns);
+void stats_expired(void);
+
+/* the gauges and counters that don't belong to any one request */
+void stats_queue_depth(const int depth);
+void stats_coalesced(const int n_gets);
+
+/* whether it is time to sample the transport's backlog, as at now_ns, and
+ * the sample, which is -1 if the transport can't tell */
+int stats_backlog_due(const long now_ns);
+void stats_backlog(const long backlog, const int in_bytes, const long now_ns);
+
+/* fill in a summary of everything recorded so far */
+void stats_summary(server_stats *stats_ptr);
+
+/* cd_stat's side:
+ *
+ * Map the stats page of the server with this instance number, read-only.
+ * Returns NULL if there is no such server running. */
+const stats_page *stats_attach(const int instance);
+
+/* Summarize what page has recorded since the copy of it in since was taken
+ * (or since the server started, if since is NULL), as at now_ns. */
+void stats_summarize(const stats_page *page, const stats_page *since,
+                     const long now_ns, server_stats *stats_ptr);
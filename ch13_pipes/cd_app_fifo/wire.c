@@ -0,0 +1,738 @@
+/* Encoding and decoding of the frames described in wire.h. */
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include "cd_data.h"
+#include "cliserv.h"
+#include "wire.h"
+
+/* The parts a frame can carry, as bits in wire_header.sections. */
+#define SECT_CATALOG   0x0001  /* just cdc_entry_data.catalog */
+#define SECT_CDC       0x0002  /* all of cdc_entry_data */
+#define SECT_CDT       0x0004
+#define SECT_QUERY     0x0008
+#define SECT_PLAN      0x0010
+#define SECT_AGGREGATE 0x0020
+#define SECT_AGG_ROW   0x0040
+#define SECT_STATUS    0x0080
+#define SECT_ERROR     0x0100
+#define SECT_BATCH     0x0200  /* the ops of a batch, on the way in ... */
+#define SECT_BATCH_RES 0x0400  /* ... and their results on the way out */
+#define SECT_STATS     0x0800
+#define SECT_CACHE     0x1000  /* cache_data, for the s_watch_ requests */
+#define SECT_PAGE      0x2000  /* page_data, for paged searches */
+#define SECT_DEADLINE  0x4000  /* deadline_ms, of requests that have one */
+#define SECT_DROPPED   0x8000  /* stats_data.expired_dropped */
+
+/* The parts each request sends to the server... */
+static uint16_t request_sections(const client_request_e request) {
+    switch(request) {
+        case s_get_cdc_entry:
+        case s_del_cdc_entry:
+        case s_find_cdc_entry:
+            return(SECT_CATALOG);
+        case s_add_cdc_entry:
+            return(SECT_CDC);
+        case s_get_cdt_entry:
+        case s_add_cdt_entry:
+        case s_del_cdt_entry:
+            return(SECT_CDT);
+        case s_query_cdc_entry:
+        case s_explain_cdc_query:
+            return(SECT_QUERY);
+        case s_aggregate:
+            return(SECT_AGGREGATE);
+        case s_batch:
+            return(SECT_BATCH);
+        case s_watch_cdc_entry:
+            return(SECT_CATALOG | SECT_CACHE);
+        case s_watch_cdt_entry:
+            return(SECT_CDT | SECT_CACHE);
+        default:
+            return(0);
+    }
+}
+
+/* ... and the parts its responses bring back. */
+static uint16_t response_sections(const client_request_e request) {
+    switch(request) {
+        case s_get_cdc_entry:
+        case s_find_cdc_entry:
+        case s_query_cdc_entry:
+            return(SECT_CDC);
+        case s_get_cdt_entry:
+            return(SECT_CDT);
+        case s_explain_cdc_query:
+            return(SECT_PLAN);
+        case s_aggregate:
+            return(SECT_AGG_ROW);
+        case s_replica_status:
+            return(SECT_STATUS);
+        case s_batch:
+            return(SECT_BATCH_RES);
+        case s_stats:
+            return(SECT_STATS | SECT_DROPPED);
+        case s_watch_cdc_entry:
+            return(SECT_CDC | SECT_CACHE);
+        case s_watch_cdt_entry:
+            return(SECT_CDT | SECT_CACHE);
+        default:
+            return(0);
+    }
+}
+
+
+/* Encoding
+ *
+ * None of the parts can overflow WIRE_MAX_FRAME (the largest, a full batch of
+ * adds, is under 3400 bytes), so the put_ functions don't need to check for
+ * room. */
+static unsigned char *put_u8(unsigned char *p, const int value) {
+    *p++ = (unsigned char)value;
+    return(p);
+}
+
+static unsigned char *put_i32(unsigned char *p, const int32_t value) {
+    uint32_t net_value = htonl((uint32_t)value);
+
+    memcpy(p, &net_value, sizeof(net_value));
+    return(p + sizeof(net_value));
+}
+
+static unsigned char *put_i64(unsigned char *p, const int64_t value) {
+    p = put_i32(p, (int32_t)((uint64_t)value >> 32));
+    return(put_i32(p, (int32_t)((uint64_t)value & 0xffffffff)));
+}
+
+/* strings that aren't terminated within max_len are cut short, so a field
+ * the caller didn't fill in can't run on */
+static unsigned char *put_str(unsigned char *p, const char *str,
+                              const int max_len) {
+    int len = 0;
+
+    while (len < max_len && str[len] != '\0') len++;
+    *p++ = (unsigned char)len;
+    memcpy(p, str, len);
+    return(p + len);
+}
+
+static unsigned char *put_cdc(unsigned char *p, const cdc_entry *cdc_ptr) {
+    p = put_str(p, cdc_ptr->catalog, CAT_CAT_LEN);
+    p = put_str(p, cdc_ptr->title, CAT_TITLE_LEN);
+    p = put_str(p, cdc_ptr->type, CAT_TYPE_LEN);
+    return(put_str(p, cdc_ptr->artist, CAT_ARTIST_LEN));
+}
+
+static unsigned char *put_cdt(unsigned char *p, const cdt_entry *cdt_ptr) {
+    p = put_str(p, cdt_ptr->catalog, TRACK_CAT_LEN);
+    p = put_i32(p, cdt_ptr->track_no);
+    return(put_str(p, cdt_ptr->track_txt, TRACK_TTEXT_LEN));
+}
+
+/* batch ops only send what their function takes, and only the gets bring
+ * anything back besides whether they worked */
+static unsigned char *put_batch(unsigned char *p, const cd_batch *batch_ptr,
+                                const int results) {
+    const cd_batch_op *op;
+    int n_ops = batch_ptr->n_ops;
+    int i;
+
+    if (n_ops < 0 || n_ops > BATCH_MAX_OPS) n_ops = 0;
+    p = put_u8(p, n_ops);
+    for (i = 0; i < n_ops; i++) {
+        op = &batch_ptr->ops[i];
+        p = put_u8(p, op->op);
+        if (results) {
+            p = put_u8(p, op->succeeded != 0);
+            if (op->op == batch_get_cdc) p = put_cdc(p, &op->cdc_entry_data);
+            if (op->op == batch_get_cdt) p = put_cdt(p, &op->cdt_entry_data);
+            continue;
+        }
+        switch(op->op) {
+            case batch_get_cdc:
+            case batch_del_cdc:
+                p = put_str(p, op->cdc_entry_data.catalog, CAT_CAT_LEN);
+                break;
+            case batch_add_cdc:
+                p = put_cdc(p, &op->cdc_entry_data);
+                break;
+            case batch_get_cdt:
+            case batch_del_cdt:
+                p = put_str(p, op->cdt_entry_data.catalog, TRACK_CAT_LEN);
+                p = put_i32(p, op->cdt_entry_data.track_no);
+                break;
+            case batch_add_cdt:
+                p = put_cdt(p, &op->cdt_entry_data);
+                break;
+        }
+    }
+    return(p);
+}
+
+static unsigned char *put_stats(unsigned char *p,
+                                const server_stats *stats_ptr) {
+    const latency_summary *latency;
+    int i;
+
+    p = put_i64(p, stats_ptr->uptime_ms);
+    for (i = 0; i < STATS_REQUEST_KINDS; i++) {
+        p = put_i64(p, stats_ptr->requests[i]);
+        p = put_i64(p, stats_ptr->failures[i]);
+    }
+    p = put_i64(p, stats_ptr->gets_coalesced);
+    p = put_i64(p, stats_ptr->in_progress);
+    p = put_i64(p, stats_ptr->queue_depth);
+    p = put_i64(p, stats_ptr->transport_backlog);
+    p = put_i64(p, stats_ptr->backlog_in_bytes);
+    p = put_i64(p, stats_ptr->active_clients);
+    for (i = 0; i < STATS_PHASES; i++) {
+        latency = &stats_ptr->latency[i];
+        p = put_i64(p, latency->count);
+        p = put_i64(p, latency->mean_ns);
+        p = put_i64(p, latency->p50_ns);
+        p = put_i64(p, latency->p90_ns);
+        p = put_i64(p, latency->p99_ns);
+        p = put_i64(p, latency->p999_ns);
+        p = put_i64(p, latency->max_ns);
+    }
+    return(p);
+}
+
+static int encode(const message_db_t *mess_ptr, uint16_t sections,
+                  unsigned char *frame) {
+    wire_header header;
+    unsigned char *p = frame + sizeof(header);
+    int i;
+
+    if (sections & SECT_CATALOG) {
+        p = put_str(p, mess_ptr->cdc_entry_data.catalog, CAT_CAT_LEN);
+    }
+    if (sections & SECT_CDC) p = put_cdc(p, &mess_ptr->cdc_entry_data);
+    if (sections & SECT_CDT) p = put_cdt(p, &mess_ptr->cdt_entry_data);
+    if (sections & SECT_CACHE) {
+        p = put_i32(p, mess_ptr->cache_data.slot);
+        p = put_i64(p, mess_ptr->cache_data.version);
+    }
+    if (sections & SECT_PAGE) {
+        p = put_i32(p, mess_ptr->page_data.limit);
+        p = put_u8(p, mess_ptr->page_data.more);
+        p = put_str(p, mess_ptr->page_data.after, CAT_CAT_LEN);
+    }
+    if (sections & SECT_DEADLINE) p = put_i64(p, mess_ptr->deadline_ms);
+    if (sections & SECT_QUERY) {
+        const cd_query *query_ptr = &mess_ptr->query_data;
+        int n_predicates = query_ptr->n_predicates;
+
+        if (n_predicates < 0 || n_predicates > QUERY_MAX_PREDICATES) {
+            n_predicates = 0;
+        }
+        p = put_u8(p, query_ptr->combine);
+        p = put_u8(p, n_predicates);
+        for (i = 0; i < n_predicates; i++) {
+            p = put_u8(p, query_ptr->predicates[i].field);
+            p = put_u8(p, query_ptr->predicates[i].match);
+            p = put_u8(p, query_ptr->predicates[i].ignore_case != 0);
+            p = put_str(p, query_ptr->predicates[i].text, QUERY_TEXT_LEN);
+        }
+    }
+    if (sections & SECT_PLAN) {
+        p = put_u8(p, mess_ptr->plan_data.access);
+        p = put_i32(p, mess_ptr->plan_data.driving_predicate);
+        p = put_i32(p, mess_ptr->plan_data.rows_examined);
+        p = put_i32(p, mess_ptr->plan_data.rows_matched);
+        p = put_str(p, mess_ptr->plan_data.description, PLAN_DESC_LEN);
+    }
+    if (sections & SECT_AGGREGATE) {
+        p = put_u8(p, mess_ptr->aggregate_data.group_by);
+        p = put_u8(p, mess_ptr->aggregate_data.count_tracks != 0);
+    }
+    if (sections & SECT_AGG_ROW) {
+        p = put_str(p, mess_ptr->agg_row_data.group, CAT_ARTIST_LEN);
+        p = put_i32(p, mess_ptr->agg_row_data.cd_count);
+        p = put_i32(p, mess_ptr->agg_row_data.track_count);
+    }
+    if (sections & SECT_STATUS) {
+        p = put_u8(p, mess_ptr->status_data.is_replica != 0);
+        p = put_i64(p, mess_ptr->status_data.primary_sequence);
+        p = put_i64(p, mess_ptr->status_data.applied_sequence);
+        p = put_i64(p, mess_ptr->status_data.lag_changes);
+        p = put_i64(p, mess_ptr->status_data.lag_ms);
+    }
+    if (sections & SECT_STATS) p = put_stats(p, &mess_ptr->stats_data);
+    if (sections & SECT_DROPPED) {
+        p = put_i64(p, mess_ptr->stats_data.expired_dropped);
+    }
+    if (sections & SECT_BATCH) p = put_batch(p, &mess_ptr->batch_data, 0);
+    if (sections & SECT_BATCH_RES) p = put_batch(p, &mess_ptr->batch_data, 1);
+    if (sections & SECT_ERROR) {
+        p = put_str(p, mess_ptr->error_text, ERR_TEXT_LEN);
+    }
+
+    memset(&header, '\0', sizeof(header));
+    header.version = WIRE_VERSION;
+    header.request = mess_ptr->request;
+    header.response = mess_ptr->response;
+    header.sections = htons(sections);
+    header.length = htons(p - frame);
+    header.request_id = htonl(mess_ptr->request_id);
+    header.client_pid = htonl(mess_ptr->client_pid);
+    memcpy(frame, &header, sizeof(header));
+    return(p - frame);
+}
+
+/* A search only sends a page, and its final response only brings one back,
+ * if it is paged (see search_cdc_page). */
+static int is_paged(const message_db_t *mess_ptr) {
+    return(mess_ptr->request == s_find_cdc_entry &&
+           mess_ptr->page_data.limit > 0);
+}
+
+int wire_encode_request(const message_db_t *mess_ptr, unsigned char *frame) {
+    uint16_t sections = request_sections(mess_ptr->request);
+
+    if (is_paged(mess_ptr)) sections |= SECT_PAGE;
+    if (mess_ptr->deadline_ms != 0) sections |= SECT_DEADLINE;
+    return(encode(mess_ptr, sections, frame));
+}
+
+/* the error text only goes back when there is an error to report, and a
+ * notice (see cache_watch.h) only says which entry has changed */
+int wire_encode_response(const message_db_t *mess_ptr, unsigned char *frame) {
+    uint16_t sections = response_sections(mess_ptr->request);
+
+    if (mess_ptr->response == r_failure) sections |= SECT_ERROR;
+    if (mess_ptr->response == r_find_no_more && is_paged(mess_ptr)) {
+        sections |= SECT_PAGE;
+    }
+    if (mess_ptr->response == r_invalidated) {
+        sections = request_sections(mess_ptr->request);
+    }
+    return(encode(mess_ptr, sections, frame));
+}
+
+
+/* Decoding
+ *
+ * The get_ functions check that what they read lies within the frame. The
+ * first one to run off the end clears ok, and after that they all read
+ * nothing. */
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    int ok;
+} frame_reader;
+
+static int get_u8(frame_reader *r) {
+    if (!r->ok || r->p + 1 > r->end) {
+        r->ok = 0;
+        return(0);
+    }
+    return(*r->p++);
+}
+
+static int32_t get_i32(frame_reader *r) {
+    uint32_t net_value = 0;
+
+    if (!r->ok || r->p + sizeof(net_value) > r->end) {
+        r->ok = 0;
+        return(0);
+    }
+    memcpy(&net_value, r->p, sizeof(net_value));
+    r->p += sizeof(net_value);
+    return((int32_t)ntohl(net_value));
+}
+
+static int64_t get_i64(frame_reader *r) {
+    uint64_t high = (uint32_t)get_i32(r);
+
+    return((int64_t)((high << 32) | (uint32_t)get_i32(r)));
+}
+
+/* str has room for max_len characters and the null */
+static void get_str(frame_reader *r, char *str, const int max_len) {
+    int len = get_u8(r);
+
+    if (!r->ok || len > max_len || r->p + len > r->end) {
+        r->ok = 0;
+        return;
+    }
+    memcpy(str, r->p, len);
+    str[len] = '\0';
+    r->p += len;
+}
+
+static void get_cdc(frame_reader *r, cdc_entry *cdc_ptr) {
+    get_str(r, cdc_ptr->catalog, CAT_CAT_LEN);
+    get_str(r, cdc_ptr->title, CAT_TITLE_LEN);
+    get_str(r, cdc_ptr->type, CAT_TYPE_LEN);
+    get_str(r, cdc_ptr->artist, CAT_ARTIST_LEN);
+}
+
+static void get_cdt(frame_reader *r, cdt_entry *cdt_ptr) {
+    get_str(r, cdt_ptr->catalog, TRACK_CAT_LEN);
+    cdt_ptr->track_no = get_i32(r);
+    get_str(r, cdt_ptr->track_txt, TRACK_TTEXT_LEN);
+}
+
+static void get_batch(frame_reader *r, cd_batch *batch_ptr,
+                      const int results) {
+    cd_batch_op *op;
+    int i;
+
+    batch_ptr->n_ops = get_u8(r);
+    if (batch_ptr->n_ops > BATCH_MAX_OPS) {
+        r->ok = 0;
+        return;
+    }
+    for (i = 0; i < batch_ptr->n_ops; i++) {
+        op = &batch_ptr->ops[i];
+        op->op = get_u8(r);
+        if (results) {
+            op->succeeded = get_u8(r);
+            if (op->op == batch_get_cdc) get_cdc(r, &op->cdc_entry_data);
+            if (op->op == batch_get_cdt) get_cdt(r, &op->cdt_entry_data);
+            continue;
+        }
+        switch(op->op) {
+            case batch_get_cdc:
+            case batch_del_cdc:
+                get_str(r, op->cdc_entry_data.catalog, CAT_CAT_LEN);
+                break;
+            case batch_add_cdc:
+                get_cdc(r, &op->cdc_entry_data);
+                break;
+            case batch_get_cdt:
+            case batch_del_cdt:
+                get_str(r, op->cdt_entry_data.catalog, TRACK_CAT_LEN);
+                op->cdt_entry_data.track_no = get_i32(r);
+                break;
+            case batch_add_cdt:
+                get_cdt(r, &op->cdt_entry_data);
+                break;
+            default:
+                r->ok = 0;
+                return;
+        }
+    }
+}
+
+static void get_stats(frame_reader *r, server_stats *stats_ptr) {
+    latency_summary *latency;
+    int i;
+
+    stats_ptr->uptime_ms = get_i64(r);
+    for (i = 0; i < STATS_REQUEST_KINDS; i++) {
+        stats_ptr->requests[i] = get_i64(r);
+        stats_ptr->failures[i] = get_i64(r);
+    }
+    stats_ptr->gets_coalesced = get_i64(r);
+    stats_ptr->in_progress = get_i64(r);
+    stats_ptr->queue_depth = get_i64(r);
+    stats_ptr->transport_backlog = get_i64(r);
+    stats_ptr->backlog_in_bytes = get_i64(r);
+    stats_ptr->active_clients = get_i64(r);
+    for (i = 0; i < STATS_PHASES; i++) {
+        latency = &stats_ptr->latency[i];
+        latency->count = get_i64(r);
+        latency->mean_ns = get_i64(r);
+        latency->p50_ns = get_i64(r);
+        latency->p90_ns = get_i64(r);
+        latency->p99_ns = get_i64(r);
+        latency->p999_ns = get_i64(r);
+        latency->max_ns = get_i64(r);
+    }
+}
+
+/* copy a frame's header out of it, into host byte order */
+static void get_header(const unsigned char *frame, wire_header *header_ptr) {
+    memcpy(header_ptr, frame, sizeof(*header_ptr));
+    header_ptr->sections = ntohs(header_ptr->sections);
+    header_ptr->length = ntohs(header_ptr->length);
+    header_ptr->request_id = ntohl(header_ptr->request_id);
+    header_ptr->client_pid = (int32_t)ntohl(header_ptr->client_pid);
+}
+
+int wire_decode(const unsigned char *frame, const int frame_len,
+                message_db_t *mess_ptr) {
+    wire_header header;
+    frame_reader r;
+    int i;
+
+    if (frame_len < (int)sizeof(header)) return(0);
+    get_header(frame, &header);
+    if (header.version != WIRE_VERSION || header.length != frame_len) {
+        return(0);
+    }
+
+    memset(mess_ptr, '\0', sizeof(*mess_ptr));
+    mess_ptr->client_pid = header.client_pid;
+    mess_ptr->request = header.request;
+    mess_ptr->response = header.response;
+    mess_ptr->request_id = header.request_id;
+
+    r.p = frame + sizeof(header);
+    r.end = frame + frame_len;
+    r.ok = 1;
+
+    if (header.sections & SECT_CATALOG) {
+        get_str(&r, mess_ptr->cdc_entry_data.catalog, CAT_CAT_LEN);
+    }
+    if (header.sections & SECT_CDC) get_cdc(&r, &mess_ptr->cdc_entry_data);
+    if (header.sections & SECT_CDT) get_cdt(&r, &mess_ptr->cdt_entry_data);
+    if (header.sections & SECT_CACHE) {
+        mess_ptr->cache_data.slot = get_i32(&r);
+        mess_ptr->cache_data.version = get_i64(&r);
+    }
+    if (header.sections & SECT_PAGE) {
+        mess_ptr->page_data.limit = get_i32(&r);
+        mess_ptr->page_data.more = get_u8(&r);
+        get_str(&r, mess_ptr->page_data.after, CAT_CAT_LEN);
+    }
+    if (header.sections & SECT_DEADLINE) mess_ptr->deadline_ms = get_i64(&r);
+    if (header.sections & SECT_QUERY) {
+        cd_query *query_ptr = &mess_ptr->query_data;
+
+        query_ptr->combine = get_u8(&r);
+        query_ptr->n_predicates = get_u8(&r);
+        if (query_ptr->n_predicates > QUERY_MAX_PREDICATES) return(0);
+        for (i = 0; i < query_ptr->n_predicates; i++) {
+            query_ptr->predicates[i].field = get_u8(&r);
+            query_ptr->predicates[i].match = get_u8(&r);
+            query_ptr->predicates[i].ignore_case = get_u8(&r);
+            get_str(&r, query_ptr->predicates[i].text, QUERY_TEXT_LEN);
+        }
+    }
+    if (header.sections & SECT_PLAN) {
+        mess_ptr->plan_data.access = get_u8(&r);
+        mess_ptr->plan_data.driving_predicate = get_i32(&r);
+        mess_ptr->plan_data.rows_examined = get_i32(&r);
+        mess_ptr->plan_data.rows_matched = get_i32(&r);
+        get_str(&r, mess_ptr->plan_data.description, PLAN_DESC_LEN);
+    }
+    if (header.sections & SECT_AGGREGATE) {
+        mess_ptr->aggregate_data.group_by = get_u8(&r);
+        mess_ptr->aggregate_data.count_tracks = get_u8(&r);
+    }
+    if (header.sections & SECT_AGG_ROW) {
+        get_str(&r, mess_ptr->agg_row_data.group, CAT_ARTIST_LEN);
+        mess_ptr->agg_row_data.cd_count = get_i32(&r);
+        mess_ptr->agg_row_data.track_count = get_i32(&r);
+    }
+    if (header.sections & SECT_STATUS) {
+        mess_ptr->status_data.is_replica = get_u8(&r);
+        mess_ptr->status_data.primary_sequence = get_i64(&r);
+        mess_ptr->status_data.applied_sequence = get_i64(&r);
+        mess_ptr->status_data.lag_changes = get_i64(&r);
+        mess_ptr->status_data.lag_ms = get_i64(&r);
+    }
+    if (header.sections & SECT_STATS) get_stats(&r, &mess_ptr->stats_data);
+    if (header.sections & SECT_DROPPED) {
+        mess_ptr->stats_data.expired_dropped = get_i64(&r);
+    }
+    if (header.sections & SECT_BATCH) get_batch(&r, &mess_ptr->batch_data, 0);
+    if (header.sections & SECT_BATCH_RES) {
+        get_batch(&r, &mess_ptr->batch_data, 1);
+    }
+    if (header.sections & SECT_ERROR) {
+        get_str(&r, mess_ptr->error_text, ERR_TEXT_LEN);
+    }
+
+    // a frame has to hold exactly the parts it claims to
+    return(r.ok && r.p == r.end);
+}
+
+
+/* Streams */
+void wire_stream_reset(wire_stream *stream_ptr) {
+    stream_ptr->start = 0;
+    stream_ptr->end = 0;
+}
+
+/* the length of the frame at the start of the buffer, or 0 if we don't have
+ * all of its header yet */
+static int buffered_frame_length(const wire_stream *stream_ptr) {
+    wire_header header;
+
+    if (stream_ptr->end - stream_ptr->start < (int)sizeof(header)) return(0);
+    get_header(stream_ptr->data + stream_ptr->start, &header);
+    return(header.length);
+}
+
+/* read len bytes, unless we hit the end of file or an error first. A
+ * signal counts as an error, unless restart is set. */
+static int read_fully(const int fd, unsigned char *buffer, const int len,
+                      const int restart) {
+    int done = 0;
+    int read_bytes;
+
+    while (done < len) {
+        read_bytes = read(fd, buffer + done, len - done);
+        if (read_bytes == -1 && errno == EINTR && restart) continue;
+        if (read_bytes <= 0) return(0);
+        done += read_bytes;
+    }
+    return(1);
+}
+
+int wire_read_all(const int fd, void *buffer, const int len) {
+    return(read_fully(fd, buffer, len, 1));
+}
+
+int wire_write_all(const int fd, const void *buffer, const int len) {
+    int done = 0;
+    int written;
+
+    while (done < len) {
+        written = write(fd, (const unsigned char *)buffer + done, len - done);
+        if (written == -1 && errno == EINTR) continue;
+        if (written <= 0) return(0);
+        done += written;
+    }
+    return(1);
+}
+
+/* Deadlines */
+int wire_ms_until(const long deadline_ms) {
+    struct timespec now;
+    long left_ms;
+
+    if (deadline_ms == 0) return(-1);
+    clock_gettime(CLOCK_REALTIME, &now);
+    left_ms = deadline_ms - (now.tv_sec * 1000L + now.tv_nsec / 1000000);
+    if (left_ms < 0) return(0);
+    return(left_ms > INT_MAX ? INT_MAX : (int)left_ms);
+}
+
+/* wait for room to write to fd; returns what wire_write_frame_by does */
+static int wait_writable(const int fd, const long deadline_ms) {
+    struct pollfd pfd;
+    int ready;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    do {
+        ready = poll(&pfd, 1, wire_ms_until(deadline_ms));
+    } while (ready == -1 && errno == EINTR);
+    if (ready == 0) errno = ETIMEDOUT;
+    return(ready > 0 ? 1 : ready);
+}
+
+int wire_write_frame_by(const int fd, const unsigned char *frame,
+                        const int frame_len, const long deadline_ms) {
+    int done = 0;
+    int written;
+    int ready;
+
+    // a blocking fd would keep us past the deadline if it were full
+    if (deadline_ms != 0 && (ready = wait_writable(fd, deadline_ms)) != 1) {
+        return(ready);
+    }
+    while (done < frame_len) {
+        written = write(fd, frame + done, frame_len - done);
+        if (written > 0) {
+            done += written;
+            continue;
+        }
+        if (written == -1 && errno == EINTR) continue;
+        if (written == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return(-1);
+        }
+        ready = wait_writable(fd, done == 0 ? deadline_ms : 0);
+        if (ready != 1) return(ready);
+    }
+    return(1);
+}
+
+int wire_read_frame(const int fd, message_db_t *mess_ptr) {
+    unsigned char frame[WIRE_MAX_FRAME];
+    wire_header header;
+
+    // a writer puts a whole frame into the fifo at once, so once we have
+    // its header the rest of it is there too. A signal mustn't stop us
+    // then, or the next reader would start partway through the frame.
+    do {
+        if (!read_fully(fd, frame, sizeof(header), 0)) return(0);
+        get_header(frame, &header);
+        if (header.length < sizeof(header) ||
+            header.length > WIRE_MAX_FRAME) return(0);
+        if (!read_fully(fd, frame + sizeof(header),
+                        header.length - sizeof(header), 1)) return(0);
+    } while (!wire_decode(frame, header.length, mess_ptr));
+    return(1);
+}
+
+int wire_stream_read(const int fd, wire_stream *stream_ptr,
+                     message_db_t *mess_ptr) {
+    return(wire_stream_read_timed(fd, stream_ptr, mess_ptr, -1) == 1);
+}
+
+int wire_stream_next(wire_stream *stream_ptr, message_db_t *mess_ptr) {
+    int frame_len;
+    int decoded;
+
+    for (;;) {
+        frame_len = buffered_frame_length(stream_ptr);
+        if (frame_len != 0 &&
+            (frame_len < (int)sizeof(wire_header) ||
+             frame_len > WIRE_MAX_FRAME)) {
+            // we can't tell where the next frame starts, so give up on
+            // whatever is buffered
+            wire_stream_reset(stream_ptr);
+            return(-1);
+        }
+        if (frame_len == 0 || stream_ptr->end - stream_ptr->start < frame_len) {
+            return(0);
+        }
+
+        // a whole frame; if it doesn't decode, skip it
+        decoded = wire_decode(stream_ptr->data + stream_ptr->start,
+                              frame_len, mess_ptr);
+        stream_ptr->start += frame_len;
+        if (stream_ptr->start == stream_ptr->end) {
+            wire_stream_reset(stream_ptr);
+        }
+        if (decoded) return(1);
+    }
+}
+
+int wire_stream_fill(const int fd, wire_stream *stream_ptr) {
+    int read_bytes;
+
+    // make room at the end of the buffer for a whole frame
+    if (stream_ptr->start > WIRE_STREAM_LEN - WIRE_MAX_FRAME) {
+        memmove(stream_ptr->data, stream_ptr->data + stream_ptr->start,
+                stream_ptr->end - stream_ptr->start);
+        stream_ptr->end -= stream_ptr->start;
+        stream_ptr->start = 0;
+    }
+    read_bytes = read(fd, stream_ptr->data + stream_ptr->end,
+                      WIRE_STREAM_LEN - stream_ptr->end);
+    if (read_bytes > 0) stream_ptr->end += read_bytes;
+    return(read_bytes);
+}
+
+int wire_stream_read_timed(const int fd, wire_stream *stream_ptr,
+                           message_db_t *mess_ptr, const int timeout_ms) {
+    struct pollfd pfd;
+    int return_code;
+    int ready;
+
+    while ((return_code = wire_stream_next(stream_ptr, mess_ptr)) == 0) {
+        if (timeout_ms >= 0) {
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            ready = poll(&pfd, 1, timeout_ms);
+            if (ready == 0) return(0);
+            if (ready == -1) return(-1);
+        }
+        if (wire_stream_fill(fd, stream_ptr) <= 0) return(-1);
+    }
+    return(return_code);
+}
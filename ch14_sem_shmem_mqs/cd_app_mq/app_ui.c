@@ -12,6 +12,7 @@
 #include "cd_data.h"
 
 #define TMP_STRING_LEN 125 
+#define FIND_PAGE 10
 /* this number must be larger than the biggest single string in any database structure */
 
 /* We make our menu options typedefs. This is in preference to using #defined constants,
@@ -364,15 +365,19 @@ static void del_track_entries(const cdc_entry *entry_to_delete) {
 /* A simple catalog search facility. We allow the user to
  * enter a string, then check for catalog entries that contain the string.
  * Since there could be multiple entries that match, we simply offer the user
- * each match in turn. */ 
+ * each match in turn. The user usually picks one of the first few, so we
+ * only ask for a page of them at a time. */ 
 static cdc_entry find_cat(void)
 {
     cdc_entry item_found;
+    cdc_entry matches[FIND_PAGE];
+    cd_page page;
     char tmp_str[TMP_STRING_LEN + 1];
-    int first_call = 1;
     int any_entry_found = 0;
     int string_ok;
     int entry_selected = 0;
+    int n_found = 0;
+    int next_match = 0;
 
     do {
         string_ok = 1;
@@ -386,11 +391,18 @@ static cdc_entry find_cat(void)
         }
     } while (!string_ok);
 
+    memset(&page, '\0', sizeof(page));
+    page.limit = FIND_PAGE;
+    page.more = 1;
     while (!entry_selected) {
-        // the first_call flag starts as 1, and is set to 0 inside of the
-        // search_cdc_entry function, which uses module-level variables to
-        // handle the "curser" over results.
-        item_found = search_cdc_entry(tmp_str, &first_call);
+        // the page remembers where the next one starts
+        if (next_match == n_found && page.more) {
+            n_found = search_cdc_page(tmp_str, &page, matches);
+            next_match = 0;
+            if (n_found < 0) n_found = page.more = 0;
+        }
+        memset(&item_found, '\0', sizeof(item_found));
+        if (next_match < n_found) item_found = matches[next_match++];
         if (item_found.catalog[0] != '\0') {
             any_entry_found = 1;
             printf("\n");
@@ -408,54 +420,63 @@ static cdc_entry find_cat(void)
 }
 
 
-/* print out all the tracks for a given catalog entry. */
+/* print out all the tracks for a given catalog entry.
+ *
+ * We don't know how many tracks there are, so we keep a window of requests
+ * for the next few tracks in the pipeline, rather than waiting for each
+ * track before asking for the next. The requests that go past the last
+ * track are just collected and ignored. */
 static void list_tracks(const cdc_entry *entry_to_use)
 {
+    unsigned int tickets[PIPELINE_WINDOW];
+    pipeline_result result;
     int track_no = 1;
-    cdt_entry entry_found;
+    int next_to_ask = 1;
+    int found;
 
     display_cdc(entry_to_use);
     printf("\nTracks\n");
-    do {
-            entry_found = get_cdt_entry(entry_to_use->catalog, 
-                                        track_no);
-            if (entry_found.catalog[0]) {
-                display_cdt(&entry_found);
-                track_no++;
-            }
-    } while(entry_found.catalog[0]);
+    for (;;) {
+        while (next_to_ask < track_no + PIPELINE_WINDOW) {
+            tickets[next_to_ask % PIPELINE_WINDOW] =
+                pipeline_get_cdt_entry(entry_to_use->catalog, next_to_ask);
+            if (!tickets[next_to_ask % PIPELINE_WINDOW]) break;
+            next_to_ask++;
+        }
+        if (next_to_ask == track_no) break;
+
+        found = pipeline_wait(tickets[track_no % PIPELINE_WINDOW], &result) &&
+                result.cdt_entry_data.catalog[0];
+        track_no++;
+        if (!found) break;
+        display_cdt(&result.cdt_entry_data);
+    }
+    while (track_no < next_to_ask) {
+        (void)pipeline_wait(tickets[track_no++ % PIPELINE_WINDOW], NULL);
+    }
     get_confirm("Press return");
 } /* list_tracks */
 
 
-/* The count_all_entries function counts all the tracks. */
+/* The count_all_entries function counts all the CDs and tracks. Rather than
+ * fetching every entry and track to count them here, we ask for the totals
+ * with aggregate_cdc_entry. */
 static void count_all_entries(void)
 {
-    int cd_entries_found = 0;
-    int track_entries_found = 0;
-    cdc_entry cdc_found;
-    cdt_entry cdt_found;
-    int track_no = 1;
+    cd_aggregate totals;
+    cd_agg_row row;
     int first_time = 1;
-    char *search_string = "";
 
-    do {
-        cdc_found = search_cdc_entry(search_string, &first_time);
-        if (cdc_found.catalog[0]) {
-            cd_entries_found++;
-            track_no = 1;
-            do {
-                cdt_found = get_cdt_entry(cdc_found.catalog, track_no);
-                if (cdt_found.catalog[0]) {
-                    track_entries_found++;
-                    track_no++;
-                }
-            } while (cdt_found.catalog[0]);
-        }
-    } while (cdc_found.catalog[0]);
+    totals.group_by = group_none;
+    totals.count_tracks = 1;
+    row = aggregate_cdc_entry(&totals, &first_time);
+
+    printf("Found %d CDs, with a total of %d tracks\n", row.cd_count,
+                row.track_count);
 
-    printf("Found %d CDs, with a total of %d tracks\n", cd_entries_found, 
-                track_entries_found);
+    // there is only one row for group_none, but we read to the end so the
+    // next aggregate starts cleanly
+    while (row.cd_count) row = aggregate_cdc_entry(&totals, &first_time);
     (void)get_confirm("Press return");
 }
 
@@ -0,0 +1,72 @@
+/* The catalog column
+ *
+ * An in-memory copy of just the catalog strings from the cdc table, packed
+ * end to end in one buffer so that searches can run over it without going
+ * to the dbm files. Each record is stored as a length byte, followed by the
+ * catalog string and its terminating null. A second buffer holds the same
+ * strings folded to lower case, for case-insensitive searches.
+ *
+ * cd_dbm.c keeps the column up to date as entries are added and deleted, so
+ * it only has to be built from scratch when the database is opened.
+ *
+ * Records are numbered in the order they were added. Deleting an entry just
+ * blanks out its record; once more than half the records are dead the
+ * column is compacted, which renumbers the records.
+ *
+ * Once column_sort has been called, the column also keeps an index of its
+ * live records in order of catalog, and keeps it in order as entries come
+ * and go, so that a search can start partway through the catalogs.
+ */
+
+/* the substring matching kernels. column_auto picks the fastest one the
+ * cpu we are running on supports. */
+typedef enum {
+    column_auto = 0,
+    column_scalar,
+    column_sse2,
+    column_avx2
+} column_kernel_e;
+
+/* Empty the column, releasing its memory. */
+void column_clear(void);
+
+/* Add a catalog string. Adding a string that is already present does
+ * nothing. Returns 0 if we run out of memory, else 1. */
+int column_add(const char *catalog);
+
+/* Remove a catalog string, if it is present. */
+void column_remove(const char *catalog);
+
+/* The number of records, including deleted ones. Valid record numbers run
+ * from 0 to column_records() - 1. */
+int column_records(void);
+
+/* The catalog string stored in a record, or NULL if it was deleted. */
+const char *column_entry(const int record);
+
+/* The record holding a catalog string, or -1 if it isn't in the column. */
+int column_find(const char *catalog);
+
+/* Build the index of records in order of catalog, after loading the
+ * column. Returns 0 if we run out of memory, else 1. */
+int column_sort(void);
+
+/* The position in the index of the first record whose catalog comes after
+ * catalog (0 for ""), and the record at a position in the index, or -1 if
+ * the position is past the end. Positions change as entries are added and
+ * deleted. */
+int column_sorted_after(const char *catalog);
+int column_sorted_record(const int position);
+
+/* Find the first live record numbered from first to last - 1 whose catalog
+ * contains needle (ignoring case if nocase is true). An empty needle matches
+ * every live record. Returns the record number, or -1 if none match.
+ *
+ * This only reads the column, so several threads may search at once as long
+ * as nobody is adding or removing entries. */
+int column_next_match(const char *needle, const int nocase,
+                      const int first, const int last);
+
+/* Choose the matching kernel. Asking for one the cpu doesn't support gets
+ * the scalar one. Returns the name of the kernel in use. */
+const char *column_use_kernel(const column_kernel_e kernel);
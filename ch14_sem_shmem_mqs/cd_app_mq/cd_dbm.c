@@ -7,18 +7,24 @@
  *
  */
 
-#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE 500   /* for the readers/writer lock */
 
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <gdbm-ndbm.h>
 
 /* The above may need to be changed to gdbm-ndbm.h on some distributions */
 
 #include "cd_data.h"
+#include "cd_column.h"
 
 #define CDC_FILE_BASE "cdc_data"
 #define CDT_FILE_BASE "cdt_data"
@@ -26,21 +32,220 @@
 #define CDC_FILE_PAG  "cdc_data.pag"
 #define CDT_FILE_DIR "cdt_data.dir"
 #define CDT_FILE_PAG "cdt_data.pag"
+#define CD_LOCK_FILE "cd_data.lock"
 
 /* Some file scope variables for accessing the database */
 static DBM *cdc_dbm_ptr = NULL;
 static DBM *cdt_dbm_ptr = NULL;
 
+/* Locking
+ *
+ * The server can run several requests at once, on a pool of threads (see
+ * server.c), so the functions here take locks. db_lock is a readers/writer
+ * lock over the database and the catalog column: the functions that only
+ * read share it, and the ones that change anything hold it alone.
+ *
+ * That isn't enough on its own, because a DBM handle keeps the last thing it
+ * fetched (and its place in a key walk) in the handle, so two readers can't
+ * call the dbm api at the same moment. Every dbm call made while sharing
+ * db_lock is also made under dbm_lock, which is only held for that one
+ * call. Searching the column, filtering and sorting all run in parallel.
+ *
+ * The functions named ..._unlocked do the work, for callers that already
+ * hold db_lock.
+ *
+ * Several server processes can also share the database (see
+ * database_share). Then db_lock is backed by an fcntl lock on CD_LOCK_FILE,
+ * read or write to match, which the kernel drops if a process dies holding
+ * it. The lock file also counts the changes made to the database, and
+ * keeps a log of the last COLUMN_LOG_LEN of them, saying which dbm files
+ * each wrote and what it did to the catalog column. A process that finds
+ * the count has moved on since it last looked reopens the dbm files that
+ * were written, since its handles may have cached what was there before,
+ * and replays the changes it missed into its column. Only one that has
+ * missed more than the log holds, or a reset of the database, reopens
+ * everything and reloads the column from scratch.
+ */
+#define COLUMN_LOG_LEN 256
+
+#define DBM_CDC 1
+#define DBM_CDT 2
+
+typedef enum {
+    change_dbm = 0,     /* to the dbm files, but not the column */
+    change_add,
+    change_remove,
+    change_reset        /* a new database */
+} column_change_e;
+
+typedef struct {
+    long            sequence;   /* the change count, once it was made */
+    column_change_e change;
+    int             files;      /* DBM_CDC and/or DBM_CDT */
+    char            catalog[CAT_CAT_LEN + 1];
+} column_change;
+
+typedef struct {
+    long          changes;
+    column_change log[COLUMN_LOG_LEN];
+} shared_state;
+
+static pthread_rwlock_t db_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t dbm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int share_fd = -1;
+static volatile shared_state *shared = NULL;   /* mapped from the lock file */
+static long seen_changes = -1;
+static int unlogged_files = 0;  /* written, but not yet in the log */
+
+static int database_initialize_unlocked(const int new_database);
+static void database_close_unlocked(void);
+static int open_dbm(const int files, const int open_mode);
+
+
+/* add a change to the shared log, if the database is shared. Call holding
+ * the lock alone. */
+static void log_change(const column_change_e change, const char *catalog,
+                       const int files)
+{
+    volatile column_change *entry;
+    long sequence;
+
+    if (share_fd == -1) return;
+    sequence = shared->changes + 1;
+    entry = &shared->log[sequence % COLUMN_LOG_LEN];
+    entry->sequence = sequence;
+    entry->change = change;
+    entry->files = files;
+    strcpy((char *)entry->catalog, catalog);
+    shared->changes = sequence;
+    seen_changes = sequence;
+}
+
+/* bring our dbm handles and column up to date with the changes the other
+ * processes have made since we last looked */
+static void catch_up(void)
+{
+    const long changes = shared->changes;
+    volatile column_change *entry;
+    long sequence = seen_changes + 1;
+    int files = 0;
+    int replayed = 0;
+
+    /* check the log still holds everything we missed before using any of
+     * it, since a reset or a full reload makes the rest moot */
+    if (seen_changes >= 0 && changes - seen_changes <= COLUMN_LOG_LEN) {
+        for (; sequence <= changes; sequence++) {
+            entry = &shared->log[sequence % COLUMN_LOG_LEN];
+            if (entry->sequence != sequence ||
+                entry->change == change_reset) break;
+            files |= entry->files;
+        }
+    }
+    if (sequence > changes && open_dbm(files, O_RDWR)) {
+        for (sequence = seen_changes + 1; sequence <= changes; sequence++) {
+            entry = &shared->log[sequence % COLUMN_LOG_LEN];
+            if (entry->change == change_add &&
+                !column_add((const char *)entry->catalog)) break;
+            if (entry->change == change_remove) {
+                column_remove((const char *)entry->catalog);
+            }
+        }
+        replayed = (sequence > changes);
+    }
+    if (!replayed) (void)database_initialize_unlocked(0);
+    seen_changes = changes;
+}
+
+/* take db_lock, shared or alone, and then the lock file if the database is
+ * shared, catching up with the other processes' changes */
+static void lock_database(const int exclusive)
+{
+    struct flock region;
+
+    if (exclusive) pthread_rwlock_wrlock(&db_lock);
+    else pthread_rwlock_rdlock(&db_lock);
+    if (share_fd == -1) return;
+
+    memset(&region, '\0', sizeof(region));
+    region.l_type = exclusive ? F_WRLCK : F_RDLCK;
+    region.l_whence = SEEK_SET;
+    while (fcntl(share_fd, F_SETLKW, &region) == -1 && errno == EINTR) ;
+    if (shared->changes != seen_changes) catch_up();
+}
+
+/* and let go again. changed says whether we changed the database, which we
+ * can only have done holding the lock alone; writes that didn't touch the
+ * column are logged now, so that the others reopen those files. */
+static void unlock_database(const int changed)
+{
+    struct flock region;
+
+    if (share_fd != -1) {
+        if (changed && unlogged_files) {
+            log_change(change_dbm, "", unlogged_files);
+        }
+        unlogged_files = 0;
+        memset(&region, '\0', sizeof(region));
+        region.l_type = F_UNLCK;
+        region.l_whence = SEEK_SET;
+        (void)fcntl(share_fd, F_SETLK, &region);
+    }
+    pthread_rwlock_unlock(&db_lock);
+}
+
+
+int database_share(void)
+{
+    void *mapped;
+
+    share_fd = open(CD_LOCK_FILE, O_RDWR | O_CREAT, 0644);
+    if (share_fd == -1) return (0);
+    if (ftruncate(share_fd, sizeof(shared_state)) == -1 ||
+        (mapped = mmap(NULL, sizeof(shared_state), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, share_fd, 0)) == MAP_FAILED) {
+        close(share_fd);
+        share_fd = -1;
+        return (0);
+    }
+    shared = (volatile shared_state *)mapped;
+
+    /* the handles we have now will be inherited by other processes, which
+     * mustn't share them, so every process opens its own on first use */
+    seen_changes = -1;
+    return (1);
+}
+
+
+/* (Re)open the dbm files named by files, closing any of them we already
+ * have open. */
+static int open_dbm(const int files, const int open_mode)
+{
+    if (files & DBM_CDC) {
+        if (cdc_dbm_ptr) dbm_close(cdc_dbm_ptr);
+        cdc_dbm_ptr = dbm_open(CDC_FILE_BASE, open_mode, 0644);
+    }
+    if (files & DBM_CDT) {
+        if (cdt_dbm_ptr) dbm_close(cdt_dbm_ptr);
+        cdt_dbm_ptr = dbm_open(CDT_FILE_BASE, open_mode, 0644);
+    }
+    if (!cdc_dbm_ptr || !cdt_dbm_ptr) {
+        database_close_unlocked();
+        return (0);
+    }
+    return (1);
+}
 
 /* This function initializes access to the database. If the parameter
- * new_database is true, then a new database is started.  */
-int database_initialize(const int new_database)
+ * new_database is true, then a new database is started.
+ *
+ * It also loads the catalog strings into the catalog column, which the
+ * search functions use. From then on the add and delete functions keep the
+ * column in step with the database. */
+static int database_initialize_unlocked(const int new_database)
 {
     int open_mode = O_RDWR;
-
-    /* If any existing database is open then close it */
-    if (cdc_dbm_ptr) dbm_close(cdc_dbm_ptr);
-    if (cdt_dbm_ptr) dbm_close(cdt_dbm_ptr);
+    datum local_key_datum;
 
     if (new_database) {
         /* delete any existing old files, and add O_CREAT
@@ -53,29 +258,64 @@ int database_initialize(const int new_database)
     }
 
     /* open the files. The dbm structs are global to this module.  */
-    cdc_dbm_ptr = dbm_open(CDC_FILE_BASE, open_mode, 0644);
-    cdt_dbm_ptr = dbm_open(CDT_FILE_BASE, open_mode, 0644);
-    if (!cdc_dbm_ptr || !cdt_dbm_ptr) {
+    if (!open_dbm(DBM_CDC | DBM_CDT, open_mode)) {
         fprintf(stderr, "Unable to create database\n");
-        cdc_dbm_ptr = cdt_dbm_ptr = NULL;
         return (0);
     }
+
+    column_clear();
+    for (local_key_datum = dbm_firstkey(cdc_dbm_ptr);
+         local_key_datum.dptr;
+         local_key_datum = dbm_nextkey(cdc_dbm_ptr)) {
+        if (!column_add(local_key_datum.dptr)) {
+            fprintf(stderr, "Unable to load catalog column\n");
+            database_close_unlocked();
+            return (0);
+        }
+    }
+    if (!column_sort()) {
+        fprintf(stderr, "Unable to load catalog column\n");
+        database_close_unlocked();
+        return (0);
+    }
+
+    /* choose the search kernel now, rather than on the first search, which
+     * may be running on several threads at once */
+    (void)column_use_kernel(column_auto);
     return (1);
 }
 
+int database_initialize(const int new_database)
+{
+    int result;
+
+    lock_database(1);
+    result = database_initialize_unlocked(new_database);
+    if (new_database) log_change(change_reset, "", DBM_CDC | DBM_CDT);
+    unlock_database(new_database);
+    return (result);
+}
+
 
 /* Close the databases. No error code is returned. */
-void database_close(void) {
+static void database_close_unlocked(void) {
     if (cdc_dbm_ptr) dbm_close(cdc_dbm_ptr);
     if (cdt_dbm_ptr) dbm_close(cdt_dbm_ptr);
     cdc_dbm_ptr = cdt_dbm_ptr = NULL;
+    column_clear();
+}
+
+void database_close(void) {
+    lock_database(1);
+    database_close_unlocked();
+    unlock_database(0);
 }
 
 
 /* This function retrieves a single catalog entry, when passed a pointer
  * pointing to catalog text string. If the entry is not found then the returned
  * data has an empty catalog field. */
-cdc_entry get_cdc_entry(const char *cd_catalog_ptr) {
+static cdc_entry get_cdc_entry_unlocked(const char *cd_catalog_ptr) {
     cdc_entry entry_to_return;
     char entry_to_find[CAT_CAT_LEN + 1];
     datum local_data_datum;
@@ -95,11 +335,24 @@ cdc_entry get_cdc_entry(const char *cd_catalog_ptr) {
     local_key_datum.dptr = (void *) entry_to_find;
     local_key_datum.dsize = sizeof(entry_to_find);
 
+    /* the fetched data belongs to the handle, so copy it out before
+     * letting go of it */
     memset(&local_data_datum, '\0', sizeof(local_data_datum));
+    pthread_mutex_lock(&dbm_lock);
     local_data_datum = dbm_fetch(cdc_dbm_ptr, local_key_datum);
     if (local_data_datum.dptr) {
     memcpy(&entry_to_return, (char *)local_data_datum.dptr, local_data_datum.dsize);
     }
+    pthread_mutex_unlock(&dbm_lock);
+    return (entry_to_return);
+}
+
+cdc_entry get_cdc_entry(const char *cd_catalog_ptr) {
+    cdc_entry entry_to_return;
+
+    lock_database(0);
+    entry_to_return = get_cdc_entry_unlocked(cd_catalog_ptr);
+    unlock_database(0);
     return (entry_to_return);
 }
 
@@ -107,7 +360,8 @@ cdc_entry get_cdc_entry(const char *cd_catalog_ptr) {
 /* This function retrieves a single track entry, when passed a pointer pointing
  * to a catalog string and a track number. If the entry is not found then the
  * returned data has an empty catalog field. */
-cdt_entry get_cdt_entry(const char *cd_catalog_ptr, const int track_no)
+static cdt_entry get_cdt_entry_unlocked(const char *cd_catalog_ptr,
+                                        const int track_no)
 {
     cdt_entry entry_to_return;
     char entry_to_find[CAT_CAT_LEN + 10];
@@ -130,17 +384,29 @@ cdt_entry get_cdt_entry(const char *cd_catalog_ptr, const int track_no)
     local_key_datum.dsize = sizeof(entry_to_find);
 
     memset(&local_data_datum, '\0', sizeof(local_data_datum));
+    pthread_mutex_lock(&dbm_lock);
     local_data_datum = dbm_fetch(cdt_dbm_ptr, local_key_datum);
     if (local_data_datum.dptr) {
           memcpy(&entry_to_return, (char *) local_data_datum.dptr,
                local_data_datum.dsize);
     }
+    pthread_mutex_unlock(&dbm_lock);
+    return (entry_to_return);
+} /* get_cdt_entry_unlocked */
+
+cdt_entry get_cdt_entry(const char *cd_catalog_ptr, const int track_no)
+{
+    cdt_entry entry_to_return;
+
+    lock_database(0);
+    entry_to_return = get_cdt_entry_unlocked(cd_catalog_ptr, track_no);
+    unlock_database(0);
     return (entry_to_return);
 } /* get_cdt_entry */
 
 
 /* This function adds a new catalog entry. */
-int add_cdc_entry(const cdc_entry entry_to_add)
+static int add_cdc_entry_unlocked(const cdc_entry entry_to_add)
 {
     char key_to_add[CAT_CAT_LEN + 1];
     datum local_data_datum;
@@ -164,15 +430,16 @@ int add_cdc_entry(const cdc_entry entry_to_add)
                        local_data_datum, DBM_REPLACE);
 
     /* dbm_store() uses 0 for success */
-    if (result == 0) return (1);
-    return (0);
+    if (result != 0) return (0);
+    log_change(change_add, key_to_add, DBM_CDC);
+    return (column_add(key_to_add));
 
-} /* add_cdc_entry */
+} /* add_cdc_entry_unlocked */
 
 
 /* This function adds a new catalog entry. The access key is the
    catalog string and track number acting as a composite key */
-int add_cdt_entry(const cdt_entry entry_to_add)
+static int add_cdt_entry_unlocked(const cdt_entry entry_to_add)
 {
     char key_to_add[CAT_CAT_LEN + 10];
     datum local_data_datum;
@@ -195,13 +462,15 @@ int add_cdt_entry(const cdt_entry entry_to_add)
     result = dbm_store(cdt_dbm_ptr, local_key_datum, local_data_datum, DBM_REPLACE);
 
     /* dbm_store() uses 0 for success and -ve numbers for errors */
-    if (result == 0)
+    if (result == 0) {
+    unlogged_files |= DBM_CDT;
     return (1);
+    }
     return (0);
-} /* add_cdt_entry */
+} /* add_cdt_entry_unlocked */
 
 
-int del_cdc_entry(const char *cd_catalog_ptr) {
+static int del_cdc_entry_unlocked(const char *cd_catalog_ptr) {
     char key_to_del[CAT_CAT_LEN + 1];
     datum local_key_datum;
     int result;
@@ -220,12 +489,16 @@ int del_cdc_entry(const char *cd_catalog_ptr) {
     result = dbm_delete(cdc_dbm_ptr, local_key_datum);
 
     /* dbm_delete() uses 0 for success */
-    if (result == 0) return (1);
+    if (result == 0) {
+        column_remove(key_to_del);
+        log_change(change_remove, key_to_del, DBM_CDC);
+        return (1);
+    }
     return (0);
 
-} /* del_cdc_entry */
+} /* del_cdc_entry_unlocked */
 
-int del_cdt_entry(const char *cd_catalog_ptr, const int track_no) {
+static int del_cdt_entry_unlocked(const char *cd_catalog_ptr, const int track_no) {
     char key_to_del[CAT_CAT_LEN + 10];
     datum local_key_datum;
     int result;
@@ -244,26 +517,78 @@ int del_cdt_entry(const char *cd_catalog_ptr, const int track_no) {
     result = dbm_delete(cdt_dbm_ptr, local_key_datum);
 
     /* dbm_delete() uses 0 for success */
-    if (result == 0) return (1);
+    if (result == 0) {
+        unlogged_files |= DBM_CDT;
+        return (1);
+    }
     return (0);
 
-} /* del_cdt_entry */
+} /* del_cdt_entry_unlocked */
+
+
+/* The locked versions of the add and delete functions, which change the
+ * database and so hold db_lock alone. */
+int add_cdc_entry(const cdc_entry entry_to_add)
+{
+    int result;
+
+    lock_database(1);
+    result = add_cdc_entry_unlocked(entry_to_add);
+    unlock_database(result);
+    return (result);
+}
+
+int add_cdt_entry(const cdt_entry entry_to_add)
+{
+    int result;
+
+    lock_database(1);
+    result = add_cdt_entry_unlocked(entry_to_add);
+    unlock_database(result);
+    return (result);
+}
+
+int del_cdc_entry(const char *cd_catalog_ptr)
+{
+    int result;
+
+    lock_database(1);
+    result = del_cdc_entry_unlocked(cd_catalog_ptr);
+    unlock_database(result);
+    return (result);
+}
+
+int del_cdt_entry(const char *cd_catalog_ptr, const int track_no)
+{
+    int result;
+
+    lock_database(1);
+    result = del_cdt_entry_unlocked(cd_catalog_ptr, track_no);
+    unlock_database(result);
+    return (result);
+}
 
 
 /* This function searches for a catalog entry, where the catalog
    text contains the provided search text. If the search text points
-   to a null character then all entries are considered to match */
+   to a null character then all entries are considered to match.
+
+   Rather than walking the dbm keys and fetching every entry to look at its
+   catalog string, we search the packed catalog column (see cd_column.c) and
+   only fetch the entries that match.
+
+   It keeps its place in static variables, so only one thread can be using
+   it at a time. The server's worker threads use search_cdc_entries. */
 cdc_entry search_cdc_entry(const char *cd_catalog_ptr, int *first_call_ptr)
 {
     static int local_first_call = 1;
+    static int next_record = 0;     /* notice this must be static */
     cdc_entry entry_to_return;
-    datum local_data_datum;
-    static datum local_key_datum;   /* notice this must be static */
+    int record = -1;
 
     memset(&entry_to_return, '\0', sizeof(entry_to_return));
 
-    /* check database initialized and parameters valid */
-    if (!cdc_dbm_ptr || !cdt_dbm_ptr) return (entry_to_return);
+    /* check parameters valid */
     if (!cd_catalog_ptr || !first_call_ptr) return (entry_to_return);
     if (strlen(cd_catalog_ptr) >= CAT_CAT_LEN) return (entry_to_return);
 
@@ -274,30 +599,769 @@ cdc_entry search_cdc_entry(const char *cd_catalog_ptr, int *first_call_ptr)
     }
     if (*first_call_ptr) {
     *first_call_ptr = 0;
-    local_key_datum = dbm_firstkey(cdc_dbm_ptr);
-    } else {
-    local_key_datum = dbm_nextkey(cdc_dbm_ptr);
-    }
-
-    do {
-    if (local_key_datum.dptr != NULL) {
-        /* an entry was found */
-        local_data_datum = dbm_fetch(cdc_dbm_ptr, local_key_datum);
-        if (local_data_datum.dptr) {
-        memcpy(&entry_to_return, (char *) local_data_datum.dptr, local_data_datum.dsize);
-
-        /* check if search string occures in the entry */
-        if (!strstr(entry_to_return.catalog, cd_catalog_ptr)) {
-            memset(&entry_to_return, '\0', sizeof(entry_to_return));
-            local_key_datum = dbm_nextkey(cdc_dbm_ptr);
-        }
-        }
+    next_record = 0;
     }
-    } while (local_key_datum.dptr &&
-         local_data_datum.dptr &&
-         (entry_to_return.catalog[0] == '\0'));
+
+    lock_database(0);
+    while (cdc_dbm_ptr && cdt_dbm_ptr &&
+           (record = column_next_match(cd_catalog_ptr, 0, next_record,
+                                       column_records())) != -1) {
+    next_record = record + 1;
+    entry_to_return = get_cdc_entry_unlocked(column_entry(record));
+    if (entry_to_return.catalog[0] != '\0') break;
+    }
+    if (record == -1) next_record = column_records();
+    unlock_database(0);
     /* Finished finding entries, either there are no more or one matched */
 
     return (entry_to_return);
 } /* search_cdc_entry */
 
+
+/* The paged search.
+ *
+ * A page can't carry on from a record number, since the column renumbers
+ * its records as it compacts them, and each process of a -w server has a
+ * column of its own. So the pages go in order of catalog instead, and each
+ * carries on from the last catalog the one before it returned. The column
+ * keeps its records in that order too (see cd_column.h), so a page starts
+ * where the token would go in the order, and only looks at the records
+ * from there up to the first match after the page. Only the entries on the
+ * page are fetched from the dbm files. */
+int search_cdc_page(const char *cd_catalog_ptr, cd_page *page_ptr,
+                    cdc_entry *matches)
+{
+    int page[PAGE_MAX];
+    int n_page = 0;
+    int n_found = 0;
+    int more = 0;
+    int position;
+    int record;
+    int i;
+
+    /* check parameters valid */
+    if (!cd_catalog_ptr || !page_ptr || !matches) return (-1);
+    if (strlen(cd_catalog_ptr) >= CAT_CAT_LEN) return (-1);
+    if (page_ptr->limit < 1 || page_ptr->limit > PAGE_MAX) return (-1);
+    page_ptr->after[CAT_CAT_LEN] = '\0';
+
+    lock_database(0);
+    if (!cdc_dbm_ptr || !cdt_dbm_ptr) {
+        unlock_database(0);
+        return (-1);
+    }
+    position = column_sorted_after(page_ptr->after);
+    while ((record = column_sorted_record(position++)) != -1) {
+        if (column_next_match(cd_catalog_ptr, 0, record, record + 1) == -1) {
+            continue;
+        }
+        if (n_page == page_ptr->limit) {
+            more = 1;
+            break;
+        }
+        page[n_page++] = record;
+    }
+
+    for (i = 0; i < n_page; i++) {
+        matches[n_found] = get_cdc_entry_unlocked(column_entry(page[i]));
+        if (matches[n_found].catalog[0] != '\0') n_found++;
+    }
+    if (n_page > 0) strcpy(page_ptr->after, column_entry(page[n_page - 1]));
+    page_ptr->more = more;
+    unlock_database(0);
+    return (n_found);
+} /* search_cdc_page */
+
+
+/* The parallel search.
+ *
+ * The records of the catalog column are split into n_workers contiguous
+ * partitions, and each partition is handed to one of a pool of threads,
+ * which runs the matching kernel over it and marks the records that matched.
+ * Searching the column only reads memory, so the threads don't need to
+ * coordinate.
+ *
+ * The pool's threads are started as they are first needed (up to
+ * SCAN_MAX_THREADS, in each process) and then wait for partitions on a
+ * queue, which all the searches going on at once share. The calling thread
+ * queues all but the first partition, scans that one itself, and then
+ * scans any of its partitions that are still queued, so a search finishes
+ * even when the pool is busy, or has no threads at all.
+ *
+ * The dbm api only lets one caller at a time use a database, so fetching the
+ * matching entries is then done serially, on the calling thread, in record
+ * order. The whole search shares db_lock, so the column can't change under
+ * the scanning threads. The caller sees the matches in the same order a
+ * serial search would produce.
+ */
+#define SCAN_MAX_THREADS 64
+
+typedef struct scan_partition {
+    struct scan_partition *next;  /* on the queue */
+    int *n_left_ptr;              /* the search's partitions not yet done */
+    char *matched;
+    int first;
+    int last;
+    const char *search_str;
+} scan_partition;
+
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scan_done = PTHREAD_COND_INITIALIZER;
+static scan_partition *scan_queue = NULL;
+static int n_scan_threads = 0;
+static pid_t scan_pool_pid = 0;    /* the process that has the threads */
+
+static void scan_partition_run(scan_partition *part) {
+    int record = part->first;
+
+    while ((record = column_next_match(part->search_str, 0, record,
+                                       part->last)) != -1) {
+        part->matched[record] = 1;
+        record++;
+    }
+    pthread_mutex_lock(&scan_lock);
+    if (--*part->n_left_ptr == 0) pthread_cond_broadcast(&scan_done);
+    pthread_mutex_unlock(&scan_lock);
+}
+
+static void *scan_pool_thread(void *arg) {
+    scan_partition *part;
+
+    for (;;) {
+        pthread_mutex_lock(&scan_lock);
+        while (!scan_queue) pthread_cond_wait(&scan_queued, &scan_lock);
+        part = scan_queue;
+        scan_queue = part->next;
+        pthread_mutex_unlock(&scan_lock);
+        scan_partition_run(part);
+    }
+    return(NULL);
+}
+
+/* start pool threads until there are n_threads of them, or as many as we
+ * can. They leave signals to the server's own threads. A forked process
+ * has none of its parent's threads, so it starts its own. Call with
+ * scan_lock held. */
+static void scan_pool_grow(int n_threads) {
+    pthread_t thread;
+    sigset_t all_signals;
+    sigset_t old_signals;
+    int started;
+
+    if (scan_pool_pid != getpid()) {
+        scan_pool_pid = getpid();
+        n_scan_threads = 0;
+    }
+    if (n_threads > SCAN_MAX_THREADS) n_threads = SCAN_MAX_THREADS;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+    while (n_scan_threads < n_threads) {
+        started = (pthread_create(&thread, NULL, scan_pool_thread, NULL) == 0);
+        if (!started) break;
+        (void)pthread_detach(thread);
+        n_scan_threads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+}
+
+/* take the first of a search's partitions off the queue, if any are still
+ * on it. Call with scan_lock held. */
+static scan_partition *scan_unqueue(const int *n_left_ptr) {
+    scan_partition **link;
+    scan_partition *part;
+
+    for (link = &scan_queue; *link; link = &(*link)->next) {
+        if ((*link)->n_left_ptr == n_left_ptr) {
+            part = *link;
+            *link = part->next;
+            return(part);
+        }
+    }
+    return(NULL);
+}
+
+static cdc_entry *search_cdc_entries_unlocked(const char *cd_catalog_ptr,
+                                              int n_workers, int *n_found_ptr)
+{
+    cdc_entry *found;
+    char *matched;
+    int n_records = column_records();
+    int n_found = 0;
+    int n_left;
+    int i;
+    scan_partition *parts;
+    scan_partition *part;
+
+    /* check database initialized and parameters valid */
+    if (!n_found_ptr) return(NULL);
+    *n_found_ptr = 0;
+    if (!cdc_dbm_ptr || !cdt_dbm_ptr) return(NULL);
+    if (!cd_catalog_ptr) return(NULL);
+    if (strlen(cd_catalog_ptr) >= CAT_CAT_LEN) return(NULL);
+    if (n_workers < 1) n_workers = 1;
+
+    /* There's no point in having more workers than records. We always
+     * allocate at least one byte, so an empty result isn't mistaken for an
+     * error. */
+    if (n_workers > n_records) n_workers = n_records ? n_records : 1;
+    matched = calloc(n_records + 1, 1);
+    parts = calloc(n_workers, sizeof(scan_partition));
+    if (!matched || !parts) {
+        free(matched);
+        free(parts);
+        return(NULL);
+    }
+
+    n_left = n_workers;
+    for (i = 0; i < n_workers; i++) {
+        parts[i].n_left_ptr = &n_left;
+        parts[i].matched = matched;
+        parts[i].first = (int)((long)n_records * i / n_workers);
+        parts[i].last = (int)((long)n_records * (i + 1) / n_workers);
+        parts[i].search_str = cd_catalog_ptr;
+    }
+
+    /* queue the others before starting on the first */
+    if (n_workers > 1) {
+        pthread_mutex_lock(&scan_lock);
+        scan_pool_grow(n_workers - 1);
+        for (i = n_workers - 1; i > 0; i--) {
+            parts[i].next = scan_queue;
+            scan_queue = &parts[i];
+        }
+        pthread_cond_broadcast(&scan_queued);
+        pthread_mutex_unlock(&scan_lock);
+    }
+    scan_partition_run(&parts[0]);
+
+    pthread_mutex_lock(&scan_lock);
+    while (n_left > 0) {
+        if ((part = scan_unqueue(&n_left)) != NULL) {
+            pthread_mutex_unlock(&scan_lock);
+            scan_partition_run(part);
+            pthread_mutex_lock(&scan_lock);
+        } else {
+            pthread_cond_wait(&scan_done, &scan_lock);
+        }
+    }
+    pthread_mutex_unlock(&scan_lock);
+    free(parts);
+
+    /* fetch the entries that matched */
+    for (i = 0; i < n_records; i++) n_found += matched[i];
+    found = calloc(n_found + 1, sizeof(cdc_entry));
+    if (!found) {
+        free(matched);
+        return(NULL);
+    }
+    n_found = 0;
+    for (i = 0; i < n_records; i++) {
+        if (!matched[i]) continue;
+        found[n_found] = get_cdc_entry_unlocked(column_entry(i));
+        if (found[n_found].catalog[0] != '\0') n_found++;
+    }
+
+    free(matched);
+    *n_found_ptr = n_found;
+    return(found);
+} /* search_cdc_entries_unlocked */
+
+cdc_entry *search_cdc_entries(const char *cd_catalog_ptr, int n_workers,
+                              int *n_found_ptr)
+{
+    cdc_entry *found;
+
+    lock_database(0);
+    found = search_cdc_entries_unlocked(cd_catalog_ptr, n_workers, n_found_ptr);
+    unlock_database(0);
+    return(found);
+} /* search_cdc_entries */
+
+
+
+/* The query engine.
+ *
+ * Running a query has two steps. plan_query looks at the predicates and
+ * picks the cheapest way to find candidate entries (see cd_data.h), and
+ * run_cdc_query then fetches the candidates that way and filters them
+ * against the whole query, so only matching entries leave this module.
+ */
+
+/* the text of one field of an entry */
+static const char *entry_field(const cdc_entry *entry,
+                               const query_field_e field) {
+    switch(field) {
+        case field_title: return(entry->title);
+        case field_type: return(entry->type);
+        case field_artist: return(entry->artist);
+        case field_catalog:
+        default: return(entry->catalog);
+    }
+}
+
+/* does a string pass one predicate? */
+static int predicate_matches(const query_predicate *pred, const char *value) {
+    int text_len = strlen(pred->text);
+    int value_len = strlen(value);
+    int i;
+
+    switch(pred->match) {
+        case match_exact:
+            if (pred->ignore_case) return(strcasecmp(value, pred->text) == 0);
+            return(strcmp(value, pred->text) == 0);
+        case match_prefix:
+            if (pred->ignore_case) {
+                return(strncasecmp(value, pred->text, text_len) == 0);
+            }
+            return(strncmp(value, pred->text, text_len) == 0);
+        case match_substring:
+            if (!pred->ignore_case) return(strstr(value, pred->text) != NULL);
+            for (i = 0; i + text_len <= value_len; i++) {
+                if (strncasecmp(value + i, pred->text, text_len) == 0) {
+                    return(1);
+                }
+            }
+            return(0);
+        default:
+            return(0);
+    }
+}
+
+/* does an entry pass the whole query? */
+static int query_matches(const cd_query *query, const cdc_entry *entry) {
+    const query_predicate *pred;
+    int i;
+
+    if (query->n_predicates == 0) return(1);
+    for (i = 0; i < query->n_predicates; i++) {
+        pred = &query->predicates[i];
+        if (predicate_matches(pred, entry_field(entry, pred->field))) {
+            if (query->combine == query_or) return(1);
+        } else {
+            if (query->combine == query_and) return(0);
+        }
+    }
+    return(query->combine == query_and);
+}
+
+/* Pick the access path for a query. When the predicates are ANDed together
+ * (or there is only one), any catalog predicate can drive the search on its
+ * own, and an exact one is best of all. When they are ORed, we can only
+ * avoid a full scan if every predicate is on the catalog. */
+static void plan_query(const cd_query *query, cd_query_plan *plan) {
+    const query_predicate *pred;
+    int all_catalog = 1;
+    int i;
+
+    memset(plan, '\0', sizeof(*plan));
+    plan->access = plan_full_scan;
+    plan->driving_predicate = -1;
+
+    for (i = 0; i < query->n_predicates; i++) {
+        if (query->predicates[i].field != field_catalog) all_catalog = 0;
+    }
+
+    if (query->combine == query_and || query->n_predicates == 1) {
+        for (i = 0; i < query->n_predicates; i++) {
+            pred = &query->predicates[i];
+            if (pred->field != field_catalog) continue;
+            if (pred->match == match_exact && !pred->ignore_case) {
+                plan->access = plan_index_probe;
+                plan->driving_predicate = i;
+                break;
+            }
+            if (plan->access == plan_full_scan) {
+                plan->access = plan_catalog_column;
+                plan->driving_predicate = i;
+            }
+        }
+    } else if (query->n_predicates > 0 && all_catalog) {
+        plan->access = plan_catalog_column;
+    }
+
+    switch(plan->access) {
+        case plan_index_probe:
+            snprintf(plan->description, sizeof(plan->description),
+                     "index probe on catalog = '%.40s'",
+                     query->predicates[plan->driving_predicate].text);
+            break;
+        case plan_catalog_column:
+            if (plan->driving_predicate == -1) {
+                snprintf(plan->description, sizeof(plan->description),
+                         "catalog column scan, %d predicates",
+                         query->n_predicates);
+            } else {
+                snprintf(plan->description, sizeof(plan->description),
+                         "catalog column scan for '%.40s'",
+                         query->predicates[plan->driving_predicate].text);
+            }
+            break;
+        case plan_full_scan:
+        default:
+            snprintf(plan->description, sizeof(plan->description),
+                     "full scan");
+            break;
+    }
+}
+
+/* add an entry to a growing malloc'd array */
+static int append_entry(cdc_entry **entries_ptr, int *n_entries_ptr,
+                        int *n_allocated_ptr, const cdc_entry *entry) {
+    cdc_entry *grown;
+
+    if (*n_entries_ptr == *n_allocated_ptr) {
+        *n_allocated_ptr = *n_allocated_ptr ? *n_allocated_ptr * 2 : 16;
+        grown = realloc(*entries_ptr, *n_allocated_ptr * sizeof(cdc_entry));
+        if (!grown) return(0);
+        *entries_ptr = grown;
+    }
+    (*entries_ptr)[(*n_entries_ptr)++] = *entry;
+    return(1);
+}
+
+static cdc_entry *run_cdc_query_unlocked(const cd_query *query_ptr,
+                                        cd_query_plan *plan_ptr,
+                                        int *n_found_ptr)
+{
+    cd_query query;
+    cdc_entry *found = NULL;
+    cdc_entry entry;
+    const query_predicate *driver = NULL;
+    const char *catalog;
+    int n_allocated = 0;
+    int n_found = 0;
+    int record;
+    int ok = 1;
+    int i;
+
+    /* check database initialized and parameters valid */
+    if (!query_ptr || !plan_ptr || !n_found_ptr) return(NULL);
+    *n_found_ptr = 0;
+    if (!cdc_dbm_ptr || !cdt_dbm_ptr) return(NULL);
+    if (query_ptr->n_predicates < 0 ||
+        query_ptr->n_predicates > QUERY_MAX_PREDICATES) return(NULL);
+
+    /* work on a copy, so we can make sure the strings are terminated */
+    query = *query_ptr;
+    for (i = 0; i < query.n_predicates; i++) {
+        query.predicates[i].text[QUERY_TEXT_LEN] = '\0';
+    }
+
+    plan_query(&query, plan_ptr);
+    if (plan_ptr->driving_predicate != -1) {
+        driver = &query.predicates[plan_ptr->driving_predicate];
+    }
+
+    switch(plan_ptr->access) {
+        case plan_index_probe:
+            entry = get_cdc_entry_unlocked(driver->text);
+            if (entry.catalog[0] != '\0') {
+                plan_ptr->rows_examined++;
+                if (query_matches(&query, &entry)) {
+                    ok = append_entry(&found, &n_found, &n_allocated, &entry);
+                }
+            }
+            break;
+
+        case plan_catalog_column:
+            /* with a driving predicate the column kernel finds candidates
+             * for us. Otherwise look at every record. Either way, we check
+             * the catalog string against the catalog predicates before
+             * paying for the fetch. */
+            record = 0;
+            while (ok && (record = column_next_match(
+                                driver ? driver->text : "",
+                                driver ? driver->ignore_case : 0,
+                                record, column_records())) != -1) {
+                catalog = column_entry(record++);
+                memset(&entry, '\0', sizeof(entry));
+                strcpy(entry.catalog, catalog);
+                if (driver && !predicate_matches(driver, catalog)) continue;
+                if (!driver && !query_matches(&query, &entry)) continue;
+                entry = get_cdc_entry_unlocked(catalog);
+                if (entry.catalog[0] == '\0') continue;
+                plan_ptr->rows_examined++;
+                if (query_matches(&query, &entry)) {
+                    ok = append_entry(&found, &n_found, &n_allocated, &entry);
+                }
+            }
+            break;
+
+        case plan_full_scan:
+        default:
+            /* the column holds every catalog key, so we walk that rather
+             * than the dbm keys. A dbm key walk keeps its place in the
+             * handle, and would have to hold dbm_lock from start to end. */
+            for (record = 0; ok && record < column_records(); record++) {
+                if (!(catalog = column_entry(record))) continue;
+                entry = get_cdc_entry_unlocked(catalog);
+                if (entry.catalog[0] == '\0') continue;
+                plan_ptr->rows_examined++;
+                if (query_matches(&query, &entry)) {
+                    ok = append_entry(&found, &n_found, &n_allocated, &entry);
+                }
+            }
+            break;
+    }
+
+    if (!ok) {
+        free(found);
+        return(NULL);
+    }
+    /* always hand back an array, so no matches isn't mistaken for an error */
+    if (!found) found = calloc(1, sizeof(cdc_entry));
+    plan_ptr->rows_matched = n_found;
+    *n_found_ptr = n_found;
+    return(found);
+} /* run_cdc_query_unlocked */
+
+cdc_entry *run_cdc_query(const cd_query *query_ptr, cd_query_plan *plan_ptr,
+                         int *n_found_ptr)
+{
+    cdc_entry *found;
+
+    lock_database(0);
+    found = run_cdc_query_unlocked(query_ptr, plan_ptr, n_found_ptr);
+    unlock_database(0);
+    return(found);
+} /* run_cdc_query */
+
+
+/* query_cdc_entry works through the results of run_cdc_query one at a time,
+ * keeping them in a static array between calls. */
+cdc_entry query_cdc_entry(const cd_query *query_ptr, int *first_call_ptr)
+{
+    static cdc_entry *results = NULL;
+    static int n_results = 0;
+    static int next_result = 0;
+    cd_query_plan plan;
+    cdc_entry entry_to_return;
+
+    memset(&entry_to_return, '\0', sizeof(entry_to_return));
+    if (!query_ptr || !first_call_ptr) return(entry_to_return);
+
+    if (*first_call_ptr) {
+        *first_call_ptr = 0;
+        free(results);
+        next_result = 0;
+        results = run_cdc_query(query_ptr, &plan, &n_results);
+    }
+    if (results && next_result < n_results) {
+        entry_to_return = results[next_result++];
+    }
+    return(entry_to_return);
+}
+
+
+int explain_cdc_query(const cd_query *query_ptr, cd_query_plan *plan_ptr)
+{
+    cdc_entry *results;
+    int n_results;
+
+    results = run_cdc_query(query_ptr, plan_ptr, &n_results);
+    if (!results) return(0);
+    free(results);
+    return(1);
+}
+
+
+/* Aggregates.
+ *
+ * We make one pass over the track table, if tracks are wanted, and one over
+ * the catalog. The catalog pass goes through the keys in the catalog column,
+ * but the track table has no such list, so that pass is a dbm key walk,
+ * which holds dbm_lock until it is done. Track counts are tallied per
+ * catalog column record, which saves us looking up every catalog string.
+ * Each CD then contributes its group and track count to a list which we
+ * sort by group, so that each run of equal groups folds into one row.
+ */
+typedef struct {
+    const char *group;
+    int track_count;
+} agg_item;
+
+static int compare_agg_items(const void *a, const void *b) {
+    return(strcmp(((const agg_item *)a)->group, ((const agg_item *)b)->group));
+}
+
+static cd_agg_row *run_cdc_aggregate_unlocked(const cd_aggregate *aggregate_ptr,
+                                               int *n_rows_ptr)
+{
+    cdc_entry *entries = NULL;
+    agg_item *items = NULL;
+    cd_agg_row *rows = NULL;
+    int *track_counts = NULL;
+    int n_records = column_records();
+    int n_entries = 0;
+    int n_allocated = 0;
+    int n_rows = 0;
+    int record;
+    int ok = 1;
+    int i;
+    cdc_entry entry;
+    cdt_entry track;
+    datum local_key_datum;
+    datum local_data_datum;
+
+    /* check database initialized and parameters valid */
+    if (!aggregate_ptr || !n_rows_ptr) return(NULL);
+    *n_rows_ptr = 0;
+    if (!cdc_dbm_ptr || !cdt_dbm_ptr) return(NULL);
+
+    track_counts = calloc(n_records + 1, sizeof(int));
+    if (!track_counts) return(NULL);
+    if (aggregate_ptr->count_tracks) {
+        pthread_mutex_lock(&dbm_lock);
+        for (local_key_datum = dbm_firstkey(cdt_dbm_ptr);
+             local_key_datum.dptr;
+             local_key_datum = dbm_nextkey(cdt_dbm_ptr)) {
+            local_data_datum = dbm_fetch(cdt_dbm_ptr, local_key_datum);
+            if (!local_data_datum.dptr) continue;
+            memset(&track, '\0', sizeof(track));
+            memcpy(&track, local_data_datum.dptr, local_data_datum.dsize);
+            record = column_find(track.catalog);
+            if (record != -1) track_counts[record]++;
+        }
+        pthread_mutex_unlock(&dbm_lock);
+    }
+
+    for (record = 0; ok && record < n_records; record++) {
+        if (!column_entry(record)) continue;
+        entry = get_cdc_entry_unlocked(column_entry(record));
+        if (entry.catalog[0] == '\0') continue;
+        ok = append_entry(&entries, &n_entries, &n_allocated, &entry);
+    }
+
+    items = calloc(n_entries + 1, sizeof(agg_item));
+    rows = calloc(n_entries + 1, sizeof(cd_agg_row));
+    if (!ok || !items || !rows) {
+        free(track_counts);
+        free(entries);
+        free(items);
+        free(rows);
+        return(NULL);
+    }
+
+    for (i = 0; i < n_entries; i++) {
+        switch(aggregate_ptr->group_by) {
+            case group_type: items[i].group = entries[i].type; break;
+            case group_artist: items[i].group = entries[i].artist; break;
+            case group_catalog: items[i].group = entries[i].catalog; break;
+            case group_none:
+            default: items[i].group = ""; break;
+        }
+        record = column_find(entries[i].catalog);
+        if (record != -1) items[i].track_count = track_counts[record];
+    }
+    qsort(items, n_entries, sizeof(agg_item), compare_agg_items);
+
+    for (i = 0; i < n_entries; i++) {
+        if (n_rows == 0 || strcmp(rows[n_rows - 1].group, items[i].group)) {
+            strcpy(rows[n_rows++].group, items[i].group);
+        }
+        rows[n_rows - 1].cd_count++;
+        rows[n_rows - 1].track_count += items[i].track_count;
+    }
+
+    free(track_counts);
+    free(entries);
+    free(items);
+    *n_rows_ptr = n_rows;
+    return(rows);
+} /* run_cdc_aggregate_unlocked */
+
+cd_agg_row *run_cdc_aggregate(const cd_aggregate *aggregate_ptr,
+                              int *n_rows_ptr)
+{
+    cd_agg_row *rows;
+
+    lock_database(0);
+    rows = run_cdc_aggregate_unlocked(aggregate_ptr, n_rows_ptr);
+    unlock_database(0);
+    return(rows);
+} /* run_cdc_aggregate */
+
+
+/* aggregate_cdc_entry works through the rows from run_cdc_aggregate in the
+ * same way that query_cdc_entry works through query results. */
+cd_agg_row aggregate_cdc_entry(const cd_aggregate *aggregate_ptr,
+                               int *first_call_ptr)
+{
+    static cd_agg_row *rows = NULL;
+    static int n_rows = 0;
+    static int next_row = 0;
+    cd_agg_row row_to_return;
+
+    memset(&row_to_return, '\0', sizeof(row_to_return));
+    if (!aggregate_ptr || !first_call_ptr) return(row_to_return);
+
+    if (*first_call_ptr) {
+        *first_call_ptr = 0;
+        free(rows);
+        next_row = 0;
+        rows = run_cdc_aggregate(aggregate_ptr, &n_rows);
+    }
+    if (rows && next_row < n_rows) row_to_return = rows[next_row++];
+    return(row_to_return);
+}
+
+
+/* Run the ops in a batch, one after the other, by calling the same functions
+ * a client would call one at a time. The whole batch runs under db_lock, held
+ * alone if any op changes the database, so no other request sees it half
+ * done. */
+int run_cdc_batch(cd_batch *batch_ptr)
+{
+    cd_batch_op *op;
+    int all_succeeded = 1;
+    int writes = 0;
+    int i;
+
+    if (!batch_ptr) return(0);
+    if (batch_ptr->n_ops < 0 || batch_ptr->n_ops > BATCH_MAX_OPS) return(0);
+
+    for (i = 0; i < batch_ptr->n_ops; i++) {
+        if (batch_ptr->ops[i].op != batch_get_cdc &&
+            batch_ptr->ops[i].op != batch_get_cdt) writes = 1;
+    }
+    lock_database(writes);
+
+    for (i = 0; i < batch_ptr->n_ops; i++) {
+        op = &batch_ptr->ops[i];
+        switch(op->op) {
+            case batch_get_cdc:
+                op->cdc_entry_data =
+                    get_cdc_entry_unlocked(op->cdc_entry_data.catalog);
+                op->succeeded = (op->cdc_entry_data.catalog[0] != '\0');
+                break;
+            case batch_get_cdt:
+                op->cdt_entry_data =
+                    get_cdt_entry_unlocked(op->cdt_entry_data.catalog,
+                                           op->cdt_entry_data.track_no);
+                op->succeeded = (op->cdt_entry_data.catalog[0] != '\0');
+                break;
+            case batch_add_cdc:
+                op->succeeded = add_cdc_entry_unlocked(op->cdc_entry_data);
+                break;
+            case batch_add_cdt:
+                op->succeeded = add_cdt_entry_unlocked(op->cdt_entry_data);
+                break;
+            case batch_del_cdc:
+                op->succeeded =
+                    del_cdc_entry_unlocked(op->cdc_entry_data.catalog);
+                break;
+            case batch_del_cdt:
+                op->succeeded =
+                    del_cdt_entry_unlocked(op->cdt_entry_data.catalog,
+                                           op->cdt_entry_data.track_no);
+                break;
+            default:
+                op->succeeded = 0;
+                break;
+        }
+        if (!op->succeeded) all_succeeded = 0;
+    }
+    unlock_database(writes);
+    return(all_succeeded);
+} /* run_cdc_batch */
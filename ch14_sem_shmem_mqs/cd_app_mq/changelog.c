@@ -0,0 +1,273 @@
+/*
+ * The change log, which lets replica servers follow the primary. See
+ * changelog.h for how it works.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "cd_data.h"
+#include "cliserv.h"
+#include "changelog.h"
+
+static int log_fd = -1;
+static int is_replica = 0;
+
+/* on the primary, the sequence number of the next record we write. On a
+ * replica, the sequence number of the next record to apply. */
+static long next_sequence = 0;
+
+/* see changelog_lock. The fcntl lock on the log covers other processes, but
+ * not the other threads of this one. */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static long long now_ms(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return((long long)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+/* the number of whole records in the log */
+static long records_in_log(void) {
+    struct stat log_stat;
+
+    if (fstat(log_fd, &log_stat) == -1) return(0);
+    return(log_stat.st_size / sizeof(change_record));
+}
+
+static int write_record(const client_request_e request,
+                        const cdc_entry *cdc_ptr, const cdt_entry *cdt_ptr) {
+    change_record record;
+
+    /* other server processes may have written to the log since we last
+     * did, so the file has the last word on the sequence number */
+    next_sequence = records_in_log();
+    memset(&record, '\0', sizeof(record));
+    record.sequence = next_sequence;
+    record.logged_ms = now_ms();
+    record.request = request;
+    if (cdc_ptr) record.cdc_entry_data = *cdc_ptr;
+    if (cdt_ptr) record.cdt_entry_data = *cdt_ptr;
+
+    /* the log is opened with O_APPEND, so one write adds one record */
+    if (write(log_fd, &record, sizeof(record)) != sizeof(record)) {
+        fprintf(stderr, "Server error, change log write failed\n");
+        return(0);
+    }
+    next_sequence++;
+    return(1);
+}
+
+/* log each add or delete in a batch that worked, as if it had been sent on
+ * its own */
+static int write_batch(const cd_batch *batch_ptr) {
+    const cd_batch_op *op;
+    int return_code = 1;
+    int i;
+
+    for (i = 0; return_code && i < batch_ptr->n_ops; i++) {
+        op = &batch_ptr->ops[i];
+        if (!op->succeeded) continue;
+        switch(op->op) {
+            case batch_add_cdc:
+                return_code = write_record(s_add_cdc_entry,
+                                           &op->cdc_entry_data, NULL);
+                break;
+            case batch_del_cdc:
+                return_code = write_record(s_del_cdc_entry,
+                                           &op->cdc_entry_data, NULL);
+                break;
+            case batch_add_cdt:
+                return_code = write_record(s_add_cdt_entry,
+                                           NULL, &op->cdt_entry_data);
+                break;
+            case batch_del_cdt:
+                return_code = write_record(s_del_cdt_entry,
+                                           NULL, &op->cdt_entry_data);
+                break;
+            default:
+                break;
+        }
+    }
+    return(return_code);
+}
+
+/* log the whole database: a reset, followed by an add for every catalog
+ * entry and each of its tracks */
+static int write_snapshot(void) {
+    cdc_entry cdc_found;
+    cdt_entry cdt_found;
+    int first_time = 1;
+    int track_no;
+
+    if (!write_record(s_create_new_database, NULL, NULL)) return(0);
+    do {
+        cdc_found = search_cdc_entry("", &first_time);
+        if (cdc_found.catalog[0] == '\0') break;
+        if (!write_record(s_add_cdc_entry, &cdc_found, NULL)) return(0);
+        for (track_no = 1; ; track_no++) {
+            cdt_found = get_cdt_entry(cdc_found.catalog, track_no);
+            if (cdt_found.catalog[0] == '\0') break;
+            if (!write_record(s_add_cdt_entry, NULL, &cdt_found)) return(0);
+        }
+    } while (1);
+    return(1);
+}
+
+
+int changelog_open_primary(const char *log_name, const int new_database) {
+    log_fd = open(log_name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd == -1) {
+        fprintf(stderr, "Server startup error, can not open change log\n");
+        return(0);
+    }
+    is_replica = 0;
+
+    /* drop any partial record left by a crash mid-write */
+    next_sequence = records_in_log();
+    if (ftruncate(log_fd, next_sequence * sizeof(change_record)) == -1) {
+        fprintf(stderr, "Server startup error, can not repair change log\n");
+        return(0);
+    }
+
+    if (next_sequence == 0) return(write_snapshot());
+    if (new_database) return(write_record(s_create_new_database, NULL, NULL));
+    return(1);
+}
+
+
+int changelog_append(const message_db_t *mess_ptr) {
+    if (log_fd == -1 || is_replica) return(1);
+
+    switch(mess_ptr->request) {
+        case s_create_new_database:
+            return(write_record(mess_ptr->request, NULL, NULL));
+        case s_add_cdc_entry:
+        case s_del_cdc_entry:
+            return(write_record(mess_ptr->request,
+                                &mess_ptr->cdc_entry_data, NULL));
+        case s_add_cdt_entry:
+        case s_del_cdt_entry:
+            return(write_record(mess_ptr->request,
+                                NULL, &mess_ptr->cdt_entry_data));
+        case s_batch:
+            return(write_batch(&mess_ptr->batch_data));
+        default:
+            return(1);
+    }
+}
+
+
+int changelog_open_replica(const char *log_name) {
+    log_fd = open(log_name, O_RDONLY);
+    if (log_fd == -1) {
+        fprintf(stderr, "Replica startup error, can not open change log\n");
+        return(0);
+    }
+    is_replica = 1;
+    next_sequence = 0;
+    return(1);
+}
+
+
+void changelog_lock(void) {
+    struct flock region;
+
+    pthread_mutex_lock(&log_lock);
+    if (log_fd == -1 || is_replica) return;
+    memset(&region, '\0', sizeof(region));
+    region.l_type = F_WRLCK;
+    region.l_whence = SEEK_SET;
+    while (fcntl(log_fd, F_SETLKW, &region) == -1 && errno == EINTR) ;
+}
+
+
+void changelog_unlock(void) {
+    struct flock region;
+
+    if (log_fd != -1 && !is_replica) {
+        memset(&region, '\0', sizeof(region));
+        region.l_type = F_UNLCK;
+        region.l_whence = SEEK_SET;
+        (void)fcntl(log_fd, F_SETLK, &region);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+
+void changelog_status(replica_status *status_ptr) {
+    change_record record;
+
+    memset(status_ptr, '\0', sizeof(*status_ptr));
+    if (log_fd == -1) return;
+    if (!is_replica) next_sequence = records_in_log();
+
+    status_ptr->is_replica = is_replica;
+    status_ptr->applied_sequence = next_sequence;
+    status_ptr->primary_sequence = is_replica ? records_in_log() : next_sequence;
+    status_ptr->lag_changes = status_ptr->primary_sequence - next_sequence;
+
+    /* the lag in time is the age of the oldest change we haven't applied */
+    if (status_ptr->lag_changes > 0 &&
+        pread(log_fd, &record, sizeof(record),
+              next_sequence * sizeof(record)) == sizeof(record)) {
+        status_ptr->lag_ms = now_ms() - record.logged_ms;
+    }
+}
+
+
+int changelog_apply(replica_status *status_ptr) {
+    change_record record;
+    long in_log;
+
+    if (log_fd == -1 || !is_replica) return(1);
+    if (status_ptr) changelog_status(status_ptr);
+
+    /* the results of the individual changes don't matter much; they all
+     * succeeded on the primary, so they will here too */
+    in_log = records_in_log();
+    while (next_sequence < in_log) {
+        if (pread(log_fd, &record, sizeof(record),
+                  next_sequence * sizeof(record)) != sizeof(record)) {
+            return(0);
+        }
+        switch(record.request) {
+            case s_create_new_database:
+                if (!database_initialize(1)) return(0);
+                break;
+            case s_add_cdc_entry:
+                (void)add_cdc_entry(record.cdc_entry_data);
+                break;
+            case s_add_cdt_entry:
+                (void)add_cdt_entry(record.cdt_entry_data);
+                break;
+            case s_del_cdc_entry:
+                (void)del_cdc_entry(record.cdc_entry_data.catalog);
+                break;
+            case s_del_cdt_entry:
+                (void)del_cdt_entry(record.cdt_entry_data.catalog,
+                                    record.cdt_entry_data.track_no);
+                break;
+            default:
+                break;
+        }
+        next_sequence++;
+    }
+    return(1);
+}
+
+
+void changelog_close(void) {
+    if (log_fd != -1) close(log_fd);
+    log_fd = -1;
+}
@@ -3,71 +3,421 @@
 
 #include "cd_data.h"
 #include "cliserv.h"
-
+#include "wire.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <sys/msg.h>
+#include <sys/stat.h>
 
 #define SERVER_MQUEUE 1234
-#define CLIENT_MQUEUE 4321
 
 /* implement the same api as we did for fifo.
  *
  * note that the message queue, which is intended for this style of communication,
- * leads to a much simpler implementation. We don't even need big parts of the
- * api!
+ * leads to a much simpler implementation. Most of what there is here is
+ * about keeping one slow client from holding up the others.
  */
 
 /* As discussed in the mq example code, messages should always start with a
  * long, which can be considered the message type or a key. The msgrcv
  * function looks for messages with a particular key.
  *
- * This allows us to use a single queue for all clients, by using the pid
- * as the key!
+ * We could use a single queue for all the clients' responses, with the
+ * client's pid as the key, but then a client that stopped reading would
+ * fill the queue up for everyone, and the server would block sending to it.
+ * So instead each client makes a private response queue of its own, and
+ * puts its id (plus 1, since keys must be positive) in the key of every
+ * request; the server remembers which queue goes with which client pid.
+ *
+ * Anyone can send the server a request, though, and name any queue in it,
+ * and the server removes the queues of clients it gives up on. So before
+ * taking a queue as a client's, it checks that the queue looks like one
+ * that the client made (see client_owns_queue). Only the server's user can
+ * write to a client's queue, or its group if the server runs as another
+ * user.
+ *
+ * The message itself is a frame (see wire.h), and we only send as much of
+ * the buffer as the frame uses. msgrcv tells us how long the frame it got
+ * was.
  */
 struct msg_passed {
-    long int msg_key; /* used for client pid */
-    message_db_t real_message;
+    long int msg_key; /* the client's queue id + 1, or RESP_KEY */
+    unsigned char frame[WIRE_MAX_FRAME];
 };
 
+#define RESP_KEY 1
+
 /* Two variables with file scope hold the two queue identifiers returned from the
  msgget function. */
 
 static int serv_qid = -1;
 static int cli_qid = -1;
 
+/* The server never waits for room in a client's queue. A response that
+ * doesn't fit is kept in the client's pending list, and sent when the
+ * client has read enough to make room; until then, its later responses
+ * join the list behind it, so that they stay in order. There is no way to
+ * be told when a queue has room, so a thread of its own (one per server
+ * process, started when it is first needed) checks every PENDING_POLL_NS
+ * while anything is pending.
+ *
+ * A response kept pending hasn't reached the client yet, so rather than
+ * 1, send_resp_to_client returns RESP_QUEUED for it, and the server can
+ * wait for it to go with wait_resp_delivered (see cliserv.h).
+ *
+ * A client that falls more than PENDING_MAX_BYTES behind, or that dies with
+ * responses pending, is evicted: its pending responses are dropped, and its
+ * queue removed, so that a client still waiting on it sees the server hang
+ * up rather than waiting for ever. A client that dies without removing its
+ * queue would otherwise leave it behind, so we also look out for dead
+ * clients as new ones arrive, and in server_ending.
+ *
+ * All of this is under clients_lock, since the worker threads (see
+ * server.c) send responses while the pending thread sends pending ones. */
+#define MAX_CLIENTS       256
+#define PENDING_MAX_BYTES (1024 * 1024)
+#define PENDING_POLL_NS   1000000
+#define DELIVER_MAX_MS    1000     /* see wait_resp_delivered */
+
+typedef struct pending_resp {
+    struct pending_resp *next;
+    int                  frame_len;
+    struct msg_passed    msg;      /* only frame_len bytes of frame */
+} pending_resp;
+
+typedef struct {
+    pid_t         client_pid;      /* 0 if the slot is free */
+    int           qid;             /* its response queue */
+    pending_resp *pending_head;
+    pending_resp *pending_tail;
+    int           pending_bytes;
+    long          n_queued;        /* responses ever kept pending */
+    long          n_delivered;     /* and sent since */
+} client_chan;
+
+static client_chan clients[MAX_CLIENTS];
+static int next_check = 0;         /* see register_client */
+static int n_pending = 0;          /* clients with responses pending */
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t delivered_cond = PTHREAD_COND_INITIALIZER;
+static pid_t pending_thread_pid = 0; /* the process that has started it */
+
+/* the slot of the client each server thread is answering */
+static __thread int resp_slot = -1;
+
+/* replica servers use their own pair of queues. Their keys are offset from
+ * the primary's by the instance number. */
+static int instance_offset = 0;
+
+/* Either side:
+ *
+ * pick which server's queues to use. Instance 0 is the primary. */
+void set_server_instance(const int instance) {
+    instance_offset = instance;
+}
+
 
 /* server side:
  *
- * In this impl, the server is responsible for creating both of the queues.
+ * In this impl, the server is responsible for creating its own queue. The
+ * clients' queues are theirs.
  */
 int server_starting() {
     #if DEBUG_TRACE
         printf("%d :- server_starting()\n",  getpid());
     #endif
 
-    serv_qid = msgget((key_t)SERVER_MQUEUE, 0666 | IPC_CREAT);
+    serv_qid = msgget((key_t)(SERVER_MQUEUE + instance_offset), 0666 | IPC_CREAT);
     if (serv_qid == -1) return(0);
+    memset(clients, '\0', sizeof(clients));
+    return(1);
+}
 
-    cli_qid = msgget((key_t)CLIENT_MQUEUE, 0666 | IPC_CREAT);
-    if (cli_qid == -1) return(0);
 
-    return(1);
+/* forget a client, dropping anything pending for it. If evict is set, we
+ * also remove its queue. Call with clients_lock held. */
+static void drop_client(client_chan *client, const int evict) {
+    pending_resp *next;
+
+    while (client->pending_head) {
+        next = client->pending_head->next;
+        free(client->pending_head);
+        client->pending_head = next;
+    }
+    if (client->pending_tail) n_pending--;
+    if (evict) (void)msgctl(client->qid, IPC_RMID, 0);
+    memset(client, '\0', sizeof(*client));
+    pthread_cond_broadcast(&delivered_cond);
+}
+
+
+/* forget a client whose queue has gone, and evict one that has died. Call
+ * with clients_lock held. */
+static void check_client(client_chan *client) {
+    struct msqid_ds queue_info;
+
+    if (client->client_pid == 0) return;
+    if (msgctl(client->qid, IPC_STAT, &queue_info) == -1 &&
+        (errno == EINVAL || errno == EIDRM)) {
+        drop_client(client, 0);
+    } else if (kill(client->client_pid, 0) == -1 && errno == ESRCH) {
+        drop_client(client, 1);
+    }
 }
 
 
 /* server side:
  *
- * Also the server is responsible for removing both of the queues.
+ * Also the server is responsible for removing its queue, and the queues of
+ * any clients that died.
  */
 void server_ending() {
+    int i;
     #if DEBUG_TRACE
         printf("%d :- server_ending()\n",  getpid());
     #endif
 
     (void)msgctl(serv_qid, IPC_RMID, 0);
-    (void)msgctl(cli_qid, IPC_RMID, 0);
+    serv_qid = -1;
+    pthread_mutex_lock(&clients_lock);
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        check_client(&clients[i]);
+        drop_client(&clients[i], 0);
+    }
+    pthread_mutex_unlock(&clients_lock);
+}
+
+
+/* server side:
+ *
+ * several processes can read the server queue as they are; msgrcv always
+ * hands each one a whole message. */
+int server_share_intake(void) {
+    return(1);
+}
+
+
+/* server side:
+ *
+ * Handing the queue over (see cliserv.h). It keeps its key, so there is
+ * nothing to tell the new server; we just don't remove it, and the requests
+ * in it wait for the new server. Clients' pending responses are another
+ * matter, as they would go with us, so we give the clients up to
+ * HANDOFF_FLUSH_SECS to make room for them. A client that doesn't is
+ * evicted, as it would have been for falling too far behind. */
+#define HANDOFF_FLUSH_SECS 5
+
+int server_can_hand_off(void) {
+    return(1);
+}
 
+int server_handoff(const int state_fd) {
+    struct timespec nap = {0, PENDING_POLL_NS};
+    time_t give_up = time(NULL) + HANDOFF_FLUSH_SECS;
+    int i;
+
+    pthread_mutex_lock(&clients_lock);
+    while (n_pending > 0 && time(NULL) < give_up) {
+        pthread_mutex_unlock(&clients_lock);
+        nanosleep(&nap, NULL);
+        pthread_mutex_lock(&clients_lock);
+    }
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].pending_head) {
+            fprintf(stderr, "Server Warning:- client %d is not reading its "
+                    "responses, dropping it\n", clients[i].client_pid);
+        }
+        drop_client(&clients[i], clients[i].pending_head != NULL);
+    }
+    pthread_mutex_unlock(&clients_lock);
     serv_qid = -1;
-    cli_qid = -1;
+    return(1);
+}
+
+int server_take_over(const int state_fd) {
+    return(server_starting());
+}
+
+
+/* could qid be client_pid's response queue? SysV queues don't record who
+ * made them, so we check what we can: that it was made (and is owned) by
+ * the user the client runs as, which we take from its /proc entry (so it
+ * must still be running, too); that it is a keyless queue with the modes
+ * client_starting gives it; and that nobody but the client has read from
+ * it. A server running as another user may not be allowed to look at the
+ * queue, but then it can't remove it either, and whoever can write to it
+ * can forge its responses anyway. */
+static int client_owns_queue(const pid_t client_pid, const int qid) {
+    struct msqid_ds queue_info;
+    struct stat proc_info;
+    char proc_path[32];
+    int mode;
+
+    sprintf(proc_path, "/proc/%d", (int)client_pid);
+    if (client_pid <= 0 || stat(proc_path, &proc_info) == -1) return(0);
+    if (msgctl(qid, IPC_STAT, &queue_info) == -1) return(errno == EACCES);
+    mode = queue_info.msg_perm.mode & 0777;
+    return(queue_info.msg_perm.cuid == proc_info.st_uid &&
+           queue_info.msg_perm.uid == proc_info.st_uid &&
+           queue_info.msg_perm.__key == IPC_PRIVATE &&
+           (mode == 0600 || mode == 0620) &&
+           (queue_info.msg_lrpid == 0 || queue_info.msg_lrpid == client_pid));
+}
+
+
+/* note which queue a client's responses go to, once we have checked that
+ * it is the client's. Each new client checks one of the others (see
+ * check_client), in turn, and if there's no room for it we check them all.
+ * Returns 1 if the client is registered, 0 if there's still no room, and -1
+ * if the queue isn't the client's. Call with clients_lock held. */
+static int register_client(const pid_t client_pid, const int qid) {
+    client_chan *free_slot = NULL;
+    int i;
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].client_pid == client_pid) {
+            // a client that started again has a new queue
+            if (clients[i].qid != qid) {
+                if (!client_owns_queue(client_pid, qid)) return(-1);
+                drop_client(&clients[i], 0);
+                clients[i].client_pid = client_pid;
+                clients[i].qid = qid;
+            }
+            return(1);
+        }
+        if (!free_slot && clients[i].client_pid == 0) free_slot = &clients[i];
+    }
+    if (!client_owns_queue(client_pid, qid)) return(-1);
+    check_client(&clients[next_check]);
+    next_check = (next_check + 1) % MAX_CLIENTS;
+    for (i = 0; i < MAX_CLIENTS && !free_slot; i++) {
+        check_client(&clients[i]);
+        if (clients[i].client_pid == 0) free_slot = &clients[i];
+    }
+    if (!free_slot) return(0);
+    free_slot->client_pid = client_pid;
+    free_slot->qid = qid;
+    return(1);
+}
+
+
+/* put a response in a client's queue, if there is room. Returns 1 if it
+ * went, 0 if the queue is full, and -1 if the queue has gone. */
+static int try_send(const int qid, struct msg_passed *msg_ptr,
+                    const int frame_len) {
+    if (msgsnd(qid, (void *)msg_ptr, frame_len, IPC_NOWAIT) == 0) return(1);
+    return(errno == EAGAIN ? 0 : -1);
+}
+
+
+/* send as many of a client's pending responses as its queue has room for.
+ * Call with clients_lock held. */
+static void send_pending(client_chan *client) {
+    pending_resp *resp;
+    int sent;
+
+    while ((resp = client->pending_head) != NULL) {
+        sent = try_send(client->qid, &resp->msg, resp->frame_len);
+        if (sent == -1) {
+            drop_client(client, 0);
+            return;
+        }
+        if (sent == 0) {
+            if (kill(client->client_pid, 0) == -1 && errno == ESRCH) {
+                drop_client(client, 1);
+            }
+            return;
+        }
+        client->pending_head = resp->next;
+        client->pending_bytes -= resp->frame_len;
+        client->n_delivered++;
+        free(resp);
+        pthread_cond_broadcast(&delivered_cond);
+    }
+    client->pending_tail = NULL;
+    n_pending--;
+}
+
+
+/* the pending thread: sends pending responses as their clients make
+ * room for them. */
+static void *send_all_pending(void *arg) {
+    struct timespec nap = {0, PENDING_POLL_NS};
+    int i;
+
+    pthread_mutex_lock(&clients_lock);
+    for (;;) {
+        while (n_pending == 0) pthread_cond_wait(&pending_cond, &clients_lock);
+        for (i = 0; i < MAX_CLIENTS && n_pending > 0; i++) {
+            if (clients[i].pending_head) send_pending(&clients[i]);
+        }
+        if (n_pending > 0) {
+            pthread_mutex_unlock(&clients_lock);
+            nanosleep(&nap, NULL);
+            pthread_mutex_lock(&clients_lock);
+        }
+    }
+    return(NULL);
+}
+
+
+/* start this process's pending thread, if it hasn't got one. It leaves the
+ * signals that stop the server to the other threads. Call with
+ * clients_lock held. */
+static int start_pending_thread(void) {
+    pthread_t thread;
+    sigset_t all_signals;
+    sigset_t old_signals;
+    int started;
+
+    if (pending_thread_pid == getpid()) return(1);
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+    started = (pthread_create(&thread, NULL, send_all_pending, NULL) == 0);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (!started) return(0);
+    (void)pthread_detach(thread);
+    pending_thread_pid = getpid();
+    return(1);
+}
+
+
+/* add a response to the end of a client's pending list, evicting the
+ * client instead if it is too far behind. Returns 0 if the client was
+ * evicted. Call with clients_lock held. */
+static int add_pending(client_chan *client, const struct msg_passed *msg_ptr,
+                       const int frame_len) {
+    pending_resp *resp = NULL;
+
+    if (client->pending_bytes + frame_len <= PENDING_MAX_BYTES &&
+        start_pending_thread()) {
+        resp = malloc(offsetof(pending_resp, msg.frame) + frame_len);
+    }
+    if (!resp) {
+        fprintf(stderr, "Server Warning:- client %d is not reading its "
+                "responses, dropping it\n", client->client_pid);
+        drop_client(client, 1);
+        return(0);
+    }
+    resp->next = NULL;
+    resp->frame_len = frame_len;
+    memcpy(&resp->msg, msg_ptr, offsetof(struct msg_passed, frame) + frame_len);
+    if (client->pending_tail) {
+        client->pending_tail->next = resp;
+    } else {
+        client->pending_head = resp;
+        if (n_pending++ == 0) pthread_cond_signal(&pending_cond);
+    }
+    client->pending_tail = resp;
+    client->pending_bytes += frame_len;
+    client->n_queued++;
+    return(1);
 }
 
 
@@ -82,54 +432,201 @@ void server_ending() {
 int read_request_from_client(message_db_t *rec_ptr)
 {
     struct msg_passed my_msg;
+    ssize_t frame_len;
+    int registered;
     #if DEBUG_TRACE
         printf("%d :- read_request_from_client()\n",  getpid());
     #endif
 
-    if (msgrcv(serv_qid, (void *)&my_msg, sizeof(*rec_ptr), 0, 0) == -1) {
-        return(0);
+    for (;;) {
+        frame_len = msgrcv(serv_qid, (void *)&my_msg, sizeof(my_msg.frame),
+                           0, 0);
+        if (frame_len == -1) return(0);
+
+        // a message that doesn't decode is dropped, and we wait for the next
+        if (!wire_decode(my_msg.frame, frame_len, rec_ptr)) continue;
+        pthread_mutex_lock(&clients_lock);
+        registered = register_client(rec_ptr->client_pid,
+                                     (int)(my_msg.msg_key - 1));
+        pthread_mutex_unlock(&clients_lock);
+        if (registered == 1) return(1);
+        if (registered == -1) {
+            fprintf(stderr, "Server Warning:- request from %d names a queue "
+                    "that isn't its own\n", rec_ptr->client_pid);
+            continue;
+        }
+
+        // the client would wait for ever for an answer, so hang up on it
+        fprintf(stderr, "Server Warning:- no room for client %d\n",
+                rec_ptr->client_pid);
+        (void)msgctl((int)(my_msg.msg_key - 1), IPC_RMID, 0);
     }
-    *rec_ptr = my_msg.real_message;
-    return(1);
 }
 
 
 /* server side:
  *
- * sending a response requires packaging our message_db_t struct inside
- * a msg_passed struct, because we need to add the pid to the key. But once
- * we've done that, msgsend looks a lot like a file write.
+ * find the client we are about to answer. */
+int start_resp_to_client(const message_db_t *mess_ptr)
+{
+    int i;
+    #if DEBUG_TRACE
+        printf("%d :- start_resp_to_client()\n",  getpid());
+    #endif
+
+    resp_slot = -1;
+    pthread_mutex_lock(&clients_lock);
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].client_pid == mess_ptr->client_pid) {
+            resp_slot = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&clients_lock);
+    return(resp_slot != -1);
+}
+
+
+/* server side:
+ *
+ * sending a response requires packaging our message_db_t struct, encoded
+ * as a frame, inside a msg_passed struct. But once we've done that, msgsnd
+ * looks a lot like a file write - except that we never let it wait for
+ * room, and keep the response pending instead, returning RESP_QUEUED.
  */
-int send_resp_to_client(const message_db_t mess_to_send) {
+int send_resp_to_client(const message_db_t *mess_ptr) {
     struct msg_passed my_msg;
+    client_chan *client;
+    int frame_len;
+    int sent = 0;
     #if DEBUG_TRACE
         printf("%d :- send_resp_to_client()\n",  getpid());
     #endif
 
-    my_msg.real_message = mess_to_send;
-    my_msg.msg_key = mess_to_send.client_pid;
+    frame_len = wire_encode_response(mess_ptr, my_msg.frame);
+    my_msg.msg_key = RESP_KEY;
+
+    pthread_mutex_lock(&clients_lock);
+    client = (resp_slot == -1) ? NULL : &clients[resp_slot];
+    if (client && client->client_pid == mess_ptr->client_pid) {
+        if (!client->pending_head) {
+            sent = try_send(client->qid, &my_msg, frame_len);
+            if (sent == -1) drop_client(client, 0);
+        }
+        if (sent == 0 && add_pending(client, &my_msg, frame_len)) {
+            sent = RESP_QUEUED;
+        }
+    }
+    pthread_mutex_unlock(&clients_lock);
+    return(sent == -1 ? 0 : sent);
+}
+
+
+/* server side:
+ *
+ * wait for the pending thread to send the responses kept pending for a
+ * client so far, for up to DELIVER_MAX_MS. A client that hasn't made room
+ * for them by then is evicted, as if it had fallen too far behind, so that
+ * it knows it has missed them. */
+int wait_resp_delivered(const pid_t client_pid)
+{
+    client_chan *client = NULL;
+    struct timespec give_up;
+    long queued;
+    int qid;
+    int i;
+    #if DEBUG_TRACE
+        printf("%d :- wait_resp_delivered()\n",  getpid());
+    #endif
 
-    if (msgsnd(cli_qid, (void *)&my_msg, sizeof(mess_to_send), 0) == -1) {
+    clock_gettime(CLOCK_REALTIME, &give_up);
+    give_up.tv_sec += DELIVER_MAX_MS / 1000;
+    give_up.tv_nsec += (DELIVER_MAX_MS % 1000) * 1000000L;
+    if (give_up.tv_nsec >= 1000000000L) {
+        give_up.tv_sec++;
+        give_up.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&clients_lock);
+    for (i = 0; i < MAX_CLIENTS && !client; i++) {
+        if (clients[i].client_pid == client_pid) client = &clients[i];
+    }
+    if (!client) {
+        pthread_mutex_unlock(&clients_lock);
+        return(0);
+    }
+    queued = client->n_queued;
+    qid = client->qid;
+    // dropping the client wakes us too, and may hand the slot to another
+    while (client->client_pid == client_pid && client->qid == qid &&
+           client->n_delivered < queued) {
+        if (pthread_cond_timedwait(&delivered_cond, &clients_lock,
+                                   &give_up) == ETIMEDOUT) break;
+    }
+    if (client->client_pid != client_pid || client->qid != qid) {
+        pthread_mutex_unlock(&clients_lock);
+        return(0);
+    }
+    if (client->n_delivered < queued) {
+        fprintf(stderr, "Server Warning:- client %d is not reading its "
+                "responses, dropping it\n", client_pid);
+        drop_client(client, 1);
+        pthread_mutex_unlock(&clients_lock);
         return(0);
     }
+    pthread_mutex_unlock(&clients_lock);
     return(1);
 }
 
 
+/* server side:
+ *
+ * the requests waiting in the server queue */
+long server_backlog(int *in_bytes_ptr)
+{
+    struct msqid_ds queue_info;
+
+    if (msgctl(serv_qid, IPC_STAT, &queue_info) == -1) return(-1);
+    return((long)queue_info.msg_qnum);
+}
+
+
+/* server side:
+ *
+ * done with this client, for now. */
+void end_resp_to_client(void)
+{
+    resp_slot = -1;
+}
+
+
 /* client side:
  *
- * The client opens the queues, but does not create them.
+ * The client opens the server's queue, but does not create it. It does
+ * create its own response queue, which has no key: the server learns its id
+ * from our requests. Only we need to read from it, and only the server to
+ * write to it: if the server runs as another user, we have to let our group
+ * write to it, and hope the server is in it.
  */
 int client_starting() {
+    struct msqid_ds queue_info;
+    int mode = 0620;
     #if DEBUG_TRACE
         printf("%d :- client_starting\n",  getpid());
     #endif
 
-    serv_qid = msgget((key_t)SERVER_MQUEUE, 0666);
+    serv_qid = msgget((key_t)(SERVER_MQUEUE + instance_offset), 0666);
     if (serv_qid == -1) return(0);
+    if (msgctl(serv_qid, IPC_STAT, &queue_info) == 0 &&
+        queue_info.msg_perm.cuid == geteuid()) {
+        mode = 0600;
+    }
 
-    cli_qid = msgget((key_t)CLIENT_MQUEUE, 0666);
-    if (cli_qid == -1) return(0);
+    cli_qid = msgget(IPC_PRIVATE, mode | IPC_CREAT);
+    if (cli_qid == -1) {
+        serv_qid = -1;
+        return(0);
+    }
     return(1);
 }
 
@@ -137,14 +634,15 @@ int client_starting() {
 
 /* client side:
  *
- * the client doesn't need to remove anything: all it does is set its qids to
- * -1 to end a connection
+ * the client removes its response queue, and sets its qids to -1 to end a
+ * connection
  */
 void client_ending() {
     #if DEBUG_TRACE
         printf("%d :- client_ending()\n",  getpid());
     #endif
 
+    if (cli_qid != -1) (void)msgctl(cli_qid, IPC_RMID, 0);
     serv_qid = -1;
     cli_qid = -1;
 }
@@ -152,23 +650,38 @@ void client_ending() {
 /* client side:
  *
  * sending a message to the server is simple, it looks very much like a
- * file write. As with server sending, we package the pid into a struct that
- * wraps the message_db_t struct.
+ * file write. As with server sending, we package the frame into a struct
+ * with a key, which here tells the server where to send the responses.
  *
- * The value of the key actually isn't important when sending to the server.
- * The only reason we set it is because the api doesn't allow keys of 0, so
- * it isn't safe to not initialize it.
+ * If the queue is full, msgsnd waits for room. There is no timed msgsnd, so
+ * for a request with a deadline we try without waiting, and nap between
+ * tries, as poll_resp_from_server does.
  */
 int send_mess_to_server(message_db_t mess_to_send) {
     struct msg_passed my_msg;
+    struct timespec nap = {0, 1000000};
+    int frame_len;
+    int result;
     #if DEBUG_TRACE
         printf("%d :- send_mess_to_server()\n",  getpid());
     #endif
 
-    my_msg.real_message = mess_to_send;
-    my_msg.msg_key = mess_to_send.client_pid;
-
-    if (msgsnd(serv_qid, (void *)&my_msg, sizeof(mess_to_send), 0) == -1) {
+    frame_len = wire_encode_request(&mess_to_send, my_msg.frame);
+    my_msg.msg_key = cli_qid + 1;
+
+    if (mess_to_send.deadline_ms == 0) {
+        result = msgsnd(serv_qid, (void *)&my_msg, frame_len, 0);
+    } else {
+        while ((result = msgsnd(serv_qid, (void *)&my_msg, frame_len,
+                                IPC_NOWAIT)) == -1 && errno == EAGAIN) {
+            if (wire_ms_until(mess_to_send.deadline_ms) == 0) {
+                errno = ETIMEDOUT;
+                return(0);
+            }
+            nanosleep(&nap, NULL);
+        }
+    }
+    if (result == -1) {
         perror("Message send failed");
         return(0);
     }
@@ -178,35 +691,56 @@ int send_mess_to_server(message_db_t mess_to_send) {
 
 /* client side:
  *
- * read a message from the client queue. Note that the third argument is the
- * pid, which means we only pick up messages meant for us.
+ * read a message from our queue. They are all for us, so we take whichever
+ * comes first.
  */
 int read_resp_from_server(message_db_t *rec_ptr) {
     struct msg_passed my_msg;
+    ssize_t frame_len;
     #if DEBUG_TRACE
         printf("%d :- read_resp_from_server()\n",  getpid());
     #endif
 
-    if (msgrcv(cli_qid, (void *)&my_msg, sizeof(*rec_ptr), getpid(), 0) == -1) {
-        return(0);
-    }
-    *rec_ptr = my_msg.real_message;
-    return(1);
+    frame_len = msgrcv(cli_qid, (void *)&my_msg, sizeof(my_msg.frame), 0, 0);
+    if (frame_len == -1) return(0);
+    return(wire_decode(my_msg.frame, frame_len, rec_ptr));
 }
 
 /* client side:
  *
- * this isn't needed, but it lets us use the same api as for fifo */
-int start_resp_to_client(const message_db_t mess_to_send)
-{
-    return(1);
+ * read a message from the client queue, if one turns up within timeout_ms.
+ *
+ * There is no timed version of msgrcv, so unless we are to wait for ever,
+ * we poll the queue with IPC_NOWAIT, sleeping for a millisecond between
+ * tries. */
+int poll_resp_from_server(message_db_t *rec_ptr, const int timeout_ms) {
+    struct msg_passed my_msg;
+    struct timespec nap = {0, 1000000};
+    ssize_t frame_len;
+    int waited_ms = 0;
+    #if DEBUG_TRACE
+        printf("%d :- poll_resp_from_server()\n",  getpid());
+    #endif
+
+    if (timeout_ms < 0) return(read_resp_from_server(rec_ptr) ? 1 : -1);
+    for (;;) {
+        frame_len = msgrcv(cli_qid, (void *)&my_msg, sizeof(my_msg.frame),
+                           0, IPC_NOWAIT);
+        if (frame_len != -1) {
+            return(wire_decode(my_msg.frame, frame_len, rec_ptr) ? 1 : -1);
+        }
+        if (errno != ENOMSG) return(-1);
+        if (waited_ms >= timeout_ms) return(0);
+        nanosleep(&nap, NULL);
+        waited_ms++;
+    }
 }
 
 /* client side:
  *
- * this isn't needed, but it lets us use the same api as for fifo */
-void end_resp_to_client(void)
-{
+ * a SysV queue has no fd, which is why poll_resp_from_server has to poll */
+int resp_fd_from_server(void) {
+    return(-1);
 }
 
 /* client side:
@@ -0,0 +1,527 @@
+/* The same api again, this time on POSIX message queues (mq_open and
+ * friends) rather than the System V ones in mqueue_imp.c. Build it with
+ * make server_pmq client_pmq.
+ *
+ * The differences that matter to us:
+ *   - queues have names, so each client can have a response queue of its
+ *     own, instead of all of them sharing one and picking out their
+ *     messages by pid. A client that stops reading only fills its own
+ *     queue.
+ *   - messages carry a priority, and mq_receive always hands out the
+ *     highest priority message first. Clients send the quick requests
+ *     (gets, adds, deletes, batches, status) at REQ_PRIO_INTERACTIVE, and
+ *     the ones that scan the catalog and stream back their results
+ *     (searches, queries and aggregates) at REQ_PRIO_BULK, so a get doesn't
+ *     wait behind a queue of searches. That does mean that a client's bulk
+ *     request can be overtaken by a quick one it sent after it.
+ *   - there are timed versions of send and receive, so a client can wait
+ *     for a response with a timeout without polling, and the server can
+ *     give up on a client that has gone away without reading its responses.
+ *
+ * On Linux a queue descriptor is also a file descriptor, which could be
+ * handed to poll or epoll, and mq_notify can signal or start a thread when a
+ * message arrives on an empty queue. The server only ever waits for one
+ * queue, though, and a blocking mq_receive (which a signal interrupts, just
+ * like msgrcv) is all it needs.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "cd_data.h"
+#include "cliserv.h"
+#include "wire.h"
+
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <mqueue.h>
+#include <sys/stat.h>
+
+#define SERVER_PMQ  "/cd_server"
+#define REPLICA_PMQ "/cd_server_%d"
+#define CLIENT_PMQ  "/cd_client_%d"
+
+#define PMQ_NAME_LEN 32
+
+/* Linux won't let an ordinary user make a queue longer than
+ * fs.mqueue.msg_max, which is 10 unless it has been changed. Every queue's
+ * full size also counts against its owner's RLIMIT_MSGQUEUE (800K by
+ * default), which is only room for about 19 queues like ours; for more
+ * clients than that, raise it with ulimit -q. */
+#define PMQ_QUEUE_LEN 10
+
+#define REQ_PRIO_BULK        1
+#define REQ_PRIO_INTERACTIVE 2
+#define RESP_PRIO            0  /* the responses to a request must stay in
+                                   order, so they all have the same priority */
+
+/* how long the server waits for room in a client's queue before checking
+ * that the client is still there */
+#define RESP_WAIT_SECS 1
+
+static char server_mq_name[PMQ_NAME_LEN] = SERVER_PMQ;
+static char client_mq_name[PMQ_NAME_LEN] = {'\0'};
+static mqd_t serv_mq = (mqd_t)-1;
+static mqd_t cli_mq = (mqd_t)-1;
+
+/* The server keeps each client's response queue open from one request to
+ * the next, in a table like the one in mqueue_imp.c, rather than opening it
+ * by name for every request. A client removes its queue when it ends, and
+ * makes a new one if it starts again, but the one we have open lives on
+ * without a name for as long as we keep it. So before using it we check
+ * that it still has its name (its link count, from fstat, which is much
+ * cheaper than looking the name up again). One that has lost it is closed,
+ * as is one whose client has died; as new clients arrive we check one of
+ * the others in turn, and all of them if the table is full. A queue that a
+ * thread is answering on is only closed once the thread is done with it.
+ * If there is still no room, the queue is opened just for the one
+ * request, as it always used to be. */
+#define MAX_CLIENTS 256
+
+typedef struct {
+    pid_t client_pid;     /* 0 if the queue is no longer the client's */
+    mqd_t mq;
+    int   busy;           /* threads answering on it; free if 0 too */
+} client_chan;
+
+static client_chan clients[MAX_CLIENTS];
+static int next_check = 0;
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* server side: the response queue of the client each thread is answering,
+ * and its slot (NULL if it was opened just for this request) */
+static __thread mqd_t resp_mq = (mqd_t)-1;
+static __thread client_chan *resp_client = NULL;
+static __thread pid_t resp_pid = 0;
+
+/* Either side:
+ *
+ * pick which server's queue to use. Instance 0 is the primary. */
+void set_server_instance(const int instance) {
+    if (instance == 0) strcpy(server_mq_name, SERVER_PMQ);
+    else sprintf(server_mq_name, REPLICA_PMQ, instance);
+}
+
+
+/* open a queue, creating it with room for PMQ_QUEUE_LEN frames if need be */
+static mqd_t open_queue(const char *name, const int flags) {
+    struct mq_attr attr;
+
+    memset(&attr, '\0', sizeof(attr));
+    attr.mq_maxmsg = PMQ_QUEUE_LEN;
+    attr.mq_msgsize = WIRE_MAX_FRAME;
+    return(mq_open(name, flags, 0666, &attr));
+}
+
+
+/* server side:
+ *
+ * the server creates its own queue, throwing away any old one a server that
+ * crashed left behind, along with the requests in it. Client queues belong
+ * to the clients. */
+int server_starting(void) {
+    #if DEBUG_TRACE
+        printf("%d :- server_starting()\n",  getpid());
+    #endif
+
+    (void)mq_unlink(server_mq_name);
+    serv_mq = open_queue(server_mq_name, O_RDONLY | O_CREAT);
+    if (serv_mq == (mqd_t)-1) {
+        fprintf(stderr, "Server startup error, no queue created\n");
+        return(0);
+    }
+    return(1);
+}
+
+
+/* has a client's queue lost its name? */
+static int queue_gone(const mqd_t mq) {
+    struct stat info;
+
+    return(fstat((int)mq, &info) == -1 || info.st_nlink == 0);
+}
+
+/* a slot's queue is no longer its client's: close it, unless a thread is
+ * answering on it, when the thread closes it (see end_resp_to_client).
+ * Call with clients_lock held. */
+static void retire_client(client_chan *client) {
+    client->client_pid = 0;
+    if (client->busy == 0) (void)mq_close(client->mq);
+}
+
+/* retire a client whose queue has gone, or who has died. Call with
+ * clients_lock held. */
+static void check_client(client_chan *client) {
+    if (client->client_pid == 0) return;
+    if (queue_gone(client->mq) ||
+        (kill(client->client_pid, 0) == -1 && errno == ESRCH)) {
+        retire_client(client);
+    }
+}
+
+/* find a free slot for a new client. Returns NULL if there isn't one. Call
+ * with clients_lock held. */
+static client_chan *free_client(void) {
+    int i;
+
+    check_client(&clients[next_check]);
+    next_check = (next_check + 1) % MAX_CLIENTS;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].client_pid == 0 && clients[i].busy == 0) {
+            return(&clients[i]);
+        }
+    }
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        check_client(&clients[i]);
+        if (clients[i].client_pid == 0 && clients[i].busy == 0) {
+            return(&clients[i]);
+        }
+    }
+    return(NULL);
+}
+
+
+/* server side:
+ *
+ * close and remove the server queue, and close the clients' queues. */
+void server_ending(void) {
+    int i;
+    #if DEBUG_TRACE
+        printf("%d :- server_ending()\n",  getpid());
+    #endif
+
+    pthread_mutex_lock(&clients_lock);
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].client_pid != 0) retire_client(&clients[i]);
+    }
+    pthread_mutex_unlock(&clients_lock);
+    (void)mq_close(serv_mq);
+    (void)mq_unlink(server_mq_name);
+    serv_mq = (mqd_t)-1;
+}
+
+
+/* server side:
+ *
+ * Handing the queue over (see cliserv.h). It keeps its name, so there is
+ * nothing to tell the new server; we just close it without removing it, and
+ * the requests in it wait for the new server to open it again. */
+int server_can_hand_off(void) {
+    return(1);
+}
+
+int server_handoff(const int state_fd) {
+    (void)mq_close(serv_mq);
+    serv_mq = (mqd_t)-1;
+    return(1);
+}
+
+int server_take_over(const int state_fd) {
+    serv_mq = open_queue(server_mq_name, O_RDONLY | O_CREAT);
+    if (serv_mq == (mqd_t)-1) {
+        fprintf(stderr, "Server startup error, could not take over queue\n");
+        return(0);
+    }
+    return(1);
+}
+
+
+/* server side:
+ *
+ * as with msgrcv, several processes can read the server queue as it is. */
+int server_share_intake(void) {
+    return(1);
+}
+
+
+/* server side:
+ *
+ * take the highest priority request waiting (the oldest, of those with the
+ * same priority). A message that doesn't decode is dropped, and we wait for
+ * the next. */
+int read_request_from_client(message_db_t *rec_ptr) {
+    unsigned char frame[WIRE_MAX_FRAME];
+    ssize_t frame_len;
+    #if DEBUG_TRACE
+        printf("%d :- read_request_from_client()\n",  getpid());
+    #endif
+
+    do {
+        frame_len = mq_receive(serv_mq, (char *)frame, sizeof(frame), NULL);
+        if (frame_len == -1) return(0);
+    } while (!wire_decode(frame, frame_len, rec_ptr));
+    return(1);
+}
+
+
+/* server side:
+ *
+ * find the response queue of the client we are about to answer, opening
+ * it if we don't have it open already. The responses to one request all go
+ * out on it. */
+int start_resp_to_client(const message_db_t *mess_ptr) {
+    char name[PMQ_NAME_LEN];
+    client_chan *client = NULL;
+    int i;
+    #if DEBUG_TRACE
+        printf("%d :- start_resp_to_client()\n",  getpid());
+    #endif
+
+    pthread_mutex_lock(&clients_lock);
+    for (i = 0; i < MAX_CLIENTS && !client; i++) {
+        if (clients[i].client_pid == mess_ptr->client_pid) {
+            client = &clients[i];
+        }
+    }
+    if (client && queue_gone(client->mq)) {
+        retire_client(client);
+        client = NULL;
+    }
+    if (client) {
+        resp_mq = client->mq;
+    } else {
+        sprintf(name, CLIENT_PMQ, mess_ptr->client_pid);
+        resp_mq = mq_open(name, O_WRONLY);
+        if (resp_mq == (mqd_t)-1) {
+            pthread_mutex_unlock(&clients_lock);
+            return(0);
+        }
+        client = free_client();
+        if (client) {
+            client->client_pid = mess_ptr->client_pid;
+            client->mq = resp_mq;
+        }
+    }
+    if (client) client->busy++;
+    resp_client = client;
+    pthread_mutex_unlock(&clients_lock);
+    resp_pid = mess_ptr->client_pid;
+    return(1);
+}
+
+
+/* server side:
+ *
+ * send one response. When the client's queue is full we wait for it to
+ * read some, but only for as long as the client is still running: one that
+ * died without removing its queue will never empty it. */
+int send_resp_to_client(const message_db_t *mess_ptr) {
+    unsigned char frame[WIRE_MAX_FRAME];
+    struct timespec give_up;
+    int frame_len;
+    #if DEBUG_TRACE
+        printf("%d :- send_resp_to_client()\n",  getpid());
+    #endif
+
+    if (resp_mq == (mqd_t)-1) return(0);
+    frame_len = wire_encode_response(mess_ptr, frame);
+    for (;;) {
+        clock_gettime(CLOCK_REALTIME, &give_up);
+        give_up.tv_sec += RESP_WAIT_SECS;
+        if (mq_timedsend(resp_mq, (const char *)frame, frame_len, RESP_PRIO,
+                         &give_up) == 0) return(1);
+        if (errno != ETIMEDOUT) return(0);
+        if (kill(resp_pid, 0) == -1 && errno == ESRCH) return(0);
+    }
+}
+
+
+/* server side:
+ *
+ * done with this client, for now. Its queue stays open for next time,
+ * unless it was only opened for this request, or has been retired since. */
+void end_resp_to_client(void) {
+    #if DEBUG_TRACE
+        printf("%d :- end_resp_to_client()\n",  getpid());
+    #endif
+
+    if (resp_mq == (mqd_t)-1) return;
+    pthread_mutex_lock(&clients_lock);
+    if (!resp_client) {
+        (void)mq_close(resp_mq);
+    } else if (--resp_client->busy == 0 && resp_client->client_pid == 0) {
+        (void)mq_close(resp_client->mq);
+    }
+    pthread_mutex_unlock(&clients_lock);
+    resp_mq = (mqd_t)-1;
+    resp_client = NULL;
+    resp_pid = 0;
+}
+
+
+/* server side:
+ *
+ * mq_send waits for room in the client's queue, so there is nothing kept
+ * back to wait for. */
+int wait_resp_delivered(const pid_t client_pid) {
+    return(1);
+}
+
+
+/* server side:
+ *
+ * the requests waiting in the server queue */
+long server_backlog(int *in_bytes_ptr) {
+    struct mq_attr attr;
+
+    if (serv_mq == (mqd_t)-1 || mq_getattr(serv_mq, &attr) == -1) return(-1);
+    return(attr.mq_curmsgs);
+}
+
+
+/* client side:
+ *
+ * open the server's queue, and make our own response queue, named by our
+ * pid. Any queue of that name is left over from an earlier process that
+ * had our pid, so we start a fresh one. */
+int client_starting(void) {
+    #if DEBUG_TRACE
+        printf("%d :- client_starting\n",  getpid());
+    #endif
+
+    serv_mq = mq_open(server_mq_name, O_WRONLY);
+    if (serv_mq == (mqd_t)-1) return(0);
+
+    sprintf(client_mq_name, CLIENT_PMQ, getpid());
+    (void)mq_unlink(client_mq_name);
+    cli_mq = open_queue(client_mq_name, O_RDONLY | O_CREAT);
+    if (cli_mq == (mqd_t)-1) {
+        (void)mq_close(serv_mq);
+        serv_mq = (mqd_t)-1;
+        return(0);
+    }
+    return(1);
+}
+
+
+/* client side:
+ *
+ * close both queues, and remove our own. */
+void client_ending(void) {
+    #if DEBUG_TRACE
+        printf("%d :- client_ending()\n",  getpid());
+    #endif
+
+    if (serv_mq != (mqd_t)-1) (void)mq_close(serv_mq);
+    if (cli_mq != (mqd_t)-1) {
+        (void)mq_close(cli_mq);
+        (void)mq_unlink(client_mq_name);
+    }
+    serv_mq = cli_mq = (mqd_t)-1;
+}
+
+
+/* client side:
+ *
+ * the priority a request goes to the server with. */
+static unsigned int request_priority(const message_db_t *mess_ptr) {
+    switch(mess_ptr->request) {
+        case s_find_cdc_entry:
+        case s_query_cdc_entry:
+        case s_aggregate:
+            return(REQ_PRIO_BULK);
+        default:
+            return(REQ_PRIO_INTERACTIVE);
+    }
+}
+
+
+/* client side:
+ *
+ * send a request. If the server's queue is full, this waits for room, until
+ * the request's deadline if it has one (which is on the clock that
+ * mq_timedsend uses). */
+int send_mess_to_server(message_db_t mess_to_send) {
+    unsigned char frame[WIRE_MAX_FRAME];
+    struct timespec give_up;
+    int frame_len;
+    int result;
+    #if DEBUG_TRACE
+        printf("%d :- send_mess_to_server()\n",  getpid());
+    #endif
+
+    frame_len = wire_encode_request(&mess_to_send, frame);
+    if (mess_to_send.deadline_ms == 0) {
+        result = mq_send(serv_mq, (const char *)frame, frame_len,
+                         request_priority(&mess_to_send));
+    } else {
+        give_up.tv_sec = mess_to_send.deadline_ms / 1000;
+        give_up.tv_nsec = (mess_to_send.deadline_ms % 1000) * 1000000L;
+        result = mq_timedsend(serv_mq, (const char *)frame, frame_len,
+                              request_priority(&mess_to_send), &give_up);
+    }
+    if (result == -1) {
+        if (errno != ETIMEDOUT) perror("Message send failed");
+        return(0);
+    }
+    return(1);
+}
+
+
+/* client side:
+ *
+ * wait for a response to arrive on our queue. */
+int read_resp_from_server(message_db_t *rec_ptr) {
+    unsigned char frame[WIRE_MAX_FRAME];
+    ssize_t frame_len;
+    #if DEBUG_TRACE
+        printf("%d :- read_resp_from_server()\n",  getpid());
+    #endif
+
+    frame_len = mq_receive(cli_mq, (char *)frame, sizeof(frame), NULL);
+    if (frame_len == -1) return(0);
+    return(wire_decode(frame, frame_len, rec_ptr));
+}
+
+
+/* client side:
+ *
+ * the same, but giving up after timeout_ms. Unlike msgrcv, mq_timedreceive
+ * can do the waiting for us. */
+int poll_resp_from_server(message_db_t *rec_ptr, const int timeout_ms) {
+    unsigned char frame[WIRE_MAX_FRAME];
+    struct timespec give_up;
+    ssize_t frame_len;
+    #if DEBUG_TRACE
+        printf("%d :- poll_resp_from_server()\n",  getpid());
+    #endif
+
+    if (timeout_ms < 0) return(read_resp_from_server(rec_ptr) ? 1 : -1);
+    clock_gettime(CLOCK_REALTIME, &give_up);
+    give_up.tv_sec += timeout_ms / 1000;
+    give_up.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (give_up.tv_nsec >= 1000000000L) {
+        give_up.tv_sec++;
+        give_up.tv_nsec -= 1000000000L;
+    }
+    frame_len = mq_timedreceive(cli_mq, (char *)frame, sizeof(frame), NULL,
+                                &give_up);
+    if (frame_len == -1) return(errno == ETIMEDOUT ? 0 : -1);
+    return(wire_decode(frame, frame_len, rec_ptr) ? 1 : -1);
+}
+
+/* client side:
+ *
+ * On Linux, a POSIX queue descriptor is a file descriptor, which poll and
+ * epoll report as readable when there is a message in the queue. */
+int resp_fd_from_server(void) {
+    return((int)cli_mq);
+}
+
+
+/* client side:
+ *
+ * this isn't needed, but it lets us use the same api as for fifo */
+int start_resp_from_server(void)
+{
+    return(1);
+}
+
+/* client side:
+ *
+ * this isn't needed, but it lets us use the same api as for fifo */
+void end_resp_from_server(void)
+{
+}
@@ -6,29 +6,238 @@
 #include <signal.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "cd_data.h"
 #include "cliserv.h"
+#include "changelog.h"
+#include "stats.h"
+#include "cache_watch.h"
 
-int save_errno;
 static int server_running = 1;
 
-static void process_command(const message_db_t mess_command);
+/* the number of threads used to scan the catalog for s_find_cdc_entry. With
+ * the default of 1, and only one worker, we use the one-at-a-time
+ * search_cdc_entry. */
+static int scan_parallelism = 1;
+
+/* replicas (started with -r) follow the primary's change log, and refuse
+ * requests that would change the database. */
+static int replica_instance = 0;
+
+/* The worker pool.
+ *
+ * With more than one worker (-t), the main thread only reads requests, and
+ * puts each one on a bounded queue, from which the worker threads take them
+ * and run them, so a slow request only holds up its own client. When the
+ * queue is full, the main thread waits, and requests back up in the
+ * server's fifo or queue.
+ *
+ * A worker takes the oldest request whose client isn't being served by
+ * another worker, so each client's requests still run one at a time, in the
+ * order it sent them. cd_dbm.c does its own locking; changelog_lock makes
+ * sure that the changes are logged in the same order as they were made.
+ *
+ * A job carries how far behind the primary a replica was when the request
+ * arrived, and when that was, for the stats.
+ *
+ * Coalescing gets (-c). When a lot of clients want the same popular entry,
+ * their gets pile up in the queue together. A worker that takes a get takes
+ * any other queued gets for the same entry (up to MAX_COALESCED in all),
+ * reads the entry once, and sends the answer to each of the clients. It only
+ * takes a get that is the oldest request of a client nobody is serving, so
+ * each client's requests still run in order. Every one of those gets arrived
+ * before the read, so the answer is one any of them could have had on its
+ * own. The stats (see stats.h) count the gets answered this way.
+ *
+ * It is only worth it when reading the entry costs more than answering a
+ * client does: with the catalog in the page cache, sending a client its
+ * answer costs several times as much as the read, and handing out the
+ * answers a batch at a time slows down clients that keep several requests
+ * in flight. So it is off unless asked for.
+ *
+ * Only the main thread takes the signals that stop the server. When it
+ * stops, the workers finish the requests already queued; any still going
+ * after STOP_GRACE_SECS (say, blocked sending to a client that has stopped
+ * reading) are interrupted with SIGUSR1, which does nothing but make the
+ * send fail. */
+#define JOB_QUEUE_LEN   64
+#define MAX_COALESCED   16
+#define STOP_GRACE_SECS 1
+
+typedef struct {
+    message_db_t   mess;
+    replica_status lag;
+    long           arrived_ns;   /* see stats_now */
+} server_job;
+
+static int n_workers = 1;
+static int n_workers_running = 0;
+static pthread_t *workers = NULL;
+static pid_t *busy_clients = NULL;   /* the clients each worker is serving */
+static int busy_slots = 1;           /* ... room for how many, per worker */
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_has_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workers_exited = PTHREAD_COND_INITIALIZER;
+static server_job job_slots[JOB_QUEUE_LEN];
+static server_job *free_jobs[JOB_QUEUE_LEN];
+static server_job *queued_jobs[JOB_QUEUE_LEN];   /* oldest first */
+static int n_free_jobs = 0;
+static int n_queued_jobs = 0;
+static int queue_closed = 0;
+static int coalesce_gets = 0;
+
+/* The pre-forked worker processes.
+ *
+ * With -w N, the server forks N processes, which all read requests from the
+ * server's fifo or queue, and run them just as a single server would. The
+ * first process only looks after the others, starting a new one in place of
+ * any that dies, so a crash while running one request doesn't take the
+ * whole server down. A process that dies within a second of starting is
+ * replaced after a second's pause, rather than straight away.
+ *
+ * The processes share the database files (see database_share in cd_dbm.c)
+ * and the change log, whose lock keeps the changes logged in the order they
+ * were made. Each keeps its own copy of the catalog column, though, which it
+ * reloads whenever another process has changed the database, so this mode
+ * suits mostly-read loads. Requests a client pipelines may be picked up by
+ * different processes, and run in any order.
+ *
+ * A replica, which has to apply the change log as it goes, runs as one
+ * process. */
+#define RESTART_SECS    1
+
+static int n_processes = 0;
+static pid_t *process_pids = NULL;
+static time_t *process_started = NULL;
+
+/* Client caches.
+ *
+ * A client may cache the entries it gets, so long as we watch them, and
+ * tell it when they change (see cache_watch.h). Only a primary running as
+ * one process can do that: a replica's entries change under it as it
+ * applies the change log, and each process of a -w server only sees the
+ * changes it makes itself. Other servers answer the s_watch_ requests as
+ * plain gets, without watching anything, and their clients don't cache.
+ *
+ * The notices about a change are sent before the change is answered, and
+ * before its response is started (see process_command). With a worker pool,
+ * every response claims its client first (see start_response), so that a
+ * notice can't get mixed up with it. The watches die with the server, so
+ * when it stops, or restarts in place, it tells all of the clients with
+ * any to empty their caches. */
+static int watching = 0;
+static int claim_clients = 0;       /* watching, with a worker pool */
+
+/* Deadlines.
+ *
+ * A client that has a request timeout (see "Deadlines" in cd_data.h) gives
+ * up on a request once its deadline has passed. If we haven't started on
+ * the request by then, there is no point in running it, so the request is
+ * dropped, unanswered, just before it would have been run (see
+ * drop_if_expired). That is what lets a server that has fallen behind
+ * catch up: the requests that have waited longest to be read are the
+ * likeliest to have been given up on. Once started, a request is finished,
+ * however late. */
+
+/* Restarting in place.
+ *
+ * A SIGUSR2 asks the server to restart without losing any requests, say to
+ * pick up a new build of the program. It stops reading requests, lets the
+ * workers (threads or processes) finish those it has, and then hands its
+ * intake over (see server_handoff in cliserv.h), leaving it in place with
+ * any requests still waiting in it. Then it closes the database and the
+ * change log, and execs the program it was started from, with the same
+ * arguments, and HANDOFF_ENV naming a file that holds the state of the
+ * intake. The new program takes the intake over rather than making a new
+ * one, and carries on from where the old one left off; as it keeps the
+ * same pid, clients don't notice it is a different program. It also keeps
+ * the stats page, and the directory it was in, and it never makes a new
+ * database, -i or not (a replica still rebuilds its copy from the change
+ * log, as it always does).
+ *
+ * Clients can go on sending requests while this happens; they only wait a
+ * little longer for their answers. Finishing a request may mean waiting for
+ * its client to make room for the answer, so the workers get
+ * RESTART_GRACE_SECS to finish, rather than STOP_GRACE_SECS. If the intake
+ * can't be handed over at all, or the program isn't there to exec, the
+ * server says so and carries on as it was. */
+#define HANDOFF_ENV         "CD_SERVER_HANDOFF"
+#define HANDOFF_MAGIC       0x43444844   /* "CDHD" */
+#define HANDOFF_VERSION     1
+#define RESTART_GRACE_SECS  10
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+} handoff_header;
+
+static int server_restarting = 0;
+static char server_path[PATH_MAX + 1] = {'\0'};
+
+static int start_workers(void);
+static int run_processes(void);
+static void run_worker_process(void);
+static void stop_workers(const int grace_secs);
+static int restart_cancelled(void);
+static void restart_server(char *argv[]);
+static int take_handoff(void);
+static void request_arrived(server_job *job_ptr);
+static void queue_job(const server_job *job_ptr);
+static int drop_if_expired(const server_job *job_ptr);
+static void run_job(server_job *job_ptr);
+static void process_gets(server_job *jobs, const int n_jobs);
+static void process_command(message_db_t *resp_ptr,
+                            const replica_status *lag_ptr);
+static void find_cdc_entries_parallel(message_db_t *resp_ptr);
+static int run_query(message_db_t *resp_ptr, const int send_matches);
+static int find_cdc_page(message_db_t *resp_ptr);
+static int run_aggregate(message_db_t *resp_ptr);
+static int is_write_request(const message_db_t *mess_ptr);
+static void send_notices(const watch_notice *notices, const int n_notices);
+static void drop_watches(void);
+static void *worker_thread(void *arg);
 
 void catch_signals()
 {
     server_running = 0;
 }
 
+/* SIGUSR2 asks for a restart, see "Restarting in place" */
+static void catch_restart(int sig)
+{
+    server_restarting = 1;
+    server_running = 0;
+}
+
+/* SIGUSR1 only interrupts a worker, see stop_workers */
+static void interrupt_worker(int sig)
+{
+}
+
 /*
 Now we come to the main function.
 
 After checking that the signal catching routines,
 the program checks to see whether you passed -i on the command line.
 
-If you did, it will create a new database.
+If you did, it will create a new database. You can also pass -p N to have
+catalog searches split between N threads, and -t N to run requests on a
+pool of N worker threads, or -w N to fork N server processes instead.
+With -t, -c has the workers answer queued gets for the same entry with a
+single read. Sending the server a SIGUSR2 restarts it in place, without
+losing any requests.
+
+Passing -r N starts read-only replica number N instead, which keeps its own
+copy of the database by following the primary's change log (-l names the
+log, if it isn't CHANGE_LOG). A replica's database files live in the
+directory given by -d, so it doesn't trample on the primary's.
 If all is well and the server is running,
 any requests from the client are fed to the process_command function
 that we'll meet in a moment. 
@@ -56,8 +265,13 @@ that we'll meet in a moment.
  */
 int main(int argc, char *argv[]) {
     struct sigaction new_action, old_action;
-    message_db_t mess_command;
+    server_job job;
     int database_init_type = 0;
+    const char *log_name = CHANGE_LOG;
+    const char *data_dir = NULL;
+    int state_fd;
+    ssize_t path_len;
+    int c;
 
     new_action.sa_handler = catch_signals;
     sigemptyset(&new_action.sa_mask);
@@ -68,81 +282,801 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Server startup error, signal catching failed\n");
         exit(EXIT_FAILURE);
     }    
+    new_action.sa_handler = catch_restart;
+    if (sigaction(SIGUSR2, &new_action, &old_action) != 0) {
+        fprintf(stderr, "Server startup error, signal catching failed\n");
+        exit(EXIT_FAILURE);
+    }
 
-    if (argc > 1) {
-        argv++;
-        if (strncmp("-i", *argv, 2) == 0) database_init_type = 1;
+    while ((c = getopt(argc, argv, "ip:t:cw:r:d:l:")) != -1) {
+        switch(c) {
+            case 'i':
+                database_init_type = 1;
+                break;
+            case 'p':
+                scan_parallelism = atoi(optarg);
+                if (scan_parallelism < 1) scan_parallelism = 1;
+                break;
+            case 't':
+                n_workers = atoi(optarg);
+                if (n_workers < 1) n_workers = 1;
+                break;
+            case 'c':
+                coalesce_gets = 1;
+                break;
+            case 'w':
+                n_processes = atoi(optarg);
+                if (n_processes < 1) n_processes = 1;
+                break;
+            case 'r':
+                replica_instance = atoi(optarg);
+                break;
+            case 'd':
+                data_dir = optarg;
+                break;
+            case 'l':
+                log_name = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-i] [-p scan_threads] "
+                        "[-t worker_threads [-c] | -w worker_processes] "
+                        "[-r replica_no] [-d data_dir] [-l change_log]\n",
+                        argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (n_processes > 0 && (n_workers > 1 || replica_instance > 0)) {
+        fprintf(stderr, "Server error: -w can not be used with -t or -r\n");
+        exit(EXIT_FAILURE);
+    }
+    watching = (n_processes == 0 && replica_instance == 0);
+    claim_clients = (watching && n_workers > 1);
+
+    // a server restarting in place left us its intake, and we are already
+    // in its directory. We'll want to know where our program is, to exec
+    // it when we restart, before it can be replaced by a new build.
+    state_fd = take_handoff();
+    if (state_fd != -1) {
+        database_init_type = 0;
+        data_dir = NULL;
     }
+    path_len = readlink("/proc/self/exe", server_path, PATH_MAX);
+    server_path[path_len > 0 ? path_len : 0] = '\0';
+
+    if (data_dir && chdir(data_dir) == -1) {
+        fprintf(stderr, "Server error: can not use directory %s\n", data_dir);
+        exit(EXIT_FAILURE);
+    }
+
+    // a replica always starts from an empty database, and builds it up
+    // from the change log
+    if (replica_instance > 0) database_init_type = 1;
     if (!database_initialize(database_init_type)) {
         fprintf(stderr, "Server error: could not initialize database\n");
         exit(EXIT_FAILURE);
     }
+    if (replica_instance > 0) {
+        if (!changelog_open_replica(log_name)) exit(EXIT_FAILURE);
+        set_server_instance(replica_instance);
+    } else {
+        if (!changelog_open_primary(log_name, database_init_type)) {
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    if (!server_starting()) exit(EXIT_FAILURE);
+    if (!(state_fd != -1 && stats_take_over(replica_instance)) &&
+        !stats_open(replica_instance)) {
+        fprintf(stderr, "Server error: no memory for statistics\n");
+        exit(EXIT_FAILURE);
+    }
+    if (state_fd != -1) {
+        if (!server_take_over(state_fd)) exit(EXIT_FAILURE);
+        close(state_fd);
+    } else if (!server_starting()) {
+        exit(EXIT_FAILURE);
+    }
+    if (n_processes > 0) {
+        if (!database_share() || !server_share_intake() ||
+            !run_processes()) {
+            fprintf(stderr, "Server startup error, could not start "
+                    "worker processes\n");
+            server_running = 0;
+        }
+        if (server_restarting) restart_server(argv);
+        server_ending();
+        stats_close();
+        changelog_close();
+        exit(server_running ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    if (n_workers > 1 && !start_workers()) {
+        fprintf(stderr, "Server startup error, could not start workers\n");
+        server_ending();
+        stats_close();
+        exit(EXIT_FAILURE);
+    }
+    memset(&job.lag, '\0', sizeof(job.lag));
     
-    while(server_running) {
-        if (read_request_from_client(&mess_command)) {
-            process_command(mess_command);
+    while(server_running || restart_cancelled()) {
+        if (read_request_from_client(&job.mess)) {
+            request_arrived(&job);
+            // replicas catch up with the primary before each request, so
+            // they never answer with data older than the request
+            if (!changelog_apply(&job.lag)) {
+                fprintf(stderr, "Replica error, could not apply change log\n");
+            }
+            if (n_workers > 1) queue_job(&job);
+            else run_job(&job);
         } else {
             if(server_running) fprintf(stderr, "Server ended - can not \
                                         read mqueue\n");
             server_running = 0;
         }
     } /* while */
+    if (n_workers > 1) {
+        stop_workers(server_restarting ? RESTART_GRACE_SECS : STOP_GRACE_SECS);
+    }
+    drop_watches();
+    if (server_restarting) restart_server(argv);
     server_ending();
+    stats_close();
+    changelog_close();
     exit(EXIT_SUCCESS);
 }
 
-/* accept a client message `comm`, do a switch based on the action requested,
- * delegate database handling to functions in cd_dbm.c, construct a response
- * message, and send it. */
-static void process_command(const message_db_t comm)
+/* Has a restart (see "Restarting in place") been asked for that can't
+ * happen? If so, we forget it, and the server carries on. */
+static int restart_cancelled(void)
 {
-    message_db_t resp;
-    int first_time = 1;
+    if (!server_restarting) return(0);
+    if (server_can_hand_off() && server_path[0] != '\0' &&
+        access(server_path, X_OK) == 0) return(0);
+    fprintf(stderr, "Server Warning:- can not restart in place, "
+            "carrying on\n");
+    server_restarting = 0;
+    server_running = 1;
+    return(1);
+}
+
+/* Hand the intake over, and exec the new program. This only returns if the
+ * intake couldn't be handed over; once it has been, there is no going
+ * back, so if the exec fails we can only end. */
+static void restart_server(char *argv[])
+{
+    handoff_header header;
+    char fd_text[16];
+    FILE *state;
+
+    header.magic = HANDOFF_MAGIC;
+    header.version = HANDOFF_VERSION;
+    state = tmpfile();
+    if (!state ||
+        write(fileno(state), &header, sizeof(header)) != sizeof(header) ||
+        !server_handoff(fileno(state))) {
+        fprintf(stderr, "Server Warning:- could not hand over, ending\n");
+        return;
+    }
+    database_close();
+    changelog_close();
+    (void)lseek(fileno(state), 0, SEEK_SET);
+    sprintf(fd_text, "%d", fileno(state));
+    (void)setenv(HANDOFF_ENV, fd_text, 1);
+    fprintf(stderr, "Server restarting\n");
+    fflush(stdout);
+    execv(server_path, argv);
+
+    fprintf(stderr, "Server error: could not restart %s\n", server_path);
+    server_ending();
+    stats_close();
+    exit(EXIT_FAILURE);
+}
+
+/* If we are taking over from a server that restarted, return the fd of the
+ * state it left us, having checked that we understand it. Otherwise
+ * return -1. */
+static int take_handoff(void)
+{
+    const char *fd_text = getenv(HANDOFF_ENV);
+    handoff_header header;
+    int state_fd;
+
+    if (!fd_text) return(-1);
+    state_fd = atoi(fd_text);
+    (void)unsetenv(HANDOFF_ENV);
+    (void)fcntl(state_fd, F_SETFD, FD_CLOEXEC);
+    if (read(state_fd, &header, sizeof(header)) != sizeof(header) ||
+        header.magic != HANDOFF_MAGIC || header.version != HANDOFF_VERSION) {
+        fprintf(stderr, "Server startup error, can not take over from "
+                "the old server\n");
+        exit(EXIT_FAILURE);
+    }
+    return(state_fd);
+}
+
+/* Start a worker process in slot i of process_pids. Returns 0 if the fork
+ * failed. */
+static int start_process(const int i)
+{
+    pid_t pid;
+
+    pid = fork();
+    if (pid == -1) return(0);
+    if (pid == 0) run_worker_process();
+    process_pids[i] = pid;
+    process_started[i] = time(NULL);
+    return(1);
+}
+
+/* The first process of a -w server: start the workers, replace any that
+ * die, and when we are told to stop, stop them too. Returns 0 if the
+ * workers could not be started. */
+static int run_processes(void)
+{
+    int status;
+    pid_t pid;
+    int grace_secs;
+    int n_left;
+    int tries;
+    int i;
+
+    process_pids = calloc(n_processes, sizeof(pid_t));
+    process_started = calloc(n_processes, sizeof(time_t));
+    if (!process_pids || !process_started) return(0);
+    for (i = 0; i < n_processes; i++) {
+        if (!start_process(i)) {
+            server_running = 0;
+            break;
+        }
+    }
+
+    while (server_running || restart_cancelled()) {
+        // the stop signals interrupt the wait
+        if ((pid = wait(&status)) == -1) continue;
+        for (i = 0; i < n_processes && process_pids[i] != pid; i++) ;
+        if (i == n_processes) continue;
+        process_pids[i] = 0;
+        if (!server_running) break;
+        fprintf(stderr, "Server Warning:- worker process %d died, "
+                "restarting it\n", pid);
+        if (time(NULL) - process_started[i] < RESTART_SECS) {
+            sleep(RESTART_SECS);
+        }
+        if (server_running && !start_process(i)) {
+            fprintf(stderr, "Server Warning:- could not restart worker\n");
+        }
+    }
+
+    // ask the workers to stop, and give them STOP_GRACE_SECS (or
+    // RESTART_GRACE_SECS) to finish their requests before making sure of it
+    grace_secs = server_restarting ? RESTART_GRACE_SECS : STOP_GRACE_SECS;
+    for (i = 0; i < n_processes; i++) {
+        if (process_pids[i] > 0) (void)kill(process_pids[i], SIGTERM);
+    }
+    n_left = n_processes;
+    for (tries = 0; n_left > 0 && tries <= grace_secs * 10; tries++) {
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < n_processes; i++) {
+                if (process_pids[i] == pid) process_pids[i] = 0;
+            }
+        }
+        for (n_left = 0, i = 0; i < n_processes; i++) {
+            if (process_pids[i] > 0) n_left++;
+        }
+        if (n_left > 0) usleep(100000);
+    }
+    for (i = 0; i < n_processes; i++) {
+        if (process_pids[i] > 0) (void)kill(process_pids[i], SIGKILL);
+    }
+    while (wait(&status) > 0 || errno == EINTR) ;
+    free(process_pids);
+    free(process_started);
+    return(1);
+}
+
+/* A worker process takes requests until it is told to stop. It leaves the
+ * server fifo or queue, and the change log, to the first process. */
+static void run_worker_process(void)
+{
+    server_job job;
+
+    // only the first process restarts
+    signal(SIGUSR2, SIG_IGN);
+    memset(&job.lag, '\0', sizeof(job.lag));
+    while (server_running) {
+        if (read_request_from_client(&job.mess)) {
+            request_arrived(&job);
+            run_job(&job);
+        } else if (server_running) {
+            fprintf(stderr, "Server worker %d ended - can not read "
+                    "requests\n", getpid());
+            exit(EXIT_FAILURE);
+        }
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/* Start the worker threads. They don't take the signals that stop the
+ * server; those go to the main thread, which then stops the workers.
+ * Returns 0 if the workers could not be started. */
+static int start_workers(void)
+{
+    struct sigaction interrupt_action;
+    sigset_t stop_signals, old_mask;
+    int i;
+
+    workers = calloc(n_workers, sizeof(pthread_t));
+    if (coalesce_gets) busy_slots = MAX_COALESCED;
+    busy_clients = calloc(n_workers * busy_slots, sizeof(pid_t));
+    if (!workers || !busy_clients) return(0);
+    for (i = 0; i < JOB_QUEUE_LEN; i++) free_jobs[i] = &job_slots[i];
+    n_free_jobs = JOB_QUEUE_LEN;
+
+    interrupt_action.sa_handler = interrupt_worker;
+    sigemptyset(&interrupt_action.sa_mask);
+    interrupt_action.sa_flags = 0;
+    if (sigaction(SIGUSR1, &interrupt_action, NULL) != 0) return(0);
+
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGHUP);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+    for (i = 0; i < n_workers; i++) {
+        if (pthread_create(&workers[i], NULL, worker_thread,
+                           (void *)(long)i) != 0) {
+            n_workers = i;
+            pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+            stop_workers(STOP_GRACE_SECS);
+            return(0);
+        }
+        n_workers_running++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return(1);
+}
+
+/* Let the workers finish the requests already queued, then wait for them to
+ * exit, interrupting any still going after grace_secs. */
+static void stop_workers(const int grace_secs)
+{
+    struct timespec give_up;
+    int i;
+
+    pthread_mutex_lock(&queue_lock);
+    queue_closed = 1;
+    pthread_cond_broadcast(&queue_has_work);
+    while (n_workers_running > 0) {
+        clock_gettime(CLOCK_REALTIME, &give_up);
+        give_up.tv_sec += grace_secs;
+        if (pthread_cond_timedwait(&workers_exited, &queue_lock,
+                                   &give_up) == ETIMEDOUT) {
+            for (i = 0; i < n_workers; i++) {
+                (void)pthread_kill(workers[i], SIGUSR1);
+            }
+        }
+    }
+    pthread_mutex_unlock(&queue_lock);
+    for (i = 0; i < n_workers; i++) pthread_join(workers[i], NULL);
+    free(workers);
+    free(busy_clients);
+    workers = NULL;
+    busy_clients = NULL;
+}
+
+/* Put a request on the queue for the workers, waiting for room if the queue
+ * is full. If the server is told to stop while we wait, the request is
+ * dropped; if it is restarting, it waits for room all the same. */
+static void queue_job(const server_job *job_ptr)
+{
+    struct timespec recheck;
+    server_job *job;
+
+    pthread_mutex_lock(&queue_lock);
+    while (n_free_jobs == 0 && (server_running || server_restarting)) {
+        // a signal doesn't wake us, so look at server_running now and then
+        clock_gettime(CLOCK_REALTIME, &recheck);
+        recheck.tv_sec += 1;
+        pthread_cond_timedwait(&queue_not_full, &queue_lock, &recheck);
+    }
+    if (n_free_jobs == 0) {
+        pthread_mutex_unlock(&queue_lock);
+        return;
+    }
+    job = free_jobs[--n_free_jobs];
+    *job = *job_ptr;
+    queued_jobs[n_queued_jobs++] = job;
+    stats_queue_depth(n_queued_jobs);
+    pthread_cond_signal(&queue_has_work);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/* is a worker serving a client? Call with queue_lock held. */
+static int client_is_busy(const pid_t client_pid)
+{
+    int i;
+
+    for (i = 0; i < n_workers * busy_slots; i++) {
+        if (busy_clients[i] == client_pid) return(1);
+    }
+    return(0);
+}
+
+/* the place in the queue of the oldest request we can run now, or -1 if
+ * there isn't one. Call with queue_lock held. */
+static int next_runnable_job(void)
+{
+    int i;
+
+    for (i = 0; i < n_queued_jobs; i++) {
+        if (!client_is_busy(queued_jobs[i]->mess.client_pid)) return(i);
+    }
+    return(-1);
+}
+
+/* take the job at place i off the queue. Call with queue_lock held. */
+static server_job take_job(const int i)
+{
+    server_job job = *queued_jobs[i];
+
+    free_jobs[n_free_jobs++] = queued_jobs[i];
+    memmove(&queued_jobs[i], &queued_jobs[i + 1],
+            (n_queued_jobs - i - 1) * sizeof(server_job *));
+    n_queued_jobs--;
+    stats_queue_depth(n_queued_jobs);
+    return(job);
+}
+
+/* are two requests gets for the same entry? */
+static int is_same_get(const message_db_t *a, const message_db_t *b)
+{
+    if (a->request != b->request) return(0);
+    switch(a->request) {
+        case s_get_cdc_entry:
+            return(strcmp(a->cdc_entry_data.catalog,
+                          b->cdc_entry_data.catalog) == 0);
+        case s_get_cdt_entry:
+            return(a->cdt_entry_data.track_no == b->cdt_entry_data.track_no &&
+                   strcmp(a->cdt_entry_data.catalog,
+                          b->cdt_entry_data.catalog) == 0);
+        default:
+            return(0);
+    }
+}
+
+/* jobs[0] is a get a worker has just taken. Take the queued gets for the
+ * same entry that can run now along with it, up to MAX_COALESCED jobs in
+ * all, marking their clients as served in serving. Returns how many jobs
+ * there are now. Call with queue_lock held.
+ *
+ * passed holds the clients with a request we have left in the queue: their
+ * later gets must wait for it. */
+static int take_same_gets(server_job *jobs, pid_t *serving)
+{
+    const message_db_t *get_ptr = &jobs[0].mess;
+    pid_t passed[JOB_QUEUE_LEN];
+    pid_t client_pid;
+    int n_passed = 0;
+    int n_jobs = 1;
+    int i = 0;
+    int j;
 
-    resp = comm; /* copy command back, then change resp as required */
+    while (i < n_queued_jobs && n_jobs < MAX_COALESCED) {
+        client_pid = queued_jobs[i]->mess.client_pid;
+        for (j = 0; j < n_passed && passed[j] != client_pid; j++) ;
+        if (j == n_passed && is_same_get(&queued_jobs[i]->mess, get_ptr) &&
+            !client_is_busy(client_pid)) {
+            jobs[n_jobs] = take_job(i);
+            serving[n_jobs++] = client_pid;
+        } else {
+            if (j == n_passed) passed[n_passed++] = client_pid;
+            i++;
+        }
+    }
+    return(n_jobs);
+}
+
+/* A worker takes requests off the queue and runs them, until the queue is
+ * closed and empty. */
+static void *worker_thread(void *arg)
+{
+    const int worker_no = (int)(long)arg;
+    pid_t *serving = &busy_clients[worker_no * busy_slots];
+    server_job jobs[MAX_COALESCED];
+    int n_jobs;
+    int next;
+    int i, j;
+
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while ((next = next_runnable_job()) == -1 &&
+               !(queue_closed && n_queued_jobs == 0)) {
+            pthread_cond_wait(&queue_has_work, &queue_lock);
+        }
+        if (next == -1) {
+            n_workers_running--;
+            pthread_cond_signal(&workers_exited);
+            pthread_mutex_unlock(&queue_lock);
+            break;
+        }
+        jobs[0] = take_job(next);
+        serving[0] = jobs[0].mess.client_pid;
+        n_jobs = 1;
+        if (coalesce_gets && (jobs[0].mess.request == s_get_cdc_entry ||
+                              jobs[0].mess.request == s_get_cdt_entry)) {
+            n_jobs = take_same_gets(jobs, serving);
+        }
+        pthread_cond_signal(&queue_not_full);
+        pthread_mutex_unlock(&queue_lock);
+
+        if (n_jobs > 1) process_gets(jobs, n_jobs);
+        else run_job(&jobs[0]);
+
+        // the clients' next requests may be queued behind these, waiting
+        // for us to finish
+        pthread_mutex_lock(&queue_lock);
+        for (j = 0; j < n_jobs; j++) {
+            serving[j] = 0;
+            for (i = 0; i < n_queued_jobs; i++) {
+                if (queued_jobs[i]->mess.client_pid ==
+                    jobs[j].mess.client_pid) {
+                    pthread_cond_signal(&queue_has_work);
+                    break;
+                }
+            }
+        }
+        if (queue_closed) pthread_cond_broadcast(&queue_has_work);
+        pthread_mutex_unlock(&queue_lock);
+    }
+    return(NULL);
+}
+
+
+/* The stats time the responses separately from the rest of a request, so
+ * process_command and the functions it calls send them through these,
+ * which keep count for the thread. A request failed if it couldn't be
+ * answered, or if it was answered with r_failure. */
+static __thread long send_ns = 0;
+static __thread long sent_ns = 0;         /* when the last send finished */
+static __thread int request_failed = 0;
 
-    if (!start_resp_to_client(resp)) {
+static int start_response(const message_db_t *resp_ptr)
+{
+    const long started = stats_now();
+    int ok;
+
+    // see "Client caches"
+    if (claim_clients) watch_claim(resp_ptr->client_pid);
+    ok = start_resp_to_client(resp_ptr);
+    if (!ok && claim_clients) watch_release();
+    send_ns += stats_now() - started;
+    if (!ok) request_failed = 1;
+    return(ok);
+}
+
+static int send_response(const message_db_t *resp_ptr)
+{
+    const long started = stats_now();
+    int ok = send_resp_to_client(resp_ptr);
+
+    sent_ns = stats_now();
+    send_ns += sent_ns - started;
+    if (!ok || resp_ptr->response == r_failure) request_failed = 1;
+    return(ok);
+}
+
+/* this always follows a send, so it is timed from the end of that */
+static void end_response(void)
+{
+    end_resp_to_client();
+    if (claim_clients) watch_release();
+    send_ns += stats_now() - sent_ns;
+}
+
+/* Answer several gets for the same entry (see "Coalescing gets") with one
+ * read, sending each client the same response process_command would have,
+ * which is made in its job. Those that have passed their deadlines are
+ * dropped before the read. In the stats, a client's send phase includes
+ * waiting for the responses to the clients before it. */
+static void process_gets(server_job *jobs, const int n_jobs)
+{
+    const long started = stats_now();
+    const message_db_t *first_ptr = &jobs[0].mess;
+    message_db_t *resp_ptr;
+    cdc_entry found_cdc;
+    cdt_entry found_cdt;
+    int dropped[MAX_COALESCED];
+    int n_dropped = 0;
+    long read_ns;
+    int i;
+
+    for (i = 0; i < n_jobs; i++) {
+        dropped[i] = drop_if_expired(&jobs[i]);
+        n_dropped += dropped[i];
+    }
+    if (n_dropped == n_jobs) return;
+
+    if (first_ptr->request == s_get_cdc_entry) {
+        found_cdc = get_cdc_entry(first_ptr->cdc_entry_data.catalog);
+    } else {
+        found_cdt = get_cdt_entry(first_ptr->cdt_entry_data.catalog,
+                                  first_ptr->cdt_entry_data.track_no);
+    }
+    read_ns = stats_now() - started;
+    stats_coalesced(n_jobs - n_dropped - 1);
+
+    for (i = 0; i < n_jobs; i++) {
+        if (dropped[i]) continue;
+        resp_ptr = &jobs[i].mess;
+        request_failed = 0;
+        if (!start_response(resp_ptr)) {
+            fprintf(stderr, "Server Warning:-\
+                 start_resp_to_client %d failed\n", resp_ptr->client_pid);
+        } else {
+            if (resp_ptr->request == s_get_cdc_entry) {
+                resp_ptr->cdc_entry_data = found_cdc;
+            } else {
+                resp_ptr->cdt_entry_data = found_cdt;
+            }
+            resp_ptr->response = r_success;
+            memset(resp_ptr->error_text, '\0', sizeof(resp_ptr->error_text));
+            sprintf(resp_ptr->error_text, "Command failed:\n\t%s\n",
+                    strerror(0));
+            if (!send_response(resp_ptr)) {
+                fprintf(stderr, "Server Warning:-\
+                     failed to respond to %d\n", resp_ptr->client_pid);
+            }
+            end_response();
+        }
+        stats_done(resp_ptr->request, request_failed,
+                   started - jobs[i].arrived_ns,
+                   read_ns, stats_now() - started - read_ns);
+    }
+}
+
+
+/* A request has just been read: note the time, for the stats, and sample
+ * the transport's backlog if it is due (see stats.h). */
+static void request_arrived(server_job *job_ptr)
+{
+    long backlog;
+    int in_bytes = 0;
+
+    job_ptr->arrived_ns = stats_now();
+    stats_arrived(job_ptr->mess.client_pid, job_ptr->arrived_ns);
+    if (stats_backlog_due(job_ptr->arrived_ns)) {
+        backlog = server_backlog(&in_bytes);
+        stats_backlog(backlog, in_bytes, job_ptr->arrived_ns);
+    }
+}
+
+
+/* Has the deadline of a job's request (see "Deadlines") passed? If so, it
+ * is dropped, and only counted in the stats. The deadline is the client's
+ * time of day, in ms. */
+static int drop_if_expired(const server_job *job_ptr)
+{
+    struct timespec now;
+
+    if (job_ptr->mess.deadline_ms == 0) return(0);
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec * 1000L + now.tv_nsec / 1000000 <
+        job_ptr->mess.deadline_ms) return(0);
+    stats_expired();
+    return(1);
+}
+
+/* run a request, unless it has passed its deadline, and record it in the
+ * stats. The response is made in the job's message. */
+static void run_job(server_job *job_ptr)
+{
+    const long started = stats_now();
+
+    if (drop_if_expired(job_ptr)) return;
+    send_ns = 0;
+    request_failed = 0;
+    process_command(&job_ptr->mess, &job_ptr->lag);
+    stats_done(job_ptr->mess.request, request_failed,
+               started - job_ptr->arrived_ns,
+               stats_now() - started - send_ns, send_ns);
+}
+
+
+/* accept a client message, do a switch based on the action requested,
+ * delegate database handling to functions in cd_dbm.c, turn the message
+ * into the response, and send it. lag_ptr is how far behind the primary a
+ * replica was when the request arrived.
+ *
+ * This may be running on several worker threads at once. */
+static void process_command(message_db_t *resp_ptr,
+                            const replica_status *lag_ptr)
+{
+    watch_notice notices[WATCH_MAX_NOTICES];
+    char needle[CAT_CAT_LEN + 1];    /* of a find: the matches overwrite it */
+    int n_notices = 0;
+    int first_time = 1;
+    int save_errno;
+    int is_write;
+
+    // a change's response waits until the clients caching what it changed
+    // have been told (see "Client caches")
+    is_write = is_write_request(resp_ptr);
+    if (!(is_write && watching) && !start_response(resp_ptr)) {
         fprintf(stderr, "Server Warning:-\
-                 start_resp_to_client %d failed\n", resp.client_pid);
+                 start_resp_to_client %d failed\n", resp_ptr->client_pid);
         return;
     }
 
     // return a message that has either a success or failure flag, and also
     // has data if the operation cals for it (e.g. get_cdc_entry).
-    resp.response = r_success;
-    memset(resp.error_text, '\0', sizeof(resp.error_text));
+    resp_ptr->response = r_success;
+    memset(resp_ptr->error_text, '\0', sizeof(resp_ptr->error_text));
     save_errno = 0;
 
-    switch(resp.request) {
+    // a replica's data belongs to the primary
+    if (replica_instance > 0 && is_write) {
+        resp_ptr->response = r_failure;
+        sprintf(resp_ptr->error_text, "Replica %d is read-only\n",
+                replica_instance);
+        if (!send_response(resp_ptr)) {
+            fprintf(stderr, "Server Warning:-\
+                 failed to respond to %d\n", resp_ptr->client_pid);
+        }
+        end_response();
+        return;
+    }
+
+    // changes are logged in the order they are made
+    if (is_write) changelog_lock();
+
+    switch(resp_ptr->request) {
         case s_create_new_database:
-            if (!database_initialize(1)) resp.response = r_failure;
+            if (!database_initialize(1)) resp_ptr->response = r_failure;
             break;
         case s_get_cdc_entry:
-            resp.cdc_entry_data = 
-                           get_cdc_entry(comm.cdc_entry_data.catalog);
+            resp_ptr->cdc_entry_data = 
+                           get_cdc_entry(resp_ptr->cdc_entry_data.catalog);
             break;
         case s_get_cdt_entry:
-            resp.cdt_entry_data = 
-                           get_cdt_entry(comm.cdt_entry_data.catalog, 
-                                         comm.cdt_entry_data.track_no);
+            resp_ptr->cdt_entry_data = 
+                           get_cdt_entry(resp_ptr->cdt_entry_data.catalog, 
+                                         resp_ptr->cdt_entry_data.track_no);
+            break;
+        case s_watch_cdc_entry:
+            // the watch has to be in place before the entry is read
+            if (!watching ||
+                !watch_entry(resp_ptr, &resp_ptr->cache_data.version)) {
+                resp_ptr->cache_data.slot = -1;
+            }
+            resp_ptr->cdc_entry_data =
+                           get_cdc_entry(resp_ptr->cdc_entry_data.catalog);
+            break;
+        case s_watch_cdt_entry:
+            if (!watching ||
+                !watch_entry(resp_ptr, &resp_ptr->cache_data.version)) {
+                resp_ptr->cache_data.slot = -1;
+            }
+            resp_ptr->cdt_entry_data =
+                           get_cdt_entry(resp_ptr->cdt_entry_data.catalog,
+                                         resp_ptr->cdt_entry_data.track_no);
             break;
         case s_add_cdc_entry:
-            if (!add_cdc_entry(comm.cdc_entry_data)) resp.response = 
+            if (!add_cdc_entry(resp_ptr->cdc_entry_data)) resp_ptr->response =
                            r_failure;
             break;
         case s_add_cdt_entry:
-            if (!add_cdt_entry(comm.cdt_entry_data)) resp.response = 
+            if (!add_cdt_entry(resp_ptr->cdt_entry_data)) resp_ptr->response =
                            r_failure;
             break;            
         case s_del_cdc_entry:
-            if (!del_cdc_entry(comm.cdc_entry_data.catalog)) resp.response
-                         = r_failure;
+            if (!del_cdc_entry(resp_ptr->cdc_entry_data.catalog)) {
+                resp_ptr->response = r_failure;
+            }
             break;            
         case s_del_cdt_entry:
-            if (!del_cdt_entry(comm.cdt_entry_data.catalog, 
-                 comm.cdt_entry_data.track_no)) resp.response = r_failure;
+            if (!del_cdt_entry(resp_ptr->cdt_entry_data.catalog,
+                 resp_ptr->cdt_entry_data.track_no)) {
+                resp_ptr->response = r_failure;
+            }
             break;
         case s_find_cdc_entry:
             // notice that unlike all the other commands, which handle request
@@ -154,35 +1088,300 @@ static void process_command(const message_db_t comm)
             // dump it in a temporary file, and then feed it to the ui one
             // at a time using the same api we use here. See the code in
             // clientif.c to better understand this.
+            //
+            // If the server was started with -p, we hand the whole search to
+            // the parallel scan instead. So do the workers, since the
+            // one-at-a-time search can only be used by one thread, and
+            // keeps its place in a catalog column that a worker process
+            // may reload between calls.
+            //
+            // A paged search (see search_cdc_page) sends one page, and says
+            // where the next one starts in the final response.
+            if (resp_ptr->page_data.limit > 0) {
+                if (!find_cdc_page(resp_ptr)) resp_ptr->response = r_failure;
+                else resp_ptr->response = r_find_no_more;
+                break;
+            }
+            if (scan_parallelism > 1 || n_workers > 1 || n_processes > 0) {
+                find_cdc_entries_parallel(resp_ptr);
+                resp_ptr->response = r_find_no_more;
+                break;
+            }
+            memcpy(needle, resp_ptr->cdc_entry_data.catalog, sizeof(needle));
             do {
-                resp.cdc_entry_data =
-                          search_cdc_entry(comm.cdc_entry_data.catalog,
-                                            &first_time);
-                if (resp.cdc_entry_data.catalog[0] != 0) {
-                    resp.response = r_success;
-                    if (!send_resp_to_client(resp)) {
+                resp_ptr->cdc_entry_data =
+                          search_cdc_entry(needle, &first_time);
+                if (resp_ptr->cdc_entry_data.catalog[0] != 0) {
+                    resp_ptr->response = r_success;
+                    if (!send_response(resp_ptr)) {
                         fprintf(stderr, "Server Warning:-\
-                            failed to respond to %d\n", resp.client_pid);
+                            failed to respond to %d\n", resp_ptr->client_pid);
                         break;
                     }
                 } else {
-                    resp.response = r_find_no_more;
+                    resp_ptr->response = r_find_no_more;
                 }
-            } while (resp.response == r_success);
+            } while (resp_ptr->response == r_success);
         break;
+        case s_query_cdc_entry:
+            // queries stream their matches back just like s_find_cdc_entry
+            if (!run_query(resp_ptr, 1)) resp_ptr->response = r_failure;
+            else resp_ptr->response = r_find_no_more;
+            break;
+        case s_explain_cdc_query:
+            // ... but an explain only sends back the plan
+            if (!run_query(resp_ptr, 0)) resp_ptr->response = r_failure;
+            break;
+        case s_aggregate:
+            // the summary rows are streamed back like search results
+            if (!run_aggregate(resp_ptr)) resp_ptr->response = r_failure;
+            else resp_ptr->response = r_find_no_more;
+            break;
+        case s_replica_status:
+            if (replica_instance > 0) {
+                resp_ptr->status_data = *lag_ptr;
+            } else {
+                changelog_lock();
+                changelog_status(&resp_ptr->status_data);
+                changelog_unlock();
+            }
+            break;
+        case s_stats:
+            stats_summary(&resp_ptr->stats_data);
+            break;
+        case s_batch:
+            // the ops report whether they worked in the batch itself, so
+            // the request only fails if the batch can't be run at all
+            if (resp_ptr->batch_data.n_ops < 0 ||
+                resp_ptr->batch_data.n_ops > BATCH_MAX_OPS) {
+                resp_ptr->response = r_failure;
+            } else {
+                (void)run_cdc_batch(&resp_ptr->batch_data);
+            }
+            break;
         default:
-            resp.response = r_failure;
+            resp_ptr->response = r_failure;
             break;
     } /* switch */
 
-    sprintf(resp.error_text, "Command failed:\n\t%s\n", 
+    // the clients caching what changed have to be told, even if logging
+    // the change fails
+    if (is_write && watching && resp_ptr->response == r_success) {
+        n_notices = watch_changed(resp_ptr, notices);
+    }
+
+    // the primary logs every change that worked, for the replicas. (For a
+    // batch, that is the ops that worked, which are in the response.)
+    if (resp_ptr->response == r_success && !changelog_append(resp_ptr)) {
+        resp_ptr->response = r_failure;
+    }
+    if (is_write) changelog_unlock();
+
+    if (is_write && watching) {
+        send_notices(notices, n_notices);
+        if (!start_response(resp_ptr)) {
+            fprintf(stderr, "Server Warning:-\
+                 start_resp_to_client %d failed\n", resp_ptr->client_pid);
+            return;
+        }
+    }
+
+    sprintf(resp_ptr->error_text, "Command failed:\n\t%s\n", 
              strerror(save_errno));
 
-    if (!send_resp_to_client(resp)) {
+    if (!send_response(resp_ptr)) {
         fprintf(stderr, "Server Warning:-\
-                 failed to respond to %d\n", resp.client_pid);
+                 failed to respond to %d\n", resp_ptr->client_pid);
     }
 
-    end_resp_to_client();
+    end_response();
     return;
 }
+
+
+/* Send notices (see cache_watch.h) to the clients watching entries that
+ * have changed. They aren't responses to anything, so they go straight to
+ * the transport rather than through start_response and the rest; in the
+ * stats, they are part of the time spent on the change. A notice that the
+ * transport has only queued (see cliserv.h) isn't sent until it reaches
+ * its client, so that the change isn't answered before then. */
+static void send_notices(const watch_notice *notices, const int n_notices)
+{
+    message_db_t notice;
+    pid_t queued[WATCH_MAX_NOTICES];
+    int n_queued = 0;
+    int sent;
+    int i;
+
+    memset(&notice, '\0', sizeof(notice));
+    notice.response = r_invalidated;
+    for (i = 0; i < n_notices; i++) {
+        notice.client_pid = notices[i].client_pid;
+        notice.request = notices[i].kind;
+        strcpy(notice.cdc_entry_data.catalog, notices[i].catalog);
+        strcpy(notice.cdt_entry_data.catalog, notices[i].catalog);
+        notice.cdt_entry_data.track_no = notices[i].track_no;
+        notice.cache_data.slot = notices[i].slot;
+        notice.cache_data.version = notices[i].version;
+
+        if (claim_clients) watch_claim(notice.client_pid);
+        sent = start_resp_to_client(&notice);
+        if (sent) {
+            sent = send_resp_to_client(&notice);
+            end_resp_to_client();
+        }
+        if (claim_clients) watch_release();
+        if (sent == RESP_QUEUED) {
+            queued[n_queued++] = notice.client_pid;
+        } else {
+            watch_notified(notice.client_pid, sent);
+        }
+    }
+    for (i = 0; i < n_queued; i++) {
+        watch_notified(queued[i], wait_resp_delivered(queued[i]));
+    }
+}
+
+
+/* When the server stops, tell the clients with watches to empty their
+ * caches (see "Client caches"). */
+static void drop_watches(void)
+{
+    watch_notice notices[WATCH_MAX_CLIENTS];
+
+    if (watching) send_notices(notices, watch_flush(notices));
+}
+
+
+/* Run a s_find_cdc_entry request using the parallel scan in cd_dbm.c, and
+ * send each match to the client in turn, just as the serial loop in
+ * process_command does. The caller sends the final r_find_no_more. */
+static void find_cdc_entries_parallel(message_db_t *resp_ptr)
+{
+    cdc_entry *matches;
+    int n_found = 0;
+    int i;
+
+    matches = search_cdc_entries(resp_ptr->cdc_entry_data.catalog,
+                                 scan_parallelism, &n_found);
+    resp_ptr->response = r_success;
+    for (i = 0; i < n_found; i++) {
+        resp_ptr->cdc_entry_data = matches[i];
+        if (!send_response(resp_ptr)) {
+            fprintf(stderr, "Server Warning:-\
+                failed to respond to %d\n", resp_ptr->client_pid);
+            break;
+        }
+    }
+    free(matches);
+}
+
+
+/* Run a paged s_find_cdc_entry request, sending its matches just as the
+ * serial search does, and leaving where the next page starts in
+ * resp_ptr->page_data for the final response. Returns 0 if the search
+ * could not be run. */
+static int find_cdc_page(message_db_t *resp_ptr)
+{
+    cdc_entry matches[PAGE_MAX];
+    int n_found;
+    int i;
+
+    n_found = search_cdc_page(resp_ptr->cdc_entry_data.catalog,
+                              &resp_ptr->page_data, matches);
+    if (n_found < 0) return(0);
+
+    resp_ptr->response = r_success;
+    for (i = 0; i < n_found; i++) {
+        resp_ptr->cdc_entry_data = matches[i];
+        if (!send_response(resp_ptr)) {
+            fprintf(stderr, "Server Warning:-\
+                failed to respond to %d\n", resp_ptr->client_pid);
+            break;
+        }
+    }
+    return(1);
+}
+
+
+/* Run a s_query_cdc_entry or s_explain_cdc_query request. The planning and
+ * filtering all happen in run_cdc_query (in cd_dbm.c); here we just send the
+ * matches to the client, if send_matches is true, and leave the plan in
+ * resp_ptr->plan_data for the final response. Returns 0 if the query could
+ * not be run. */
+static int run_query(message_db_t *resp_ptr, const int send_matches)
+{
+    cdc_entry *matches;
+    int n_found = 0;
+    int i;
+
+    matches = run_cdc_query(&resp_ptr->query_data, &resp_ptr->plan_data,
+                            &n_found);
+    if (!matches) return(0);
+
+    resp_ptr->response = r_success;
+    for (i = 0; send_matches && i < n_found; i++) {
+        resp_ptr->cdc_entry_data = matches[i];
+        if (!send_response(resp_ptr)) {
+            fprintf(stderr, "Server Warning:-\
+                failed to respond to %d\n", resp_ptr->client_pid);
+            break;
+        }
+    }
+    free(matches);
+    return(1);
+}
+
+
+/* Run a s_aggregate request. run_cdc_aggregate (in cd_dbm.c) does the
+ * counting; we send one response per summary row, and the caller sends the
+ * final r_find_no_more. Returns 0 if the aggregate could not be run. */
+static int run_aggregate(message_db_t *resp_ptr)
+{
+    cd_agg_row *rows;
+    int n_rows = 0;
+    int i;
+
+    rows = run_cdc_aggregate(&resp_ptr->aggregate_data, &n_rows);
+    if (!rows) return(0);
+
+    resp_ptr->response = r_success;
+    for (i = 0; i < n_rows; i++) {
+        resp_ptr->agg_row_data = rows[i];
+        if (!send_response(resp_ptr)) {
+            fprintf(stderr, "Server Warning:-\
+                failed to respond to %d\n", resp_ptr->client_pid);
+            break;
+        }
+    }
+    free(rows);
+    return(1);
+}
+
+
+/* does a request change the database? A batch does if any of its ops
+ * would. */
+static int is_write_request(const message_db_t *mess_ptr)
+{
+    int i;
+
+    switch(mess_ptr->request) {
+        case s_create_new_database:
+        case s_add_cdc_entry:
+        case s_add_cdt_entry:
+        case s_del_cdc_entry:
+        case s_del_cdt_entry:
+            return(1);
+        case s_batch:
+            for (i = 0; i < mess_ptr->batch_data.n_ops &&
+                        i < BATCH_MAX_OPS; i++) {
+                if (mess_ptr->batch_data.ops[i].op != batch_get_cdc &&
+                    mess_ptr->batch_data.ops[i].op != batch_get_cdt) {
+                    return(1);
+                }
+            }
+            return(0);
+        default:
+            return(0);
+    }
+}
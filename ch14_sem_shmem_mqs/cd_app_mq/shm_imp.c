@@ -0,0 +1,830 @@
+/* The cliserv.h api once more, this time over shared memory. Build it with
+ * make server_shm client_shm.
+ *
+ * The other transports copy every frame into the kernel and back out
+ * again, and make at least one system call per message each way. Here the
+ * server and its clients map one shared memory segment, and hand frames to
+ * each other through rings in it:
+ *   - one request ring, which every client writes to and the server (or its
+ *     worker processes, see server.c) reads from
+ *   - a response ring for each client, in a table of SHM_MAX_CLIENTS. A
+ *     client claims a free entry when it starts, and the server finds it by
+ *     the client's pid.
+ *
+ * The rings are bounded queues in which each slot carries a sequence number
+ * saying whose turn it is to use it: a writer claims the next slot by
+ * moving the ring's tail on with a compare-and-swap, copies its frame in,
+ * and then sets the slot's sequence to hand it to the readers, which claim
+ * slots from the head in the same way. Nobody takes a lock, and any number
+ * of threads or processes can write or read each ring.
+ *
+ * Nobody spins while idle, either. Each ring has a pair of event counters
+ * (see shm_event), one bumped when a frame is put in and one when a frame
+ * is taken out, and a reader that finds the ring empty (or a writer that
+ * finds it full) sleeps on the counter with a futex, after spinning for a
+ * moment if there is another CPU that could be about to give it something.
+ * A futex costs a system call only when somebody is actually asleep.
+ *
+ * The price of not locking is that a writer killed halfway through writing
+ * a frame (between claiming a slot and handing it over) leaves that slot
+ * claimed, and the readers can't get past it. So a writer puts its pid in
+ * the slot before it moves the tail on, and a reader that has been held up
+ * by the same slot for PEER_CHECK_MS looks to see if its writer is still
+ * there. If it isn't, the reader hands the slot over itself, empty, and
+ * the frame is dropped (see ring_reclaim). A writer that dies before moving
+ * the tail on leaves only its pid behind, which the next writer clears.
+ *
+ * The server only waits RESP_MAX_WAIT_MS for room in a client's response
+ * ring. A client that leaves it full for that long is evicted, as
+ * mqueue_imp.c evicts one that falls too far behind: its entry in the
+ * client table is marked as taken from it (with its pid negated, so that
+ * nobody else can claim the entry while it is still running), and from
+ * then on its reads and sends fail, as if the server had hung up on it.
+ *
+ * The segment can only be opened by the server's own user.
+ */
+
+#define _GNU_SOURCE
+
+#include "cd_data.h"
+#include "cliserv.h"
+#include "wire.h"
+
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SERVER_SHM  "/cd_shm"
+#define REPLICA_SHM "/cd_shm_%d"
+
+#define SHM_NAME_LEN 32
+#define SHM_MAGIC    0x43445348   /* "CDSH" */
+
+/* ring lengths must be powers of two */
+#define REQ_RING_LEN    64
+#define RESP_RING_LEN   16
+#define SHM_MAX_CLIENTS 64
+
+/* how long to sleep at a time while waiting on a peer that may have died */
+#define PEER_CHECK_MS   1000
+
+/* how long the server waits for room in a client's ring (see above) */
+#define RESP_MAX_WAIT_MS 1000
+
+/* how many times to look at a ring before sleeping, with another CPU */
+#define SPIN_TRIES      2000
+
+typedef struct {
+    unsigned int count;         /* the futex word */
+    unsigned int waiters;
+} shm_event;
+
+typedef struct {
+    unsigned int  seq;
+    pid_t         writer;       /* while claimed: 0 once a reader is done */
+    int           frame_len;
+    unsigned char frame[WIRE_MAX_FRAME];
+} ring_slot;
+
+/* the writer of a slot that a reader has handed over for it */
+#define RECLAIMED_WRITER ((pid_t)-1)
+
+/* head and tail are on cache lines of their own, as readers only move one
+ * and writers the other */
+typedef struct {
+    unsigned int head __attribute__((aligned(64)));
+    unsigned int tail __attribute__((aligned(64)));
+    shm_event    ready __attribute__((aligned(64)));
+    shm_event    space;
+} ring_ctl;
+
+typedef struct {
+    pid_t     owner;             /* 0 if free, -pid once evicted */
+    ring_ctl  ring;
+    ring_slot slots[RESP_RING_LEN];
+} client_area;
+
+typedef struct {
+    unsigned int magic;
+    pid_t        server_pid;
+    ring_ctl     requests;
+    ring_slot    request_slots[REQ_RING_LEN];
+    client_area  clients[SHM_MAX_CLIENTS];
+} shm_area;
+
+static char shm_name[SHM_NAME_LEN] = SERVER_SHM;
+static shm_area *area = NULL;
+static int spin_tries = 0;
+
+/* client side: our entry in the client table, which is ours while its
+ * owner is my_pid */
+static client_area *my_client = NULL;
+static pid_t my_pid = 0;
+
+/* server side: our pid, for the slots we claim. Worker processes (see
+ * server.c) are forked after server_starting, and note their own. */
+static pid_t server_self = 0;
+
+/* server side: the entry of the client each thread is answering */
+static __thread client_area *resp_client = NULL;
+static __thread pid_t resp_pid = 0;
+
+
+/* Either side:
+ *
+ * pick which server's segment to use. Instance 0 is the primary. */
+void set_server_instance(const int instance) {
+    if (instance == 0) strcpy(shm_name, SERVER_SHM);
+    else sprintf(shm_name, REPLICA_SHM, instance);
+}
+
+
+/* the futexes are in memory that several processes share, so we can't use
+ * the private versions */
+static int futex_wait(unsigned int *word, const unsigned int expected,
+                      const int timeout_ms) {
+    struct timespec timeout;
+
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    return(syscall(SYS_futex, word, FUTEX_WAIT, expected,
+                   timeout_ms < 0 ? NULL : &timeout, NULL, 0));
+}
+
+static void futex_wake_all(unsigned int *word) {
+    (void)syscall(SYS_futex, word, FUTEX_WAKE, 0x7fffffff, NULL, NULL, 0);
+}
+
+
+/* Something happened that a sleeper might be waiting for. The waiters
+ * count means we only make the system call if there is one. */
+static void event_signal(shm_event *event) {
+    __atomic_add_fetch(&event->count, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&event->waiters, __ATOMIC_SEQ_CST) != 0) {
+        futex_wake_all(&event->count);
+    }
+}
+
+/* Before sleeping on an event, a waiter says so, and takes the count. It
+ * must then look again at what it is waiting for, and only sleep if that
+ * still hasn't happened: anything that happens after this wakes it, or
+ * makes the futex wait return straight away. */
+static unsigned int event_prepare(shm_event *event) {
+    __atomic_add_fetch(&event->waiters, 1, __ATOMIC_SEQ_CST);
+    return(__atomic_load_n(&event->count, __ATOMIC_SEQ_CST));
+}
+
+/* and then sleeps until the count moves on from key, for up to timeout_ms.
+ * Returns -1 if a signal interrupted the sleep. */
+static int event_wait(shm_event *event, const unsigned int key,
+                      const int timeout_ms) {
+    int result = 0;
+
+    if (futex_wait(&event->count, key, timeout_ms) == -1 && errno == EINTR) {
+        result = -1;
+    }
+    __atomic_sub_fetch(&event->waiters, 1, __ATOMIC_SEQ_CST);
+    return(result);
+}
+
+static void event_cancel(shm_event *event) {
+    __atomic_sub_fetch(&event->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+
+static void ring_reset(ring_ctl *ring, ring_slot *slots,
+                       const unsigned int len) {
+    unsigned int i;
+
+    memset(ring, '\0', sizeof(*ring));
+    for (i = 0; i < len; i++) {
+        slots[i].seq = i;
+        slots[i].writer = 0;
+    }
+}
+
+static int peer_is_gone(const pid_t pid) {
+    return(pid > 0 && kill(pid, 0) == -1 && errno == ESRCH);
+}
+
+/* put a frame in the ring, if there is room, as process writer. Returns 1
+ * if there was. The slot is ours once we have put our pid in it and moved
+ * the tail past it. */
+static int ring_try_push(ring_ctl *ring, ring_slot *slots,
+                         const unsigned int len,
+                         const unsigned char *frame, const int frame_len,
+                         const pid_t writer) {
+    ring_slot *slot;
+    unsigned int pos;
+    pid_t owner;
+    int diff;
+
+    pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &slots[pos & (len - 1)];
+        diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            owner = 0;
+            if (!__atomic_compare_exchange_n(&slot->writer, &owner, writer,
+                                             0, __ATOMIC_SEQ_CST,
+                                             __ATOMIC_SEQ_CST)) {
+                // another writer is claiming it. One that died before
+                // moving the tail on can't have written anything.
+                if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == pos &&
+                    peer_is_gone(owner)) {
+                    (void)__atomic_compare_exchange_n(&slot->writer, &owner,
+                                                      0, 0, __ATOMIC_SEQ_CST,
+                                                      __ATOMIC_SEQ_CST);
+                }
+                pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 0,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_RELAXED)) break;
+            // the slot was already taken, and pos has been moved on
+            __atomic_store_n(&slot->writer, 0, __ATOMIC_SEQ_CST);
+        } else if (diff < 0) {
+            return(0);          /* the readers haven't finished with it */
+        } else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(slot->frame, frame, frame_len);
+    slot->frame_len = frame_len;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    event_signal(&ring->ready);
+    return(1);
+}
+
+/* take the oldest frame from the ring, if there is one. Returns 1 if there
+ * was. frame must have room for WIRE_MAX_FRAME bytes. */
+static int ring_try_pop(ring_ctl *ring, ring_slot *slots,
+                        const unsigned int len,
+                        unsigned char *frame, int *frame_len_ptr) {
+    ring_slot *slot;
+    unsigned int pos;
+    int diff;
+
+    pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &slots[pos & (len - 1)];
+        diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+                     (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 0,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            return(0);          /* nothing has been put there yet */
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    *frame_len_ptr = slot->frame_len;
+    if (*frame_len_ptr < 0 || *frame_len_ptr > WIRE_MAX_FRAME) {
+        *frame_len_ptr = 0;
+    }
+    memcpy(frame, slot->frame, *frame_len_ptr);
+    __atomic_store_n(&slot->writer, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&slot->seq, pos + len, __ATOMIC_RELEASE);
+    event_signal(&ring->space);
+    return(1);
+}
+
+/* If the slot at the head of the ring has been claimed by a writer that
+ * has since died, hand it over empty, so that the readers can get past
+ * it; the frame in it decodes as nothing. Only one reader gets to do it.
+ * Returns 1 if we did. */
+static int ring_reclaim(ring_ctl *ring, ring_slot *slots,
+                        const unsigned int len) {
+    unsigned int pos = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+    ring_slot *slot = &slots[pos & (len - 1)];
+    pid_t writer;
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != pos) return(0);
+    if ((int)(__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) - pos) <= 0) {
+        return(0);              /* nobody has claimed it yet */
+    }
+    writer = __atomic_load_n(&slot->writer, __ATOMIC_SEQ_CST);
+    if (!peer_is_gone(writer)) return(0);
+    if (!__atomic_compare_exchange_n(&slot->writer, &writer,
+                                     RECLAIMED_WRITER, 0, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_SEQ_CST)) return(0);
+    slot->frame_len = 0;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    event_signal(&ring->ready);
+    return(1);
+}
+
+/* could a push or pop go ahead now? For spinning on, without claiming
+ * anything. */
+static int ring_has_room(ring_ctl *ring, ring_slot *slots,
+                         const unsigned int len) {
+    unsigned int pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    return(__atomic_load_n(&slots[pos & (len - 1)].seq,
+                           __ATOMIC_ACQUIRE) == pos);
+}
+
+static int ring_has_frame(ring_ctl *ring, ring_slot *slots,
+                          const unsigned int len) {
+    unsigned int pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    return(__atomic_load_n(&slots[pos & (len - 1)].seq,
+                           __ATOMIC_ACQUIRE) == pos + 1);
+}
+
+
+static long now_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return(now.tv_sec * 1000L + now.tv_nsec / 1000000L);
+}
+
+/* Wait for a frame from the ring, for up to timeout_ms (-1 for ever), and
+ * take it. While we wait, we keep an eye on peer, the process that should
+ * be filling the ring (0 if there isn't just one), on the writer of the
+ * slot at the head, if we are held up there for PEER_CHECK_MS, and on
+ * *owner_ptr (if there is one), which must stay owner.
+ * Returns 1 if we took a frame, 0 if none came in time, and -1 if a signal
+ * interrupted us, the peer went away or *owner_ptr changed. */
+static int ring_pop_wait(ring_ctl *ring, ring_slot *slots,
+                         const unsigned int len, unsigned char *frame,
+                         int *frame_len_ptr, const int timeout_ms,
+                         const pid_t peer, const pid_t *owner_ptr,
+                         const pid_t owner) {
+    long give_up = timeout_ms < 0 ? 0 : now_ms() + timeout_ms;
+    long held_since = 0;
+    unsigned int held_at = 0;
+    unsigned int head;
+    long left;
+    unsigned int key;
+    int i;
+
+    for (;;) {
+        for (i = 0; i < spin_tries && !ring_has_frame(ring, slots, len); i++) ;
+        if (ring_try_pop(ring, slots, len, frame, frame_len_ptr)) return(1);
+
+        head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        if (held_since == 0 || head != held_at) {
+            held_at = head;
+            held_since = now_ms();
+        } else if (now_ms() - held_since >= PEER_CHECK_MS &&
+                   ring_reclaim(ring, slots, len)) {
+            continue;
+        }
+
+        left = PEER_CHECK_MS;
+        if (timeout_ms >= 0) {
+            left = give_up - now_ms();
+            if (left <= 0) return(0);
+            if (left > PEER_CHECK_MS) left = PEER_CHECK_MS;
+        }
+        key = event_prepare(&ring->ready);
+        if (owner_ptr &&
+            __atomic_load_n(owner_ptr, __ATOMIC_ACQUIRE) != owner) {
+            event_cancel(&ring->ready);
+            return(-1);
+        }
+        if (ring_has_frame(ring, slots, len)) {
+            event_cancel(&ring->ready);
+            continue;
+        }
+        if (event_wait(&ring->ready, key, left) == -1) return(-1);
+        if (peer_is_gone(peer) && !ring_has_frame(ring, slots, len)) {
+            return(-1);
+        }
+    }
+}
+
+/* Wait for room in the ring, for up to timeout_ms (-1 for as long as it
+ * takes), and put a frame in it, as process writer. Returns 1 if we did,
+ * and 0 if a signal interrupted us, the peer that should be emptying the
+ * ring went away, *owner_ptr (if there is one) stopped being the peer, or
+ * we ran out of time (when errno is ETIMEDOUT). */
+static int ring_push_wait(ring_ctl *ring, ring_slot *slots,
+                          const unsigned int len, const unsigned char *frame,
+                          const int frame_len, const pid_t writer,
+                          const pid_t peer, const pid_t *owner_ptr,
+                          const int timeout_ms) {
+    long give_up = timeout_ms < 0 ? 0 : now_ms() + timeout_ms;
+    long left;
+    unsigned int key;
+    int i;
+
+    for (;;) {
+        if (owner_ptr &&
+            __atomic_load_n(owner_ptr, __ATOMIC_ACQUIRE) != peer) return(0);
+        for (i = 0; i < spin_tries && !ring_has_room(ring, slots, len); i++) ;
+        if (ring_try_push(ring, slots, len, frame, frame_len, writer)) {
+            return(1);
+        }
+
+        left = PEER_CHECK_MS;
+        if (timeout_ms >= 0) {
+            left = give_up - now_ms();
+            if (left <= 0) {
+                errno = ETIMEDOUT;
+                return(0);
+            }
+            if (left > PEER_CHECK_MS) left = PEER_CHECK_MS;
+        }
+        key = event_prepare(&ring->space);
+        if (ring_has_room(ring, slots, len)) {
+            event_cancel(&ring->space);
+            continue;
+        }
+        if (event_wait(&ring->space, key, left) == -1) return(0);
+        if (peer_is_gone(peer)) return(0);
+    }
+}
+
+
+/* map the segment, which the server has already sized */
+static shm_area *map_area(const int shm_fd) {
+    void *mapped;
+
+    mapped = mmap(NULL, sizeof(shm_area), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, shm_fd, 0);
+    return(mapped == MAP_FAILED ? NULL : (shm_area *)mapped);
+}
+
+static void choose_spin_tries(void) {
+    spin_tries = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_TRIES : 0;
+}
+
+static void note_server_self(void) {
+    server_self = getpid();
+}
+
+
+/* server side:
+ *
+ * make a new segment, throwing away any left by a server that crashed, and
+ * set up its rings. */
+int server_starting(void) {
+    int shm_fd;
+    int i;
+    #if DEBUG_TRACE
+        printf("%d :- server_starting()\n",  getpid());
+    #endif
+
+    (void)shm_unlink(shm_name);
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (shm_fd == -1 || ftruncate(shm_fd, sizeof(shm_area)) == -1 ||
+        (area = map_area(shm_fd)) == NULL) {
+        fprintf(stderr, "Server startup error, no shared memory\n");
+        if (shm_fd != -1) close(shm_fd);
+        return(0);
+    }
+    close(shm_fd);
+
+    ring_reset(&area->requests, area->request_slots, REQ_RING_LEN);
+    for (i = 0; i < SHM_MAX_CLIENTS; i++) {
+        area->clients[i].owner = 0;
+        ring_reset(&area->clients[i].ring, area->clients[i].slots,
+                   RESP_RING_LEN);
+    }
+    area->server_pid = getpid();
+    note_server_self();
+    (void)pthread_atfork(NULL, NULL, note_server_self);
+    choose_spin_tries();
+    __atomic_store_n(&area->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    return(1);
+}
+
+
+/* server side:
+ *
+ * remove the segment. Clients still using it find out when they next wait
+ * for us. */
+void server_ending(void) {
+    #if DEBUG_TRACE
+        printf("%d :- server_ending()\n",  getpid());
+    #endif
+
+    if (area) {
+        area->magic = 0;
+        (void)munmap(area, sizeof(shm_area));
+    }
+    (void)shm_unlink(shm_name);
+    area = NULL;
+}
+
+
+/* server side:
+ *
+ * Handing the segment over (see cliserv.h). It keeps its name, and the
+ * requests in its ring, so there is nothing to tell the new server; we just
+ * unmap it without removing it. The new server maps it again as it is. The
+ * clients keep an eye on the server by its pid, which the new server
+ * shares with us. */
+int server_can_hand_off(void) {
+    return(1);
+}
+
+int server_handoff(const int state_fd) {
+    (void)munmap(area, sizeof(shm_area));
+    area = NULL;
+    return(1);
+}
+
+int server_take_over(const int state_fd) {
+    int shm_fd;
+
+    shm_fd = shm_open(shm_name, O_RDWR, 0);
+    if (shm_fd == -1 || (area = map_area(shm_fd)) == NULL ||
+        area->magic != SHM_MAGIC) {
+        fprintf(stderr, "Server startup error, could not take over shared "
+                "memory\n");
+        if (shm_fd != -1) close(shm_fd);
+        return(0);
+    }
+    close(shm_fd);
+    area->server_pid = getpid();
+    note_server_self();
+    (void)pthread_atfork(NULL, NULL, note_server_self);
+    choose_spin_tries();
+    return(1);
+}
+
+
+/* server side:
+ *
+ * any number of processes can read the request ring already. */
+int server_share_intake(void) {
+    return(1);
+}
+
+
+/* server side:
+ *
+ * wait for the next request. A frame that doesn't decode is dropped, and we
+ * wait for the next. */
+int read_request_from_client(message_db_t *rec_ptr) {
+    unsigned char frame[WIRE_MAX_FRAME];
+    int frame_len;
+    #if DEBUG_TRACE
+        printf("%d :- read_request_from_client()\n",  getpid());
+    #endif
+
+    do {
+        if (ring_pop_wait(&area->requests, area->request_slots, REQ_RING_LEN,
+                          frame, &frame_len, -1, 0, NULL, 0) != 1) {
+            return(0);
+        }
+    } while (!wire_decode(frame, frame_len, rec_ptr));
+    return(1);
+}
+
+
+/* server side:
+ *
+ * find the response ring of the client we are about to answer. */
+int start_resp_to_client(const message_db_t *mess_ptr) {
+    int i;
+    #if DEBUG_TRACE
+        printf("%d :- start_resp_to_client()\n",  getpid());
+    #endif
+
+    for (i = 0; i < SHM_MAX_CLIENTS; i++) {
+        if (__atomic_load_n(&area->clients[i].owner, __ATOMIC_ACQUIRE) ==
+            mess_ptr->client_pid) {
+            resp_client = &area->clients[i];
+            resp_pid = mess_ptr->client_pid;
+            return(1);
+        }
+    }
+    return(0);
+}
+
+
+/* take a client's entry from it (see the top of the file), and wake it if
+ * it is waiting on its ring, so that it finds out */
+static void evict_client(client_area *client, const pid_t client_pid) {
+    pid_t owner = client_pid;
+
+    if (__atomic_compare_exchange_n(&client->owner, &owner, -client_pid, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "Server Warning:- client %d is not reading its "
+                "responses, dropping it\n", client_pid);
+        event_signal(&client->ring.ready);
+    }
+}
+
+
+/* server side:
+ *
+ * send one response, waiting up to RESP_MAX_WAIT_MS for room in the
+ * client's ring, and evicting the client if there still isn't any. */
+int send_resp_to_client(const message_db_t *mess_ptr) {
+    unsigned char frame[WIRE_MAX_FRAME];
+    int frame_len;
+    #if DEBUG_TRACE
+        printf("%d :- send_resp_to_client()\n",  getpid());
+    #endif
+
+    if (!resp_client) return(0);
+    frame_len = wire_encode_response(mess_ptr, frame);
+    if (ring_push_wait(&resp_client->ring, resp_client->slots,
+                       RESP_RING_LEN, frame, frame_len, server_self,
+                       resp_pid, &resp_client->owner, RESP_MAX_WAIT_MS)) {
+        return(1);
+    }
+    if (errno == ETIMEDOUT) evict_client(resp_client, resp_pid);
+    return(0);
+}
+
+
+/* server side:
+ *
+ * done with this client, for now. */
+void end_resp_to_client(void) {
+    #if DEBUG_TRACE
+        printf("%d :- end_resp_to_client()\n",  getpid());
+    #endif
+
+    resp_client = NULL;
+    resp_pid = 0;
+}
+
+
+/* server side:
+ *
+ * a response waits for room in the client's ring, so there is nothing
+ * kept back to wait for. */
+int wait_resp_delivered(const pid_t client_pid) {
+    return(1);
+}
+
+
+/* server side:
+ *
+ * the slots of the request ring that writers have claimed and readers
+ * haven't yet taken, which costs no system call at all */
+long server_backlog(int *in_bytes_ptr) {
+    unsigned int head, tail;
+
+    if (!area) return(-1);
+    head = __atomic_load_n(&area->requests.head, __ATOMIC_RELAXED);
+    tail = __atomic_load_n(&area->requests.tail, __ATOMIC_RELAXED);
+    return((int)(tail - head) < 0 ? 0 : (long)(tail - head));
+}
+
+
+/* client side:
+ *
+ * map the server's segment, and claim an entry in its client table: a free
+ * one, or one whose owner (or evicted owner) has died without giving it
+ * back. A segment of the wrong size belongs to a server built with
+ * different ring lengths. */
+int client_starting(void) {
+    pid_t mypid = getpid();
+    struct stat shm_stat;
+    pid_t owner;
+    int shm_fd;
+    int i;
+    #if DEBUG_TRACE
+        printf("%d :- client_starting\n",  getpid());
+    #endif
+
+    shm_fd = shm_open(shm_name, O_RDWR, 0);
+    if (shm_fd == -1) return(0);
+    if (fstat(shm_fd, &shm_stat) == -1 ||
+        shm_stat.st_size != sizeof(shm_area)) {
+        close(shm_fd);
+        return(0);
+    }
+    area = map_area(shm_fd);
+    close(shm_fd);
+    if (!area) return(0);
+    if (__atomic_load_n(&area->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+        client_ending();
+        return(0);
+    }
+
+    for (i = 0; i < SHM_MAX_CLIENTS && !my_client; i++) {
+        owner = __atomic_load_n(&area->clients[i].owner, __ATOMIC_ACQUIRE);
+        if ((owner == 0 || owner == mypid || owner == -mypid ||
+             peer_is_gone(owner < 0 ? -owner : owner)) &&
+            __atomic_compare_exchange_n(&area->clients[i].owner, &owner,
+                                        mypid, 0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED)) {
+            my_client = &area->clients[i];
+        }
+    }
+    if (!my_client) {
+        fprintf(stderr, "Client error, the server has no room for us\n");
+        client_ending();
+        return(0);
+    }
+    // the server only answers once we have sent it something, so nobody
+    // else is using the ring while we empty it
+    ring_reset(&my_client->ring, my_client->slots, RESP_RING_LEN);
+    my_pid = mypid;
+    choose_spin_tries();
+    return(1);
+}
+
+
+/* client side:
+ *
+ * give back our entry in the client table, and unmap the segment. */
+void client_ending(void) {
+    #if DEBUG_TRACE
+        printf("%d :- client_ending()\n",  getpid());
+    #endif
+
+    if (my_client) {
+        __atomic_store_n(&my_client->owner, 0, __ATOMIC_RELEASE);
+    }
+    if (area) (void)munmap(area, sizeof(shm_area));
+    my_client = NULL;
+    area = NULL;
+}
+
+
+/* client side:
+ *
+ * put a request in the server's ring, waiting for room if it is full (until
+ * the request's deadline, if it has one). */
+int send_mess_to_server(message_db_t mess_to_send) {
+    unsigned char frame[WIRE_MAX_FRAME];
+    int frame_len;
+    #if DEBUG_TRACE
+        printf("%d :- send_mess_to_server()\n",  getpid());
+    #endif
+
+    if (!area || !my_client) return(0);
+    if (__atomic_load_n(&my_client->owner, __ATOMIC_ACQUIRE) != my_pid) {
+        fprintf(stderr, "Client error, the server has dropped us\n");
+        return(0);
+    }
+    frame_len = wire_encode_request(&mess_to_send, frame);
+    if (!ring_push_wait(&area->requests, area->request_slots, REQ_RING_LEN,
+                        frame, frame_len, my_pid, area->server_pid,
+                        NULL, wire_ms_until(mess_to_send.deadline_ms))) {
+        if (errno != ETIMEDOUT) fprintf(stderr, "Message send failed\n");
+        return(0);
+    }
+    return(1);
+}
+
+
+/* client side:
+ *
+ * wait for a response in our ring. */
+int read_resp_from_server(message_db_t *rec_ptr) {
+    return(poll_resp_from_server(rec_ptr, -1) == 1);
+}
+
+
+/* client side:
+ *
+ * the same, but giving up after timeout_ms. */
+int poll_resp_from_server(message_db_t *rec_ptr, const int timeout_ms) {
+    unsigned char frame[WIRE_MAX_FRAME];
+    int frame_len;
+    int result;
+    #if DEBUG_TRACE
+        printf("%d :- poll_resp_from_server()\n",  getpid());
+    #endif
+
+    if (!my_client) return(-1);
+    result = ring_pop_wait(&my_client->ring, my_client->slots, RESP_RING_LEN,
+                           frame, &frame_len, timeout_ms, area->server_pid,
+                           &my_client->owner, my_pid);
+    if (result != 1) return(result);
+    return(wire_decode(frame, frame_len, rec_ptr) ? 1 : -1);
+}
+
+/* client side:
+ *
+ * the ring is just memory, and the server wakes us with a futex, which
+ * nothing else can wait on */
+int resp_fd_from_server(void) {
+    return(-1);
+}
+
+
+/* client side:
+ *
+ * this isn't needed, but it lets us use the same api as for fifo */
+int start_resp_from_server(void)
+{
+    return(1);
+}
+
+/* client side:
+ *
+ * this isn't needed, but it lets us use the same api as for fifo */
+void end_resp_from_server(void)
+{
+}
@@ -0,0 +1,341 @@
+/*
+ * The server's statistics page. See stats.h for what is in it.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "cd_data.h"
+#include "cliserv.h"
+#include "stats.h"
+
+#define STATS_NAME_LEN 32
+
+static stats_page *page = NULL;
+static char page_name[STATS_NAME_LEN] = {'\0'};   /* empty if not shared */
+
+
+static void make_name(const int instance, char *name) {
+    if (instance == 0) strcpy(name, STATS_SHM);
+    else sprintf(name, REPLICA_STATS_SHM, instance);
+}
+
+long stats_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return(now.tv_sec * 1000000000L + now.tv_nsec);
+}
+
+
+/* Histograms
+ *
+ * Times under HIST_SUB ns have a bucket each. After that, a time whose top
+ * bit is bit n goes in one of the HIST_SUB buckets for bit n, picked by the
+ * HIST_SUB_BITS bits below its top one. */
+static int bucket_of(const unsigned long ns) {
+    int shift;
+
+    if (ns < HIST_SUB) return(ns);
+    shift = (int)(8 * sizeof(ns)) - 1 - __builtin_clzl(ns) - HIST_SUB_BITS;
+    if (shift > HIST_MAX_BITS - 1 - HIST_SUB_BITS) return(HIST_BUCKETS - 1);
+    return((shift + 1) * HIST_SUB + (int)(ns >> shift) - HIST_SUB);
+}
+
+/* the longest time that goes in a bucket */
+static long bucket_top(const int bucket) {
+    int shift;
+
+    if (bucket < HIST_SUB) return(bucket);
+    shift = bucket / HIST_SUB - 1;
+    return(((long)(HIST_SUB + bucket % HIST_SUB + 1) << shift) - 1);
+}
+
+static void add(unsigned long *counter_ptr, const unsigned long n) {
+    (void)__atomic_add_fetch(counter_ptr, n, __ATOMIC_RELAXED);
+}
+
+void stats_record_time(stats_histogram *hist_ptr, const long ns) {
+    unsigned long value = ns < 0 ? 0 : ns;
+    unsigned long max;
+
+    add(&hist_ptr->counts[bucket_of(value)], 1);
+    add(&hist_ptr->total_ns, value);
+    max = __atomic_load_n(&hist_ptr->max_ns, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&hist_ptr->max_ns, &max, value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+}
+
+/* the time below which per_mille thousandths of the counted times fall */
+static long percentile(const unsigned long *counts, const unsigned long n,
+                       const int per_mille) {
+    unsigned long wanted = (n * per_mille + 999) / 1000;
+    unsigned long passed = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        passed += counts[i];
+        if (passed >= wanted) return(bucket_top(i));
+    }
+    return(bucket_top(HIST_BUCKETS - 1));
+}
+
+static long at_most(const long value, const long limit) {
+    return(value < limit ? value : limit);
+}
+
+void stats_summarize_histogram(const stats_histogram *hist_ptr,
+                               const stats_histogram *since_ptr,
+                               latency_summary *summary_ptr) {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long n = 0;
+    long max;
+    int top = 0;
+    int i;
+
+    memset(summary_ptr, '\0', sizeof(*summary_ptr));
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        counts[i] = hist_ptr->counts[i] -
+                    (since_ptr ? since_ptr->counts[i] : 0);
+        n += counts[i];
+        if (counts[i] > 0) top = i;
+    }
+    summary_ptr->count = n;
+    if (n == 0) return;
+
+    // the exact maximum is only kept since the start
+    max = hist_ptr->max_ns;
+    if (since_ptr) max = at_most(bucket_top(top), max);
+    summary_ptr->mean_ns =
+        (hist_ptr->total_ns - (since_ptr ? since_ptr->total_ns : 0)) / n;
+    summary_ptr->p50_ns = at_most(percentile(counts, n, 500), max);
+    summary_ptr->p90_ns = at_most(percentile(counts, n, 900), max);
+    summary_ptr->p99_ns = at_most(percentile(counts, n, 990), max);
+    summary_ptr->p999_ns = at_most(percentile(counts, n, 999), max);
+    summary_ptr->max_ns = max;
+}
+
+
+/* Server side */
+int stats_open(const int instance) {
+    void *mapped = MAP_FAILED;
+    int fd;
+
+    make_name(instance, page_name);
+    (void)shm_unlink(page_name);
+    fd = shm_open(page_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd != -1) {
+        if (ftruncate(fd, sizeof(stats_page)) == 0) {
+            mapped = mmap(NULL, sizeof(stats_page), PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (mapped == MAP_FAILED) (void)shm_unlink(page_name);
+    }
+    if (mapped == MAP_FAILED) {
+        fprintf(stderr, "Server Warning:- no stats page for cd_stat\n");
+        page_name[0] = '\0';
+        mapped = mmap(NULL, sizeof(stats_page), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) return(0);
+    }
+
+    // the new page is all zeros. The magic number goes in last, so that
+    // cd_stat doesn't use the page before it is ready.
+    page = mapped;
+    page->version = STATS_VERSION;
+    page->server_pid = getpid();
+    page->started_ns = stats_now();
+    __atomic_store_n(&page->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    return(1);
+}
+
+int stats_take_over(const int instance) {
+    struct stat page_stat;
+    void *mapped = MAP_FAILED;
+    int fd;
+
+    make_name(instance, page_name);
+    fd = shm_open(page_name, O_RDWR, 0);
+    if (fd == -1) {
+        page_name[0] = '\0';
+        return(0);
+    }
+    if (fstat(fd, &page_stat) == 0 &&
+        page_stat.st_size == sizeof(stats_page)) {
+        mapped = mmap(NULL, sizeof(stats_page), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapped != MAP_FAILED &&
+        ((stats_page *)mapped)->magic == STATS_MAGIC &&
+        ((stats_page *)mapped)->version == STATS_VERSION &&
+        ((stats_page *)mapped)->server_pid == getpid()) {
+        page = mapped;
+        return(1);
+    }
+    if (mapped != MAP_FAILED) (void)munmap(mapped, sizeof(stats_page));
+    page_name[0] = '\0';
+    return(0);
+}
+
+void stats_close(void) {
+    if (page) (void)munmap(page, sizeof(stats_page));
+    if (page_name[0] != '\0') (void)shm_unlink(page_name);
+    page = NULL;
+    page_name[0] = '\0';
+}
+
+/* A client is looked for in ACTIVE_PROBES slots from the one its pid
+ * hashes to. If it isn't in any of them, it takes the first that is empty,
+ * or whose client hasn't been heard from for ACTIVE_SECS. Slots are only
+ * written once a second per client, so that the clients' slots don't bounce
+ * between CPUs on every request. */
+void stats_arrived(const pid_t client_pid, const long arrived_ns) {
+    const long second = (arrived_ns - page->started_ns) / 1000000000L;
+    const uint64_t entry = ((uint64_t)(uint32_t)client_pid << 32) |
+                           (uint32_t)second;
+    const unsigned int home = (uint32_t)client_pid * 2654435761U;
+    uint64_t *slot_ptr;
+    uint64_t old;
+    int probe;
+
+    (void)__atomic_add_fetch(&page->in_progress, 1, __ATOMIC_RELAXED);
+    for (probe = 0; probe < ACTIVE_PROBES; probe++) {
+        slot_ptr = &page->clients[(home + probe) & (ACTIVE_SLOTS - 1)];
+        old = __atomic_load_n(slot_ptr, __ATOMIC_RELAXED);
+        if ((uint32_t)(old >> 32) == (uint32_t)client_pid) {
+            if (old != entry) __atomic_store_n(slot_ptr, entry,
+                                               __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    for (probe = 0; probe < ACTIVE_PROBES; probe++) {
+        slot_ptr = &page->clients[(home + probe) & (ACTIVE_SLOTS - 1)];
+        old = __atomic_load_n(slot_ptr, __ATOMIC_RELAXED);
+        if ((old == 0 || second - (long)(uint32_t)old > ACTIVE_SECS) &&
+            __atomic_compare_exchange_n(slot_ptr, &old, entry, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+}
+
+void stats_done(const client_request_e request, const int failed,
+                const long queue_ns, const long storage_ns,
+                const long send_ns) {
+    (void)__atomic_sub_fetch(&page->in_progress, 1, __ATOMIC_RELAXED);
+    if (request >= 0 && request < s_request_kinds) {
+        add(&page->requests[request], 1);
+        if (failed) add(&page->failures[request], 1);
+    }
+    stats_record_time(&page->phases[phase_queue_wait], queue_ns);
+    stats_record_time(&page->phases[phase_storage], storage_ns);
+    stats_record_time(&page->phases[phase_send], send_ns);
+}
+
+void stats_expired(void) {
+    (void)__atomic_sub_fetch(&page->in_progress, 1, __ATOMIC_RELAXED);
+    add(&page->expired_dropped, 1);
+}
+
+void stats_queue_depth(const int depth) {
+    __atomic_store_n(&page->queue_depth, depth, __ATOMIC_RELAXED);
+}
+
+void stats_coalesced(const int n_gets) {
+    add(&page->gets_coalesced, n_gets);
+}
+
+int stats_backlog_due(const long now_ns) {
+    return(now_ns - __atomic_load_n(&page->backlog_sampled_ns,
+                                    __ATOMIC_RELAXED) >=
+           BACKLOG_SAMPLE_MS * 1000000L);
+}
+
+void stats_backlog(const long backlog, const int in_bytes, const long now_ns) {
+    __atomic_store_n(&page->transport_backlog, backlog, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->backlog_in_bytes, in_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->backlog_sampled_ns, now_ns, __ATOMIC_RELAXED);
+}
+
+void stats_summary(server_stats *stats_ptr) {
+    stats_summarize(page, NULL, stats_now(), stats_ptr);
+}
+
+
+/* cd_stat's side */
+const stats_page *stats_attach(const int instance) {
+    char name[STATS_NAME_LEN];
+    struct stat page_stat;
+    stats_page *mapped;
+    int fd;
+
+    make_name(instance, name);
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) return(NULL);
+    if (fstat(fd, &page_stat) == -1 ||
+        page_stat.st_size != sizeof(stats_page)) {
+        close(fd);
+        return(NULL);
+    }
+    mapped = mmap(NULL, sizeof(stats_page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return(NULL);
+    if (__atomic_load_n(&mapped->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+        mapped->version != STATS_VERSION) {
+        (void)munmap(mapped, sizeof(stats_page));
+        return(NULL);
+    }
+    return(mapped);
+}
+
+void stats_summarize(const stats_page *page_ptr, const stats_page *since,
+                     const long now_ns, server_stats *stats_ptr) {
+    const long second = (now_ns - page_ptr->started_ns) / 1000000000L;
+    uint64_t slot;
+    int i;
+
+    memset(stats_ptr, '\0', sizeof(*stats_ptr));
+    stats_ptr->uptime_ms = (now_ns - page_ptr->started_ns) / 1000000L;
+    for (i = 0; i < STATS_REQUEST_KINDS; i++) {
+        stats_ptr->requests[i] = page_ptr->requests[i] -
+                                 (since ? since->requests[i] : 0);
+        stats_ptr->failures[i] = page_ptr->failures[i] -
+                                 (since ? since->failures[i] : 0);
+    }
+    stats_ptr->gets_coalesced = page_ptr->gets_coalesced -
+                                (since ? since->gets_coalesced : 0);
+    stats_ptr->expired_dropped = page_ptr->expired_dropped -
+                                 (since ? since->expired_dropped : 0);
+    stats_ptr->in_progress = page_ptr->in_progress;
+    stats_ptr->queue_depth = page_ptr->queue_depth;
+    stats_ptr->transport_backlog = page_ptr->transport_backlog;
+    stats_ptr->backlog_in_bytes = page_ptr->backlog_in_bytes;
+    if (page_ptr->backlog_sampled_ns == 0) {
+        stats_ptr->transport_backlog = -1;
+    } else if (stats_ptr->in_progress == 0 &&
+               now_ns - page_ptr->backlog_sampled_ns >=
+               BACKLOG_IDLE_MS * 1000000L) {
+        stats_ptr->transport_backlog = 0;
+    }
+    for (i = 0; i < ACTIVE_SLOTS; i++) {
+        slot = page_ptr->clients[i];
+        if (slot != 0 && second - (long)(uint32_t)slot <= ACTIVE_SECS) {
+            stats_ptr->active_clients++;
+        }
+    }
+    for (i = 0; i < STATS_PHASES; i++) {
+        stats_summarize_histogram(&page_ptr->phases[i],
+                                  since ? &since->phases[i] : NULL,
+                                  &stats_ptr->latency[i]);
+    }
+}
@@ -0,0 +1,452 @@
+/* cd_loadgen: put a running server under a realistic load, and measure it.
+ *
+ *     cd_loadgen [-c clients] [-d secs | -n requests] [-r rate]
+ *                [-m get=80,add=10,del=5,find=5] [-k keys] [-s skew] [-C]
+ *                [-t timeout_ms] [-q]
+ *
+ * Each of the clients is a process of its own, with its own connection to
+ * the server, making requests one at a time. Each request is picked at
+ * random from the mix (the numbers are weights, not percentages) and is
+ * for one of the keys catalog entries, which are added first if they
+ * aren't there. With a skew of 0 every key is as likely as any other; with
+ * a skew of s the nth most popular key is picked in proportion to 1/n^s (a
+ * Zipf distribution; 0.99 is typical of caches). A find is a search for
+ * one key, so it costs the server a scan of the whole catalog.
+ *
+ * The clients stop after secs seconds (10 by default), or once each has
+ * made requests requests.
+ *
+ * Without -r, the load is closed loop: each client sends its next request
+ * as soon as the last one is answered, so the server sets the pace, and
+ * the latencies are just the round trips. With -r, the load is open loop:
+ * between them the clients start rate requests a second, evenly spaced,
+ * whether or not the server is keeping up. That is how real users behave,
+ * but a client that is still waiting for one answer can't send its next
+ * request on time. Timing each request from when it was actually sent
+ * would then leave out the time the ones behind it spent waiting to be
+ * sent, which is exactly when the server is slowest ("coordinated
+ * omission"). So with -r the latencies are also given as they would have
+ * been seen by a user who sent each request on schedule: timed from when
+ * the request should have been sent. If the two are far apart, the
+ * server can't take the rate.
+ *
+ * With -C, the clients cache the entries they get (see "Caching" in
+ * cd_data.h), and the results say how often the cache had the answer.
+ *
+ * With -t, each request is given up on after timeout_ms (see "Deadlines" in
+ * cd_data.h). Those that run out of time count as failed, and the results
+ * say how many did; cd_stat says how many of them the server dropped.
+ *
+ * A get or find that finds nothing, or a del of a key that isn't there,
+ * counts as failed. With dels in the mix, some of those are to be expected.
+ * The results say how the failures were spread over the clients, since a
+ * client whose connection to the server has broken fails everything it
+ * tries. The clients report their failures on stderr, as any client does
+ * (a del that misses says so too); -q keeps them quiet.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "cd_data.h"
+#include "cliserv.h"
+#include "stats.h"
+
+#define KEY_FORMAT  "lg_%07d"
+#define MAX_KEYS    10000000
+#define START_DELAY 200000000L   /* ns, for the clients to connect */
+
+typedef enum {
+    op_get = 0,
+    op_add,
+    op_del,
+    op_find,
+    N_OPS
+} op_e;
+
+static const char *op_names[N_OPS] = {"get", "add", "del", "find"};
+
+/* what the clients have done between them. They all add to the one copy,
+ * in shared memory. */
+typedef struct {
+    unsigned long   done[N_OPS];
+    unsigned long   failed[N_OPS];
+    stats_histogram service;     /* from sending to the answer */
+    stats_histogram corrected;   /* from when it should have been sent */
+    client_cache_stats cache;
+    long            expired;     /* ran out of time, with -t */
+    unsigned long   client_failed[];   /* by each client */
+} loadgen_results;
+
+static int n_clients = 1;
+static int duration = 10;
+static long per_client = 0;
+static double rate = 0.0;
+static int weights[N_OPS] = {80, 10, 5, 5};
+static int n_keys = 10000;
+static double skew = 0.0;
+static int caching = 0;
+static int timeout_ms = 0;
+static int quiet = 0;
+
+static double *key_cdf;           /* P(key rank <= i) */
+static loadgen_results *results;
+
+
+/* parse "get=80,add=10,..."; returns 0 if it makes no sense */
+static int parse_mix(char *mix) {
+    char *name;
+    int total = 0;
+    int op;
+
+    memset(weights, '\0', sizeof(weights));
+    for (name = strtok(mix, ","); name; name = strtok(NULL, ",")) {
+        for (op = 0; op < N_OPS; op++) {
+            if (strncmp(name, op_names[op], strlen(op_names[op])) == 0 &&
+                name[strlen(op_names[op])] == '=') break;
+        }
+        if (op == N_OPS) return(0);
+        weights[op] = atoi(strchr(name, '=') + 1);
+        if (weights[op] < 0) return(0);
+        total += weights[op];
+    }
+    return(total > 0);
+}
+
+/* Picking keys. The cumulative distribution is worked out once, before the
+ * clients are forked, and a key is picked by a binary search of it. */
+static int make_key_cdf(void) {
+    double total = 0.0;
+    int i;
+
+    key_cdf = malloc(n_keys * sizeof(double));
+    if (!key_cdf) return(0);
+    for (i = 0; i < n_keys; i++) {
+        total += skew > 0.0 ? 1.0 / pow(i + 1, skew) : 1.0;
+        key_cdf[i] = total;
+    }
+    for (i = 0; i < n_keys; i++) key_cdf[i] /= total;
+    return(1);
+}
+
+static int pick_key(unsigned short seed[3]) {
+    const double wanted = erand48(seed);
+    int low = 0;
+    int high = n_keys - 1;
+    int mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (key_cdf[mid] < wanted) low = mid + 1;
+        else high = mid;
+    }
+    return(low);
+}
+
+static op_e pick_op(unsigned short seed[3]) {
+    int total = 0;
+    int wanted;
+    int op;
+
+    for (op = 0; op < N_OPS; op++) total += weights[op];
+    wanted = (int)(erand48(seed) * total);
+    for (op = 0; op < N_OPS - 1; op++) {
+        if (wanted < weights[op]) break;
+        wanted -= weights[op];
+    }
+    return(op);
+}
+
+static void make_entry(const int key, cdc_entry *entry_ptr) {
+    memset(entry_ptr, '\0', sizeof(*entry_ptr));
+    sprintf(entry_ptr->catalog, KEY_FORMAT, key);
+    strcpy(entry_ptr->title, "cd_loadgen");
+    strcpy(entry_ptr->type, "load");
+    strcpy(entry_ptr->artist, "cd_loadgen");
+}
+
+/* make sure all the keys are there to start with */
+static int add_keys(void) {
+    cdc_entry entry;
+    int i;
+
+    make_entry(n_keys - 1, &entry);
+    if (get_cdc_entry(entry.catalog).catalog[0] != '\0') return(1);
+    for (i = 0; i < n_keys; i++) {
+        make_entry(i, &entry);
+        if (!add_cdc_entry(entry)) return(0);
+    }
+    return(1);
+}
+
+/* run one request; returns 0 if it failed */
+static int run_request(const op_e op, const int key) {
+    cdc_entry entry;
+    int first_call = 1;
+    int found = 0;
+
+    make_entry(key, &entry);
+    switch(op) {
+        case op_get:
+            return(get_cdc_entry(entry.catalog).catalog[0] != '\0');
+        case op_add:
+            return(add_cdc_entry(entry));
+        case op_del:
+            return(del_cdc_entry(entry.catalog));
+        default:
+            while (search_cdc_entry(entry.catalog, &first_call).catalog[0]) {
+                found++;
+            }
+            return(found > 0);
+    }
+}
+
+
+/* sleep until ns, on the clock of stats_now */
+static void sleep_until(const long ns) {
+    struct timespec until;
+
+    until.tv_sec = ns / 1000000000L;
+    until.tv_nsec = ns % 1000000000L;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until,
+                           NULL) == EINTR) ;
+}
+
+static void add(unsigned long *counter_ptr) {
+    (void)__atomic_add_fetch(counter_ptr, 1, __ATOMIC_RELAXED);
+}
+
+static void add_n(long *counter_ptr, const long n) {
+    (void)__atomic_add_fetch(counter_ptr, n, __ATOMIC_RELAXED);
+}
+
+/* One client. Its schedule (if it has one) starts at start_ns, offset from
+ * the other clients' so that they don't all send at once. */
+static void run_client(const int client_no, const long start_ns,
+                       const long end_ns) {
+    const long interval = rate > 0.0 ? (long)(n_clients * 1e9 / rate) : 0;
+    client_cache_stats cache_stats;
+    unsigned short seed[3];
+    long intended;
+    long sent;
+    long done;
+    long i;
+    op_e op;
+
+    seed[0] = getpid();
+    seed[1] = getpid() >> 16;
+    seed[2] = client_no;
+    if (!database_initialize(0)) {
+        fprintf(stderr, "cd_loadgen: client %d can not reach the server\n",
+                client_no);
+        exit(EXIT_FAILURE);
+    }
+    // clientif.c reports every failed request on stderr, misses and all.
+    // Linux also lets a sleep run up to 50us late by default, which would
+    // all count against the server.
+    if (quiet) (void)freopen("/dev/null", "w", stderr);
+    (void)prctl(PR_SET_TIMERSLACK, 1);
+    set_client_cache(caching);
+    set_request_timeout(timeout_ms);
+    sleep_until(start_ns);
+    intended = start_ns + interval * client_no / n_clients;
+    for (i = 0; per_client == 0 || i < per_client; i++) {
+        if (interval > 0) {
+            sleep_until(intended);
+            sent = stats_now();
+        } else {
+            sent = intended = stats_now();
+        }
+        if (per_client == 0 && intended >= end_ns) break;
+        op = pick_op(seed);
+        if (!run_request(op, pick_key(seed))) {
+            add(&results->failed[op]);
+            add(&results->client_failed[client_no]);
+        }
+        done = stats_now();
+        add(&results->done[op]);
+        stats_record_time(&results->service, done - sent);
+        stats_record_time(&results->corrected, done - intended);
+        intended += interval;
+    }
+    get_client_cache_stats(&cache_stats);
+    add_n(&results->cache.hits, cache_stats.hits);
+    add_n(&results->cache.misses, cache_stats.misses);
+    add_n(&results->cache.invalidations, cache_stats.invalidations);
+    add_n(&results->expired, requests_expired());
+    database_close();
+    exit(EXIT_SUCCESS);
+}
+
+
+static double us(const long ns) {
+    return(ns / 1000.0);
+}
+
+static void print_latency(const char *title,
+                          const stats_histogram *hist_ptr) {
+    latency_summary latency;
+
+    stats_summarize_histogram(hist_ptr, NULL, &latency);
+    printf("%-14s %10ld %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", title,
+           latency.count, us(latency.mean_ns), us(latency.p50_ns),
+           us(latency.p90_ns), us(latency.p99_ns), us(latency.p999_ns),
+           us(latency.max_ns));
+}
+
+static void print_results(const double secs) {
+    unsigned long requests = 0;
+    unsigned long failures = 0;
+    int most = 0;
+    int least = 0;
+    int op;
+    int i;
+
+    for (op = 0; op < N_OPS; op++) {
+        requests += results->done[op];
+        failures += results->failed[op];
+    }
+    for (i = 1; i < n_clients; i++) {
+        if (results->client_failed[i] > results->client_failed[most]) {
+            most = i;
+        }
+        if (results->client_failed[i] < results->client_failed[least]) {
+            least = i;
+        }
+    }
+    printf("%d clients, ", n_clients);
+    if (rate > 0.0) printf("open loop at %.0f requests/s", rate);
+    else printf("closed loop");
+    printf(", %d keys, skew %.2f\n", n_keys, skew);
+    printf("%lu requests in %.3f s: %.0f requests/s, %lu failed\n",
+           requests, secs, requests / secs, failures);
+    if (rate > 0.0 && requests / secs < 0.99 * rate) {
+        printf("which is behind the rate asked for: the server can't keep "
+               "up with it\n");
+    }
+
+    printf("\n%-14s %10s %10s\n", "request", "count", "failed");
+    for (op = 0; op < N_OPS; op++) {
+        if (weights[op] == 0) continue;
+        printf("%-14s %10lu %10lu\n", op_names[op], results->done[op],
+               results->failed[op]);
+    }
+    if (n_clients > 1) {
+        printf("failed by one client: %lu to %lu (client %d)\n",
+               results->client_failed[least], results->client_failed[most],
+               most);
+    }
+    if (caching) {
+        printf("\nclient cache: %ld hits, %ld misses (%.1f%% hit), "
+               "%ld invalidations\n", results->cache.hits,
+               results->cache.misses,
+               100.0 * results->cache.hits /
+               (results->cache.hits + results->cache.misses > 0 ?
+                results->cache.hits + results->cache.misses : 1),
+               results->cache.invalidations);
+    }
+    if (timeout_ms > 0) {
+        printf("\n%ld requests ran out of time (timeout %d ms)\n",
+               results->expired, timeout_ms);
+    }
+
+    printf("\n%-14s %10s %9s %9s %9s %9s %9s %9s\n", "latency (us)", "count",
+           "mean", "p50", "p90", "p99", "p99.9", "max");
+    print_latency("service", &results->service);
+    if (rate > 0.0) print_latency("corrected", &results->corrected);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-c clients] [-d secs | -n requests] "
+            "[-r rate]\n\t[-m get=80,add=10,del=5,find=5] [-k keys] "
+            "[-s skew] [-C] [-t timeout_ms] [-q]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    pid_t *client_pids;
+    long start_ns;
+    long end_ns;
+    int status;
+    int failed = 0;
+    int c;
+    int i;
+
+    while ((c = getopt(argc, argv, "c:d:n:r:m:k:s:Ct:q")) != -1) {
+        switch(c) {
+            case 'c':
+                n_clients = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'n':
+                per_client = atol(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'm':
+                if (!parse_mix(optarg)) usage(argv[0]);
+                break;
+            case 'k':
+                n_keys = atoi(optarg);
+                break;
+            case 's':
+                skew = atof(optarg);
+                break;
+            case 'C':
+                caching = 1;
+                break;
+            case 't':
+                timeout_ms = atoi(optarg);
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (n_clients < 1 || duration < 1 || per_client < 0 || rate < 0.0 ||
+        n_keys < 1 || n_keys > MAX_KEYS || skew < 0.0 ||
+        timeout_ms < 0) usage(argv[0]);
+
+    client_pids = calloc(n_clients, sizeof(pid_t));
+    results = mmap(NULL, sizeof(*results) +
+                   n_clients * sizeof(results->client_failed[0]),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (!client_pids || results == MAP_FAILED || !make_key_cdf()) {
+        fprintf(stderr, "cd_loadgen: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!database_initialize(0) || !add_keys()) {
+        fprintf(stderr, "cd_loadgen: can not reach the server\n");
+        exit(EXIT_FAILURE);
+    }
+    database_close();
+
+    start_ns = stats_now() + START_DELAY;
+    end_ns = start_ns + duration * 1000000000L;
+    for (i = 0; i < n_clients; i++) {
+        client_pids[i] = fork();
+        if (client_pids[i] == 0) run_client(i, start_ns, end_ns);
+    }
+    for (i = 0; i < n_clients; i++) {
+        if (waitpid(client_pids[i], &status, 0) == -1 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+    }
+
+    print_results((stats_now() - start_ns) / 1e9);
+    if (failed) printf("%d clients could not finish\n", failed);
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,60 @@
+/* The change log
+ *
+ * The primary server appends a record to the change log for every add,
+ * delete or database reset that succeeds. Replica servers (started with -r)
+ * keep their own copy of the database, which they build by replaying the
+ * log from the start, and then keep up to date by applying new records as
+ * they appear. Clients can send read-only requests to any replica.
+ *
+ * The log is a plain file of fixed-size records, so a record's sequence
+ * number is also its position in the file. It is only ever appended to; a
+ * database reset is logged like any other change, so replaying the whole
+ * log always ends up with the primary's data.
+ *
+ * Include this after cd_data.h and cliserv.h.
+ */
+
+#define CHANGE_LOG "/tmp/cd_change_log"
+
+typedef struct {
+    long              sequence;
+    long long         logged_ms;   /* when, in ms since the epoch */
+    client_request_e  request;     /* one of the add_, del_ or create ones */
+    cdc_entry         cdc_entry_data;
+    cdt_entry         cdt_entry_data;
+} change_record;
+
+/* Primary side:
+ *
+ * Open the log for appending. If the log is new, the current contents of
+ * the database are logged first, so that replicas can start from the log
+ * alone. If new_database is set, the database was
+ * just reset, and we log that. Returns 0 for error, 1 for success. */
+int changelog_open_primary(const char *log_name, const int new_database);
+
+/* Log a request that changed the database, if it is one that does. For a
+ * batch, pass the response, which says which of the ops worked. Returns 0 if
+ * the log could not be written. */
+int changelog_append(const message_db_t *mess_ptr);
+
+/* The changes must go into the log in the same order as they were made to
+ * the database, so hold this lock from making a change until it is logged.
+ * It works across all the threads and processes of the primary server. */
+void changelog_lock(void);
+void changelog_unlock(void);
+
+/* Replica side:
+ *
+ * Open the log for reading. The replica's own database should be empty;
+ * the first changelog_apply call replays the whole log into it. */
+int changelog_open_replica(const char *log_name);
+
+/* Apply any new records in the log to the database. Before doing so, fill
+ * in *status_ptr (if it isn't NULL) with how far behind we were. Returns 0
+ * if a record could not be applied. */
+int changelog_apply(replica_status *status_ptr);
+
+/* Either side: fill in the current status. */
+void changelog_status(replica_status *status_ptr);
+
+void changelog_close(void);
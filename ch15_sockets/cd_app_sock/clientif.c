@@ -0,0 +1,1389 @@
+/* The file starts with #include files and constants. */
+
+#define _POSIX_SOURCE
+#define _GNU_SOURCE     /* for memfd_create */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "cd_data.h"
+#include "cliserv.h"
+
+/* This is the client-side proxy to the data api. It forwards all operations
+ * over the server socket to server.c, which in turn hands them off to the server
+ * side data api. And it gets responses
+ *
+ * All of the low-level socket communication is done via calls to functions
+ * in sock_imp.c
+ */
+
+/* storing mypid in a static var reduces the number of calls to getpid().  */
+static pid_t mypid;
+
+/* Every request we send gets the next request id, and the server puts the
+ * id in its responses, so we can tell which request a response answers.
+ * Usually that is the one we just sent, but if there are pipelined requests
+ * waiting, their responses can come first.
+ *
+ * Each pipelined request has a slot, where its response is kept if it turns
+ * up while we are reading something else. */
+typedef enum {
+    slot_free = 0,
+    slot_sent,
+    slot_answered
+} slot_state_e;
+
+typedef struct {
+    slot_state_e state;
+    unsigned int request_id;
+    long         deadline_ms;
+    message_db_t response;
+} pipeline_slot;
+
+static unsigned int last_request_id = 0;
+static pipeline_slot pipeline[PIPELINE_WINDOW];
+
+/* An async call has a slot too, which keeps its callback until its answer
+ * comes, and then the answer until cd_client_run_once hands it over. */
+typedef struct {
+    slot_state_e   state;
+    unsigned int   request_id;
+    long           deadline_ms;
+    async_callback callback;
+    void          *user_data;
+    async_result   result;
+} async_slot;
+
+static async_slot async_calls[ASYNC_WINDOW];
+static int n_async = 0;             /* slots in use */
+static int n_async_answered = 0;
+static int running_callbacks = 0;
+
+/* Searches and queries hand back their matches one at a time, as the server
+ * sends them, through a result stream. So that the server isn't left
+ * waiting for us to take matches the caller hasn't asked for yet, each call
+ * also takes any others that have already arrived, and keeps them in the
+ * stream until they are asked for.
+ *
+ * Up to STREAM_MEM_ENTRIES matches are kept in memory. Beyond that, they
+ * spill over to a memfd, which the kernel can page out if it has to. The
+ * memory is used first, and spilling only starts when it is full, so the
+ * matches come back out in the order they went in. */
+#define STREAM_MEM_ENTRIES 256
+
+typedef struct {
+    unsigned int request_id;    /* 0 if there is no search running */
+    int          finished;      /* the server has sent its last match */
+    cdc_entry    mem[STREAM_MEM_ENTRIES];
+    int          mem_first;     /* mem is used as a ring */
+    int          mem_count;
+    int          spill_fd;      /* -1 until we need it */
+    off_t        spill_read;
+    off_t        spill_write;
+    long         deadline_ms;   /* for the next match to arrive */
+} result_stream;
+
+static result_stream search_results = {0, 1, {{{0}}}, 0, 0, -1, 0, 0, 0};
+static result_stream query_results = {0, 1, {{{0}}}, 0, 0, -1, 0, 0, 0};
+
+/* With caching on (see "Caching" in cd_data.h), each key has the one slot
+ * of the cache it hashes to, and the server watches what we have in each
+ * slot (see cache_watch.h). Before we look in the cache, we take in any
+ * notices the server has sent about entries that have changed.
+ *
+ * An entry that is already on its way to us when a notice about it is sent
+ * mustn't go in either, so we keep the version of the last notice for each
+ * slot, and of the last one for all of them, and only keep entries whose
+ * watches are at least that new (see cache_put).
+ *
+ * There can't be any notices until the server has watched something for
+ * us, and until then there may be nothing to read them from (our fifo,
+ * say, isn't opened until the first response), so we don't look. */
+typedef struct {
+    int              used;
+    client_request_e kind;        /* s_watch_cdc_entry or s_watch_cdt_entry */
+    char             catalog[CAT_CAT_LEN + 1];
+    int              track_no;
+    long             version;
+    cdc_entry        cdc_entry_data;
+    cdt_entry        cdt_entry_data;
+} cache_entry;
+
+static int caching = 0;
+static cache_entry cache[CACHE_SLOTS];
+static long notice_versions[CACHE_SLOTS];
+static long flush_version = 0;
+static int watched = 0;
+static client_cache_stats cache_stats;
+
+/* With a request timeout (see "Deadlines" in cd_data.h), send_request puts
+ * a deadline in each request, on the wall clock since the server may be on
+ * another machine, and the waits for answers end there. */
+static int request_timeout_ms = 0;  /* 0 for none */
+static long n_expired = 0;
+
+/* these are the only functions used here not declared in cliserv.h */
+static int send_request(message_db_t *mess_ptr);
+static long now_ms(void);
+static long deadline_from_now(void);
+static int wait_resp(message_db_t *rec_ptr, const long deadline_ms);
+static int read_resp_for(const unsigned int request_id,
+                         const long deadline_ms, message_db_t *rec_ptr);
+static int read_one_response(const unsigned int request_id,
+                             const long deadline_ms, message_db_t *rec_ptr);
+static void file_response(const message_db_t *rec_ptr);
+static cdc_entry next_match(result_stream *stream, const message_db_t mess_send,
+                            int *first_call_ptr);
+static void stream_start(result_stream *stream,
+                         const unsigned int request_id);
+static int stream_has_room(result_stream *stream);
+static void stream_put(result_stream *stream, const message_db_t *rec_ptr);
+static int stream_take(result_stream *stream, cdc_entry *entry_ptr);
+static unsigned int pipeline_send(message_db_t mess_send);
+static pipeline_slot *find_slot(const unsigned int request_id);
+static unsigned int async_send(message_db_t mess_send, async_callback callback,
+                               void *user_data);
+static async_slot *find_async(const unsigned int request_id);
+static int async_wait_ms(const int timeout_ms);
+static void expire_async(void);
+static int take_responses(const int timeout_ms);
+static int cache_get(message_db_t *mess_ptr, message_db_t *rec_ptr);
+static void cache_put(const message_db_t *mess_ptr,
+                      const message_db_t *rec_ptr);
+static void cache_empty(void);
+static void take_notices(void);
+static void file_notice(const message_db_t *rec_ptr);
+
+/* database_initialize on the client side connects to the server */
+int database_initialize(const int new_database) {
+    const char *instance = getenv("CD_SERVER_INSTANCE");
+    const char *cache_on = getenv("CD_CLIENT_CACHE");
+    const char *timeout = getenv("CD_REQUEST_TIMEOUT");
+
+    // read-only clients can talk to a replica by setting CD_SERVER_INSTANCE
+    if (instance) set_server_instance(atoi(instance));
+    if (!client_starting()) return(0);
+    mypid = getpid();
+    memset(pipeline, '\0', sizeof(pipeline));
+    set_client_cache(cache_on && strcmp(cache_on, "0") != 0);
+    set_request_timeout(timeout ? atoi(timeout) : 0);
+    return(1);
+    
+}
+
+/* database_close on the client side closes the connection */
+void database_close(void) {
+    stream_start(&search_results, 0);
+    stream_start(&query_results, 0);
+    if (search_results.spill_fd != -1) close(search_results.spill_fd);
+    if (query_results.spill_fd != -1) close(query_results.spill_fd);
+    search_results.spill_fd = query_results.spill_fd = -1;
+    cache_empty();
+    memset(async_calls, '\0', sizeof(async_calls));
+    n_async = n_async_answered = 0;
+    client_ending();
+}
+
+/*  pack up the cd_catalog_ptr into a message, along with an enum telling
+ *  the server which function we called, then send it and read response */
+cdc_entry get_cdc_entry(const char *cd_catalog_ptr)
+{
+    cdc_entry ret_val;
+    message_db_t mess_send;
+    message_db_t mess_ret;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    ret_val.catalog[0] = '\0';
+    mess_send.client_pid = mypid;
+    mess_send.request = s_get_cdc_entry;
+    strcpy(mess_send.cdc_entry_data.catalog, cd_catalog_ptr);
+
+    if (caching && cache_get(&mess_send, &mess_ret)) {
+        return(mess_ret.cdc_entry_data);
+    }
+
+    if (send_request(&mess_send)) {
+        if (read_one_response(mess_send.request_id, mess_send.deadline_ms,
+                              &mess_ret)) {
+            if (mess_ret.response == r_success) {
+                if (caching) cache_put(&mess_send, &mess_ret);
+                ret_val = mess_ret.cdc_entry_data;
+            } else {
+                fprintf(stderr, "%s", mess_ret.error_text);
+            }
+        } else {
+            fprintf(stderr, "Server failed to respond\n");
+        }
+    } else {
+        fprintf(stderr, "Server not accepting requests\n");
+    }
+    return(ret_val);
+}
+
+
+/* send a request to the server, after giving it the next request id and
+ * its deadline (which are left in *mess_ptr). Returns 0 if the send fails
+ * or runs out of time, else 1. */
+static int send_request(message_db_t *mess_ptr) {
+    mess_ptr->client_pid = mypid;
+    mess_ptr->request_id = ++last_request_id;
+    if (last_request_id == 0) mess_ptr->request_id = ++last_request_id;
+    mess_ptr->deadline_ms = deadline_from_now();
+    if (send_mess_to_server(*mess_ptr)) return(1);
+    if (errno == ETIMEDOUT) n_expired++;
+    else cache_empty();
+    return(0);
+}
+
+/* the wall clock, in ms */
+static long now_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return(now.tv_sec * 1000L + now.tv_nsec / 1000000);
+}
+
+/* the deadline for a request sent now, or 0 if there is no timeout */
+static long deadline_from_now(void) {
+    if (request_timeout_ms <= 0) return(0);
+    return(now_ms() + request_timeout_ms);
+}
+
+/* read the next response, waiting no later than deadline_ms, unless that is
+ * 0. Returns 1 if it read one, 0 if the deadline came first, and -1 if the
+ * read failed. */
+static int wait_resp(message_db_t *rec_ptr, const long deadline_ms) {
+    long left_ms;
+
+    if (deadline_ms == 0) return(read_resp_from_server(rec_ptr) ? 1 : -1);
+    left_ms = deadline_ms - now_ms();
+    if (left_ms < 0) left_ms = 0;
+    if (left_ms > INT_MAX) left_ms = INT_MAX;
+    return(poll_resp_from_server(rec_ptr, (int)left_ms));
+}
+
+/* read the next response to request_id, giving up at deadline_ms (see
+ * wait_resp). Responses to other requests that arrive first are filed away
+ * by file_response. A request that runs out of time says nothing about the
+ * server's other answers, so the cache is only emptied if the read fails.
+ *
+ * Returns 0 if the read fails or runs out of time, else 1. */
+static int read_resp_for(const unsigned int request_id,
+                         const long deadline_ms, message_db_t *rec_ptr) {
+    int result;
+
+    while ((result = wait_resp(rec_ptr, deadline_ms)) == 1) {
+        if (rec_ptr->request_id == request_id) return(1);
+        file_response(rec_ptr);
+    }
+    if (result == 0) n_expired++;
+    else cache_empty();
+    return(0);
+}
+
+/* put a response where it belongs: in the cache, if it is a notice; in its
+ * pipelined request's or async call's slot; or in its search's result
+ * stream. Anything else is left over from a request we gave up on, and is
+ * dropped. */
+static void file_response(const message_db_t *rec_ptr) {
+    pipeline_slot *slot;
+    async_slot *call;
+
+    if (rec_ptr->response == r_invalidated) {
+        file_notice(rec_ptr);
+        return;
+    }
+    slot = find_slot(rec_ptr->request_id);
+    call = slot ? NULL : find_async(rec_ptr->request_id);
+    if (slot && slot->state == slot_sent) {
+        slot->response = *rec_ptr;
+        slot->state = slot_answered;
+    } else if (call && call->state == slot_sent) {
+        call->result.succeeded = (rec_ptr->response == r_success);
+        if (!call->result.succeeded) {
+            fprintf(stderr, "%s", rec_ptr->error_text);
+        }
+        call->result.cdc_entry_data = rec_ptr->cdc_entry_data;
+        call->result.cdt_entry_data = rec_ptr->cdt_entry_data;
+        call->state = slot_answered;
+        n_async_answered++;
+    } else if (rec_ptr->request_id == search_results.request_id) {
+        stream_put(&search_results, rec_ptr);
+    } else if (rec_ptr->request_id == query_results.request_id) {
+        stream_put(&query_results, rec_ptr);
+    }
+}
+
+/* read a signle response from the server. Utility function used in
+ * many of this file's functions.
+ *   Calls, in turn, X_resp_from_server, with X \in {start, read, end}
+ *
+ * Returns 0 if any of the socket functions err out, or deadline_ms passes
+ * first, else 1. */
+static int read_one_response(const unsigned int request_id,
+                             const long deadline_ms, message_db_t *rec_ptr) {
+
+    int return_code = 0;
+    if (!rec_ptr) return(0);
+    if (start_resp_from_server()) {
+        if (read_resp_for(request_id, deadline_ms, rec_ptr)) {
+            return_code = 1;
+        }
+        end_resp_from_server();
+    }
+    return(return_code);
+}
+ 
+/* All of the other get_xxx and set_xxx functions are implemented much like
+ * get_cdc_entry: they package up their inputs into a
+ * message_db_t struct, send it, and read the response.
+ */
+
+cdt_entry get_cdt_entry(const char *cd_catalog_ptr, const int track_no)
+{
+    cdt_entry ret_val;
+    message_db_t mess_send;
+    message_db_t mess_ret;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    ret_val.catalog[0] = '\0';
+    mess_send.client_pid = mypid;
+    mess_send.request = s_get_cdt_entry;
+    strcpy(mess_send.cdt_entry_data.catalog, cd_catalog_ptr);
+    mess_send.cdt_entry_data.track_no = track_no;
+
+    if (caching && cache_get(&mess_send, &mess_ret)) {
+        return(mess_ret.cdt_entry_data);
+    }
+
+    if (send_request(&mess_send)) {
+        if (read_one_response(mess_send.request_id, mess_send.deadline_ms,
+                              &mess_ret)) {
+            if (mess_ret.response == r_success) {
+                if (caching) cache_put(&mess_send, &mess_ret);
+                ret_val = mess_ret.cdt_entry_data;
+            } else {
+                fprintf(stderr, "%s", mess_ret.error_text);
+            }
+        } else {
+            fprintf(stderr, "Server failed to respond\n");
+        }
+    } else {
+        fprintf(stderr, "Server not accepting requests\n");
+    }
+    return(ret_val);
+}
+
+
+int add_cdc_entry(const cdc_entry entry_to_add) {
+    message_db_t mess_send;
+    message_db_t mess_ret;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.client_pid = mypid;
+    mess_send.request = s_add_cdc_entry;
+    mess_send.cdc_entry_data = entry_to_add;
+
+    if (send_request(&mess_send)) {
+        if (read_one_response(mess_send.request_id, mess_send.deadline_ms,
+                              &mess_ret)) {
+            if (mess_ret.response == r_success) {
+                return(1);
+            } else {
+                fprintf(stderr, "%s", mess_ret.error_text);
+            }
+        } else {
+            fprintf(stderr, "Server failed to respond\n");
+        }
+    } else {
+        fprintf(stderr, "Server not accepting requests\n");
+    }
+    return(0);
+}
+
+int add_cdt_entry(const cdt_entry entry_to_add) {
+    message_db_t mess_send;
+    message_db_t mess_ret;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.client_pid = mypid;
+    mess_send.request = s_add_cdt_entry;
+    mess_send.cdt_entry_data = entry_to_add;
+
+    if (send_request(&mess_send)) {
+        if (read_one_response(mess_send.request_id, mess_send.deadline_ms,
+                              &mess_ret)) {
+            if (mess_ret.response == r_success) {
+                return(1);
+            } else {
+                fprintf(stderr, "%s", mess_ret.error_text);
+            }
+        } else {
+            fprintf(stderr, "Server failed to respond\n");
+        }
+    } else {
+        fprintf(stderr, "Server not accepting requests\n");
+    }
+    return(0);
+}
+
+
+int del_cdc_entry(const char *cd_catalog_ptr) {
+    message_db_t mess_send;
+    message_db_t mess_ret;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.client_pid = mypid;
+    mess_send.request = s_del_cdc_entry;
+    strcpy(mess_send.cdc_entry_data.catalog, cd_catalog_ptr);
+
+    if (send_request(&mess_send)) {
+        if (read_one_response(mess_send.request_id, mess_send.deadline_ms,
+                              &mess_ret)) {
+            if (mess_ret.response == r_success) {
+                return(1);
+            } else {
+                fprintf(stderr, "%s", mess_ret.error_text);
+            }
+        } else {
+            fprintf(stderr, "Server failed to respond\n");
+        }
+    } else {
+        fprintf(stderr, "Server not accepting requests\n");
+    }
+    return(0);
+}
+
+
+int del_cdt_entry(const char *cd_catalog_ptr, const int track_no)
+{
+    message_db_t mess_send;
+    message_db_t mess_ret;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.client_pid = mypid;
+    mess_send.request = s_del_cdt_entry;
+    strcpy(mess_send.cdt_entry_data.catalog, cd_catalog_ptr);
+    mess_send.cdt_entry_data.track_no = track_no;
+
+    if (send_request(&mess_send)) {
+        if (read_one_response(mess_send.request_id, mess_send.deadline_ms,
+                              &mess_ret)) {
+            if (mess_ret.response == r_success) {
+                return(1);
+            } else {
+                fprintf(stderr, "%s", mess_ret.error_text);
+            }
+        } else {
+            fprintf(stderr, "Server failed to respond\n");
+        }
+    } else {
+        fprintf(stderr, "Server not accepting requests\n");
+    }
+    return(0);
+}
+
+/* This is the most complicated of the functions.
+ *
+ * First, remember that we set *first_call_ptr by modifying the address in
+ * our impementation of search_cdc_entry. This is more complicated in the
+ * client-server setup, because the server can't modify *first_call_ptr for us!
+ *
+ * When *first_call_ptr is 1, we send the search to the server, which sends
+ * back all of the matches, one response each, followed by a r_find_no_more.
+ * This call and the ones that follow each return the next match from the
+ * search's result stream (see next_match), so the first match is handed back
+ * as soon as it arrives, rather than after the server has sent them all.
+ *
+ * Note that we don't use read_one_response in this function, because we
+ * have to read many responses. */
+cdc_entry search_cdc_entry(const char *cd_catalog_ptr, int *first_call_ptr) {
+    message_db_t mess_send;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    // set the pid and request (action). Copy the string we are
+    // searching for. We copy it to the catalog part of the message, which
+    // is I think mostly to save space since we never need a catalog id
+    // at the same time that we are perorming a search.
+    mess_send.client_pid = mypid;
+    mess_send.request = s_find_cdc_entry;
+    strcpy(mess_send.cdc_entry_data.catalog, cd_catalog_ptr);
+    return(next_match(&search_results, mess_send, first_call_ptr));
+}
+
+
+/* search_cdc_page sends a s_find_cdc_entry with the page in it, and reads
+ * the matches up to the final r_find_no_more, which brings the page back
+ * ready for the next call. A page is small enough that it doesn't need a
+ * result stream. */
+int search_cdc_page(const char *cd_catalog_ptr, cd_page *page_ptr,
+                    cdc_entry *matches) {
+    message_db_t mess_send;
+    message_db_t mess_ret;
+    int n_found = 0;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    if (page_ptr->limit < 1 || page_ptr->limit > PAGE_MAX) return(-1);
+    mess_send.client_pid = mypid;
+    mess_send.request = s_find_cdc_entry;
+    strcpy(mess_send.cdc_entry_data.catalog, cd_catalog_ptr);
+    mess_send.page_data = *page_ptr;
+
+    if (!send_request(&mess_send)) {
+        fprintf(stderr, "Server not accepting requests\n");
+        return(-1);
+    }
+    if (!start_resp_from_server()) {
+        fprintf(stderr, "Server not responding\n");
+        return(-1);
+    }
+    while (read_resp_for(mess_send.request_id, mess_send.deadline_ms,
+                         &mess_ret)) {
+        if (mess_ret.response == r_success) {
+            if (n_found < page_ptr->limit) {
+                matches[n_found++] = mess_ret.cdc_entry_data;
+            }
+            continue;
+        }
+        end_resp_from_server();
+        if (mess_ret.response == r_find_no_more) {
+            page_ptr->more = mess_ret.page_data.more;
+            strcpy(page_ptr->after, mess_ret.page_data.after);
+            return(n_found);
+        }
+        fprintf(stderr, "%s", mess_ret.error_text);
+        return(-1);
+    }
+    end_resp_from_server();
+    fprintf(stderr, "Server failed to respond\n");
+    return(-1);
+}
+
+
+/* query_cdc_entry works just like search_cdc_entry, except that the request
+ * carries a whole query rather than a catalog string. */
+cdc_entry query_cdc_entry(const cd_query *query_ptr, int *first_call_ptr) {
+    message_db_t mess_send;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.client_pid = mypid;
+    mess_send.request = s_query_cdc_entry;
+    mess_send.query_data = *query_ptr;
+    return(next_match(&query_results, mess_send, first_call_ptr));
+}
+
+
+/* Return the next match from a search or query, sending the request
+ * (mess_send) first if *first_call_ptr is set. A match with an empty catalog
+ * marks the end of the matches, as for the server side search_cdc_entry. */
+static cdc_entry next_match(result_stream *stream, const message_db_t mess_send,
+                            int *first_call_ptr) {
+    message_db_t request = mess_send;
+    message_db_t mess_ret;
+    cdc_entry ret_val;
+
+    ret_val.catalog[0] = '\0';
+
+    if (*first_call_ptr) {
+        // any matches left from an earlier search are dropped, here and
+        // (by file_response) as they arrive
+        *first_call_ptr = 0;
+        stream_start(stream, 0);
+        if (!send_request(&request)) {
+            fprintf(stderr, "Server not accepting requests\n");
+            return(ret_val);
+        }
+        stream_start(stream, request.request_id);
+        stream->deadline_ms = request.deadline_ms;
+        if (!start_resp_from_server()) {
+            fprintf(stderr, "Server not responding\n");
+            stream_start(stream, 0);
+            return(ret_val);
+        }
+    }
+
+    // first take whatever has already arrived, without waiting...
+    while (!stream->finished && stream_has_room(stream) &&
+           poll_resp_from_server(&mess_ret, 0) == 1) {
+        if (mess_ret.request_id == stream->request_id) {
+            stream_put(stream, &mess_ret);
+        } else {
+            file_response(&mess_ret);
+        }
+    }
+
+    // ... and only if that doesn't give us a match, wait for the next one.
+    // If it doesn't come, any matches that come later are dropped.
+    while (!stream_take(stream, &ret_val) && !stream->finished) {
+        if (!read_resp_for(stream->request_id, stream->deadline_ms,
+                           &mess_ret)) {
+            fprintf(stderr, "Server failed to respond\n");
+            stream->finished = 1;
+            stream->request_id = 0;
+        } else {
+            stream_put(stream, &mess_ret);
+        }
+    }
+    return(ret_val);
+}
+
+
+/* Empty a result stream, and get it ready for the matches to request_id (if
+ * that isn't 0). The spill file is kept for the next search. */
+static void stream_start(result_stream *stream,
+                         const unsigned int request_id) {
+    stream->request_id = request_id;
+    stream->finished = (request_id == 0);
+    stream->mem_first = stream->mem_count = 0;
+    if (stream->spill_fd != -1 && stream->spill_write > 0) {
+        (void)ftruncate(stream->spill_fd, 0);
+    }
+    stream->spill_read = stream->spill_write = 0;
+}
+
+/* is there somewhere to put another match? This is where we make the spill
+ * file, if memory is full. */
+static int stream_has_room(result_stream *stream) {
+    if (stream->mem_count < STREAM_MEM_ENTRIES) return(1);
+    if (stream->spill_fd == -1) {
+        stream->spill_fd = memfd_create("cd_matches", 0);
+    }
+    return(stream->spill_fd != -1);
+}
+
+/* add a response to its stream: a match, or the end of the matches. Each
+ * match gives the next one the request's full timeout to arrive in. */
+static void stream_put(result_stream *stream, const message_db_t *rec_ptr) {
+    int slot;
+
+    stream->deadline_ms = deadline_from_now();
+    if (rec_ptr->response != r_success) {
+        stream->finished = 1;
+        return;
+    }
+    if (stream->spill_read == stream->spill_write &&
+        stream->mem_count < STREAM_MEM_ENTRIES) {
+        slot = (stream->mem_first + stream->mem_count) % STREAM_MEM_ENTRIES;
+        stream->mem[slot] = rec_ptr->cdc_entry_data;
+        stream->mem_count++;
+        return;
+    }
+    if (!stream_has_room(stream) ||
+        pwrite(stream->spill_fd, &rec_ptr->cdc_entry_data, sizeof(cdc_entry),
+               stream->spill_write) != sizeof(cdc_entry)) {
+        fprintf(stderr, "Search results lost, can not spill them\n");
+        return;
+    }
+    stream->spill_write += sizeof(cdc_entry);
+}
+
+/* take the oldest match out of a stream. Returns 0 if it is empty. */
+static int stream_take(result_stream *stream, cdc_entry *entry_ptr) {
+    if (stream->mem_count > 0) {
+        *entry_ptr = stream->mem[stream->mem_first];
+        stream->mem_first = (stream->mem_first + 1) % STREAM_MEM_ENTRIES;
+        stream->mem_count--;
+        return(1);
+    }
+    if (stream->spill_read == stream->spill_write) return(0);
+    if (pread(stream->spill_fd, entry_ptr, sizeof(cdc_entry),
+              stream->spill_read) != sizeof(cdc_entry)) {
+        stream->spill_read = stream->spill_write;
+        return(0);
+    }
+    stream->spill_read += sizeof(cdc_entry);
+    if (stream->spill_read == stream->spill_write) {
+        // all caught up, so go back to using memory
+        (void)ftruncate(stream->spill_fd, 0);
+        stream->spill_read = stream->spill_write = 0;
+    }
+    return(1);
+}
+
+
+/* explain_cdc_query is a one request, one response call like the get and
+ * add functions; the plan comes back in the response. */
+int explain_cdc_query(const cd_query *query_ptr, cd_query_plan *plan_ptr) {
+    message_db_t mess_send;
+    message_db_t mess_ret;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.client_pid = mypid;
+    mess_send.request = s_explain_cdc_query;
+    mess_send.query_data = *query_ptr;
+
+    if (send_request(&mess_send)) {
+        if (read_one_response(mess_send.request_id, mess_send.deadline_ms,
+                              &mess_ret)) {
+            if (mess_ret.response == r_success) {
+                *plan_ptr = mess_ret.plan_data;
+                return(1);
+            } else {
+                fprintf(stderr, "%s", mess_ret.error_text);
+            }
+        } else {
+            fprintf(stderr, "Server failed to respond\n");
+        }
+    } else {
+        fprintf(stderr, "Server not accepting requests\n");
+    }
+    return(0);
+}
+
+
+/* aggregate_cdc_entry sends a s_aggregate request on the first call. The
+ * server only sends back the summary rows, so there are few enough of them
+ * that we just read them all into a (static!) malloc'd array, rather than
+ * streaming them as search_cdc_entry does. */
+cd_agg_row aggregate_cdc_entry(const cd_aggregate *aggregate_ptr,
+                               int *first_call_ptr) {
+    static cd_agg_row *rows = NULL;
+    static int n_rows = 0;
+    static int next_row = 0;
+
+    message_db_t mess_send;
+    message_db_t mess_ret;
+    cd_agg_row *grown;
+    int n_allocated = 0;
+    cd_agg_row ret_val;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    memset(&ret_val, '\0', sizeof(ret_val));
+
+    if (*first_call_ptr) {
+        *first_call_ptr = 0;
+        free(rows);
+        rows = NULL;
+        n_rows = next_row = 0;
+
+        mess_send.client_pid = mypid;
+        mess_send.request = s_aggregate;
+        mess_send.aggregate_data = *aggregate_ptr;
+
+        if (send_request(&mess_send)) {
+            if (start_resp_from_server()) {
+                while (read_resp_for(mess_send.request_id,
+                                     mess_send.deadline_ms, &mess_ret)) {
+                    if (mess_ret.response != r_success) break;
+                    if (n_rows == n_allocated) {
+                        n_allocated = n_allocated ? n_allocated * 2 : 16;
+                        grown = realloc(rows, n_allocated * sizeof(cd_agg_row));
+                        if (!grown) break;
+                        rows = grown;
+                    }
+                    rows[n_rows++] = mess_ret.agg_row_data;
+                } /* while */
+            } else {
+                fprintf(stderr, "Server not responding\n");
+            }
+        } else {
+            fprintf(stderr, "Server not accepting requests\n");
+        }
+    }
+
+    if (rows && next_row < n_rows) ret_val = rows[next_row++];
+    return(ret_val);
+}
+
+
+/* run_cdc_batch sends the whole batch as one request, and the server sends
+ * it back with the results of the ops filled in. If the server never gets
+ * to run the batch, all of the ops are marked as failed. */
+int run_cdc_batch(cd_batch *batch_ptr) {
+    message_db_t mess_send;
+    message_db_t mess_ret;
+    int all_succeeded = 1;
+    int i;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    if (batch_ptr->n_ops < 0 || batch_ptr->n_ops > BATCH_MAX_OPS) return(0);
+    for (i = 0; i < batch_ptr->n_ops; i++) {
+        batch_ptr->ops[i].succeeded = 0;
+    }
+
+    mess_send.client_pid = mypid;
+    mess_send.request = s_batch;
+    mess_send.batch_data = *batch_ptr;
+
+    if (send_request(&mess_send)) {
+        if (read_one_response(mess_send.request_id, mess_send.deadline_ms,
+                              &mess_ret)) {
+            if (mess_ret.response == r_success &&
+                mess_ret.batch_data.n_ops == batch_ptr->n_ops) {
+                for (i = 0; i < batch_ptr->n_ops; i++) {
+                    batch_ptr->ops[i].succeeded =
+                        mess_ret.batch_data.ops[i].succeeded;
+                    if (!batch_ptr->ops[i].succeeded) all_succeeded = 0;
+                    if (batch_ptr->ops[i].op == batch_get_cdc) {
+                        batch_ptr->ops[i].cdc_entry_data =
+                            mess_ret.batch_data.ops[i].cdc_entry_data;
+                    }
+                    if (batch_ptr->ops[i].op == batch_get_cdt) {
+                        batch_ptr->ops[i].cdt_entry_data =
+                            mess_ret.batch_data.ops[i].cdt_entry_data;
+                    }
+                }
+                return(all_succeeded);
+            } else {
+                fprintf(stderr, "%s", mess_ret.error_text);
+            }
+        } else {
+            fprintf(stderr, "Server failed to respond\n");
+        }
+    } else {
+        fprintf(stderr, "Server not accepting requests\n");
+    }
+    return(0);
+}
+
+
+/* get_replica_status is a simple one request, one response call */
+int get_replica_status(replica_status *status_ptr) {
+    message_db_t mess_send;
+    message_db_t mess_ret;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.client_pid = mypid;
+    mess_send.request = s_replica_status;
+
+    if (send_request(&mess_send)) {
+        if (read_one_response(mess_send.request_id, mess_send.deadline_ms,
+                              &mess_ret)) {
+            if (mess_ret.response == r_success) {
+                *status_ptr = mess_ret.status_data;
+                return(1);
+            } else {
+                fprintf(stderr, "%s", mess_ret.error_text);
+            }
+        } else {
+            fprintf(stderr, "Server failed to respond\n");
+        }
+    } else {
+        fprintf(stderr, "Server not accepting requests\n");
+    }
+    return(0);
+}
+
+
+/* and so is get_server_stats */
+int get_server_stats(server_stats *stats_ptr) {
+    message_db_t mess_send;
+    message_db_t mess_ret;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.client_pid = mypid;
+    mess_send.request = s_stats;
+
+    if (send_request(&mess_send)) {
+        if (read_one_response(mess_send.request_id, mess_send.deadline_ms,
+                              &mess_ret)) {
+            if (mess_ret.response == r_success) {
+                *stats_ptr = mess_ret.stats_data;
+                return(1);
+            } else {
+                fprintf(stderr, "%s", mess_ret.error_text);
+            }
+        } else {
+            fprintf(stderr, "Server failed to respond\n");
+        }
+    } else {
+        fprintf(stderr, "Server not accepting requests\n");
+    }
+    return(0);
+}
+
+
+/* Caching, which is only ever used by get_cdc_entry and get_cdt_entry. */
+void set_client_cache(const int on) {
+    cache_empty();
+    caching = on;
+}
+
+void get_client_cache_stats(client_cache_stats *stats_ptr) {
+    *stats_ptr = cache_stats;
+}
+
+/* the slot of the cache a key goes in (an FNV-1a hash, as in cache_watch.c) */
+static int cache_slot(const client_request_e kind, const char *catalog,
+                      const int track_no) {
+    unsigned int hash = 2166136261U ^ kind;
+
+    while (*catalog) {
+        hash ^= (unsigned char)*catalog++;
+        hash *= 16777619U;
+    }
+    hash ^= (unsigned int)track_no;
+    hash *= 16777619U;
+    return(hash & (CACHE_SLOTS - 1));
+}
+
+/* Answer a s_get_ request from the cache, if the entry is there, filling in
+ * *rec_ptr as the server would have and returning 1. If it isn't, the
+ * request is turned into the matching s_watch_ one, for the slot the entry
+ * would go in, and 0 is returned so that it gets sent. */
+static int cache_get(message_db_t *mess_ptr, message_db_t *rec_ptr) {
+    const int is_cdt = (mess_ptr->request == s_get_cdt_entry);
+    const client_request_e kind = is_cdt ? s_watch_cdt_entry
+                                         : s_watch_cdc_entry;
+    const char *catalog = is_cdt ? mess_ptr->cdt_entry_data.catalog
+                                 : mess_ptr->cdc_entry_data.catalog;
+    const int track_no = is_cdt ? mess_ptr->cdt_entry_data.track_no : 0;
+    const int slot = cache_slot(kind, catalog, track_no);
+    cache_entry *entry_ptr = &cache[slot];
+
+    take_notices();
+    if (entry_ptr->used && entry_ptr->kind == kind &&
+        entry_ptr->track_no == track_no &&
+        strcmp(entry_ptr->catalog, catalog) == 0) {
+        cache_stats.hits++;
+        rec_ptr->response = r_success;
+        rec_ptr->cdc_entry_data = entry_ptr->cdc_entry_data;
+        rec_ptr->cdt_entry_data = entry_ptr->cdt_entry_data;
+        return(1);
+    }
+    cache_stats.misses++;
+    mess_ptr->request = kind;
+    mess_ptr->cache_data.slot = slot;
+    mess_ptr->cache_data.version = 0;
+    return(0);
+}
+
+/* keep the answer to a s_watch_ request (mess_ptr), if the server is
+ * watching it for us, and nothing has changed it since the watch began */
+static void cache_put(const message_db_t *mess_ptr,
+                      const message_db_t *rec_ptr) {
+    const int slot = rec_ptr->cache_data.slot;
+    const long version = rec_ptr->cache_data.version;
+    cache_entry *entry_ptr;
+
+    if (mess_ptr->request != s_watch_cdc_entry &&
+        mess_ptr->request != s_watch_cdt_entry) return;
+    if (slot < 0 || slot != mess_ptr->cache_data.slot) return;
+    watched = 1;
+    if (version < notice_versions[slot] || version < flush_version) return;
+
+    entry_ptr = &cache[slot];
+    entry_ptr->used = 1;
+    entry_ptr->kind = mess_ptr->request;
+    entry_ptr->version = version;
+    if (mess_ptr->request == s_watch_cdt_entry) {
+        strcpy(entry_ptr->catalog, mess_ptr->cdt_entry_data.catalog);
+        entry_ptr->track_no = mess_ptr->cdt_entry_data.track_no;
+    } else {
+        strcpy(entry_ptr->catalog, mess_ptr->cdc_entry_data.catalog);
+        entry_ptr->track_no = 0;
+    }
+    entry_ptr->cdc_entry_data = rec_ptr->cdc_entry_data;
+    entry_ptr->cdt_entry_data = rec_ptr->cdt_entry_data;
+}
+
+/* Empty the cache. The versions of the notices stay, since entries that
+ * were asked for before may still arrive. */
+static void cache_empty(void) {
+    memset(cache, '\0', sizeof(cache));
+}
+
+/* take in the notices that have arrived, without waiting for any more */
+static void take_notices(void) {
+    if (watched) (void)take_responses(0);
+}
+
+/* a notice that the entry the server was watching in a slot (or in all of
+ * them, if the slot is -1) has changed */
+static void file_notice(const message_db_t *rec_ptr) {
+    const int slot = rec_ptr->cache_data.slot;
+    const long version = rec_ptr->cache_data.version;
+    const char *catalog;
+    int track_no;
+    int i;
+
+    if (slot == -1) {
+        for (i = 0; i < CACHE_SLOTS; i++) {
+            if (cache[i].used) cache_stats.invalidations++;
+        }
+        cache_empty();
+        if (version > flush_version) flush_version = version;
+        return;
+    }
+    if (slot < 0 || slot >= CACHE_SLOTS) return;
+    if (version > notice_versions[slot]) notice_versions[slot] = version;
+
+    if (rec_ptr->request == s_watch_cdt_entry) {
+        catalog = rec_ptr->cdt_entry_data.catalog;
+        track_no = rec_ptr->cdt_entry_data.track_no;
+    } else {
+        catalog = rec_ptr->cdc_entry_data.catalog;
+        track_no = 0;
+    }
+    if (cache[slot].used && cache[slot].kind == rec_ptr->request &&
+        cache[slot].track_no == track_no &&
+        strcmp(cache[slot].catalog, catalog) == 0 &&
+        cache[slot].version < version) {
+        cache[slot].used = 0;
+        cache_stats.invalidations++;
+    }
+}
+
+
+/* File all of the responses that have arrived, waiting up to timeout_ms for
+ * one if none has. Returns the number filed, or -1 if the transport failed,
+ * which empties the cache. */
+static int take_responses(const int timeout_ms) {
+    message_db_t mess_ret;
+    int n_taken = 0;
+    int result;
+
+    if (!start_resp_from_server()) {
+        cache_empty();
+        return(-1);
+    }
+    result = poll_resp_from_server(&mess_ret, timeout_ms);
+    while (result == 1) {
+        file_response(&mess_ret);
+        n_taken++;
+        result = poll_resp_from_server(&mess_ret, 0);
+    }
+    if (result == -1) {
+        cache_empty();
+        return(-1);
+    }
+    return(n_taken);
+}
+
+
+/* The pipelined calls fill in a request just as the ones above do, but only
+ * send it, and keep a slot for its response. */
+unsigned int pipeline_get_cdc_entry(const char *cd_catalog_ptr) {
+    message_db_t mess_send;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.request = s_get_cdc_entry;
+    strcpy(mess_send.cdc_entry_data.catalog, cd_catalog_ptr);
+    return(pipeline_send(mess_send));
+}
+
+unsigned int pipeline_get_cdt_entry(const char *cd_catalog_ptr,
+                                    const int track_no) {
+    message_db_t mess_send;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.request = s_get_cdt_entry;
+    strcpy(mess_send.cdt_entry_data.catalog, cd_catalog_ptr);
+    mess_send.cdt_entry_data.track_no = track_no;
+    return(pipeline_send(mess_send));
+}
+
+unsigned int pipeline_add_cdc_entry(const cdc_entry entry_to_add) {
+    message_db_t mess_send;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.request = s_add_cdc_entry;
+    mess_send.cdc_entry_data = entry_to_add;
+    return(pipeline_send(mess_send));
+}
+
+unsigned int pipeline_add_cdt_entry(const cdt_entry entry_to_add) {
+    message_db_t mess_send;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.request = s_add_cdt_entry;
+    mess_send.cdt_entry_data = entry_to_add;
+    return(pipeline_send(mess_send));
+}
+
+unsigned int pipeline_del_cdc_entry(const char *cd_catalog_ptr) {
+    message_db_t mess_send;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.request = s_del_cdc_entry;
+    strcpy(mess_send.cdc_entry_data.catalog, cd_catalog_ptr);
+    return(pipeline_send(mess_send));
+}
+
+unsigned int pipeline_del_cdt_entry(const char *cd_catalog_ptr,
+                                    const int track_no) {
+    message_db_t mess_send;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.request = s_del_cdt_entry;
+    strcpy(mess_send.cdt_entry_data.catalog, cd_catalog_ptr);
+    mess_send.cdt_entry_data.track_no = track_no;
+    return(pipeline_send(mess_send));
+}
+
+/* Send a pipelined request, if there is a free slot for it. The ticket is
+ * just the request id. */
+static unsigned int pipeline_send(message_db_t mess_send) {
+    pipeline_slot *slot = find_slot(0);
+
+    if (!slot) {
+        fprintf(stderr, "Too many pipelined requests\n");
+        return(0);
+    }
+    if (!send_request(&mess_send)) {
+        fprintf(stderr, "Server not accepting requests\n");
+        return(0);
+    }
+    slot->request_id = mess_send.request_id;
+    slot->deadline_ms = mess_send.deadline_ms;
+    slot->state = slot_sent;
+    return(mess_send.request_id);
+}
+
+/* the slot in use for request_id, or a free one if request_id is 0 */
+static pipeline_slot *find_slot(const unsigned int request_id) {
+    int i;
+
+    for (i = 0; i < PIPELINE_WINDOW; i++) {
+        if (request_id == 0 && pipeline[i].state == slot_free) {
+            return(&pipeline[i]);
+        }
+        if (request_id != 0 && pipeline[i].state != slot_free &&
+            pipeline[i].request_id == request_id) return(&pipeline[i]);
+    }
+    return(NULL);
+}
+
+/* Collect the response for a ticket, reading responses until it turns up
+ * if it isn't already in its slot. */
+int pipeline_wait(const unsigned int ticket, pipeline_result *result_ptr) {
+    pipeline_slot *slot = find_slot(ticket);
+    message_db_t mess_ret;
+    int return_code = 0;
+
+    if (result_ptr) memset(result_ptr, '\0', sizeof(*result_ptr));
+    if (ticket == 0 || !slot) return(0);
+
+    if (slot->state == slot_sent) {
+        if (read_one_response(ticket, slot->deadline_ms, &mess_ret)) {
+            slot->response = mess_ret;
+            slot->state = slot_answered;
+        } else {
+            fprintf(stderr, "Server failed to respond\n");
+        }
+    }
+    if (slot->state == slot_answered) {
+        if (slot->response.response == r_success) {
+            if (result_ptr) {
+                result_ptr->cdc_entry_data = slot->response.cdc_entry_data;
+                result_ptr->cdt_entry_data = slot->response.cdt_entry_data;
+            }
+            return_code = 1;
+        } else {
+            fprintf(stderr, "%s", slot->response.error_text);
+        }
+    }
+    slot->state = slot_free;
+    return(return_code);
+}
+
+
+/* The async calls are filled in just as the pipelined ones are. */
+unsigned int async_get_cdc_entry(const char *cd_catalog_ptr,
+                                 async_callback callback, void *user_data) {
+    message_db_t mess_send;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.request = s_get_cdc_entry;
+    strcpy(mess_send.cdc_entry_data.catalog, cd_catalog_ptr);
+    return(async_send(mess_send, callback, user_data));
+}
+
+unsigned int async_get_cdt_entry(const char *cd_catalog_ptr,
+                                 const int track_no,
+                                 async_callback callback, void *user_data) {
+    message_db_t mess_send;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.request = s_get_cdt_entry;
+    strcpy(mess_send.cdt_entry_data.catalog, cd_catalog_ptr);
+    mess_send.cdt_entry_data.track_no = track_no;
+    return(async_send(mess_send, callback, user_data));
+}
+
+unsigned int async_add_cdc_entry(const cdc_entry entry_to_add,
+                                 async_callback callback, void *user_data) {
+    message_db_t mess_send;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.request = s_add_cdc_entry;
+    mess_send.cdc_entry_data = entry_to_add;
+    return(async_send(mess_send, callback, user_data));
+}
+
+unsigned int async_add_cdt_entry(const cdt_entry entry_to_add,
+                                 async_callback callback, void *user_data) {
+    message_db_t mess_send;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.request = s_add_cdt_entry;
+    mess_send.cdt_entry_data = entry_to_add;
+    return(async_send(mess_send, callback, user_data));
+}
+
+unsigned int async_del_cdc_entry(const char *cd_catalog_ptr,
+                                 async_callback callback, void *user_data) {
+    message_db_t mess_send;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.request = s_del_cdc_entry;
+    strcpy(mess_send.cdc_entry_data.catalog, cd_catalog_ptr);
+    return(async_send(mess_send, callback, user_data));
+}
+
+unsigned int async_del_cdt_entry(const char *cd_catalog_ptr,
+                                 const int track_no,
+                                 async_callback callback, void *user_data) {
+    message_db_t mess_send;
+
+    memset(&mess_send, '\0', sizeof(mess_send));
+    mess_send.request = s_del_cdt_entry;
+    strcpy(mess_send.cdt_entry_data.catalog, cd_catalog_ptr);
+    mess_send.cdt_entry_data.track_no = track_no;
+    return(async_send(mess_send, callback, user_data));
+}
+
+/* Send an async call, if there is a free slot for it. Whatever answers have
+ * already arrived are taken in first, so that a client sending many calls
+ * without running its callbacks doesn't leave the server unable to send
+ * it any more. The handle is just the request id. */
+static unsigned int async_send(message_db_t mess_send, async_callback callback,
+                               void *user_data) {
+    async_slot *call;
+
+    if (n_async > 0) (void)take_responses(0);
+    call = find_async(0);
+    if (!call) {
+        fprintf(stderr, "Too many outstanding async calls\n");
+        return(0);
+    }
+    if (!send_request(&mess_send)) {
+        fprintf(stderr, "Server not accepting requests\n");
+        return(0);
+    }
+    memset(call, '\0', sizeof(*call));
+    call->state = slot_sent;
+    call->request_id = mess_send.request_id;
+    call->deadline_ms = mess_send.deadline_ms;
+    call->callback = callback;
+    call->user_data = user_data;
+    call->result.handle = mess_send.request_id;
+    n_async++;
+    return(mess_send.request_id);
+}
+
+/* the slot in use for request_id, or a free one if request_id is 0 */
+static async_slot *find_async(const unsigned int request_id) {
+    int i;
+
+    if (request_id != 0 && n_async == 0) return(NULL);
+    for (i = 0; i < ASYNC_WINDOW; i++) {
+        if (request_id == 0 && async_calls[i].state == slot_free) {
+            return(&async_calls[i]);
+        }
+        if (request_id != 0 && async_calls[i].state != slot_free &&
+            async_calls[i].request_id == request_id) return(&async_calls[i]);
+    }
+    return(NULL);
+}
+
+int async_outstanding(void) {
+    return(n_async);
+}
+
+/* How long cd_client_run_once should wait for an answer, given that it was
+ * asked to wait timeout_ms: no longer than until the first deadline of the
+ * calls still waiting, so that it can fail them on time. */
+static int async_wait_ms(const int timeout_ms) {
+    long first = 0;
+    long left_ms;
+    int i;
+
+    for (i = 0; i < ASYNC_WINDOW; i++) {
+        if (async_calls[i].state == slot_sent &&
+            async_calls[i].deadline_ms != 0 &&
+            (first == 0 || async_calls[i].deadline_ms < first)) {
+            first = async_calls[i].deadline_ms;
+        }
+    }
+    if (first == 0) return(timeout_ms);
+    left_ms = first - now_ms();
+    if (left_ms < 0) left_ms = 0;
+    if (timeout_ms >= 0 && left_ms > timeout_ms) left_ms = timeout_ms;
+    if (left_ms > INT_MAX) left_ms = INT_MAX;
+    return((int)left_ms);
+}
+
+/* fail the calls still waiting whose deadlines have passed */
+static void expire_async(void) {
+    const long now = now_ms();
+    int i;
+
+    for (i = 0; i < ASYNC_WINDOW; i++) {
+        if (async_calls[i].state == slot_sent &&
+            async_calls[i].deadline_ms != 0 &&
+            async_calls[i].deadline_ms <= now) {
+            async_calls[i].result.succeeded = 0;
+            async_calls[i].state = slot_answered;
+            n_async_answered++;
+            n_expired++;
+        }
+    }
+}
+
+/* Take in the answers that have arrived (waiting for one only if none is
+ * already waiting to be handed over), fail the calls that have run out of
+ * time, and hand them all to their callbacks. A slot is freed before its
+ * callback is called, so the callback can use it for another call. */
+int cd_client_run_once(const int timeout_ms) {
+    async_callback callback;
+    async_result result;
+    void *user_data;
+    int n_called = 0;
+    int failed;
+    int i;
+
+    if (running_callbacks || n_async == 0) return(0);
+    failed = (take_responses(n_async_answered > 0 ? 0 :
+                             async_wait_ms(timeout_ms)) == -1);
+    if (!failed) expire_async();
+
+    running_callbacks = 1;
+    for (i = 0; i < ASYNC_WINDOW; i++) {
+        if (async_calls[i].state == slot_free) continue;
+        if (async_calls[i].state == slot_sent && !failed) continue;
+        if (async_calls[i].state == slot_answered) n_async_answered--;
+        result = async_calls[i].result;
+        callback = async_calls[i].callback;
+        user_data = async_calls[i].user_data;
+        async_calls[i].state = slot_free;
+        n_async--;
+        if (callback) callback(&result, user_data);
+        n_called++;
+    }
+    running_callbacks = 0;
+    return(failed ? -1 : n_called);
+}
+
+int cd_client_fd(void) {
+    return(resp_fd_from_server());
+}
+
+
+/* Deadlines */
+void set_request_timeout(const int timeout_ms) {
+    request_timeout_ms = timeout_ms > 0 ? timeout_ms : 0;
+}
+
+long requests_expired(void) {
+    return(n_expired);
+}
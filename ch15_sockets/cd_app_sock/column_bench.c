@@ -0,0 +1,114 @@
+/* A benchmark of the catalog column search (cd_column.c) against the way
+ * search_cdc_entry used to work: copying each cdc_entry out of the database
+ * and running strstr on its catalog string.
+ *
+ * There's no database involved: we make up a catalog in memory, so that the
+ * numbers only measure the matching. Run it as
+ *     ./column_bench [number_of_entries [number_of_searches]]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "cd_data.h"
+#include "cd_column.h"
+
+static const char *needles[] = {"CD", "12", "x7", "Q9ZZ", "not there"};
+#define N_NEEDLES (sizeof(needles) / sizeof(needles[0]))
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* the old search loop, one record at a time */
+static long strstr_search(const cdc_entry *entries, int n_entries,
+                          const char *needle, int nocase) {
+    cdc_entry entry;
+    long matches = 0;
+    int i;
+
+    for (i = 0; i < n_entries; i++) {
+        memcpy(&entry, &entries[i], sizeof(entry));
+        if (nocase) {
+            if (strcasestr(entry.catalog, needle)) matches++;
+        } else {
+            if (strstr(entry.catalog, needle)) matches++;
+        }
+    }
+    return(matches);
+}
+
+static long column_search(const char *needle, int nocase) {
+    long matches = 0;
+    int record = 0;
+
+    while ((record = column_next_match(needle, nocase, record,
+                                       column_records())) != -1) {
+        matches++;
+        record++;
+    }
+    return(matches);
+}
+
+int main(int argc, char *argv[]) {
+    int n_entries = argc > 1 ? atoi(argv[1]) : 100000;
+    int n_searches = argc > 2 ? atoi(argv[2]) : 20;
+    column_kernel_e kernels[] = {column_scalar, column_sse2, column_avx2};
+    cdc_entry *entries;
+    const char *name;
+    double started;
+    long matches = 0;
+    long expected = 0;
+    int nocase;
+    int i, k, n;
+
+    entries = calloc(n_entries, sizeof(cdc_entry));
+    if (!entries) exit(EXIT_FAILURE);
+    srand(1);
+    for (i = 0; i < n_entries; i++) {
+        sprintf(entries[i].catalog, "CD%d-%c%c%d", i,
+                'A' + rand() % 26, 'a' + rand() % 26, rand() % 1000);
+        if (!column_add(entries[i].catalog)) {
+            fprintf(stderr, "column_add failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("%d entries, %d searches per needle\n\n", n_entries, n_searches);
+
+    for (nocase = 0; nocase <= 1; nocase++) {
+        printf("%s\n", nocase ? "case-insensitive" : "case-sensitive");
+        for (n = 0; n < N_NEEDLES; n++) {
+            started = now();
+            for (i = 0; i < n_searches; i++) {
+                expected = strstr_search(entries, n_entries, needles[n],
+                                         nocase);
+            }
+            printf("  %-10s %8ld matches  strstr %8.3f ms",
+                   needles[n], expected,
+                   (now() - started) * 1000 / n_searches);
+
+            for (k = 0; k < 3; k++) {
+                name = column_use_kernel(kernels[k]);
+                started = now();
+                for (i = 0; i < n_searches; i++) {
+                    matches = column_search(needles[n], nocase);
+                }
+                printf("  %s %8.3f ms", name,
+                       (now() - started) * 1000 / n_searches);
+                if (matches != expected) printf(" (MISMATCH %ld)", matches);
+            }
+            printf("\n");
+        }
+    }
+
+    column_clear();
+    free(entries);
+    exit(EXIT_SUCCESS);
+}
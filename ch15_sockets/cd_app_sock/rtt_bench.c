@@ -0,0 +1,182 @@
+/* A small round-trip benchmark for the client/server transport.
+ *
+ * It adds one catalog entry, then calls get_cdc_entry for it over and over,
+ * each call being one request and one response, and reports the requests per
+ * second and mean round trip time. Start a server first, then run
+ *     ./rtt_bench [number_of_requests [number_of_clients [window [stalled]]]]
+ * With more than one client, that many processes run the loop at once, and
+ * the total rate is reported. With a window of more than 1, each client
+ * keeps that many pipelined requests waiting (up to PIPELINE_WINDOW) rather
+ * than waiting for each answer before sending the next request.
+ *
+ * stalled adds that many more clients, which each start a search with
+ * STALL_MATCHES matches, take the first, and then stop reading, for up to
+ * STALL_SECS. A transport that keeps clients apart shouldn't slow the
+ * others down; one that doesn't will hold them up until the stalled clients
+ * give up.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "cd_data.h"
+
+#define STALL_MATCHES 2000
+#define STALL_SECS    10
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* run the request loop in one client process; returns the failures */
+static int run_client(int n_requests, int window) {
+    unsigned int tickets[PIPELINE_WINDOW];
+    pipeline_result result;
+    cdc_entry entry;
+    int failures = 0;
+    int sent = 0;
+    int i;
+
+    if (!database_initialize(0)) {
+        fprintf(stderr, "rtt_bench: can not reach the server\n");
+        return(n_requests);
+    }
+    if (window <= 1) {
+        for (i = 0; i < n_requests; i++) {
+            entry = get_cdc_entry("rtt_bench");
+            if (entry.catalog[0] == '\0') failures++;
+        }
+    } else {
+        // keep the window full, collecting the oldest answer each time
+        for (i = 0; i < n_requests; i++) {
+            while (sent < n_requests && sent < i + window) {
+                tickets[sent % window] = pipeline_get_cdc_entry("rtt_bench");
+                sent++;
+            }
+            if (!pipeline_wait(tickets[i % window], &result) ||
+                result.cdc_entry_data.catalog[0] == '\0') failures++;
+        }
+    }
+    database_close();
+    return(failures);
+}
+
+static void stop_stalling(int sig) {
+}
+
+/* a client that starts a long search and then stops reading. It writes to
+ * ready_fd once the search has started, and ends after STALL_SECS, or when
+ * it gets a SIGTERM. */
+static void run_stalled_client(int ready_fd) {
+    struct sigaction act;
+    int first_call = 1;
+    char ready = 1;
+
+    memset(&act, '\0', sizeof(act));
+    act.sa_handler = stop_stalling;
+    (void)sigaction(SIGTERM, &act, NULL);
+    if (database_initialize(0)) {
+        (void)search_cdc_entry("rtt_stall", &first_call);
+    }
+    (void)write(ready_fd, &ready, 1);
+    (void)sleep(STALL_SECS);
+    database_close();
+    exit(EXIT_SUCCESS);
+}
+
+/* make sure there are STALL_MATCHES entries for the stalled clients to find */
+static int add_stall_entries(void) {
+    cdc_entry entry;
+    int i;
+
+    memset(&entry, '\0', sizeof(entry));
+    sprintf(entry.catalog, "rtt_stall_%d", STALL_MATCHES - 1);
+    if (get_cdc_entry(entry.catalog).catalog[0] != '\0') return(1);
+    strcpy(entry.title, "stalled client benchmark");
+    for (i = 0; i < STALL_MATCHES; i++) {
+        sprintf(entry.catalog, "rtt_stall_%d", i);
+        if (!add_cdc_entry(entry)) return(0);
+    }
+    return(1);
+}
+
+int main(int argc, char *argv[]) {
+    int n_requests = argc > 1 ? atoi(argv[1]) : 10000;
+    int n_clients = argc > 2 ? atoi(argv[2]) : 1;
+    int window = argc > 3 ? atoi(argv[3]) : 1;
+    int n_stalled = argc > 4 ? atoi(argv[4]) : 0;
+    pid_t *client_pids;
+    pid_t *stalled_pids = NULL;
+    int ready_pipe[2];
+    char ready;
+    cdc_entry entry;
+    double started;
+    double elapsed;
+    int status;
+    int failed = 0;
+    int i;
+
+    if (window > PIPELINE_WINDOW) window = PIPELINE_WINDOW;
+    client_pids = calloc(n_clients, sizeof(pid_t));
+    if (!client_pids) exit(EXIT_FAILURE);
+    memset(&entry, '\0', sizeof(entry));
+    strcpy(entry.catalog, "rtt_bench");
+    strcpy(entry.title, "round trip benchmark");
+    if (!database_initialize(0) || !add_cdc_entry(entry) ||
+        (n_stalled > 0 && !add_stall_entries())) {
+        fprintf(stderr, "rtt_bench: can not reach the server\n");
+        exit(EXIT_FAILURE);
+    }
+    database_close();
+
+    if (n_stalled > 0) {
+        stalled_pids = calloc(n_stalled, sizeof(pid_t));
+        if (!stalled_pids || pipe(ready_pipe) == -1) exit(EXIT_FAILURE);
+        for (i = 0; i < n_stalled; i++) {
+            stalled_pids[i] = fork();
+            if (stalled_pids[i] == 0) run_stalled_client(ready_pipe[1]);
+        }
+        close(ready_pipe[1]);
+        for (i = 0; i < n_stalled; i++) {
+            if (read(ready_pipe[0], &ready, 1) != 1) break;
+        }
+    }
+
+    started = now();
+    for (i = 0; i < n_clients; i++) {
+        client_pids[i] = fork();
+        if (client_pids[i] == 0) {
+            exit(run_client(n_requests, window) ? EXIT_FAILURE : 0);
+        }
+    }
+    for (i = 0; i < n_clients; i++) {
+        if (waitpid(client_pids[i], &status, 0) == -1 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+    }
+    elapsed = now() - started;
+
+    for (i = 0; i < n_stalled; i++) {
+        if (stalled_pids[i] > 0) (void)kill(stalled_pids[i], SIGTERM);
+    }
+    while (n_stalled > 0 && wait(&status) > 0) ;
+
+    printf("%d clients x %d requests (window %d) in %.3f s: %.0f requests/s, "
+           "mean round trip %.1f us\n", n_clients, n_requests,
+           window > 1 ? window : 1, elapsed,
+           n_clients * n_requests / elapsed,
+           elapsed * 1e6 / n_requests);
+    if (n_stalled > 0) printf("with %d stalled clients\n", n_stalled);
+    if (failed) printf("%d clients saw failures\n", failed);
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,843 @@
+/* The cliserv.h api over stream sockets.
+ *
+ * The server listens on a socket, and each client connects to it once, in
+ * client_starting, and keeps its connection until client_ending. Requests
+ * and responses both travel down the connection as frames (see wire.h), so
+ * there are no per-client fifos to make, open and clean up, and a client
+ * that goes away just closes its connection.
+ *
+ * Everything here is the same whatever kind of socket is used; making the
+ * sockets, and telling clients apart, is left to uds_imp.c (UNIX domain
+ * sockets) or tcp_imp.c (see sock_imp.h).
+ *
+ * The server waits for all of its connections at once with epoll. Its
+ * sockets are nonblocking: when epoll says one is readable, we read what is
+ * there into that connection's buffer, and hand out whole frames from the
+ * buffers in turn, a connection at a time, so one busy client can't starve
+ * the others. A connection whose buffer is full is taken out of the epoll
+ * set until we have used some of it up; the client's writes then back up in
+ * its own socket, which is the only flow control it needs.
+ *
+ * The frames of a response that streams back many of them (a search, say)
+ * are gathered up and written a buffer at a time, rather than each with a
+ * system call of its own.
+ *
+ * The server never waits for room in a client's socket either. What
+ * doesn't fit is kept in the connection's output queue, and epoll tells the
+ * reading thread when the socket has room for it; until the queue is empty,
+ * later responses join it, so that they stay in order. As with the SysV
+ * queues (see mqueue_imp.c), a response kept back is RESP_QUEUED, and a
+ * client that falls more than OUT_MAX_BYTES behind is evicted: its
+ * connection is closed, and it sees the server hang up.
+ *
+ * The client_pid the server sees and answers is the one sock_accepted gave
+ * the connection, rather than what the client puts in its requests.
+ */
+
+#define _GNU_SOURCE
+
+#include "cd_data.h"
+#include "cliserv.h"
+#include "wire.h"
+#include "sock_imp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+
+/* The server's connections. The thread that reads requests accepts and
+ * closes them; the threads answering requests (see server.c) look them up
+ * by pid, and mark them in use while they write to them, so that one isn't
+ * closed under a writer. All of this happens under conns_lock. */
+#define MAX_CONNS       256
+#define LISTEN_BACKLOG  64
+#define EPOLL_BATCH     64
+#define OUT_BUF_LEN     (4 * WIRE_MAX_FRAME)
+#define OUT_MAX_BYTES   (1024 * 1024)
+#define DELIVER_MAX_MS  1000     /* see wait_resp_delivered */
+
+typedef struct {
+    int            fd;          /* -1 if the slot is free */
+    pid_t          client_pid;
+    int            in_use;      /* threads sending responses on it */
+    int            hung_up;     /* closed by the client while in use */
+    int            reading;     /* epoll is watching for requests */
+    int            writing;     /* and for room for the output queue */
+    int            ready;       /* on the ready list */
+    wire_stream   *stream;
+    unsigned char *out_data;    /* the output queue */
+    int            out_start;
+    int            out_end;
+    int            out_cap;
+    long           out_queued;  /* bytes ever kept in the output queue */
+    long           out_sent;    /* and written from it since */
+} client_conn;
+
+static int listen_fd = -1;
+static int epoll_fd = -1;
+static pid_t epoll_pid = 0;     /* the process that made epoll_fd */
+static int intake_shared = 0;   /* worker processes accept connections */
+static client_conn conns[MAX_CONNS];
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread client_conn *current_conn = NULL;
+
+/* the responses each thread has yet to write to current_conn */
+static __thread unsigned char out_buf[OUT_BUF_LEN];
+static __thread int out_len = 0;
+static __thread int out_failed = 0;
+
+/* the connections with buffered data to hand out, in the order we'll get
+ * to them */
+static int ready_list[MAX_CONNS];
+static int ready_head = 0;
+static int n_ready = 0;
+
+/* client side */
+static int server_fd = -1;
+static wire_stream read_stream;
+
+
+/* server side:
+ *
+ * make the listening socket. A client that has gone away is noticed when
+ * writing to it fails with EPIPE, so we ignore SIGPIPE. */
+int server_starting(void) {
+    int i;
+    #if DEBUG_TRACE
+        printf("%d :- server_starting()\n",  getpid());
+    #endif
+
+    listen_fd = sock_listen(LISTEN_BACKLOG);
+    if (listen_fd == -1) {
+        fprintf(stderr, "Server startup error, no socket created\n");
+        return(0);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < MAX_CONNS; i++) conns[i].fd = -1;
+    n_ready = 0;
+    return(1);
+}
+
+
+/* server side:
+ *
+ * close everything, and tidy up after the listening socket. */
+void server_ending(void) {
+    int i;
+    #if DEBUG_TRACE
+        printf("%d :- server_ending()\n",  getpid());
+    #endif
+
+    for (i = 0; i < MAX_CONNS; i++) {
+        if (conns[i].fd != -1) close(conns[i].fd);
+        free(conns[i].stream);
+        free(conns[i].out_data);
+        conns[i].fd = -1;
+        conns[i].stream = NULL;
+        conns[i].out_data = NULL;
+    }
+    if (epoll_fd != -1) close(epoll_fd);
+    if (listen_fd != -1) {
+        close(listen_fd);
+        sock_unlisten();
+    }
+    epoll_fd = listen_fd = -1;
+}
+
+
+/* server side:
+ *
+ * Several processes can accept connections on one listening socket; each
+ * makes its own epoll set the first time it reads (see watch_connections)
+ * and then serves the clients it accepted. */
+int server_share_intake(void) {
+    intake_shared = 1;
+    return(1);
+}
+
+
+/* server side:
+ *
+ * Handing the intake over (see cliserv.h). We pass on the listening
+ * socket, so that new clients can go on connecting to it, and every
+ * connection we have, with whatever we have read from it and not yet handed
+ * out, the last request perhaps only partly read. Requests that clients
+ * send meanwhile wait in their sockets.
+ *
+ * A connection with responses still in its output queue is left behind,
+ * as the rest of them would be lost, and its client sees us hang up.
+ *
+ * When worker processes share the intake, each has its own connections,
+ * which the one that restarts has no way to collect, so we can't. */
+typedef struct {
+    int listen_fd;
+    int n_conns;            /* conn_handoffs that follow */
+} sock_handoff;
+
+typedef struct {
+    int   fd;
+    pid_t client_pid;
+    int   buffered;         /* bytes of its stream that follow */
+} conn_handoff;
+
+static int conn_handed_off(const client_conn *conn) {
+    return(conn->fd != -1 && !conn->hung_up &&
+           conn->out_end == conn->out_start);
+}
+
+int server_can_hand_off(void) {
+    return(!intake_shared);
+}
+
+int server_handoff(const int state_fd) {
+    sock_handoff state;
+    conn_handoff conn_state;
+    client_conn *conn;
+    int ok;
+    int i;
+
+    pthread_mutex_lock(&conns_lock);
+    state.listen_fd = listen_fd;
+    state.n_conns = 0;
+    for (i = 0; i < MAX_CONNS; i++) {
+        if (conn_handed_off(&conns[i])) state.n_conns++;
+    }
+    ok = wire_write_all(state_fd, &state, sizeof(state));
+    (void)fcntl(listen_fd, F_SETFD, 0);
+    for (i = 0; ok && i < MAX_CONNS; i++) {
+        conn = &conns[i];
+        if (!conn_handed_off(conn)) continue;
+        conn_state.fd = conn->fd;
+        conn_state.client_pid = conn->client_pid;
+        conn_state.buffered = conn->stream->end - conn->stream->start;
+        ok = wire_write_all(state_fd, &conn_state, sizeof(conn_state)) &&
+             wire_write_all(state_fd, conn->stream->data + conn->stream->start,
+                            conn_state.buffered);
+        (void)fcntl(conn->fd, F_SETFD, 0);
+    }
+    pthread_mutex_unlock(&conns_lock);
+    return(ok);
+}
+
+int server_take_over(const int state_fd) {
+    sock_handoff state;
+    conn_handoff conn_state;
+    client_conn *conn;
+    int i;
+
+    for (i = 0; i < MAX_CONNS; i++) conns[i].fd = -1;
+    n_ready = 0;
+    if (!wire_read_all(state_fd, &state, sizeof(state)) ||
+        state.n_conns < 0 || state.n_conns > MAX_CONNS) {
+        fprintf(stderr, "Server startup error, could not take over socket\n");
+        return(0);
+    }
+    listen_fd = state.listen_fd;
+    (void)fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+    for (i = 0; i < state.n_conns; i++) {
+        conn = &conns[i];
+        conn->stream = malloc(sizeof(wire_stream));
+        if (!conn->stream ||
+            !wire_read_all(state_fd, &conn_state, sizeof(conn_state)) ||
+            conn_state.buffered < 0 || conn_state.buffered > WIRE_STREAM_LEN) {
+            fprintf(stderr, "Server startup error, could not take over "
+                    "connections\n");
+            return(0);
+        }
+        wire_stream_reset(conn->stream);
+        if (!wire_read_all(state_fd, conn->stream->data,
+                           conn_state.buffered)) {
+            fprintf(stderr, "Server startup error, could not take over "
+                    "connections\n");
+            return(0);
+        }
+        conn->stream->end = conn_state.buffered;
+        conn->fd = conn_state.fd;
+        conn->client_pid = conn_state.client_pid;
+        (void)fcntl(conn->fd, F_SETFD, FD_CLOEXEC);
+        sock_adopted(conn->client_pid);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    return(1);
+}
+
+
+/* put a connection with data buffered on the ready list. Call with
+ * conns_lock held. */
+static void make_ready(client_conn *conn) {
+    if (conn->ready) return;
+    ready_list[(ready_head + n_ready) % MAX_CONNS] = conn - conns;
+    n_ready++;
+    conn->ready = 1;
+}
+
+/* set up this process's epoll set, if it hasn't got one. The listening
+ * socket is in every worker process's set, so we ask for only one of them
+ * to be woken for each new connection. Any connections we already have
+ * (taken over from a server that restarted) go in it too, unless their
+ * buffers are full, and those with data buffered go on the ready list. */
+static int watch_connections(void) {
+    struct epoll_event event;
+    int i;
+
+    if (epoll_fd != -1 && epoll_pid == getpid()) return(1);
+    if (epoll_fd != -1) close(epoll_fd);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) return(0);
+    epoll_pid = getpid();
+
+    memset(&event, '\0', sizeof(event));
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.u32 = MAX_CONNS;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
+        return(0);
+    }
+
+    pthread_mutex_lock(&conns_lock);
+    for (i = 0; i < MAX_CONNS; i++) {
+        if (conns[i].fd == -1) continue;
+        memset(&event, '\0', sizeof(event));
+        event.events = conns[i].stream->end == WIRE_STREAM_LEN ? 0 : EPOLLIN;
+        event.data.u32 = i;
+        (void)epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conns[i].fd, &event);
+        conns[i].reading = event.events != 0;
+        if (conns[i].stream->end > conns[i].stream->start) {
+            make_ready(&conns[i]);
+        }
+    }
+    pthread_mutex_unlock(&conns_lock);
+    return(1);
+}
+
+/* start or stop epoll telling us about a connection's data, or about room
+ * for its output queue. Call with conns_lock held. */
+static void set_events(client_conn *conn, const int reading,
+                       const int writing) {
+    struct epoll_event event;
+
+    if (conn->reading == reading && conn->writing == writing) return;
+    memset(&event, '\0', sizeof(event));
+    event.events = (reading ? EPOLLIN : 0) | (writing ? EPOLLOUT : 0);
+    event.data.u32 = conn - conns;
+    (void)epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    conn->reading = reading;
+    conn->writing = writing;
+}
+
+static void set_reading(client_conn *conn, const int reading) {
+    set_events(conn, reading, conn->writing);
+}
+
+/* close a connection and free its slot, unless a response is being sent on
+ * it, in which case end_resp_to_client does it. Call with conns_lock
+ * held. */
+static void close_conn(client_conn *conn) {
+    (void)epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    conn->reading = 0;
+    conn->writing = 0;
+    if (conn->in_use) {
+        conn->hung_up = 1;
+        return;
+    }
+    close(conn->fd);
+    conn->fd = -1;
+    conn->client_pid = 0;
+    conn->hung_up = 0;
+    wire_stream_reset(conn->stream);
+    free(conn->out_data);
+    conn->out_data = NULL;
+    conn->out_start = conn->out_end = conn->out_cap = 0;
+}
+
+/* cut off a client that isn't reading its responses. Call with conns_lock
+ * held. */
+static void evict_conn(client_conn *conn) {
+    fprintf(stderr, "Server Warning:- client %d is not reading its "
+            "responses, dropping it\n", conn->client_pid);
+    close_conn(conn);
+}
+
+/* write as much of a connection's output queue as its socket has room for,
+ * and stop epoll watching for room once it is empty. Returns 0 (having
+ * closed the connection) if the client has gone away. Call with conns_lock
+ * held. */
+static int drain_conn(client_conn *conn) {
+    int written;
+
+    while (conn->out_start < conn->out_end) {
+        written = write(conn->fd, conn->out_data + conn->out_start,
+                        conn->out_end - conn->out_start);
+        if (written > 0) {
+            conn->out_start += written;
+            conn->out_sent += written;
+        } else if (written == -1 && errno == EINTR) {
+            continue;
+        } else if (written == -1 && errno == EAGAIN) {
+            return(1);
+        } else {
+            close_conn(conn);
+            return(0);
+        }
+    }
+    conn->out_start = conn->out_end = 0;
+    set_events(conn, conn->reading, 0);
+    return(1);
+}
+
+/* send len bytes of responses down a connection: straight to its socket if
+ * nothing is queued ahead of them, and whatever doesn't fit to the end of
+ * its output queue. Returns 1 if they all went, RESP_QUEUED if some were
+ * queued, and 0 (having closed the connection) if the client has gone away
+ * or has been evicted for falling too far behind. Call with conns_lock
+ * held. */
+static int send_conn(client_conn *conn, const unsigned char *data,
+                     const int len) {
+    unsigned char *grown;
+    int new_cap;
+    int written;
+    int done = 0;
+
+    if (conn->fd == -1 || conn->hung_up || !drain_conn(conn)) return(0);
+    while (conn->out_end == 0 && done < len) {
+        written = write(conn->fd, data + done, len - done);
+        if (written > 0) {
+            done += written;
+        } else if (written == -1 && errno == EINTR) {
+            continue;
+        } else if (written == -1 && errno == EAGAIN) {
+            break;
+        } else {
+            close_conn(conn);
+            return(0);
+        }
+    }
+    if (done == len) return(1);
+
+    if (conn->out_end - conn->out_start + len - done > OUT_MAX_BYTES) {
+        evict_conn(conn);
+        return(0);
+    }
+    if (conn->out_start > 0) {
+        memmove(conn->out_data, conn->out_data + conn->out_start,
+                conn->out_end - conn->out_start);
+        conn->out_end -= conn->out_start;
+        conn->out_start = 0;
+    }
+    if (conn->out_end + len - done > conn->out_cap) {
+        new_cap = conn->out_cap ? conn->out_cap : OUT_BUF_LEN;
+        while (new_cap < conn->out_end + len - done) new_cap *= 2;
+        grown = realloc(conn->out_data, new_cap);
+        if (!grown) {
+            evict_conn(conn);
+            return(0);
+        }
+        conn->out_data = grown;
+        conn->out_cap = new_cap;
+    }
+    memcpy(conn->out_data + conn->out_end, data + done, len - done);
+    conn->out_end += len - done;
+    conn->out_queued += len - done;
+    set_events(conn, conn->reading, 1);
+    return(RESP_QUEUED);
+}
+
+/* take all the connections waiting on the listening socket. If we have
+ * no room for one, it is closed, and its client sees the server hang up. */
+static void accept_conns(void) {
+    pid_t client_pid;
+    client_conn *conn;
+    struct epoll_event event;
+    int fd;
+    int i;
+
+    while ((fd = accept4(listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        if (!sock_accepted(fd, &client_pid)) {
+            close(fd);
+            continue;
+        }
+        pthread_mutex_lock(&conns_lock);
+        for (i = 0; i < MAX_CONNS && conns[i].fd != -1; i++) ;
+        conn = i < MAX_CONNS ? &conns[i] : NULL;
+        if (conn && !conn->stream) {
+            conn->stream = malloc(sizeof(wire_stream));
+            if (conn->stream) wire_stream_reset(conn->stream);
+        }
+        if (!conn || !conn->stream) {
+            pthread_mutex_unlock(&conns_lock);
+            fprintf(stderr, "Server Warning:- no room for client %d\n",
+                    client_pid);
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->client_pid = client_pid;
+        conn->ready = 0;
+        memset(&event, '\0', sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        conn->reading = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+        if (!conn->reading) close_conn(conn);
+        pthread_mutex_unlock(&conns_lock);
+    }
+}
+
+/* read what a connection has for us. Call with conns_lock held. */
+static void fill_conn(client_conn *conn) {
+    int read_bytes;
+
+    read_bytes = wire_stream_fill(conn->fd, conn->stream);
+    if (read_bytes > 0) {
+        make_ready(conn);
+    } else if (read_bytes == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close_conn(conn);
+    }
+}
+
+/* the next frame from the connections with whole frames buffered, taking
+ * them in turn. Returns 0 if none of them has one. Call with conns_lock
+ * held. */
+static int next_request(message_db_t *rec_ptr) {
+    client_conn *conn;
+    int found;
+
+    while (n_ready > 0) {
+        conn = &conns[ready_list[ready_head]];
+        ready_head = (ready_head + 1) % MAX_CONNS;
+        n_ready--;
+        conn->ready = 0;
+        if (conn->fd == -1 || conn->hung_up) continue;
+
+        found = wire_stream_next(conn->stream, rec_ptr);
+        if (found == -1) {
+            close_conn(conn);       /* we've lost our place in its stream */
+            continue;
+        }
+        if (found == 1) {
+            rec_ptr->client_pid = conn->client_pid;
+            // it may have more; let the others have a turn first, though
+            make_ready(conn);
+            return(1);
+        }
+        // it has part of a frame, and there is always room for the rest
+        set_reading(conn, 1);
+    }
+    return(0);
+}
+
+/* read_request_from_client (this is called in main() of server.c, and then
+ * the message gets passed to the process_command function)
+ *
+ * It puts the data into *rec_ptr, and returns 0 if waiting for a request
+ * fails, say because a signal interrupted it. */
+int read_request_from_client(message_db_t *rec_ptr) {
+    struct epoll_event events[EPOLL_BATCH];
+    client_conn *conn;
+    int n_events;
+    int i;
+    #if DEBUG_TRACE
+        printf("%d :- read_request_from_client()\n",  getpid());
+    #endif
+
+    if (listen_fd == -1 || !watch_connections()) return(0);
+    for (;;) {
+        pthread_mutex_lock(&conns_lock);
+        i = next_request(rec_ptr);
+        pthread_mutex_unlock(&conns_lock);
+        if (i) return(1);
+
+        n_events = epoll_wait(epoll_fd, events, EPOLL_BATCH, -1);
+        if (n_events == -1) return(0);
+        for (i = 0; i < n_events; i++) {
+            if (events[i].data.u32 == MAX_CONNS) {
+                accept_conns();
+                continue;
+            }
+            pthread_mutex_lock(&conns_lock);
+            conn = &conns[events[i].data.u32];
+            if (conn->fd != -1 && conn->writing &&
+                (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                (void)drain_conn(conn);
+            }
+            if (conn->fd != -1 && conn->reading) {
+                fill_conn(conn);
+                // a full buffer waits until we've handed some of it out
+                if (conn->fd != -1 && conn->reading &&
+                    conn->stream->end == WIRE_STREAM_LEN) {
+                    set_reading(conn, 0);
+                }
+            }
+            pthread_mutex_unlock(&conns_lock);
+        }
+    }
+}
+
+
+/* server side:
+ *
+ * find the connection of the client we are about to answer, and hold on to
+ * it until end_resp_to_client. */
+int start_resp_to_client(const message_db_t *mess_ptr) {
+    int i;
+    #if DEBUG_TRACE
+        printf("%d :- start_resp_to_client()\n",  getpid());
+    #endif
+
+    current_conn = NULL;
+    out_len = 0;
+    out_failed = 0;
+    pthread_mutex_lock(&conns_lock);
+    for (i = 0; i < MAX_CONNS; i++) {
+        if (conns[i].fd != -1 && !conns[i].hung_up &&
+            conns[i].client_pid == mess_ptr->client_pid) {
+            current_conn = &conns[i];
+            current_conn->in_use++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&conns_lock);
+    return(current_conn != NULL);
+}
+
+
+/* server side:
+ *
+ * send the responses gathered so far (see send_conn). Returns 0 if they
+ * could not be. */
+static int flush_responses(void) {
+    if (out_len > 0 && !out_failed) {
+        pthread_mutex_lock(&conns_lock);
+        out_failed = !send_conn(current_conn, out_buf, out_len);
+        pthread_mutex_unlock(&conns_lock);
+    }
+    out_len = 0;
+    return(!out_failed);
+}
+
+
+/* server side:
+ *
+ * add a response to the ones waiting to go to the client, sending them
+ * first if there isn't room. The response itself only goes with the next
+ * lot, or in end_resp_to_client, so it is RESP_QUEUED until then. */
+int send_resp_to_client(const message_db_t *mess_ptr) {
+    #if DEBUG_TRACE
+        printf("%d :- send_resp_to_client()\n",  getpid());
+    #endif
+
+    if (!current_conn || out_failed) return(0);
+    if (out_len > OUT_BUF_LEN - WIRE_MAX_FRAME && !flush_responses()) {
+        return(0);
+    }
+    out_len += wire_encode_response(mess_ptr, out_buf + out_len);
+    return(RESP_QUEUED);
+}
+
+
+/* server side:
+ *
+ * send the responses still waiting, and let go of the connection, closing
+ * it if the client hung up meanwhile. */
+void end_resp_to_client(void) {
+    #if DEBUG_TRACE
+        printf("%d :- end_resp_to_client()\n",  getpid());
+    #endif
+
+    if (!current_conn) return;
+    if (!flush_responses()) {
+        fprintf(stderr, "Server Warning:- failed to respond to %d\n",
+                current_conn->client_pid);
+    }
+    pthread_mutex_lock(&conns_lock);
+    current_conn->in_use--;
+    if (current_conn->hung_up && current_conn->in_use == 0) {
+        close_conn(current_conn);
+    }
+    pthread_mutex_unlock(&conns_lock);
+    current_conn = NULL;
+}
+
+
+/* server side:
+ *
+ * wait for the responses queued for a client so far to be written, for up
+ * to DELIVER_MAX_MS. The reading thread may be the one waiting, so we write
+ * them ourselves as the socket makes room. A client that hasn't made room
+ * for them by then is evicted, so that it knows it has missed them. */
+int wait_resp_delivered(const pid_t client_pid) {
+    client_conn *conn = NULL;
+    struct timespec now;
+    struct pollfd pfd;
+    long give_up;
+    long queued;
+    int delivered;
+    int fd;
+    int i;
+    #if DEBUG_TRACE
+        printf("%d :- wait_resp_delivered()\n",  getpid());
+    #endif
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    give_up = now.tv_sec * 1000L + now.tv_nsec / 1000000 + DELIVER_MAX_MS;
+
+    pthread_mutex_lock(&conns_lock);
+    for (i = 0; i < MAX_CONNS && !conn; i++) {
+        if (conns[i].fd != -1 && !conns[i].hung_up &&
+            conns[i].client_pid == client_pid) {
+            conn = &conns[i];
+        }
+    }
+    if (!conn) {
+        pthread_mutex_unlock(&conns_lock);
+        return(0);
+    }
+    queued = conn->out_queued;
+    fd = conn->fd;
+    // closing the connection may hand the slot to another client
+    while (conn->fd == fd && conn->client_pid == client_pid &&
+           !conn->hung_up && conn->out_sent < queued) {
+        if (!drain_conn(conn) || conn->out_sent >= queued) continue;
+        if (wire_ms_until(give_up) == 0) {
+            evict_conn(conn);
+            break;
+        }
+        pthread_mutex_unlock(&conns_lock);
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        (void)poll(&pfd, 1, wire_ms_until(give_up));
+        pthread_mutex_lock(&conns_lock);
+    }
+    delivered = conn->fd == fd && conn->client_pid == client_pid &&
+                !conn->hung_up;
+    pthread_mutex_unlock(&conns_lock);
+    return(delivered);
+}
+
+
+/* server side:
+ *
+ * the bytes waiting in our connections' sockets, and those we have read
+ * from them but not yet handed out. With worker processes sharing the
+ * intake, that is only the connections this process accepted. */
+long server_backlog(int *in_bytes_ptr) {
+    long backlog = 0;
+    int waiting;
+    int i;
+
+    *in_bytes_ptr = 1;
+    pthread_mutex_lock(&conns_lock);
+    for (i = 0; i < MAX_CONNS; i++) {
+        if (conns[i].fd == -1 || conns[i].hung_up) continue;
+        if (ioctl(conns[i].fd, FIONREAD, &waiting) == 0) backlog += waiting;
+        backlog += conns[i].stream->end - conns[i].stream->start;
+    }
+    pthread_mutex_unlock(&conns_lock);
+    return(backlog);
+}
+
+
+/* client side:
+ *
+ * connect to the server. */
+int client_starting(void) {
+    #if DEBUG_TRACE
+        printf("%d :- client_starting\n",  getpid());
+    #endif
+
+    server_fd = sock_connect();
+    if (server_fd == -1) return(0);
+    wire_stream_reset(&read_stream);
+    signal(SIGPIPE, SIG_IGN);
+    return(1);
+}
+
+
+/* client side:
+ *
+ * hang up. */
+void client_ending(void) {
+    #if DEBUG_TRACE
+        printf("%d :- client_ending()\n",  getpid());
+    #endif
+
+    if (server_fd != -1) close(server_fd);
+    server_fd = -1;
+}
+
+
+/* client side:
+ *
+ * write a request down our connection, waiting no later than its deadline
+ * (if it has one) for room to start writing it. */
+int send_mess_to_server(message_db_t mess_to_send) {
+    unsigned char frame[WIRE_MAX_FRAME];
+    int frame_len;
+    int result;
+    #if DEBUG_TRACE
+        printf("%d :- send_mess_to_server()\n",  getpid());
+    #endif
+
+    if (server_fd == -1) return(0);
+    frame_len = wire_encode_request(&mess_to_send, frame);
+    result = wire_write_frame_by(server_fd, frame, frame_len,
+                                 mess_to_send.deadline_ms);
+    if (result == -1) perror("Message send failed");
+    return(result == 1);
+}
+
+
+/* client side:
+ *
+ * read the next response from our connection. */
+int read_resp_from_server(message_db_t *rec_ptr) {
+    #if DEBUG_TRACE
+        printf("%d :- read_resp_from_server()\n",  getpid());
+    #endif
+
+    if (server_fd == -1) return(0);
+    return(wire_stream_read(server_fd, &read_stream, rec_ptr));
+}
+
+
+/* client side:
+ *
+ * the same, but giving up after timeout_ms. */
+int poll_resp_from_server(message_db_t *rec_ptr, const int timeout_ms) {
+    #if DEBUG_TRACE
+        printf("%d :- poll_resp_from_server()\n",  getpid());
+    #endif
+
+    if (server_fd == -1) return(-1);
+    return(wire_stream_read_timed(server_fd, &read_stream, rec_ptr,
+                                  timeout_ms));
+}
+
+/* client side:
+ *
+ * our connection to the server */
+int resp_fd_from_server(void) {
+    return(server_fd);
+}
+
+
+/* client side:
+ *
+ * this isn't needed, but it lets us use the same api as for fifo */
+int start_resp_from_server(void)
+{
+    return(1);
+}
+
+/* client side:
+ *
+ * this isn't needed, but it lets us use the same api as for fifo */
+void end_resp_from_server(void)
+{
+}
@@ -0,0 +1,39 @@
+/* The parts of the socket transports that differ with the kind of socket.
+ *
+ * sock_imp.c implements the cliserv.h api over any stream socket, and calls
+ * these to make and connect the sockets. uds_imp.c provides them for UNIX
+ * domain sockets, and tcp_imp.c for TCP; each also has its own
+ * set_server_instance, since that picks the socket's address.
+ *
+ * Include this after cd_data.h and cliserv.h.
+ */
+
+/* server side:
+ *
+ * make the server's listening socket, nonblocking and close-on-exec, and
+ * start it listening with room for backlog connections. Returns its fd, or
+ * -1 if it can't be made. sock_unlisten tidies up after it, once it has
+ * been closed. */
+int sock_listen(const int backlog);
+void sock_unlisten(void);
+
+/* server side:
+ *
+ * set up a connection fd that the server has just accepted, and fill in
+ * *client_pid_ptr with the number the server should know its client by,
+ * which must differ from those of the other connections to this server
+ * process. Returns 0 if the connection shouldn't be kept. */
+int sock_accepted(const int fd, pid_t *client_pid_ptr);
+
+/* server side:
+ *
+ * note a connection the server has taken over from a server that restarted
+ * in place (see server_take_over), whose client it knows by client_pid, so
+ * that sock_accepted doesn't give that number to another one. */
+void sock_adopted(const pid_t client_pid);
+
+/* client side:
+ *
+ * connect to the server, returning the (blocking) fd of the connection, or
+ * -1 if we can't. */
+int sock_connect(void);
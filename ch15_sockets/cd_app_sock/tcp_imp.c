@@ -0,0 +1,162 @@
+/* The socket transport (see sock_imp.c) over TCP, so that clients can run on
+ * other machines than the server. Build it with make server_tcp client_tcp.
+ *
+ * The sockets are set up as in ../simple_inet_ex, except that the address
+ * comes from CD_SERVER_HOST and CD_SERVER_PORT (see cliserv.h), and is
+ * looked up with getaddrinfo, so it can be a host name, or an IPv6 address.
+ *
+ * Two things need more care than over a UNIX domain socket:
+ *   - most requests, and many responses, are a frame of a few dozen bytes,
+ *     written in one go. Nagle's algorithm would hold each of those back
+ *     until the last one was acknowledged, which with delayed acks can mean
+ *     tens of milliseconds, so both ends set TCP_NODELAY. sock_imp.c already
+ *     gathers the frames of a long response into one write, so this doesn't
+ *     cost us many small packets.
+ *   - the client's pid means nothing to the server, since clients on two
+ *     machines may have the same one. Instead the server numbers the
+ *     connections it accepts, and that is the client_pid it knows them by.
+ *
+ * A client connects once, in client_starting, and uses the connection for
+ * every request until client_ending, so there is a TCP handshake per
+ * session rather than per request. Both ends turn on keepalives, so a
+ * connection to a machine that has gone away is eventually dropped.
+ *
+ * There is no authentication or encryption: anyone who can reach the port
+ * can change the catalog, which is why the server only listens on the
+ * loopback address unless told otherwise.
+ */
+
+#define _GNU_SOURCE
+
+#include "cd_data.h"
+#include "cliserv.h"
+#include "sock_imp.h"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#define PORT_LEN 12
+
+static int server_instance = 0;
+static pid_t last_conn_no = 0;  /* the server's last connection number */
+
+
+/* Either side:
+ *
+ * pick which server to use. The primary (instance 0) listens on the base
+ * port, and replica n on the nth port after it. */
+void set_server_instance(const int instance) {
+    server_instance = instance;
+}
+
+
+/* look up the addresses for the server, for listening on (passive) or
+ * connecting to. Returns 0 if there aren't any. */
+static int find_addresses(const int passive, struct addrinfo **found_ptr) {
+    struct addrinfo hints;
+    const char *host = getenv("CD_SERVER_HOST");
+    const char *port = getenv("CD_SERVER_PORT");
+    char service[PORT_LEN];
+
+    if (!host) host = SERVER_HOST;
+    sprintf(service, "%d",
+            (port ? atoi(port) : SERVER_PORT) + server_instance);
+
+    memset(&hints, '\0', sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | (passive ? AI_PASSIVE : 0);
+    return(getaddrinfo(host, service, &hints, found_ptr) == 0);
+}
+
+
+/* the options every connection gets, at either end */
+static void set_conn_options(const int fd) {
+    int on = 1;
+
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    (void)setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+}
+
+
+/* server side:
+ *
+ * listen on the first of the server's addresses that we can. SO_REUSEADDR
+ * lets a restarted server have its port back straight away, rather than
+ * waiting for the old connections to time out. */
+int sock_listen(const int backlog) {
+    struct addrinfo *found;
+    struct addrinfo *address;
+    int on = 1;
+    int fd = -1;
+
+    if (!find_addresses(1, &found)) return(-1);
+    for (address = found; address && fd == -1; address = address->ai_next) {
+        fd = socket(address->ai_family,
+                    address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    address->ai_protocol);
+        if (fd == -1) continue;
+        (void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, address->ai_addr, address->ai_addrlen) == -1 ||
+            listen(fd, backlog) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    return(fd);
+}
+
+
+/* server side:
+ *
+ * a port has no name to remove. */
+void sock_unlisten(void) {
+}
+
+
+/* server side:
+ *
+ * number the connection. Only the thread reading requests accepts them, so
+ * the count needs no lock. */
+int sock_accepted(const int fd, pid_t *client_pid_ptr) {
+    set_conn_options(fd);
+    if (++last_conn_no <= 0) last_conn_no = 1;
+    *client_pid_ptr = last_conn_no;
+    return(1);
+}
+
+
+/* server side:
+ *
+ * carry on numbering after the connections we took over. */
+void sock_adopted(const pid_t client_pid) {
+    if (client_pid > last_conn_no) last_conn_no = client_pid;
+}
+
+
+/* client side:
+ *
+ * connect to the first of the server's addresses that will have us. */
+int sock_connect(void) {
+    struct addrinfo *found;
+    struct addrinfo *address;
+    int fd = -1;
+
+    if (!find_addresses(0, &found)) return(-1);
+    for (address = found; address && fd == -1; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC,
+                    address->ai_protocol);
+        if (fd == -1) continue;
+        if (connect(fd, address->ai_addr, address->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    if (fd != -1) set_conn_options(fd);
+    return(fd);
+}
@@ -0,0 +1,107 @@
+/* The socket transport (see sock_imp.c) over UNIX domain sockets.
+ *
+ * The server listens on a named stream socket (see ../unix_af for the basic
+ * idea), so clients must be on the same machine. In return we know who is
+ * on the other end of a connection from the socket itself (SO_PEERCRED):
+ * the client's real pid is what the server knows it by.
+ */
+
+#define _GNU_SOURCE
+
+#include "cd_data.h"
+#include "cliserv.h"
+#include "sock_imp.h"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static char server_socket_name[sizeof(((struct sockaddr_un *)0)->sun_path)] =
+    SERVER_SOCKET;
+
+
+/* Either side:
+ *
+ * pick which server's socket to use. The primary (instance 0) has the
+ * well-known SERVER_SOCKET; replicas have numbered ones. */
+void set_server_instance(const int instance) {
+    if (instance == 0) strcpy(server_socket_name, SERVER_SOCKET);
+    else sprintf(server_socket_name, REPLICA_SOCKET, instance);
+}
+
+
+static void make_address(struct sockaddr_un *address_ptr) {
+    memset(address_ptr, '\0', sizeof(*address_ptr));
+    address_ptr->sun_family = AF_UNIX;
+    strcpy(address_ptr->sun_path, server_socket_name);
+}
+
+
+/* server side:
+ *
+ * throw away any old socket that a server which crashed left behind, and
+ * make ours, where any user's clients can connect to it. */
+int sock_listen(const int backlog) {
+    struct sockaddr_un address;
+    int fd;
+
+    make_address(&address);
+    (void)unlink(server_socket_name);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return(-1);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(fd, backlog) == -1) {
+        close(fd);
+        return(-1);
+    }
+    (void)chmod(server_socket_name, 0777);
+    return(fd);
+}
+
+
+/* server side:
+ *
+ * remove the socket's name. */
+void sock_unlisten(void) {
+    (void)unlink(server_socket_name);
+}
+
+
+/* server side:
+ *
+ * the client is whoever the kernel says it is. */
+int sock_accepted(const int fd, pid_t *client_pid_ptr) {
+    struct ucred peer;
+    socklen_t peer_len = sizeof(peer);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) == -1) {
+        return(0);
+    }
+    *client_pid_ptr = peer.pid;
+    return(1);
+}
+
+
+/* server side:
+ *
+ * the kernel keeps the pids apart for us. */
+void sock_adopted(const pid_t client_pid) {
+}
+
+
+/* client side:
+ *
+ * connect to the server's socket. */
+int sock_connect(void) {
+    struct sockaddr_un address;
+    int fd;
+
+    make_address(&address);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return(-1);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        close(fd);
+        return(-1);
+    }
+    return(fd);
+}
@@ -0,0 +1,113 @@
+/* The wire format
+ *
+ * Rather than writing whole message_db_t structs, which carry room for every
+ * kind of request and response, the transports send each message as a frame:
+ * a fixed header followed by just the parts of the message that the request
+ * needs. Strings are sent as a length byte and their characters, so a get
+ * request for a short catalog key is a few dozen bytes rather than the
+ * several kilobytes of the struct.
+ *
+ * Which parts go in a frame depends on the request, and on which way the
+ * frame is going; the header has a bit for each part present, so the
+ * decoder doesn't need to know. Numbers go in network byte order, so the two
+ * ends needn't be the same kind of machine (see tcp_imp.c).
+ *
+ * Every frame fits in WIRE_MAX_FRAME bytes, which is no more than PIPE_BUF,
+ * so a frame written to a fifo in one go is never mixed up with another
+ * writer's.
+ *
+ * Include this after cd_data.h and cliserv.h.
+ */
+
+#include <stdint.h>
+
+#define WIRE_VERSION    2
+#define WIRE_MAX_FRAME  4096   /* the smallest PIPE_BUF POSIX allows is 512,
+                                  but Linux's is 4096 */
+
+typedef struct {
+    uint8_t  version;
+    uint8_t  request;
+    uint8_t  response;
+    uint8_t  reserved;
+    uint16_t sections;     /* which parts follow the header, see wire.c */
+    uint16_t length;       /* of the whole frame, including the header */
+    uint32_t request_id;
+    int32_t  client_pid;
+} wire_header;
+
+/* Encode a message on its way to the server, or back to the client, into
+ * frame, which must have room for WIRE_MAX_FRAME bytes. Returns the length
+ * of the frame. */
+int wire_encode_request(const message_db_t *mess_ptr, unsigned char *frame);
+int wire_encode_response(const message_db_t *mess_ptr, unsigned char *frame);
+
+/* Decode a frame of frame_len bytes into *mess_ptr. Parts of the message
+ * that weren't in the frame are zeroed. Returns 1 on success, 0 if the frame
+ * is malformed or from a different version. */
+int wire_decode(const unsigned char *frame, const int frame_len,
+                message_db_t *mess_ptr);
+
+/* Frames read from a byte stream (a fifo or a socket) can arrive several at a
+ * time, or in pieces. A wire_stream buffers what has been read so far. */
+#define WIRE_STREAM_LEN (8 * WIRE_MAX_FRAME)
+
+typedef struct {
+    unsigned char data[WIRE_STREAM_LEN];
+    int           start;   /* first byte not yet decoded */
+    int           end;     /* end of the bytes read */
+} wire_stream;
+
+/* Forget anything buffered, e.g. when the stream's fd is reopened. */
+void wire_stream_reset(wire_stream *stream_ptr);
+
+/* Decode the next frame from fd into *mess_ptr, reading more from fd only
+ * if the buffer doesn't hold a whole frame already. A frame that doesn't
+ * decode is skipped. Returns 1 on success, 0 on end of file, a read error,
+ * or a frame length that leaves us unable to find the next frame. */
+int wire_stream_read(const int fd, wire_stream *stream_ptr,
+                     message_db_t *mess_ptr);
+
+/* Read exactly one frame from fd into *mess_ptr, and nothing after it, for
+ * when several processes read the same fifo and each must get whole frames.
+ * It reads the header, then the rest of the frame, so the caller must stop
+ * the others reading from fd in between. A frame that doesn't decode is
+ * skipped. Returns 1 on success, 0 on end of file, a read error (including
+ * being interrupted by a signal) or a bad frame length. */
+int wire_read_frame(const int fd, message_db_t *mess_ptr);
+
+/* The two halves of wire_stream_read, for a server that waits for many
+ * streams at once and reads each when it is ready. wire_stream_next decodes
+ * the next whole frame in the buffer, if there is one, without reading;
+ * it returns 1 if it found one, 0 if more must be read first, and -1 for a
+ * bad frame length. wire_stream_fill reads once from fd into the buffer,
+ * which always has room for at least one whole frame when wire_stream_next
+ * has returned 0, and returns what read did. */
+int wire_stream_next(wire_stream *stream_ptr, message_db_t *mess_ptr);
+int wire_stream_fill(const int fd, wire_stream *stream_ptr);
+
+/* The same, but giving up if fd has nothing to read for timeout_ms (-1 waits
+ * for ever). Returns 1 on success, 0 if we gave up waiting (keeping any part
+ * of a frame read so far), or -1 for the errors above. */
+int wire_stream_read_timed(const int fd, wire_stream *stream_ptr,
+                           message_db_t *mess_ptr, const int timeout_ms);
+
+/* Deadlines. A request's deadline_ms (see message_db_t) is on the wall
+ * clock. wire_ms_until says how long there is until it, for a timed wait:
+ * -1 if there is no deadline, and 0 if it has passed.
+ *
+ * wire_write_frame_by writes a frame to fd, waiting for room for it no
+ * later than deadline_ms (if that isn't 0). fd may be non-blocking, as a
+ * fifo that other writers share has to be for the wait to be kept to. Once
+ * part of the frame has been written, the rest always follows, so that the
+ * reader doesn't lose its place. Returns 1 if the frame was written, 0 if
+ * the deadline came first (with errno set to ETIMEDOUT), and -1 on error. */
+int wire_ms_until(const long deadline_ms);
+int wire_write_frame_by(const int fd, const unsigned char *frame,
+                        const int frame_len, const long deadline_ms);
+
+/* Read or write all len bytes of buffer, carrying on after a signal. They
+ * return 0 if they can't, 1 if they do. These are for the server's handoff
+ * state (see server_handoff in cliserv.h) rather than for frames. */
+int wire_read_all(const int fd, void *buffer, const int len);
+int wire_write_all(const int fd, const void *buffer, const int len);